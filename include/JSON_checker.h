@@ -2,6 +2,8 @@
 
 #pragma once
 
+#include <stddef.h>
+
 #ifdef JSON_checker_EXPORTS
 
 #if defined (__SUNPRO_C) && (__SUNPRO_C >= 0x550)
@@ -32,6 +34,64 @@ extern "C" {
 JSON_CHECKER_PUBLIC_API
 int checkUTF8JSON(const unsigned char* data, size_t size);
 
+struct cb_threadpool;
+
+/*
+ * Check a document like checkUTF8JSON (with exactly the same result),
+ * splitting the work over the threads of pool. chunk_size is the
+ * number of bytes each task scans (0 picks a few chunks per thread of
+ * at least 256KB); documents which don't span two chunks are checked
+ * on the calling thread. Must not be called from one of the pool's
+ * threads.
+ */
+JSON_CHECKER_PUBLIC_API
+int checkUTF8JSONParallel(const unsigned char* data, size_t size,
+                          struct cb_threadpool* pool, size_t chunk_size);
+
+/*
+ * A JSON_validator checks documents like checkUTF8JSON, but may be
+ * reused for any number of documents (by one thread at a time) without
+ * further allocations; its nesting stack only grows on the heap for
+ * documents nested more than 64 deep.
+ */
+typedef struct JSON_checker_struct JSON_validator;
+
+/*
+ * Create a validator which rejects documents nested more than
+ * max_depth levels deep (0 for no limit). Returns NULL on memory fail.
+ */
+JSON_CHECKER_PUBLIC_API
+JSON_validator* JSON_validator_create(int max_depth);
+
+JSON_CHECKER_PUBLIC_API
+void JSON_validator_destroy(JSON_validator* validator);
+
+/*
+ * Check that the size bytes at data are valid UTF-8 and a valid JSON
+ * value. Returns non-zero if they are.
+ */
+JSON_CHECKER_PUBLIC_API
+int JSON_validator_check(JSON_validator* validator, const unsigned char* data,
+                         size_t size);
+
+/*
+ * Check a document which arrives in chunks: call JSON_validator_begin,
+ * then JSON_validator_feed with each chunk (which may split UTF-8
+ * sequences and tokens anywhere), then JSON_validator_finish. Feed
+ * returns zero as soon as the document is known to be invalid (and
+ * the rest may be dropped); finish returns non-zero if the whole
+ * document was valid.
+ */
+JSON_CHECKER_PUBLIC_API
+void JSON_validator_begin(JSON_validator* validator);
+
+JSON_CHECKER_PUBLIC_API
+int JSON_validator_feed(JSON_validator* validator, const unsigned char* data,
+                        size_t size);
+
+JSON_CHECKER_PUBLIC_API
+int JSON_validator_finish(JSON_validator* validator);
+
 #ifdef __cplusplus
 }
 #endif
@@ -24,6 +24,9 @@
 #ifndef cJSON__h
 #define cJSON__h
 
+#include <stddef.h>
+#include <stdint.h>
+
 #ifdef BUILDING_CJSON
 
 #if defined (__SUNPRO_C) && (__SUNPRO_C >= 0x550)
@@ -62,6 +65,12 @@ extern "C"
 #define cJSON_Object 6
 
 #define cJSON_IsReference 256
+#define cJSON_StringIsConst 512
+#define cJSON_NumberIsSaturated 1024 /* The number doesn't fit in
+                                        valueint64 */
+
+/* The flags above may be or'ed into type (for instance by
+   cJSON_ParseInSitu), so compare (type & 255) with the types. */
 
 /* The cJSON structure: */
 typedef struct cJSON {
@@ -82,8 +91,28 @@ typedef struct cJSON {
         char *string; /* The item's name string, if this item is the
                          child of, or is in the list of subitems of an
                          object. */
+
+        struct cJSON_Index *index; /* The lookup index of an array or
+                                      object, see cJSON_EnableIndex. */
+
+        int64_t valueint64; /* The item's number, if type==cJSON_Number.
+                               Exact for integers which fit, otherwise
+                               valuedouble saturated to the range (and
+                               cJSON_NumberIsSaturated is set in type;
+                               doubles of magnitude 2^63 or more, -2^63
+                               included, are treated as out of range).
+                               It is printed instead of valuedouble if
+                               the two are the same (so -0 is printed
+                               as a double). */
+
+        const struct cJSON_Allocator *allocator; /* The allocator of
+                                                    the item and its
+                                                    strings, NULL for
+                                                    the hooks. */
 } cJSON;
 
+typedef struct cJSON_Index cJSON_Index;
+
 typedef struct cJSON_Hooks {
     void *(*malloc_fn)(size_t sz);
     void (*free_fn)(void *ptr);
@@ -95,11 +124,75 @@ typedef struct cJSON_Hooks {
 CJSON_PUBLIC_API
 extern void cJSON_InitHooks(cJSON_Hooks* hooks);
 
+/* An allocator for a single parse, print or item, which unlike the
+   hooks carries a context (for instance a per-bucket memory tracker)
+   and is told the size of the block being freed. It is stored in the
+   items allocated with it, so cJSON_Delete (and the functions which
+   add a name to an item) use it for them; it must outlive the items.
+   The size passed to free_fn is always the one passed to malloc_fn
+   for the block. The lookup index (cJSON_EnableIndex) is allocated
+   through the hooks. */
+typedef struct cJSON_Allocator {
+    void *(*malloc_fn)(void *ctx, size_t size);
+    void (*free_fn)(void *ctx, void *ptr, size_t size);
+    void *ctx;
+} cJSON_Allocator;
+
+/* An arena hands out the nodes and strings for a parsed document from
+   a few large slabs (allocated through the hooks above) instead of
+   allocating every item separately. */
+typedef struct cJSON_Arena cJSON_Arena;
+
+/* Create an arena which allocates slabs of (at least) slab_size bytes.
+   Pass 0 to use the default slab size. Returns NULL on memory fail. */
+CJSON_PUBLIC_API
+extern cJSON_Arena *cJSON_CreateArena(size_t slab_size);
+/* Release everything allocated from the arena in O(1). The slabs are
+   kept and reused by the next parse. All documents parsed into the
+   arena become invalid. */
+CJSON_PUBLIC_API
+extern void cJSON_ResetArena(cJSON_Arena *arena);
+/* Release the arena and all of its slabs. */
+CJSON_PUBLIC_API
+extern void cJSON_DeleteArena(cJSON_Arena *arena);
+
+
+/* The parsers (and cJSON_DecodeBinary) recurse for every array or
+   object, so they reject documents nested deeper than this rather than
+   running out of stack. */
+#ifndef CJSON_NESTING_LIMIT
+#define CJSON_NESTING_LIMIT 1000
+#endif
 
 /* Supply a block of JSON, and this returns a cJSON object you can
    interrogate. Call cJSON_Delete when finished. */
 CJSON_PUBLIC_API
 extern cJSON *cJSON_Parse(const char *value);
+/* Parse the first length bytes of value. The buffer does not need to
+   be NUL-terminated; the parser never reads past value + length. */
+CJSON_PUBLIC_API
+extern cJSON *cJSON_ParseWithLength(const char *value, size_t length);
+/* Parse like cJSON_ParseWithLength, allocating the items and their
+   strings with allocator (the hooks if it is NULL). */
+CJSON_PUBLIC_API
+extern cJSON *cJSON_ParseWithAllocator(const char *value, size_t length,
+                                       const cJSON_Allocator *allocator);
+/* Parse a block of JSON like cJSON_Parse, but allocate all of the
+   items and strings from the arena. The returned object must NOT be
+   passed to cJSON_Delete (or have items added, detached or replaced);
+   it lives until the arena is reset or deleted. */
+CJSON_PUBLIC_API
+extern cJSON *cJSON_ParseWithArena(const char *value, cJSON_Arena *arena);
+/* Parse length bytes of buffer in place: strings are unescaped into
+   the buffer itself, and valuestring/string point into it, so the
+   buffer must outlive the returned object (and its content is
+   undefined after the call, even if the parse fails). If arena is NULL
+   the items are allocated through the hooks and must be released with
+   cJSON_Delete (which leaves the strings alone); string values carry
+   cJSON_IsReference and names cJSON_StringIsConst. Otherwise the items
+   come from the arena as for cJSON_ParseWithArena. */
+CJSON_PUBLIC_API
+extern cJSON *cJSON_ParseInSitu(char *buffer, size_t length, cJSON_Arena *arena);
 /* Render a cJSON entity to text for transfer/storage. Free the char*
    when finished. */
 CJSON_PUBLIC_API
@@ -108,6 +201,20 @@ extern char  *cJSON_Print(cJSON *item);
    formatting. Free the char* when finished. */
 CJSON_PUBLIC_API
 extern char  *cJSON_PrintUnformatted(cJSON *item);
+/* Render a cJSON entity to text (formatted if fmt is non-zero) in a
+   buffer from allocator (the hooks if it is NULL). Sets *size to the
+   size of the buffer, which may be more than the length of the text,
+   to pass to the allocator's free_fn (or use cJSON_Free if allocator
+   is NULL). */
+CJSON_PUBLIC_API
+extern char  *cJSON_PrintWithAllocator(cJSON *item, int fmt,
+                                       const cJSON_Allocator *allocator,
+                                       size_t *size);
+/* Render a cJSON entity to text (formatted if fmt is non-zero) into the
+   len bytes at buf without allocating any memory. Returns 0 on success,
+   -1 if the text (and its terminator) doesn't fit. */
+CJSON_PUBLIC_API
+extern int    cJSON_PrintToBuffer(cJSON *item, char *buf, size_t len, int fmt);
 /* Release the memory returned by cJSON_Print and cJSON_PrintUnformatted */
 CJSON_PUBLIC_API
 extern void   cJSON_Free(char *ptr);
@@ -125,6 +232,55 @@ extern cJSON *cJSON_GetArrayItem(cJSON *array,int item);
 /* Get item "string" from object. Case insensitive. */
 CJSON_PUBLIC_API
 extern cJSON *cJSON_GetObjectItem(cJSON *object,const char *string);
+/* Get item "string" from object. Case sensitive. */
+CJSON_PUBLIC_API
+extern cJSON *cJSON_GetObjectItemCaseSensitive(cJSON *object,const char *string);
+
+/* Speed up the lookups above (and cJSON_GetArraySize) on a large array
+   or object with a hash table of the names and a vector of the
+   children. The index is built by the first lookup, and is kept up to
+   date by the functions below which add, detach or replace items
+   (don't modify the child list by hand while it is enabled). Only
+   detaching or renaming an item in an object with a name used more
+   than once has it rebuilt by the next lookup instead. It is
+   released by cJSON_Delete, or by cJSON_DisableIndex which must be
+   used before the arena of an arena parsed item is reset. Returns 0 on
+   success, -1 on memory fail. */
+CJSON_PUBLIC_API
+extern int cJSON_EnableIndex(cJSON *item);
+CJSON_PUBLIC_API
+extern void cJSON_DisableIndex(cJSON *item);
+
+/* A precompiled RFC 6901 JSON Pointer such as "/a/b/0" ("~1" stands for
+   '/' and "~0" for '~' in a name). The segments are split, unescaped
+   and hashed once, so the same path can be looked up cheaply in many
+   documents. */
+typedef struct cJSON_Path cJSON_Path;
+
+/* Compile pointer, which must be empty (the document itself) or start
+   with '/'. Returns NULL if it isn't a valid JSON Pointer, or on memory
+   fail. */
+CJSON_PUBLIC_API
+extern cJSON_Path *cJSON_CompilePath(const char *pointer);
+CJSON_PUBLIC_API
+extern void cJSON_DeletePath(cJSON_Path *path);
+/* Get the item path points to within item, or NULL if there is none.
+   Object names are case sensitive, and a segment only selects an array
+   element if it is an index without leading zeros. Uses the lookup
+   index of the objects and arrays where it is enabled. */
+CJSON_PUBLIC_API
+extern cJSON *cJSON_GetPath(cJSON *item, const cJSON_Path *path);
+/* Compile and look up pointer in a single call */
+CJSON_PUBLIC_API
+extern cJSON *cJSON_GetPointer(cJSON *item, const char *pointer);
+/* Look up count paths with a single traversal of item: paths sharing a
+   prefix are followed together, and the children of every object or
+   array on the way are only scanned once. Sets results[i] to the item
+   for paths[i] (or NULL), and returns the number of paths found (-1 on
+   memory fail). */
+CJSON_PUBLIC_API
+extern int cJSON_GetPaths(cJSON *item, const cJSON_Path *const *paths,
+                          int count, cJSON **results);
 
 /* These calls create a cJSON item of the appropriate type. */
 CJSON_PUBLIC_API
@@ -136,12 +292,30 @@ extern cJSON *cJSON_CreateFalse(void);
 CJSON_PUBLIC_API
 extern cJSON *cJSON_CreateNumber(double num);
 CJSON_PUBLIC_API
+extern cJSON *cJSON_CreateInt64(int64_t num);
+CJSON_PUBLIC_API
 extern cJSON *cJSON_CreateString(const char *string);
 CJSON_PUBLIC_API
 extern cJSON *cJSON_CreateArray(void);
 CJSON_PUBLIC_API
 extern cJSON *cJSON_CreateObject(void);
 
+/* Create an item of type (cJSON_False, cJSON_True, cJSON_NULL,
+   cJSON_Array or cJSON_Object) with allocator, or the hooks if it is
+   NULL. The items added to it may use other allocators. These return
+   NULL on memory fail. */
+CJSON_PUBLIC_API
+extern cJSON *cJSON_CreateWithAllocator(int type, const cJSON_Allocator *allocator);
+CJSON_PUBLIC_API
+extern cJSON *cJSON_CreateNumberWithAllocator(double num,
+                                              const cJSON_Allocator *allocator);
+CJSON_PUBLIC_API
+extern cJSON *cJSON_CreateInt64WithAllocator(int64_t num,
+                                             const cJSON_Allocator *allocator);
+CJSON_PUBLIC_API
+extern cJSON *cJSON_CreateStringWithAllocator(const char *string,
+                                              const cJSON_Allocator *allocator);
+
 /* These utilities create an Array of count items. */
 CJSON_PUBLIC_API
 extern cJSON *cJSON_CreateIntArray(int *numbers,int count);
@@ -181,6 +355,171 @@ extern void cJSON_ReplaceItemInArray(cJSON *array,int which,cJSON *newitem);
 CJSON_PUBLIC_API
 extern void cJSON_ReplaceItemInObject(cJSON *object,const char *string,cJSON *newitem);
 
+/* The callbacks of a streaming parser. Each may be NULL, and returns
+   0 to continue or non-zero to abort the parse. The key and the value
+   (which is a number, string, true, false or null item) are only valid
+   during the call. */
+typedef struct cJSON_SaxCallbacks {
+    int (*start_object)(void *ctx);
+    int (*end_object)(void *ctx);
+    int (*start_array)(void *ctx);
+    int (*end_array)(void *ctx);
+    int (*key)(void *ctx, const char *key);
+    int (*value)(void *ctx, const cJSON *value);
+} cJSON_SaxCallbacks;
+
+/* A streaming parser reports the elements of a document to the
+   callbacks as they are seen, without building a tree; the document
+   may be fed in chunks split anywhere. */
+typedef struct cJSON_Sax cJSON_Sax;
+
+/* Create a streaming parser passing ctx to the callbacks. Returns NULL
+   on memory fail. */
+CJSON_PUBLIC_API
+extern cJSON_Sax *cJSON_CreateSax(const cJSON_SaxCallbacks *callbacks, void *ctx);
+/* Parse the next len bytes of the document. Returns -1 if the document
+   is invalid, memory fails or a callback aborted (this or earlier). */
+CJSON_PUBLIC_API
+extern int cJSON_SaxFeed(cJSON_Sax *sax, const char *data, size_t len);
+/* Signal the end of the document. Returns 0 if a complete document
+   was parsed, -1 otherwise. */
+CJSON_PUBLIC_API
+extern int cJSON_SaxFinish(cJSON_Sax *sax);
+CJSON_PUBLIC_API
+extern void cJSON_DeleteSax(cJSON_Sax *sax);
+
+/* A compact binary encoding of a tree, for storing or shipping it
+   without printing and parsing text. All integers are little endian:
+
+     header      "cJB\1", u32 total length, u32 dictionary offset,
+                 u32 root value offset
+     dictionary  u32 count, u32 offset[count] of the keys, which are each
+                 u32 length, u32 FNV-1a hash, the bytes and a NUL
+     value       a type byte followed by
+                   'n' 't' 'f'  nothing (null, true, false)
+                   'i'          an int64 (integers which are exact)
+                   'd'          a double
+                   's'          u32 length, the bytes and a NUL
+                   'a'          u32 count, u32 offset[count] of the items
+                   'o'          u32 count, (u32 key, u32 offset)[count]
+                                with the key's index in the dictionary
+
+   Every offset is from the start of the buffer, and points past the
+   value containing it, so the encoding can be navigated (and checked)
+   in place. */
+
+/* Encode item into a buffer allocated through the hooks, which must be
+   released with cJSON_Free. Sets *length to its size. Returns NULL on
+   memory fail (or if it would be 4GB or more). */
+CJSON_PUBLIC_API
+extern char *cJSON_EncodeBinary(cJSON *item, size_t *length);
+/* Decode the length bytes at buffer into a tree for cJSON_Delete.
+   Returns NULL if the encoding is invalid, nested deeper than
+   CJSON_NESTING_LIMIT, or on memory fail. */
+CJSON_PUBLIC_API
+extern cJSON *cJSON_DecodeBinary(const char *buffer, size_t length);
+
+/* A value within an encoded buffer, for reading single fields without
+   decoding the document. Every access is checked against the buffer,
+   and fails (returns -1 or NULL) if the encoding is invalid. */
+typedef struct cJSON_BinaryValue {
+    const unsigned char *buffer;
+    size_t length;
+    size_t offset;
+} cJSON_BinaryValue;
+
+/* Get the root value of the encoded buffer. Returns 0 on success. */
+CJSON_PUBLIC_API
+extern int cJSON_BinaryOpen(const char *buffer, size_t length,
+                            cJSON_BinaryValue *root);
+/* Returns the cJSON type of value (cJSON_Number for both 'i' and 'd') */
+CJSON_PUBLIC_API
+extern int cJSON_BinaryType(const cJSON_BinaryValue *value);
+/* Returns the number of items in an array or object */
+CJSON_PUBLIC_API
+extern int cJSON_BinaryGetSize(const cJSON_BinaryValue *value);
+CJSON_PUBLIC_API
+extern int cJSON_BinaryGetArrayItem(const cJSON_BinaryValue *array, int which,
+                                    cJSON_BinaryValue *item);
+/* Get item "string" from object. Case sensitive. Only the keys with the
+   same hash (from the dictionary) are compared. */
+CJSON_PUBLIC_API
+extern int cJSON_BinaryGetObjectItem(const cJSON_BinaryValue *object,
+                                     const char *string,
+                                     cJSON_BinaryValue *item);
+/* Get the which'th member of object and its name (which points into the
+   buffer) */
+CJSON_PUBLIC_API
+extern int cJSON_BinaryGetObjectEntry(const cJSON_BinaryValue *object,
+                                      int which, const char **string,
+                                      cJSON_BinaryValue *item);
+/* Returns the (NUL terminated) string in the buffer, or NULL if value
+   isn't a string */
+CJSON_PUBLIC_API
+extern const char *cJSON_BinaryGetString(const cJSON_BinaryValue *value);
+/* Get a number as an integer (saturated) and/or double, either may be
+   NULL */
+CJSON_PUBLIC_API
+extern int cJSON_BinaryGetNumber(const cJSON_BinaryValue *value,
+                                 int64_t *valueint64, double *valuedouble);
+
+/* A compact read-only representation of a document, for keeping many
+   of them in memory: the values are 16 byte nodes in a single array
+   (numbers are stored in the node, and so are strings of up to 7
+   bytes), with the children of an array or object following it.
+   Nodes are referred to by their index; the root is node 0, and the
+   functions return -1 (or NULL) for a missing node. The strings are
+   NUL terminated, and stop at the first NUL within them. */
+typedef struct cJSON_Tape cJSON_Tape;
+
+/* Parse length bytes of JSON straight into a tape, without building a
+   tree. Returns NULL if the document is invalid or on memory fail. */
+CJSON_PUBLIC_API
+extern cJSON_Tape *cJSON_TapeParse(const char *value, size_t length);
+/* Make a tape of item and its children. Returns NULL on memory fail. */
+CJSON_PUBLIC_API
+extern cJSON_Tape *cJSON_TapeFromTree(cJSON *item);
+CJSON_PUBLIC_API
+extern void cJSON_DeleteTape(cJSON_Tape *tape);
+/* Returns the number of bytes the tape occupies */
+CJSON_PUBLIC_API
+extern size_t cJSON_TapeSize(const cJSON_Tape *tape);
+
+/* Returns the cJSON type of node */
+CJSON_PUBLIC_API
+extern int cJSON_TapeType(const cJSON_Tape *tape, int node);
+/* Returns the number of items in an array (or object) */
+CJSON_PUBLIC_API
+extern int cJSON_TapeGetArraySize(const cJSON_Tape *tape, int node);
+/* Walk the items of an array or object: the first item of node, and
+   the one after item within parent. */
+CJSON_PUBLIC_API
+extern int cJSON_TapeGetChild(const cJSON_Tape *tape, int node);
+CJSON_PUBLIC_API
+extern int cJSON_TapeGetNext(const cJSON_Tape *tape, int parent, int item);
+CJSON_PUBLIC_API
+extern int cJSON_TapeGetArrayItem(const cJSON_Tape *tape, int array, int which);
+/* Get item "string" from object. Case insensitive. */
+CJSON_PUBLIC_API
+extern int cJSON_TapeGetObjectItem(const cJSON_Tape *tape, int object,
+                                   const char *string);
+/* Get item "string" from object. Case sensitive. */
+CJSON_PUBLIC_API
+extern int cJSON_TapeGetObjectItemCaseSensitive(const cJSON_Tape *tape, int object,
+                                                const char *string);
+/* Returns the name of a member of an object, or NULL */
+CJSON_PUBLIC_API
+extern const char *cJSON_TapeGetName(const cJSON_Tape *tape, int node);
+/* Returns the string, or NULL if node isn't a string. It is valid until
+   the tape is deleted. */
+CJSON_PUBLIC_API
+extern const char *cJSON_TapeGetString(const cJSON_Tape *tape, int node);
+/* Get a number as an integer (saturated) and/or double, either may be
+   NULL. Returns 0 on success, -1 if node isn't a number. */
+CJSON_PUBLIC_API
+extern int cJSON_TapeGetNumber(const cJSON_Tape *tape, int node,
+                               int64_t *valueint64, double *valuedouble);
+
 #define cJSON_AddNullToObject(object,name) \
         cJSON_AddItemToObject(object, name, cJSON_CreateNull())
 #define cJSON_AddTrueToObject(object,name) \
@@ -0,0 +1,198 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2016 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#pragma once
+
+#include <platform/platform.h>
+#include <platform/visibility.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Asynchronous file I/O.
+ *
+ * Requests are submitted in batches and their completions are reaped
+ * in batches, so that many can be in flight at once (to keep the queue
+ * of a fast device full) with a few system calls per batch. An
+ * operation may complete with fewer bytes than requested, just like
+ * pread / pwrite.
+ *
+ * The engine used depends on the platform:
+ *
+ *   "io_uring"   Linux 5.6 and later
+ *   "iocp"       Windows (the files must be opened FILE_FLAG_OVERLAPPED)
+ *   "threadpool" everywhere else, or when io_uring isn't available. It
+ *                runs the blocking calls on worker threads.
+ *
+ * A cb_aio_t may only be used by one thread at a time. The functions
+ * return -1 on failure with the reason in errno (use GetLastError on
+ * Windows).
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifdef WIN32
+    typedef HANDLE cb_aio_file_t;
+#else
+    typedef int cb_aio_file_t;
+#endif
+
+    typedef struct cb_aio cb_aio_t;
+
+    typedef enum {
+        /** Read from the file into buffer */
+        CB_AIO_READ,
+        /** Write buffer to the file */
+        CB_AIO_WRITE,
+        /** Flush the file's data and metadata to stable storage */
+        CB_AIO_FSYNC,
+        /** Flush the file's data (and only the metadata needed to read
+         *  it back) to stable storage */
+        CB_AIO_FDATASYNC
+    } cb_aio_opcode_t;
+
+    /** Use the registered file file_index instead of file */
+#define CB_AIO_FIXED_FILE 1
+    /** The buffer is within the registered buffer buffer_index */
+#define CB_AIO_FIXED_BUFFER 2
+
+    /** Don't use the system's native engine (for testing) */
+#define CB_AIO_THREADPOOL 1
+
+    typedef struct {
+        /** One of cb_aio_opcode_t (an int so that a bad value can be
+         *  rejected rather than being undefined behaviour in C++) */
+        int opcode;
+        /** CB_AIO_FIXED_ flags */
+        int flags;
+        cb_aio_file_t file;
+        unsigned int file_index;
+        unsigned int buffer_index;
+        /** Where to read to / write from (not used when syncing) */
+        void *buffer;
+        size_t length;
+        uint64_t offset;
+        /** Returned in the event for the request */
+        void *user_data;
+    } cb_aio_request_t;
+
+    typedef struct {
+        void *user_data;
+        /** The number of bytes read or written, or -1 on failure */
+        ssize_t result;
+        /** The errno (or Windows error code) if the request failed */
+        int error;
+    } cb_aio_event_t;
+
+    typedef struct {
+        void *base;
+        size_t length;
+    } cb_aio_buffer_t;
+
+    /**
+     * Create an I/O context
+     *
+     * @param depth the number of requests which may be in flight
+     * @param flags CB_AIO_THREADPOOL or 0
+     * @return the context, or NULL on failure
+     */
+    PLATFORM_PUBLIC_API
+    cb_aio_t *cb_aio_create(unsigned int depth, int flags);
+
+    /**
+     * Wait for the requests in flight, and release the context (the
+     * registered files aren't closed)
+     */
+    PLATFORM_PUBLIC_API
+    void cb_aio_destroy(cb_aio_t *aio);
+
+    /**
+     * Get the name of the engine in use ("io_uring", "iocp" or
+     * "threadpool")
+     */
+    PLATFORM_PUBLIC_API
+    const char *cb_aio_engine(const cb_aio_t *aio);
+
+    /**
+     * Register a table of files to refer to by index in the requests
+     * (CB_AIO_FIXED_FILE), which saves io_uring looking up the file
+     * for every request. Replaces the files already registered. Must
+     * not be called while requests are in flight.
+     *
+     * @return 0 on success, -1 on failure
+     */
+    PLATFORM_PUBLIC_API
+    int cb_aio_register_files(cb_aio_t *aio, const cb_aio_file_t *files,
+                              unsigned int nfiles);
+
+    /**
+     * Register buffers for the I/O to use (CB_AIO_FIXED_BUFFER). io_uring
+     * maps them into the kernel once instead of for every request (the
+     * memory is locked, and counts against RLIMIT_MEMLOCK on older
+     * kernels). Replaces the buffers already registered. Must not be
+     * called while requests are in flight.
+     *
+     * @return 0 on success, -1 on failure
+     */
+    PLATFORM_PUBLIC_API
+    int cb_aio_register_buffers(cb_aio_t *aio, const cb_aio_buffer_t *buffers,
+                                unsigned int nbuffers);
+
+    /**
+     * Start a batch of requests. The requests are copied, but the
+     * buffers must stay valid until the requests complete.
+     *
+     * @param aio the context to submit to
+     * @param requests the requests to start
+     * @param nrequests the number of requests
+     * @return the number of requests started from the start of the
+     *         array (fewer than nrequests when the context is at its
+     *         depth), or -1 if none could be (EAGAIN if the context is
+     *         full, EINVAL if one of the requests which would have been
+     *         started is invalid)
+     */
+    PLATFORM_PUBLIC_API
+    int cb_aio_submit(cb_aio_t *aio, const cb_aio_request_t *requests,
+                      unsigned int nrequests);
+
+    /**
+     * Reap the completed requests, in the order they completed.
+     *
+     * @param aio the context to reap from
+     * @param events where to store the completions
+     * @param min wait until at least this many are done (0 to just
+     *            collect the ones which are), which must not be more
+     *            than the number in flight
+     * @param max the size of events
+     * @return the number of events stored, or -1 on failure
+     */
+    PLATFORM_PUBLIC_API
+    int cb_aio_complete(cb_aio_t *aio, cb_aio_event_t *events,
+                        unsigned int min, unsigned int max);
+
+    /**
+     * Get the number of requests which have been submitted but not
+     * reaped
+     */
+    PLATFORM_PUBLIC_API
+    unsigned int cb_aio_inflight(const cb_aio_t *aio);
+
+#ifdef __cplusplus
+}
+#endif
@@ -14,6 +14,11 @@
  *   See the License for the specific language governing permissions and
  *   limitations under the License.
  */
+#pragma once
+
+#include <platform/visibility.h>
+
+#include <stddef.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -24,11 +29,102 @@ typedef void (*write_cb_t)(void *ctx, const char *frame);
 /**
  * Prints a backtrace from the current thread. For each frame, the
  * `write_cb` function is called with `context` and a string describing
- * the frame.
+ * the frame (using the cache of cb_backtrace_symbolize).
  */
 PLATFORM_PUBLIC_API
 void print_backtrace(write_cb_t write_cb, void* context);
 
+/**
+ * The maximum number of frames in a cb_backtrace_t
+ */
+#define CB_BACKTRACE_MAX_FRAMES 32
+
+/**
+ * A backtrace captured by cb_backtrace_get, to be symbolized later (if
+ * ever) with cb_backtrace_symbolize. It is plain data: it may be
+ * copied, compared or used as a key (the unused frames are NULL).
+ */
+typedef struct {
+    int nframes;
+    void* frames[CB_BACKTRACE_MAX_FRAMES];
+} cb_backtrace_t;
+
+/**
+ * Captures the return addresses of the current thread's stack (not
+ * including this function) into `backtrace`. This is cheap enough to
+ * do on every slow operation: no symbols are looked up.
+ */
+PLATFORM_PUBLIC_API
+void cb_backtrace_get(cb_backtrace_t* bt);
+
+/**
+ * Calls `write_cb` with `context` and a description of each frame in
+ * the backtrace (the same format as print_backtrace).
+ *
+ * The descriptions are cached (the cache is shared by all threads and
+ * reading it doesn't lock), so only the first occurrence of an address
+ * costs a symbol lookup.
+ */
+PLATFORM_PUBLIC_API
+void cb_backtrace_symbolize(const cb_backtrace_t* bt, write_cb_t write_cb,
+                            void* context);
+
+/**
+ * Describes a single address using the cache of cb_backtrace_symbolize
+ *
+ * @param address the address to describe
+ * @param buffer where to store the description
+ * @param size the size of buffer (the description is truncated to fit)
+ */
+PLATFORM_PUBLIC_API
+void cb_backtrace_describe(void* address, char* buffer, size_t size);
+
+/**
+ * Captures the return addresses of the current thread's stack (not
+ * including this function) into `frames`, innermost first.
+ *
+ * This doesn't allocate, and is meant to be called from signal
+ * handlers, but it is not strictly async-signal-safe. The unwinder is
+ * loaded when the library is, so the first call from a handler doesn't
+ * have to load it. However, on glibc older than 2.35 the unwinder still
+ * looks up the unwind tables through dl_iterate_phdr(), which takes the
+ * loader lock. A signal which interrupts a thread in the middle of
+ * dlopen() or dlclose() may therefore deadlock, or see the list of
+ * loaded objects half updated. That is acceptable for crash handlers
+ * and profilers, but the caller should keep it in mind.
+ *
+ * @return the number of frames stored (at most `max_frames`)
+ */
+PLATFORM_PUBLIC_API
+int cb_backtrace_capture(void** frames, int max_frames);
+
+/**
+ * Writes the captured frames to the file descriptor as raw addresses,
+ * followed by where the executable code is mapped (the executable
+ * mappings from /proc/self/maps on Linux, the loaded images on macOS,
+ * the module and offset of each frame on Windows) so that they can be
+ * symbolized offline:
+ *
+ *     backtrace: 3 frames
+ *      #0 0x7f21d9a3c8d1
+ *      ...
+ *     mappings:
+ *     7f21d9a30000-7f21d9a41000 r-xp 00000000 fd:01 1234 /lib/libplatform.so
+ *
+ * Only write() is used to produce the output (no stdio, allocation or
+ * locks), so it is async-signal-safe and works when the process is out
+ * of memory.
+ */
+PLATFORM_PUBLIC_API
+void cb_backtrace_write(int fd, void* const* frames, int nframes);
+
+/**
+ * Captures and writes a backtrace of the current thread to the file
+ * descriptor, see cb_backtrace_capture and cb_backtrace_write.
+ */
+PLATFORM_PUBLIC_API
+void print_backtrace_to_fd(int fd);
+
 #ifdef __cplusplus
 } // extern "C"
 #endif
@@ -0,0 +1,109 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2016 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#pragma once
+
+#include <platform/visibility.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef _MSC_VER
+#include <stdlib.h>
+#endif
+
+/*
+ * Byte swapping which compiles to a single instruction (bswap / rev),
+ * and bulk versions for converting arrays of values.
+ */
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define CB_BIG_ENDIAN 1
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    static inline uint16_t cb_bswap16(uint16_t value) {
+#if defined(_MSC_VER)
+        return _byteswap_ushort(value);
+#elif defined(__GNUC__)
+        return __builtin_bswap16(value);
+#else
+        return (uint16_t)((value << 8) | (value >> 8));
+#endif
+    }
+
+    static inline uint32_t cb_bswap32(uint32_t value) {
+#if defined(_MSC_VER)
+        return _byteswap_ulong(value);
+#elif defined(__GNUC__)
+        return __builtin_bswap32(value);
+#else
+        return ((value & 0x000000ffU) << 24) | ((value & 0x0000ff00U) << 8) |
+               ((value & 0x00ff0000U) >> 8) | ((value & 0xff000000U) >> 24);
+#endif
+    }
+
+    static inline uint64_t cb_bswap64(uint64_t value) {
+#if defined(_MSC_VER)
+        return _byteswap_uint64(value);
+#elif defined(__GNUC__)
+        return __builtin_bswap64(value);
+#else
+        return ((uint64_t)cb_bswap32((uint32_t)value) << 32) |
+               cb_bswap32((uint32_t)(value >> 32));
+#endif
+    }
+
+    /* Network (big endian) <-> host order for 64 bit values */
+    static inline uint64_t cb_ntohll(uint64_t value) {
+#ifdef CB_BIG_ENDIAN
+        return value;
+#else
+        return cb_bswap64(value);
+#endif
+    }
+
+    static inline uint64_t cb_htonll(uint64_t value) {
+        return cb_ntohll(value);
+    }
+
+    /**
+     * Byte swap each of the n values in src and store them in dst.
+     *
+     * The buffers don't need to be aligned, and dst may be the same as
+     * src to swap in place (but they must not otherwise overlap). The
+     * bulk of the work is done 16 or 32 bytes at a time with a byte
+     * shuffle (SSSE3 / AVX2, picked at runtime, or NEON).
+     *
+     * @param dst where to store the swapped values
+     * @param src the values to swap
+     * @param n the number of values (not bytes)
+     */
+    PLATFORM_PUBLIC_API
+    void cb_bswap16_array(void *dst, const void *src, size_t n);
+
+    PLATFORM_PUBLIC_API
+    void cb_bswap32_array(void *dst, const void *src, size_t n);
+
+    PLATFORM_PUBLIC_API
+    void cb_bswap64_array(void *dst, const void *src, size_t n);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,131 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2016 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#pragma once
+
+#include <platform/visibility.h>
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    struct cJSON;
+
+    /**
+     * A statistics counter for values bumped by many threads at once.
+     *
+     * A single atomic counter makes every increment move the cache
+     * line between the cores. This one is split into shards on cache
+     * lines of their own (about two per CPU), and each thread always
+     * adds to the same shard with a relaxed atomic add, so threads
+     * running at the same time rarely touch the same line. Reading the
+     * counter sums the shards, which is a lot more expensive than an
+     * increment but fine for collecting stats.
+     *
+     * Counters given a name are registered, so that all of them can be
+     * listed (see cb_counter_stats_to_json).
+     */
+    typedef struct cb_counter cb_counter_t;
+
+    /**
+     * Create a counter starting at 0
+     *
+     * @param name the name to register the counter as, or NULL for a
+     *             counter which isn't registered
+     * @return the new counter, or NULL if memory allocation failed or
+     *         the name is already in use
+     */
+    PLATFORM_PUBLIC_API
+    cb_counter_t *cb_counter_create(const char *name);
+
+    /**
+     * Destroy the counter (and remove it from the registry). Must not
+     * race with the use of the counter.
+     */
+    PLATFORM_PUBLIC_API
+    void cb_counter_destroy(cb_counter_t *counter);
+
+    /**
+     * Add to the counter (a "negative" value wraps around like any
+     * unsigned arithmetic, so it may be used to subtract)
+     */
+    PLATFORM_PUBLIC_API
+    void cb_counter_add(cb_counter_t *counter, uint64_t value);
+
+    /**
+     * Add one to the counter
+     */
+    PLATFORM_PUBLIC_API
+    void cb_counter_increment(cb_counter_t *counter);
+
+    /**
+     * Get the value of the counter. The additions running at the same
+     * time may or may not be included.
+     */
+    PLATFORM_PUBLIC_API
+    uint64_t cb_counter_get(const cb_counter_t *counter);
+
+    /**
+     * Get the value of the counter and set it to zero. Every addition
+     * is counted exactly once: either in the value returned or in the
+     * counter afterwards.
+     */
+    PLATFORM_PUBLIC_API
+    uint64_t cb_counter_reset(cb_counter_t *counter);
+
+    /**
+     * Get the name the counter was created with (NULL if none)
+     */
+    PLATFORM_PUBLIC_API
+    const char *cb_counter_get_name(const cb_counter_t *counter);
+
+    /**
+     * Look up a registered counter
+     *
+     * @return the counter, or NULL if no counter has the name
+     */
+    PLATFORM_PUBLIC_API
+    cb_counter_t *cb_counter_find(const char *name);
+
+    typedef void (*cb_counter_callback)(const char *name, uint64_t value,
+                                        void *ctx);
+
+    /**
+     * Call the callback with the name and value of every registered
+     * counter. The counters can't be created or destroyed while
+     * this is running (the callback must not do that either).
+     *
+     * @param callback the function to call for each counter
+     * @param ctx passed on to the callback
+     */
+    PLATFORM_PUBLIC_API
+    void cb_counter_stats_iterate(cb_counter_callback callback, void *ctx);
+
+    /**
+     * Create a JSON object with the value of every registered counter:
+     *
+     *     {"get_hits":1032,"get_misses":7}
+     *
+     * Values above INT64_MAX are reported as INT64_MAX. The caller owns the returned object (release it with cJSON_Delete).
+     */
+    PLATFORM_PUBLIC_API
+    struct cJSON *cb_counter_stats_to_json(void);
+
+#ifdef __cplusplus
+}
+#endif
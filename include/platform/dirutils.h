@@ -20,9 +20,17 @@
 
 #include <platform/visibility.h>
 
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
 #include <string>
 #include <vector>
 
+namespace Couchbase {
+    class ThreadPool;
+}
+
 namespace CouchbaseDirectoryUtilities
 {
     /**
@@ -58,12 +66,295 @@ namespace CouchbaseDirectoryUtilities
     PLATFORM_PUBLIC_API
     std::vector<std::string> findFilesContaining(const std::string &dir, const std::string &name);
 
+    /**
+     * Iterate over the entries in a directory (without "." and "..")
+     * as they are read from the system, using the type returned by
+     * readdir/FindNextFile.
+     *
+     * Nothing is allocated per entry: the name returned by getName() is
+     * only valid until the next call to next() (or close()). The entry
+     * is only stat'ed if the system doesn't report the type, or if the
+     * size is requested (POSIX only, Windows returns it with the name).
+     *
+     *     DirectoryIterator iter;
+     *     if (iter.open(dir)) {
+     *         while (iter.next()) {
+     *             if (iter.getType() == DirectoryIterator::Type::File) {
+     *                 ... iter.getName() ...
+     *             }
+     *         }
+     *     }
+     */
+    class PLATFORM_PUBLIC_API DirectoryIterator {
+    public:
+        enum class Type {
+            File,
+            Directory,
+            Symlink,
+            /** Devices, pipes, sockets etc */
+            Other,
+            /** The type couldn't be determined */
+            Unknown
+        };
+
+        DirectoryIterator();
+
+        ~DirectoryIterator();
+
+        /**
+         * Start reading the given directory (closing the current one)
+         *
+         * @return true on success, false if it couldn't be opened
+         */
+        bool open(const std::string &directory);
+
+        /**
+         * Move to the next entry
+         *
+         * @return true if there is one, false at the end of the
+         *         directory (or if it isn't open)
+         */
+        bool next(void);
+
+        /**
+         * Stop reading the directory
+         */
+        void close(void);
+
+        /**
+         * Get the name of the current entry (without the directory)
+         */
+        const char *getName(void) const;
+
+        /**
+         * Get the length of the name of the current entry
+         */
+        size_t getNameLength(void) const;
+
+        /**
+         * Get the type of the current entry. Symbolic links (and
+         * junctions on Windows) are reported as such, not followed.
+         */
+        Type getType(void) const;
+
+        /**
+         * Get the size of the current entry
+         *
+         * @param size where to store the size in bytes
+         * @return true on success, false if it couldn't be determined
+         */
+        bool getSize(uint64_t &size) const;
+
+    private:
+        DirectoryIterator(const DirectoryIterator &) = delete;
+        DirectoryIterator &operator=(const DirectoryIterator &) = delete;
+
+        struct Impl;
+        std::unique_ptr<Impl> impl;
+    };
+
+    /**
+     * Call the callback for each of the entries in a directory (see
+     * DirectoryIterator), until it returns false.
+     *
+     * @param directory the directory to list
+     * @param callback called for each entry, return false to stop
+     * @return true if the directory was read, false if it couldn't be
+     *         opened
+     */
+    PLATFORM_PUBLIC_API
+    bool forEachEntry(const std::string &directory,
+                      const std::function<bool(const DirectoryIterator &)> &callback);
+
+    /**
+     * Watch a directory for entries being created, deleted or renamed,
+     * instead of polling it with findFilesWithPrefix.
+     *
+     * A thread waits for the notifications from the system (inotify on
+     * Linux, kqueue on macOS and the BSDs, ReadDirectoryChangesW on
+     * Windows) and calls the callback for every entry whose name
+     * starts with the prefix. Only changes made after start() returns
+     * are reported, and subdirectories aren't watched.
+     *
+     * kqueue only tells that the directory changed, so the directory is
+     * listed on every change and the differences are reported:
+     * renames show up as Deleted and Created, and changes which cancel
+     * out (a file created and deleted before the listing) aren't seen.
+     */
+    class PLATFORM_PUBLIC_API DirectoryWatcher {
+    public:
+        enum class Event {
+            Created,
+            Deleted,
+            /** The entry was renamed to something else */
+            RenamedFrom,
+            /** Something was renamed to the entry */
+            RenamedTo,
+            /**
+             * Events were lost (the system's queue filled up). The
+             * name is empty: rescan the directory.
+             */
+            Overflow
+        };
+
+        /**
+         * Called on the watcher thread with the name of the entry
+         * (without the directory). It must not call stop().
+         */
+        typedef std::function<void(Event event, const std::string &name)> Callback;
+
+        /**
+         * @param directory the directory to watch
+         * @param prefix only report entries starting with this (all
+         *               of them if empty)
+         * @param callback called for every event
+         */
+        DirectoryWatcher(const std::string &directory,
+                         const std::string &prefix,
+                         Callback callback);
+
+        /**
+         * Stops watching
+         */
+        ~DirectoryWatcher();
+
+        /**
+         * Start watching the directory
+         *
+         * @return true if success, false if the directory can't be
+         *         watched (or it is already started)
+         */
+        bool start(void);
+
+        /**
+         * Stop watching the directory (and wait for the callback to
+         * return if it is running)
+         */
+        void stop(void);
+
+    private:
+        DirectoryWatcher(const DirectoryWatcher &) = delete;
+        DirectoryWatcher &operator=(const DirectoryWatcher &) = delete;
+
+        struct Impl;
+        std::unique_ptr<Impl> impl;
+    };
+
     /**
      * Delete a file or directory (including subdirectories)
      */
     PLATFORM_PUBLIC_API
     bool rmrf(const std::string &path);
 
+    /**
+     * Delete a file or directory (including subdirectories) using a
+     * pool of worker threads, see TreeRemover.
+     *
+     * @param path the file or directory to delete
+     * @param nthreads the number of threads to use (0 means one per CPU)
+     * @return true if everything was deleted
+     */
+    PLATFORM_PUBLIC_API
+    bool rmrf(const std::string &path, size_t nthreads);
+
+    /**
+     * Delete a file or directory tree in the background.
+     *
+     * Every directory is scanned by a task on a thread pool, and its
+     * subdirectories are queued as new tasks so that the tree is
+     * deleted in parallel. On POSIX the entries are removed relative to
+     * the descriptor of their directory (openat/unlinkat) and the type
+     * reported by readdir is used, so no paths are built and no entry
+     * is stat'ed. Symbolic links are removed, never followed.
+     *
+     * Unlike rmrf() the removal doesn't stop at the first error: as
+     * much as possible is deleted, and the failures are counted.
+     */
+    class PLATFORM_PUBLIC_API TreeRemover {
+    public:
+        /**
+         * Called (on one of the worker threads) once the removal is
+         * complete, with true if everything was deleted. It must not
+         * call wait() or delete the TreeRemover.
+         */
+        typedef std::function<void(bool success)> Callback;
+
+        /**
+         * @param path the file or directory to delete
+         * @param nthreads the number of threads to use (0 means one
+         *                 per CPU)
+         */
+        TreeRemover(const std::string &path, size_t nthreads = 0);
+
+        /**
+         * Waits for the removal to complete
+         */
+        ~TreeRemover();
+
+        /**
+         * Start deleting the tree and return immediately. Throws
+         * std::runtime_error if the threads couldn't be created, or
+         * std::logic_error if it is already started.
+         *
+         * @param callback called upon completion (may be empty)
+         */
+        void start(Callback callback = Callback());
+
+        /**
+         * Wait for the removal to complete
+         *
+         * @return true if everything was deleted, false if something
+         *         failed (or start() wasn't called)
+         */
+        bool wait(void);
+
+        /**
+         * Has the removal completed?
+         */
+        bool isDone(void) const {
+            return done.load();
+        }
+
+        /**
+         * Get the number of files (and other non-directories) deleted
+         * so far
+         */
+        uint64_t getFilesRemoved(void) const {
+            return files.load();
+        }
+
+        /**
+         * Get the number of directories deleted so far
+         */
+        uint64_t getDirectoriesRemoved(void) const {
+            return directories.load();
+        }
+
+        /**
+         * Get the number of entries which couldn't be deleted so far
+         */
+        uint64_t getFailures(void) const {
+            return failures.load();
+        }
+
+    private:
+        TreeRemover(const TreeRemover &) = delete;
+        TreeRemover &operator=(const TreeRemover &) = delete;
+
+        struct Directory;
+
+        void finished(void);
+
+        std::string path;
+        size_t nthreads;
+        Callback callback;
+        std::unique_ptr<Couchbase::ThreadPool> pool;
+        std::atomic<uint64_t> files;
+        std::atomic<uint64_t> directories;
+        std::atomic<uint64_t> failures;
+        std::atomic<bool> done;
+    };
+
 
     /**
      * Check if a directory exists or not
@@ -80,6 +371,38 @@ namespace CouchbaseDirectoryUtilities
     PLATFORM_PUBLIC_API
     bool mkdirp(const std::string &directory);
 
+    /**
+     * Copy the content of a file, replacing the destination if it
+     * exists (which gets the permissions of the source if it is
+     * created).
+     *
+     * The data isn't passed through userspace where the system can
+     * avoid it: the file is cloned (reflinked) if the file system
+     * supports it (FICLONE on Linux, clonefile on macOS), otherwise it
+     * is copied in the kernel (copy_file_range or sendfile), and only
+     * as a last resort with read/write. On Windows this is CopyFile.
+     *
+     * @param source the file to copy
+     * @param destination the name of the copy
+     * @return true if success, false otherwise (errno is set on POSIX)
+     */
+    PLATFORM_PUBLIC_API
+    bool copyFile(const std::string &source, const std::string &destination);
+
+    /**
+     * Reserve disk space for a file, so that writing up to size bytes
+     * doesn't fail with ENOSPC and the file is laid out contiguously
+     * where possible. The file is created if it doesn't exist, and
+     * extended (with zeros) to size bytes if it is smaller, even where
+     * the file system can't reserve the space. It is never truncated.
+     *
+     * @param path the file to allocate space for
+     * @param size the number of bytes to reserve
+     * @return true if success, false otherwise (errno is set on POSIX)
+     */
+    PLATFORM_PUBLIC_API
+    bool preallocate(const std::string &path, uint64_t size);
+
 }
 
 #endif  // PLATFORM_DIRUTILS_H_
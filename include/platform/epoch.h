@@ -0,0 +1,114 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2016 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#pragma once
+
+#include <platform/visibility.h>
+
+/*
+ * Epoch based memory reclamation, for shared structures which are read
+ * all the time and changed rarely (configuration, routing tables).
+ *
+ * Readers access the structure through a pointer inside a critical
+ * section, between cb_epoch_enter and cb_epoch_exit, without taking any
+ * lock. A writer publishes a new version by swapping the pointer
+ * (with a release store) and hands the old version to cb_epoch_retire.
+ * The old version is released once every thread which was in a
+ * critical section when it was retired has left it (a "grace period"),
+ * so no reader can still see it.
+ *
+ * Entering and leaving a critical section only touches memory owned by
+ * the calling thread. A thread is registered the first time it enters
+ * a critical section. The threads started with cb_create_thread (and
+ * the other cb_create_* functions) are unregistered when they finish;
+ * other threads should call cb_epoch_unregister_thread before they
+ * exit.
+ *
+ * Critical sections should be short: a reader which stays in one
+ * holds back the release of everything retired since it entered.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    typedef void (*cb_epoch_destructor)(void *ptr);
+
+    /**
+     * Enter a read side critical section. Critical sections may be
+     * nested (only the outermost one counts).
+     */
+    PLATFORM_PUBLIC_API
+    void cb_epoch_enter(void);
+
+    /**
+     * Leave the critical section entered by cb_epoch_enter. Pointers
+     * read inside it must not be used afterwards.
+     */
+    PLATFORM_PUBLIC_API
+    void cb_epoch_exit(void);
+
+    /**
+     * Release an object once no reader may still be using it. The
+     * object must already be unreachable for new readers. This never
+     * blocks, and may be called inside a critical section. The
+     * destructor may retire other objects.
+     *
+     * @param ptr the object to release
+     * @param destructor called with ptr to release it (free for memory
+     *                   from malloc)
+     */
+    PLATFORM_PUBLIC_API
+    void cb_epoch_retire(void *ptr, cb_epoch_destructor destructor);
+
+    /**
+     * Wait for a grace period, and release everything retired before
+     * the call. Must not be called inside a critical section (that
+     * would wait for itself).
+     */
+    PLATFORM_PUBLIC_API
+    void cb_epoch_synchronize(void);
+
+    /**
+     * Forget the calling thread (it must not be in a critical section).
+     * It is registered again if it enters another one.
+     */
+    PLATFORM_PUBLIC_API
+    void cb_epoch_unregister_thread(void);
+
+#ifdef __cplusplus
+}
+
+namespace Couchbase {
+    /**
+     * A read side critical section for the lifetime of the object
+     */
+    class EpochGuard {
+    public:
+        EpochGuard() {
+            cb_epoch_enter();
+        }
+
+        ~EpochGuard() {
+            cb_epoch_exit();
+        }
+
+    private:
+        EpochGuard(const EpochGuard &) = delete;
+        EpochGuard &operator=(const EpochGuard &) = delete;
+    };
+}
+#endif
@@ -0,0 +1,142 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2016 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#pragma once
+
+#include <platform/visibility.h>
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    struct cJSON;
+
+/*
+ * Every power of two range is split into CB_HISTOGRAM_SUB_BUCKETS
+ * linear buckets, so a recorded value is off by at most 1/32 (~3%).
+ * Values below 2 * CB_HISTOGRAM_SUB_BUCKETS are recorded exactly.
+ */
+#define CB_HISTOGRAM_SUB_BUCKET_BITS 5
+#define CB_HISTOGRAM_SUB_BUCKETS (1 << CB_HISTOGRAM_SUB_BUCKET_BITS)
+#define CB_HISTOGRAM_BUCKETS \
+    ((65 - CB_HISTOGRAM_SUB_BUCKET_BITS) * CB_HISTOGRAM_SUB_BUCKETS)
+
+    /**
+     * A log-linear histogram of 64 bit values (typically the
+     * nanoseconds between two calls to gethrtime()) using a fixed
+     * amount of memory.
+     *
+     * Recording never allocates or locks: it only does relaxed atomic
+     * increments, so several threads may record into the same
+     * histogram. For hot paths give each thread its own histogram
+     * (so no cache lines are shared) and use cb_histogram_merge()
+     * to combine them when reporting.
+     *
+     * The members are internal, the struct is only public so that a
+     * histogram may live on the stack or be embedded in another object.
+     */
+    typedef struct {
+        uint64_t count;
+        uint64_t sum;
+        uint64_t min;
+        uint64_t max;
+        uint64_t buckets[CB_HISTOGRAM_BUCKETS];
+    } cb_histogram_t;
+
+    /**
+     * Initialize (or clear) a histogram. Must not race with recording.
+     */
+    PLATFORM_PUBLIC_API
+    void cb_histogram_initialize(cb_histogram_t *histogram);
+
+    /**
+     * Record a value
+     */
+    PLATFORM_PUBLIC_API
+    void cb_histogram_record(cb_histogram_t *histogram, uint64_t value);
+
+    /**
+     * Record the same value count times
+     */
+    PLATFORM_PUBLIC_API
+    void cb_histogram_record_n(cb_histogram_t *histogram, uint64_t value,
+                               uint64_t count);
+
+    /**
+     * Add all of the values recorded in src to dest. Recording may take
+     * place in src (the new values may or may not be included).
+     */
+    PLATFORM_PUBLIC_API
+    void cb_histogram_merge(cb_histogram_t *dest, const cb_histogram_t *src);
+
+    /**
+     * Get the number of recorded values
+     */
+    PLATFORM_PUBLIC_API
+    uint64_t cb_histogram_count(const cb_histogram_t *histogram);
+
+    /**
+     * Get the smallest recorded value (0 if the histogram is empty)
+     */
+    PLATFORM_PUBLIC_API
+    uint64_t cb_histogram_min(const cb_histogram_t *histogram);
+
+    /**
+     * Get the largest recorded value (0 if the histogram is empty)
+     */
+    PLATFORM_PUBLIC_API
+    uint64_t cb_histogram_max(const cb_histogram_t *histogram);
+
+    /**
+     * Get the mean of the recorded values (0 if the histogram is empty)
+     */
+    PLATFORM_PUBLIC_API
+    double cb_histogram_mean(const cb_histogram_t *histogram);
+
+    /**
+     * Get the value at the given percentile, i.e. the smallest value
+     * which is greater than or equal to percentile % of the recorded
+     * values (within the resolution of the histogram; the result is
+     * never above the maximum recorded value).
+     *
+     * @param histogram the histogram to query
+     * @param percentile 0.0 to 100.0 (for instance 99.9)
+     * @return the value, or 0 if the histogram is empty
+     */
+    PLATFORM_PUBLIC_API
+    uint64_t cb_histogram_percentile(const cb_histogram_t *histogram,
+                                     double percentile);
+
+    /**
+     * Create a JSON representation of the histogram looking like:
+     *
+     *     {"count":10,"min":1,"max":900,"mean":120.5,
+     *      "p50":100,"p90":300,"p99":900,"p99.9":900,
+     *      "buckets":[[<upper bound>, <count>], ...]}
+     *
+     * where buckets only lists the non-empty buckets. Values above
+     * INT64_MAX (such as the upper bound of the last bucket) are
+     * reported as INT64_MAX. The caller owns
+     * the returned object (release it with cJSON_Delete).
+     */
+    PLATFORM_PUBLIC_API
+    struct cJSON *cb_histogram_to_json(const cb_histogram_t *histogram);
+
+#ifdef __cplusplus
+}
+#endif
@@ -25,24 +25,44 @@
 #include <string>
 
 namespace Couchbase {
-    class PLATFORM_PUBLIC_API MemoryMappedFile {
+    /**
+     * The interface common to all of the memory mappings (file backed
+     * or not), so code which only needs to access the memory doesn't
+     * depend on what backs it.
+     */
+    class PLATFORM_PUBLIC_API MemoryMapping {
     public:
-        ~MemoryMappedFile();
-
-        MemoryMappedFile(const char *fname, bool share, bool rdonly);
-
         /**
-        * Open the mapping. Throws an std::string with a reason why
-        * in case of a failure.
-        */
-        void open(void);
+         * The kind of pages to back the mapping with
+         */
+        enum class HugePages {
+            /** Use the normal page size */
+            None,
+            /**
+             * Ask for transparent huge pages (MADV_HUGEPAGE on Linux).
+             * Whether the system honours it depends on its
+             * configuration, so check getBacking().
+             */
+            Transparent,
+            /**
+             * Require huge pages from the hugetlb pool. For a file this
+             * means the file must live on a hugetlbfs mount. Opening
+             * the mapping fails if huge pages can't be used.
+             */
+            Explicit
+        };
 
         /**
-        * Close the file mapping.. This invalidates the root pointer
-        * and the mapping should NOT be used after it is closed
-        * (it'll most likely cause a crash)
-        */
-        void close(void);
+         * What the mapping ended up being backed by (see getBacking())
+         */
+        struct Backing {
+            /** The size of the pages used for the mapping */
+            size_t pageSize;
+            /** The number of bytes currently mapped by huge pages */
+            size_t hugePageBytes;
+            /** Are the pages locked in memory */
+            bool locked;
+        };
 
         /**
         * Get the address for the beginning of the pointer.
@@ -64,9 +84,155 @@ namespace Couchbase {
             return size;
         }
 
+    protected:
+        MemoryMapping() :
+            root(NULL),
+            size(0) {
+        }
+
+        void *root;
+        size_t size;
+    };
+
+    class PLATFORM_PUBLIC_API MemoryMappedFile : public MemoryMapping {
+    public:
+        /**
+         * The expected access pattern for a range of the mapping
+         */
+        enum class Advice {
+            /** No special treatment (the default) */
+            Normal,
+            /** The pages will be read in order: read ahead aggressively */
+            Sequential,
+            /** The pages will be read randomly: don't read ahead */
+            Random,
+            /** The pages will be needed soon: start reading them in */
+            WillNeed,
+            /** The pages won't be needed soon: they may be dropped */
+            DontNeed
+        };
+
+        ~MemoryMappedFile();
+
+        MemoryMappedFile(const char *fname, bool share, bool rdonly);
+
+        /**
+        * Read all of the pages in (and map them) as part of open(),
+        * so that the first access to a page doesn't take a page fault.
+        * Must be called before open().
+        */
+        void setPrefault(bool enable) {
+            prefault = enable;
+        }
+
+        /**
+        * Request huge pages for the mapping. Must be called before
+        * open().
+        */
+        void setHugePages(HugePages pages) {
+            hugePages = pages;
+        }
+
+        /**
+        * Lock the pages of the mapping in memory (mlock/VirtualLock)
+        * so they are never paged out. This implies prefaulting. open()
+        * fails if the pages can't be locked (for instance because of
+        * RLIMIT_MEMLOCK). Must be called before open().
+        */
+        void setLocked(bool enable) {
+            locked = enable;
+        }
+
+        /**
+        * Open the mapping. Throws an std::string with a reason why
+        * in case of a failure.
+        */
+        void open(void);
+
+        /**
+        * Map a window of the file. Throws an std::string with a reason
+        * why in case of a failure.
+        *
+        * A shared writable mapping may extend beyond the end of the
+        * file, in which case the file is extended to cover it. Other
+        * mappings must be within the file.
+        *
+        * @param offset where the mapping starts in the file. Must be a
+        *               multiple of the page size (the allocation
+        *               granularity of 64k on Windows)
+        * @param length the number of bytes to map (0 means up to the
+        *               end of the file)
+        */
+        void open(size_t offset, size_t length);
+
+        /**
+        * Change the length of the mapping (keeping its offset), for
+        * instance to append to the file through a shared writable
+        * mapping. The file is extended like in open(). The mapping
+        * may move, so getRoot() must be called again afterwards. The
+        * changes made through a private mapping are kept.
+        * Throws an std::string with a reason why in case of a failure,
+        * leaving the current mapping intact.
+        *
+        * @param length the new number of bytes to map
+        */
+        void remap(size_t length);
+
+        /**
+        * Write the modified pages in a range of the mapping back to the
+        * file. Throws an std::string with a reason upon failure.
+        *
+        * @param offset the start of the range within the mapping
+        * @param length the number of bytes in the range (0 means up to
+        *               the end of the mapping)
+        * @param async schedule the writes and return without waiting
+        *              for them to complete
+        */
+        void sync(size_t offset = 0, size_t length = 0, bool async = false);
+
+        /**
+        * Close the file mapping.. This invalidates the root pointer
+        * and the mapping should NOT be used after it is closed
+        * (it'll most likely cause a crash)
+        */
+        void close(void);
+
+        /**
+        * Tell the system how a range of the mapping is going to be used.
+        * The range is extended to page boundaries. This is purely a
+        * hint, and the advice not supported by a platform is ignored.
+        *
+        * For a private writable mapping DontNeed only drops the pages
+        * from the page cache, and keeps the modified pages.
+        *
+        * Throws an std::string with the reason upon failure.
+        *
+        * @param advice the expected access pattern
+        * @param offset the start of the range within the mapping
+        * @param length the number of bytes in the range (0 means up to
+        *               the end of the mapping)
+        */
+        void advise(Advice advice, size_t offset = 0, size_t length = 0);
+
+        /**
+        * Report the pages actually backing the mapping, so the caller
+        * can verify that huge pages or locking are in effect.
+        */
+        Backing getBacking(void) const;
+
+        /**
+        * Get the offset in the file where the mapping starts
+        */
+        size_t getOffset(void) const {
+            return fileOffset;
+        }
+
     private:
         MemoryMappedFile(MemoryMappedFile &) = delete;
 
+        void *mapRange(size_t length);
+        void ensureFileSize(size_t length);
+
         std::string filename;
 #ifdef WIN32
         HANDLE filehandle;
@@ -74,9 +240,101 @@ namespace Couchbase {
 #else
         int filehandle;
 #endif
-        void *root;
-        size_t size;
         bool sharedMapping;
         bool readonly;
+        bool prefault;
+        HugePages hugePages;
+        bool locked;
+        size_t pageSize;
+        size_t fileOffset;
+    };
+
+    /**
+     * A segment of shared memory which isn't backed by a file. It is
+     * either anonymous (and shared with the processes forked after it
+     * was created) or named, so that other processes can attach to it
+     * with open() (memfd_create/shm_open on POSIX and a pagefile
+     * backed section on Windows).
+     *
+     * As with MemoryMappedFile, failures are reported by throwing an
+     * std::string with the reason.
+     */
+    class PLATFORM_PUBLIC_API SharedMemorySegment : public MemoryMapping {
+    public:
+        /**
+         * @param name the name of the segment, or NULL (or "") for an
+         *             anonymous segment. On POSIX a leading '/' is
+         *             added if missing.
+         * @param rdonly map the segment read only (only for open())
+         */
+        SharedMemorySegment(const char *name, bool rdonly);
+
+        ~SharedMemorySegment();
+
+        /**
+        * Request huge pages for the segment. Explicit huge pages are
+        * only available for anonymous segments on Linux, and for all
+        * segments on Windows (given the "Lock pages in memory"
+        * privilege). Must be called before create().
+        */
+        void setHugePages(HugePages pages) {
+            hugePages = pages;
+        }
+
+        /**
+        * Lock the pages of the segment in memory. Must be called before
+        * create() or open().
+        */
+        void setLocked(bool enable) {
+            locked = enable;
+        }
+
+        /**
+        * Create a new (zero filled) segment and map it. Fails if a
+        * segment with the same name already exists.
+        *
+        * @param size the size of the segment in bytes
+        */
+        void create(size_t size);
+
+        /**
+        * Map an existing named segment (all of it)
+        */
+        void open(void);
+
+        /**
+        * Unmap the segment. The memory is released once every process
+        * has closed it (and the name is removed, see unlink())
+        */
+        void close(void);
+
+        /**
+        * Report the pages actually backing the segment
+        */
+        Backing getBacking(void) const;
+
+        /**
+        * Remove the name of a segment so that no other process can
+        * open it. Existing mappings stay valid. This is a noop on
+        * Windows, where the segment is removed when the last handle
+        * is closed.
+        */
+        static void unlink(const char *name);
+
+    private:
+        SharedMemorySegment(SharedMemorySegment &) = delete;
+
+        void *mapSegment(size_t length, bool writable);
+
+        std::string name;
+#ifdef WIN32
+        HANDLE maphandle;
+#else
+        int fd;
+#endif
+        bool readonly;
+        HugePages hugePages;
+        bool locked;
+        size_t pageSize;
     };
 }
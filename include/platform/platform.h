@@ -32,6 +32,7 @@
 #include <time.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <platform/byteorder.h>
 #include <platform/visibility.h>
 
 #ifdef __sun
@@ -56,6 +57,7 @@ extern "C" {
     typedef DWORD cb_thread_t;
     typedef CRITICAL_SECTION cb_mutex_t;
     typedef CONDITION_VARIABLE cb_cond_t;
+    typedef SRWLOCK cb_rwlock_t;
     typedef long ssize_t;
     typedef unsigned __int64 hrtime_t;
 #define CB_DONT_NEED_BYTEORDER 1
@@ -68,6 +70,7 @@ extern "C" {
     typedef pthread_t cb_thread_t;
     typedef pthread_mutex_t cb_mutex_t;
     typedef pthread_cond_t cb_cond_t;
+    typedef pthread_rwlock_t cb_rwlock_t;
 
 #ifndef __sun
     typedef uint64_t hrtime_t;
@@ -111,11 +114,82 @@ extern "C" {
      *                 can't call cb_join_thread on).
      * @param name Name of the thread. Maximum of 16 characters in length,
      *             including terminating '\0'. (Note: name ignored on Windows).
+     * @return 0 on success, -1 on failure (with errno set to EINVAL if the
+     *         name is too long)
      */
     PLATFORM_PUBLIC_API
     int cb_create_named_thread(cb_thread_t *id, cb_thread_main_func func,
                                void *arg, int detached, const char* name);
 
+#define CB_THREAD_PRIORITY_LOW -1
+#define CB_THREAD_PRIORITY_NORMAL 0
+#define CB_THREAD_PRIORITY_HIGH 1
+
+    /**
+     * Attributes for cb_create_thread_ex. Use cb_thread_attr_initialize
+     * to get the defaults (which is the same as cb_create_thread) and
+     * set the members you care about.
+     */
+    typedef struct cb_thread_attr {
+        /** Name of the thread (see cb_create_named_thread), or NULL */
+        const char *name;
+        /** Set to non-zero to create the thread in a detached state */
+        int detached;
+        /**
+         * The CPUs the thread may run on. NULL (or ncpus == 0) means
+         * all CPUs. On Windows all of the CPUs must be in the same
+         * processor group (CPU n is bit n % 64 in group n / 64).
+         */
+        const unsigned int *cpus;
+        size_t ncpus;
+        /**
+         * Restrict the thread to the CPUs of this NUMA node, or -1 for
+         * no restriction. Combined with cpus the thread runs on the
+         * CPUs present in both.
+         */
+        int numa_node;
+        /** Stack size in bytes, or 0 for the system default */
+        size_t stack_size;
+        /**
+         * One of the CB_THREAD_PRIORITY_ values. Raising the priority
+         * may require extra privileges; the thread is started with
+         * the normal priority if the change is denied.
+         */
+        int priority;
+    } cb_thread_attr_t;
+
+    /**
+     * Initialize the thread attributes with the default values.
+     *
+     * @param attr the attributes to initialize
+     */
+    PLATFORM_PUBLIC_API
+    void cb_thread_attr_initialize(cb_thread_attr_t *attr);
+
+    /**
+     * Create a new thread (in a running state) with the given attributes.
+     *
+     * CPU affinity and NUMA placement are only honoured on Linux and
+     * Windows, and silently ignored elsewhere.
+     *
+     * @param id The thread identifier (returned)
+     * @param func The entry point for the newly created thread
+     * @param arg Arguments passed to the newly created thread
+     * @param attr The attributes for the new thread (NULL for defaults)
+     * @return 0 on success, -1 on failure (e.g. the CPU set is empty or
+     *         the NUMA node doesn't exist)
+     */
+    PLATFORM_PUBLIC_API
+    int cb_create_thread_ex(cb_thread_t *id, cb_thread_main_func func,
+                            void *arg, const cb_thread_attr_t *attr);
+
+    /**
+     * Get the number of NUMA nodes in the system (1 on systems without
+     * NUMA, or where it can't be determined).
+     */
+    PLATFORM_PUBLIC_API
+    int cb_get_numa_node_count(void);
+
     /**
      * Wait for a thread to complete
      *
@@ -198,6 +272,211 @@ extern "C" {
     PLATFORM_PUBLIC_API
     void cb_mutex_exit(cb_mutex_t *mutex);
 
+    /***********************************************************************
+     *                     Mutex contention profiling                      *
+     **********************************************************************/
+    /**
+     * Give a mutex a name, so that its use is recorded while profiling
+     * is enabled. Only named mutexes are tracked. The registration is
+     * removed by cb_mutex_destroy.
+     *
+     * @param mutex the (initialized) mutex to name
+     * @param name the name to report it as (truncated to 31 characters)
+     * @return 0 on success, -1 if the registry is full (it holds 1023)
+     */
+    PLATFORM_PUBLIC_API
+    int cb_mutex_set_name(cb_mutex_t *mutex, const char *name);
+
+    /**
+     * Enable (or disable) contention profiling. While enabled
+     * cb_mutex_enter first tries to get the mutex without blocking, and
+     * the named mutexes record the number of acquisitions, the number
+     * of acquisitions which had to wait, the time spent waiting (using
+     * gethrtime) and the longest time the mutex was held.
+     *
+     * @param enable non-zero to enable profiling
+     */
+    PLATFORM_PUBLIC_API
+    void cb_mutex_profiling_enable(int enable);
+
+    typedef struct cb_mutex_stats {
+        const char *name;
+        uint64_t acquisitions;
+        uint64_t contended;
+        uint64_t total_wait_ns;
+        uint64_t max_wait_ns;
+        uint64_t max_hold_ns;
+    } cb_mutex_stats_t;
+
+    typedef void (*cb_mutex_stats_callback)(const cb_mutex_stats_t *stats,
+                                            void *ctx);
+
+    /**
+     * Call the callback with the statistics for every named mutex. The
+     * stats (and the name) are only valid during the callback.
+     *
+     * @param callback the function to call for each mutex
+     * @param ctx passed on to the callback
+     */
+    PLATFORM_PUBLIC_API
+    void cb_mutex_stats_iterate(cb_mutex_stats_callback callback, void *ctx);
+
+    /**
+     * Reset the statistics for all of the named mutexes
+     */
+    PLATFORM_PUBLIC_API
+    void cb_mutex_stats_reset(void);
+
+    struct cJSON;
+
+    /**
+     * Get the statistics for all of the named mutexes as a JSON array
+     * of objects (one per mutex, with the members named as in
+     * cb_mutex_stats_t). The caller must release it with cJSON_Delete.
+     */
+    PLATFORM_PUBLIC_API
+    struct cJSON *cb_mutex_stats_to_json(void);
+
+    /**
+     * The number of attempts cb_adaptive_mutex_enter makes to grab the
+     * lock before blocking when initialized with a spin count of 0.
+     */
+#define CB_ADAPTIVE_MUTEX_DEFAULT_SPINS 100
+
+    /**
+     * A mutex which spins (with backoff) for a while before it blocks
+     * in the kernel. Use it for locks which are only held for a very
+     * short time, where parking the thread costs more than the work
+     * being protected.
+     *
+     * The underlying cb_mutex_t may be passed to the cb_cond_ functions.
+     */
+    typedef struct cb_adaptive_mutex {
+        cb_mutex_t mutex;
+        unsigned int spins;
+    } cb_adaptive_mutex_t;
+
+    /**
+     * Initialize an adaptive mutex.
+     *
+     * @param mutex the mutex object to initialize
+     * @param spins the number of attempts to get the lock before
+     *              blocking (0 for CB_ADAPTIVE_MUTEX_DEFAULT_SPINS)
+     */
+    PLATFORM_PUBLIC_API
+    void cb_adaptive_mutex_initialize(cb_adaptive_mutex_t *mutex,
+                                      unsigned int spins);
+
+    /**
+     * Destroy (and release all allocated resources) an adaptive mutex.
+     *
+     * @param mutex the mutex object to destroy
+     */
+    PLATFORM_PUBLIC_API
+    void cb_adaptive_mutex_destroy(cb_adaptive_mutex_t *mutex);
+
+    /**
+     * Enter a locked section
+     *
+     * @param mutex the mutex protecting this section
+     */
+    PLATFORM_PUBLIC_API
+    void cb_adaptive_mutex_enter(cb_adaptive_mutex_t *mutex);
+
+    /**
+     * Try to enter a locked section (without spinning)
+     *
+     * @param mutex the mutex protecting this section
+     * @return 0 if the mutex was obtained, -1 otherwise
+     */
+    PLATFORM_PUBLIC_API
+    int cb_adaptive_mutex_try_enter(cb_adaptive_mutex_t *mutex);
+
+    /**
+     * Exit a locked section
+     *
+     * @param mutex the mutex protecting this section
+     */
+    PLATFORM_PUBLIC_API
+    void cb_adaptive_mutex_exit(cb_adaptive_mutex_t *mutex);
+
+    /***********************************************************************
+     *                  Reader-writer lock related functions               *
+     **********************************************************************/
+    /**
+     * Initialize a reader-writer lock.
+     *
+     * Like the mutex there is no static initializer, so the lock
+     * <b>must</b> be initialized by calling this function before use.
+     *
+     * @param rwlock the lock object to initialize
+     * @param prefer_writer set to non-zero to let a waiting writer
+     *                      block new readers (so that a steady stream
+     *                      of readers can't starve the writers). The
+     *                      Windows SRW lock doesn't starve writers, so
+     *                      it is ignored there.
+     */
+    PLATFORM_PUBLIC_API
+    void cb_rwlock_initialize(cb_rwlock_t *rwlock, int prefer_writer);
+
+    /**
+     * Destroy (and release all allocated resources) a reader-writer lock.
+     *
+     * @param rwlock the lock object to destroy
+     */
+    PLATFORM_PUBLIC_API
+    void cb_rwlock_destroy(cb_rwlock_t *rwlock);
+
+    /**
+     * Enter a section shared with other readers
+     *
+     * @param rwlock the lock protecting this section
+     */
+    PLATFORM_PUBLIC_API
+    void cb_rwlock_reader_enter(cb_rwlock_t *rwlock);
+
+    /**
+     * Try to enter a section shared with other readers
+     *
+     * @param rwlock the lock protecting this section
+     * @return 0 if the lock was obtained, -1 otherwise
+     */
+    PLATFORM_PUBLIC_API
+    int cb_rwlock_reader_try_enter(cb_rwlock_t *rwlock);
+
+    /**
+     * Exit a section entered with cb_rwlock_reader_enter
+     *
+     * @param rwlock the lock protecting this section
+     */
+    PLATFORM_PUBLIC_API
+    void cb_rwlock_reader_exit(cb_rwlock_t *rwlock);
+
+    /**
+     * Enter an exclusive section
+     *
+     * @param rwlock the lock protecting this section
+     */
+    PLATFORM_PUBLIC_API
+    void cb_rwlock_writer_enter(cb_rwlock_t *rwlock);
+
+    /**
+     * Try to enter an exclusive section
+     *
+     * @param rwlock the lock protecting this section
+     * @return 0 if the lock was obtained, -1 otherwise
+     */
+    PLATFORM_PUBLIC_API
+    int cb_rwlock_writer_try_enter(cb_rwlock_t *rwlock);
+
+    /**
+     * Exit a section entered with cb_rwlock_writer_enter
+     *
+     * @param rwlock the lock protecting this section
+     */
+    PLATFORM_PUBLIC_API
+    void cb_rwlock_writer_exit(cb_rwlock_t *rwlock);
+
     /***********************************************************************
      *                 Condition variable related functions                *
      **********************************************************************/
@@ -247,6 +526,30 @@ extern "C" {
     PLATFORM_PUBLIC_API
     void cb_cond_timedwait(cb_cond_t *cond, cb_mutex_t *mutex, unsigned int ms);
 
+    /**
+     * Wait for a condition variable to be signaled, but give up after a
+     * given number of nanoseconds.
+     *
+     * The timeout is measured with a monotonic clock where the platform
+     * allows it, so it isn't affected by changes to the wall clock.
+     * Windows only supports millisecond timeouts, so the timeout is
+     * rounded up to the next millisecond there.
+     *
+     * The mutex must be in a locked state, and this method will release
+     * the mutex and wait for the condition variable to be signaled in an
+     * atomic operation.
+     *
+     * The mutex is locked when the method returns.
+     *
+     * @param cond the condition variable to wait for
+     * @param mutex the locked mutex protecting the critical section
+     * @param ns the number of nanoseconds to wait.
+     * @return 0 if the condition variable was signaled (or the wait was
+     *         spuriously woken), -1 if the wait timed out
+     */
+    PLATFORM_PUBLIC_API
+    int cb_cond_timedwait_ns(cb_cond_t *cond, cb_mutex_t *mutex, uint64_t ns);
+
     /**
      * Singal a single thread waiting for a condition variable
      *
@@ -263,6 +566,151 @@ extern "C" {
     PLATFORM_PUBLIC_API
     void cb_cond_broadcast(cb_cond_t *cond);
 
+    /***********************************************************************
+     *                   Semaphore and event functions                     *
+     **********************************************************************/
+
+    /*
+     * The semaphore and event block in the kernel on the address of the
+     * counter (futex on Linux, WaitOnAddress on Windows and __ulock on
+     * macOS), so posting and waiting don't make any system calls unless
+     * somebody has to sleep or be woken. Other platforms use a mutex
+     * and a condition variable.
+     */
+#if defined(__linux__) || defined(WIN32) || defined(__APPLE__)
+#define CB_SEMAPHORE_USE_FUTEX 1
+#endif
+
+    typedef struct cb_semaphore {
+        volatile uint32_t count;
+        volatile uint32_t waiters;
+#ifndef CB_SEMAPHORE_USE_FUTEX
+        cb_mutex_t mutex;
+        cb_cond_t cond;
+#endif
+    } cb_semaphore_t;
+
+    /**
+     * Initialize a counting semaphore
+     *
+     * @param sem the semaphore to initialize
+     * @param count the initial count
+     */
+    PLATFORM_PUBLIC_API
+    void cb_semaphore_initialize(cb_semaphore_t *sem, uint32_t count);
+
+    /**
+     * Destroy (and release all allocated resources) a semaphore
+     *
+     * @param sem the semaphore to destroy
+     */
+    PLATFORM_PUBLIC_API
+    void cb_semaphore_destroy(cb_semaphore_t *sem);
+
+    /**
+     * Increase the count of the semaphore, waking up to n waiters
+     *
+     * @param sem the semaphore to post
+     * @param n the number to add to the count
+     */
+    PLATFORM_PUBLIC_API
+    void cb_semaphore_post(cb_semaphore_t *sem, uint32_t n);
+
+    /**
+     * Wait until the count is non-zero, and decrement it
+     *
+     * @param sem the semaphore to wait for
+     */
+    PLATFORM_PUBLIC_API
+    void cb_semaphore_wait(cb_semaphore_t *sem);
+
+    /**
+     * Decrement the count if it is non-zero (without blocking)
+     *
+     * @param sem the semaphore to decrement
+     * @return 0 if the count was decremented, -1 otherwise
+     */
+    PLATFORM_PUBLIC_API
+    int cb_semaphore_try_wait(cb_semaphore_t *sem);
+
+    /**
+     * Wait until the count is non-zero and decrement it, but give up
+     * after the given number of nanoseconds.
+     *
+     * @param sem the semaphore to wait for
+     * @param ns the maximum number of nanoseconds to wait
+     * @return 0 if the count was decremented, -1 if the wait timed out
+     */
+    PLATFORM_PUBLIC_API
+    int cb_semaphore_timedwait_ns(cb_semaphore_t *sem, uint64_t ns);
+
+    /**
+     * A one-shot event. Threads block in cb_event_wait until somebody
+     * calls cb_event_set, after which all waits return immediately
+     * (until the event is reset).
+     */
+    typedef cb_semaphore_t cb_event_t;
+
+    /**
+     * Initialize an event (in the unset state)
+     *
+     * @param event the event to initialize
+     */
+    PLATFORM_PUBLIC_API
+    void cb_event_initialize(cb_event_t *event);
+
+    /**
+     * Destroy (and release all allocated resources) an event
+     *
+     * @param event the event to destroy
+     */
+    PLATFORM_PUBLIC_API
+    void cb_event_destroy(cb_event_t *event);
+
+    /**
+     * Set the event, and wake all of the threads waiting for it
+     *
+     * @param event the event to set
+     */
+    PLATFORM_PUBLIC_API
+    void cb_event_set(cb_event_t *event);
+
+    /**
+     * Move the event back to the unset state
+     *
+     * @param event the event to reset
+     */
+    PLATFORM_PUBLIC_API
+    void cb_event_reset(cb_event_t *event);
+
+    /**
+     * Check if the event is set
+     *
+     * @param event the event to check
+     * @return non-zero if the event is set
+     */
+    PLATFORM_PUBLIC_API
+    int cb_event_is_set(cb_event_t *event);
+
+    /**
+     * Wait for the event to be set
+     *
+     * @param event the event to wait for
+     */
+    PLATFORM_PUBLIC_API
+    void cb_event_wait(cb_event_t *event);
+
+    /**
+     * Wait for the event to be set, but give up after the given number
+     * of nanoseconds.
+     *
+     * @param event the event to wait for
+     * @param ns the maximum number of nanoseconds to wait
+     * @return 0 if the event is set, -1 if the wait timed out
+     */
+    PLATFORM_PUBLIC_API
+    int cb_event_timedwait_ns(cb_event_t *event, uint64_t ns);
+
 
 #ifndef CB_DONT_NEED_GETHRTIME
     /**
@@ -288,6 +736,9 @@ extern "C" {
 
     PLATFORM_PUBLIC_API
     uint64_t htonll(uint64_t);
+
+    /* Out of line; cb_ntohll and cb_htonll (platform/byteorder.h) are
+     * the inline versions */
 #endif
 
     typedef void *cb_dlhandle_t;
@@ -301,6 +752,65 @@ extern "C" {
     PLATFORM_PUBLIC_API
     void cb_dlclose(cb_dlhandle_t handle);
 
+    /*
+     * A registry of libraries for loading plugins. The handles are
+     * reference counted on the library they resolve to, so opening the
+     * same library again (under any name) doesn't go through dlopen, and
+     * the result of every symbol lookup is cached (including the
+     * failures). It is safe to use from multiple threads.
+     */
+
+    /**
+     * Open a library through the registry. See cb_dlopen for the naming
+     * rules and errmsg.
+     */
+    PLATFORM_PUBLIC_API
+    cb_dlhandle_t cb_dlregistry_open(const char *library, char **errmsg);
+
+    /**
+     * Look up a symbol in a library opened with cb_dlregistry_open
+     * (other handles are passed on to cb_dlsym)
+     */
+    PLATFORM_PUBLIC_API
+    void *cb_dlregistry_sym(cb_dlhandle_t handle, const char *symbol,
+                            char **errmsg);
+
+    /**
+     * One entry of the table passed to cb_dlregistry_bind: the symbol
+     * to look up and the offset of the pointer to store it in (use
+     * offsetof on the struct of function pointers).
+     */
+    typedef struct {
+        const char *name;
+        size_t offset;
+        /* don't fail if the symbol is missing, just store NULL */
+        int optional;
+    } cb_dlsymbol_t;
+
+    /**
+     * Resolve a table of symbols into a struct of function pointers in
+     * one call.
+     *
+     * @param handle a handle from cb_dlregistry_open
+     * @param symbols the symbols to look up
+     * @param nsymbols the number of entries in symbols
+     * @param functions the struct to store the addresses in
+     * @param errmsg set to the error for the first missing symbol which
+     *               isn't optional (may be NULL)
+     * @return 0 if all of the required symbols were found, -1 otherwise
+     *         (the ones which were found are stored anyway)
+     */
+    PLATFORM_PUBLIC_API
+    int cb_dlregistry_bind(cb_dlhandle_t handle, const cb_dlsymbol_t *symbols,
+                           size_t nsymbols, void *functions, char **errmsg);
+
+    /**
+     * Release a reference to the library, which is closed when the last
+     * one is dropped (other handles are passed on to cb_dlclose)
+     */
+    PLATFORM_PUBLIC_API
+    void cb_dlregistry_close(cb_dlhandle_t handle);
+
 #ifdef WIN32
     struct iovec {
         size_t iov_len;
@@ -359,6 +869,33 @@ extern "C" {
     PLATFORM_PUBLIC_API
     void cb_set_timeofday_offset(uint64_t offset);
 
+    /*
+        return a monotonically increasing value with a milliseconds
+        frequency (on the same timeline as cb_get_monotonic_seconds).
+    */
+    PLATFORM_PUBLIC_API
+    uint64_t cb_get_monotonic_milliseconds(void);
+
+    /*
+        start a background thread which caches the monotonic and wall
+        clock time every interval_ms milliseconds. While it runs
+        cb_get_monotonic_seconds, cb_get_monotonic_milliseconds and
+        cb_get_timeofday just read the cached values (so the time they
+        return is up to interval_ms old, and cb_get_timeofday only has
+        a millisecond resolution). Without the ticker the monotonic
+        calls use the coarse (tick granularity) clocks where the
+        platform has them.
+        Returns 0 on success, -1 if the thread couldn't be started.
+    */
+    PLATFORM_PUBLIC_API
+    int cb_start_clock_ticker(unsigned int interval_ms);
+
+    /*
+        stop the thread started by cb_start_clock_ticker.
+    */
+    PLATFORM_PUBLIC_API
+    void cb_stop_clock_ticker(void);
+
     /**
      * Some of our platforms complain on not using mkstemp. Instead of
      * having the test in all programs we're just going to use this
@@ -0,0 +1,103 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2016 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#pragma once
+
+#include <platform/backtrace.h>
+#include <platform/visibility.h>
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /**
+     * An in-process sampling CPU profiler.
+     *
+     * On POSIX an ITIMER_PROF timer sends SIGPROF at the requested rate
+     * (of consumed CPU time), and the handler captures the stack of the
+     * interrupted thread into a lock-free ring buffer. On Windows a
+     * thread suspends each of the other threads which used CPU since
+     * the last sample and walks its stack. A background thread
+     * ("cb_profiler") aggregates the samples, so memory use doesn't
+     * grow with the length of the profile, only with the number of
+     * distinct stacks.
+     *
+     * The stacks are captured with cb_backtrace_capture, which isn't
+     * strictly async-signal-safe on glibc older than 2.35 (see its
+     * documentation): a sample which interrupts a thread inside dlopen()
+     * or dlclose() may deadlock.
+     *
+     * The profiler owns SIGPROF while it runs. cb_profiler_stop puts
+     * the previous handler back, unless it was the default action
+     * (which would kill the process if a last signal is still on its
+     * way).
+     */
+
+    /**
+     * Start profiling the process.
+     *
+     * @param frequency the number of samples per second of CPU time (0
+     *                  for the default of 100)
+     * @return 0 on success, -1 if it is already running or not
+     *         supported on this platform
+     */
+    PLATFORM_PUBLIC_API
+    int cb_profiler_start(unsigned int frequency);
+
+    /**
+     * Stop profiling. The samples are kept until cb_profiler_reset.
+     */
+    PLATFORM_PUBLIC_API
+    void cb_profiler_stop(void);
+
+    /**
+     * Throw away the samples collected so far
+     */
+    PLATFORM_PUBLIC_API
+    void cb_profiler_reset(void);
+
+    /**
+     * Get the number of samples collected, and the number which were
+     * lost because the ring buffer was full (may be NULL)
+     */
+    PLATFORM_PUBLIC_API
+    uint64_t cb_profiler_get_samples(uint64_t *dropped);
+
+    /**
+     * Write the profile in the "collapsed stack" format used by
+     * flamegraph.pl and most profile viewers: one line per distinct
+     * stack, with the function names from the outermost to the
+     * innermost frame separated by ';', followed by a space and the
+     * number of samples:
+     *
+     *     main;run;parse_document;cJSON_Parse 42
+     *
+     * The frames are symbolized with the cache of
+     * cb_backtrace_symbolize (frames without a symbol are shown as
+     * their address). May be called while the profiler runs.
+     *
+     * @param write_cb called with `context` for every line (without a
+     *                 trailing newline)
+     * @param context passed to write_cb
+     */
+    PLATFORM_PUBLIC_API
+    void cb_profiler_write_collapsed(write_cb_t write_cb, void *context);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,160 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2016 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#pragma once
+
+#include <platform/visibility.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Bounded lock-free queues of pointers for handing work between
+ * threads.
+ *
+ * cb_mpmc_queue_t may be used by any number of producers and consumers.
+ * Every slot has a sequence number telling whether it is ready to be
+ * written or read in the current lap of the ring, so a push or pop costs
+ * a single compare-and-swap on the position (D. Vyukov's bounded MPMC
+ * queue). cb_spsc_queue_t is for exactly one producer and one consumer
+ * thread, and doesn't need any read-modify-write operations at all.
+ *
+ * The positions are on cache lines of their own, so the producers and
+ * consumers don't slow each other down.
+ *
+ * The try functions never block. The others wait for an item (or a
+ * free slot) on a cb_semaphore_t, which doesn't make any system call
+ * unless a thread has to sleep. A push or pop only has to wake
+ * somebody up if a thread is waiting on the other side.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    typedef struct cb_mpmc_queue cb_mpmc_queue_t;
+    typedef struct cb_spsc_queue cb_spsc_queue_t;
+
+    /**
+     * Create a queue
+     *
+     * @param capacity the number of items it can hold (rounded up to a
+     *                 power of two)
+     * @return the queue, or NULL on memory fail
+     */
+    PLATFORM_PUBLIC_API
+    cb_mpmc_queue_t *cb_mpmc_queue_create(size_t capacity);
+
+    /**
+     * Destroy the queue (any items left in it are not touched)
+     */
+    PLATFORM_PUBLIC_API
+    void cb_mpmc_queue_destroy(cb_mpmc_queue_t *queue);
+
+    /**
+     * Add an item to the queue unless it is full
+     *
+     * @return 0 on success, -1 if the queue is full
+     */
+    PLATFORM_PUBLIC_API
+    int cb_mpmc_queue_try_push(cb_mpmc_queue_t *queue, void *item);
+
+    /**
+     * Remove the oldest item from the queue unless it is empty
+     *
+     * @return 0 on success, -1 if the queue is empty
+     */
+    PLATFORM_PUBLIC_API
+    int cb_mpmc_queue_try_pop(cb_mpmc_queue_t *queue, void **item);
+
+    /**
+     * Add an item to the queue, waiting for room if it is full
+     */
+    PLATFORM_PUBLIC_API
+    void cb_mpmc_queue_push(cb_mpmc_queue_t *queue, void *item);
+
+    /**
+     * Remove the oldest item from the queue, waiting for one if it is
+     * empty
+     */
+    PLATFORM_PUBLIC_API
+    void cb_mpmc_queue_pop(cb_mpmc_queue_t *queue, void **item);
+
+    /**
+     * Add an item to the queue, but give up if it is still full after
+     * the given number of nanoseconds
+     *
+     * @return 0 on success, -1 if the wait timed out
+     */
+    PLATFORM_PUBLIC_API
+    int cb_mpmc_queue_timedpush_ns(cb_mpmc_queue_t *queue, void *item,
+                                   uint64_t ns);
+
+    /**
+     * Remove the oldest item from the queue, but give up if it is still
+     * empty after the given number of nanoseconds
+     *
+     * @return 0 on success, -1 if the wait timed out
+     */
+    PLATFORM_PUBLIC_API
+    int cb_mpmc_queue_timedpop_ns(cb_mpmc_queue_t *queue, void **item,
+                                  uint64_t ns);
+
+    /**
+     * Get the number of items in the queue (which may be out of date by
+     * the time it returns if other threads use the queue)
+     */
+    PLATFORM_PUBLIC_API
+    size_t cb_mpmc_queue_size(cb_mpmc_queue_t *queue);
+
+    /*
+     * The single producer / single consumer version. The push functions
+     * may only be called by one thread at a time, and so may the pop
+     * functions.
+     */
+
+    PLATFORM_PUBLIC_API
+    cb_spsc_queue_t *cb_spsc_queue_create(size_t capacity);
+
+    PLATFORM_PUBLIC_API
+    void cb_spsc_queue_destroy(cb_spsc_queue_t *queue);
+
+    PLATFORM_PUBLIC_API
+    int cb_spsc_queue_try_push(cb_spsc_queue_t *queue, void *item);
+
+    PLATFORM_PUBLIC_API
+    int cb_spsc_queue_try_pop(cb_spsc_queue_t *queue, void **item);
+
+    PLATFORM_PUBLIC_API
+    void cb_spsc_queue_push(cb_spsc_queue_t *queue, void *item);
+
+    PLATFORM_PUBLIC_API
+    void cb_spsc_queue_pop(cb_spsc_queue_t *queue, void **item);
+
+    PLATFORM_PUBLIC_API
+    int cb_spsc_queue_timedpush_ns(cb_spsc_queue_t *queue, void *item,
+                                   uint64_t ns);
+
+    PLATFORM_PUBLIC_API
+    int cb_spsc_queue_timedpop_ns(cb_spsc_queue_t *queue, void **item,
+                                  uint64_t ns);
+
+    PLATFORM_PUBLIC_API
+    size_t cb_spsc_queue_size(cb_spsc_queue_t *queue);
+
+#ifdef __cplusplus
+}
+#endif
@@ -65,6 +65,56 @@ extern "C" {
     PLATFORM_PUBLIC_API
     int cb_rand_close(cb_rand_t handle);
 
+    /*
+     * The pools below read the entropy from the operating system in
+     * large blocks (using getrandom(), arc4random_buf() or
+     * BCryptGenRandom() where available) and serve the small requests
+     * from memory. The bytes are wiped from the pool as they are
+     * handed out, and the pools are discarded in a child process after
+     * fork() so parent and child never get the same bytes.
+     */
+    typedef struct cb_rand_pool cb_rand_pool_t;
+
+    /**
+     * Create an entropy pool. The pool isn't thread safe (use
+     * cb_rand_bytes() to use a pool per thread).
+     *
+     * @param size the number of bytes to read from the system at a time
+     *             (0 for the default of 4k)
+     * @return the new pool or NULL if memory allocation failed
+     */
+    PLATFORM_PUBLIC_API
+    cb_rand_pool_t *cb_rand_pool_create(size_t size);
+
+    /**
+     * Get random bytes from the pool, refilling it when it runs empty.
+     * Requests of more than half the pool size bypass the pool.
+     *
+     * @param pool the pool to read from
+     * @param dest where to store the random bytes
+     * @param nbytes the number of bytes to get
+     * @return 0 on success -1 on failure
+     */
+    PLATFORM_PUBLIC_API
+    int cb_rand_pool_get(cb_rand_pool_t *pool, void *dest, size_t nbytes);
+
+    /**
+     * Wipe and release the pool
+     */
+    PLATFORM_PUBLIC_API
+    void cb_rand_pool_destroy(cb_rand_pool_t *pool);
+
+    /**
+     * Get random bytes from the calling thread's pool (created upon
+     * first use and released when the thread exits)
+     *
+     * @param dest where to store the random bytes
+     * @param nbytes the number of bytes to get
+     * @return 0 on success -1 on failure
+     */
+    PLATFORM_PUBLIC_API
+    int cb_rand_bytes(void *dest, size_t nbytes);
+
 #ifdef __cplusplus
 }
 
@@ -73,9 +123,30 @@ namespace Couchbase {
 
     class RandomGenerator {
     public:
+        enum class Mode {
+            /** Use a provider owned by this generator */
+            Private,
+            /** Use the provider shared by the process (serialized) */
+            Shared,
+            /**
+             * Use a non-cryptographic generator (xoshiro256**) with a
+             * state per thread, seeded once per thread from the shared
+             * provider. Never blocks and never makes system calls
+             * after seeding, but must not be used for keys, nonces
+             * and the like.
+             */
+            Fast
+        };
+
+        /**
+         * Create a generator in Shared (true) or Private (false) mode
+         */
         PLATFORM_PUBLIC_API
         RandomGenerator(bool);
 
+        PLATFORM_PUBLIC_API
+        RandomGenerator(Mode mode);
+
         PLATFORM_PUBLIC_API
         ~RandomGenerator();
 
@@ -88,8 +159,15 @@ namespace Couchbase {
         PLATFORM_PUBLIC_API
         const RandomGeneratorProvider *getProvider(void) const;
 
+        /**
+         * Get the next value from the calling thread's fast generator
+         * (as used by Mode::Fast)
+         */
+        PLATFORM_PUBLIC_API
+        static uint64_t fastNext(void);
+
     private:
-        bool shared;
+        Mode mode;
         RandomGeneratorProvider *provider;
     };
 }
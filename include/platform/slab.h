@@ -0,0 +1,112 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2016 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#pragma once
+
+#include <platform/visibility.h>
+
+#include <stddef.h>
+
+/*
+ * A slab allocator for objects of a fixed size, which keeps the churn
+ * of small objects away from the general purpose heap.
+ *
+ * Every thread caches two magazines (small stacks of free objects) per
+ * slab, so most allocations and frees are a push or pop without any
+ * locking. When both are empty (or full) the thread swaps a magazine
+ * with the slab's depot under its lock. Objects may be freed by another
+ * thread than the one which allocated them.
+ *
+ * The memory is only returned to the system when the slab is destroyed.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    struct cJSON_Hooks;
+
+    typedef struct cb_slab cb_slab_t;
+
+    /**
+     * Create a slab
+     *
+     * @param size the size of the objects (rounded up to a multiple of
+     *             16, which is also their alignment)
+     * @return the slab, or NULL if out of memory (or there are already
+     *         256 slabs)
+     */
+    PLATFORM_PUBLIC_API
+    cb_slab_t *cb_slab_create(size_t size);
+
+    /**
+     * Release all of the memory of the slab. The objects allocated
+     * from it become invalid, and the slab must not be in use by other
+     * threads.
+     */
+    PLATFORM_PUBLIC_API
+    void cb_slab_destroy(cb_slab_t *slab);
+
+    /**
+     * Allocate an object
+     *
+     * @return the object, or NULL if out of memory
+     */
+    PLATFORM_PUBLIC_API
+    void *cb_slab_alloc(cb_slab_t *slab);
+
+    /**
+     * Return an object to the slab it was allocated from
+     */
+    PLATFORM_PUBLIC_API
+    void cb_slab_free(cb_slab_t *slab, void *ptr);
+
+    /**
+     * Get the size of the objects in the slab
+     */
+    PLATFORM_PUBLIC_API
+    size_t cb_slab_object_size(const cb_slab_t *slab);
+
+    /*
+     * malloc replacements backed by a set of slabs for the sizes up to
+     * 512 bytes (bigger blocks come from malloc). The memory must be
+     * released with cb_slab_release.
+     */
+
+    PLATFORM_PUBLIC_API
+    void *cb_slab_malloc(size_t size);
+
+    PLATFORM_PUBLIC_API
+    void *cb_slab_calloc(size_t nmemb, size_t size);
+
+    PLATFORM_PUBLIC_API
+    char *cb_slab_strdup(const char *str);
+
+    PLATFORM_PUBLIC_API
+    void cb_slab_release(void *ptr);
+
+    /**
+     * Set up cJSON hooks using the functions above, for use with
+     * cJSON_InitHooks (so that the nodes and their strings of the
+     * documents come from the slabs). Everything allocated by cJSON
+     * before the hooks are installed must be released first.
+     */
+    PLATFORM_PUBLIC_API
+    void cb_slab_cjson_hooks(struct cJSON_Hooks *hooks);
+
+#ifdef __cplusplus
+}
+#endif
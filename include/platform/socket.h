@@ -0,0 +1,150 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2016 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#pragma once
+
+#include <platform/platform.h>
+#include <platform/visibility.h>
+
+#ifndef WIN32
+#include <sys/socket.h>
+#include <sys/uio.h>
+#endif
+
+/*
+ * Batched and scatter-gather socket I/O.
+ *
+ * The functions return -1 on failure with the reason in errno (use
+ * WSAGetLastError on Windows).
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifdef WIN32
+    typedef SOCKET cb_socket_t;
+#else
+    typedef int cb_socket_t;
+#endif
+
+    /**
+     * One message for cb_sendmmsg / cb_recvmmsg (the same layout as
+     * struct mmsghdr on Linux).
+     */
+    typedef struct {
+        struct msghdr msg_hdr;
+        /* Set to the number of bytes sent or received */
+        unsigned int msg_len;
+    } cb_mmsghdr_t;
+
+    /**
+     * Send up to vlen messages with a single system call where the
+     * platform has one (sendmmsg on Linux), else one call per message.
+     *
+     * Each message is sent with its own sendmsg, so on a stream socket
+     * one may only be sent partially (see msg_len). Use
+     * cb_writev_cursor to send a byte stream.
+     *
+     * @return the number of messages sent, -1 if the first one failed
+     *         (sending stops at the first error)
+     */
+    PLATFORM_PUBLIC_API
+    int cb_sendmmsg(cb_socket_t sock, cb_mmsghdr_t *msgvec, unsigned int vlen,
+                    int flags);
+
+    /**
+     * Receive up to vlen messages with a single system call where the
+     * platform has one (recvmmsg on Linux). Only the first message is
+     * waited for (unless the socket is non-blocking), the rest are the
+     * ones which have already arrived.
+     *
+     * @return the number of messages received, -1 if the first one
+     *         failed
+     */
+    PLATFORM_PUBLIC_API
+    int cb_recvmmsg(cb_socket_t sock, cb_mmsghdr_t *msgvec, unsigned int vlen,
+                    int flags);
+
+    /**
+     * A position in an array of iovecs, for sending it over as many
+     * calls as it takes. The array is consumed: the buffer the cursor
+     * points into is adjusted in place to start at the first byte which
+     * hasn't been written.
+     */
+    typedef struct {
+        struct iovec *iov;
+        int iovcnt;
+    } cb_iovec_cursor_t;
+
+    PLATFORM_PUBLIC_API
+    void cb_iovec_cursor_init(cb_iovec_cursor_t *cursor, struct iovec *iov,
+                              int iovcnt);
+
+    /**
+     * Move the cursor past nbytes (which must not be more than is left)
+     */
+    PLATFORM_PUBLIC_API
+    void cb_iovec_cursor_advance(cb_iovec_cursor_t *cursor, size_t nbytes);
+
+    /**
+     * Get the number of bytes left to write
+     */
+    PLATFORM_PUBLIC_API
+    size_t cb_iovec_cursor_remaining(const cb_iovec_cursor_t *cursor);
+
+    /**
+     * Write as much of the data left in the cursor as the socket accepts,
+     * retrying short writes (and EINTR) until it is all written or the
+     * socket would block.
+     *
+     * @return the number of bytes written by this call (the cursor is
+     *         moved past them), or -1 if nothing could be written (the
+     *         error is EWOULDBLOCK / WSAEWOULDBLOCK if the socket is
+     *         full)
+     */
+    PLATFORM_PUBLIC_API
+    ssize_t cb_writev_cursor(cb_socket_t sock, cb_iovec_cursor_t *cursor,
+                             int flags);
+
+    /**
+     * Send part of a file to a socket without copying it through
+     * userspace (sendfile, or TransmitFile on Windows). Files where the
+     * kernel can't do that fall back to reading and sending a chunk at
+     * a time.
+     *
+     * On a non-blocking socket it sends as much as the socket accepts.
+     * On Windows it sends at most 64KB per call, and returns what was
+     * sent when the socket doesn't take it all straight away (blocking
+     * or not).
+     *
+     * @param sock the socket to send to
+     * @param fd the file to send from
+     * @param offset where in the file to start, moved past the bytes
+     *               which were sent
+     * @param len the number of bytes to send
+     * @return the number of bytes sent by this call (less than len if
+     *         the socket is full or the file ends), or -1 if nothing
+     *         could be sent (the error is EWOULDBLOCK if the socket is
+     *         full)
+     */
+    PLATFORM_PUBLIC_API
+    ssize_t cb_sendfile(cb_socket_t sock, int fd, uint64_t *offset,
+                        size_t len);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,161 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2016 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#pragma once
+
+#include <platform/visibility.h>
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /**
+     * A unit of work for the thread pool.
+     *
+     * The task is intrusive: the caller owns the memory (typically by
+     * embedding the struct in its own object) and the pool only links
+     * it into a worker's queue, so submitting never allocates. The
+     * task must stay valid until its function has been called. The
+     * pool does not touch the task once the function is invoked, so
+     * the function may free or resubmit it.
+     */
+    typedef struct cb_threadpool_task {
+        /** The function to run (called on one of the worker threads) */
+        void (*func)(struct cb_threadpool_task *task);
+
+        /* Internal use only */
+        struct cb_threadpool_task *next;
+        struct cb_threadpool_task *prev;
+    } cb_threadpool_task;
+
+    typedef struct cb_threadpool cb_threadpool_t;
+
+    /**
+     * Create a thread pool with a work queue per worker thread.
+     *
+     * Workers take their own most recently queued task first and steal
+     * the oldest task from another worker when their own queue is
+     * empty. Each queue has its own lock, so there is no lock shared by
+     * all producers and consumers.
+     *
+     * @param nthreads the number of worker threads (0 means one per
+     *                 available CPU)
+     * @param name prefix for the worker names ("name:N"), truncated to
+     *             fit the 16 character thread name limit. May be NULL.
+     * @return the new pool, or NULL on failure
+     */
+    PLATFORM_PUBLIC_API
+    cb_threadpool_t *cb_threadpool_create(size_t nthreads, const char *name);
+
+    /**
+     * Queue a task for execution.
+     *
+     * A task submitted from one of the pool's own workers is queued on
+     * that worker, other callers spread their tasks round-robin over
+     * the workers.
+     *
+     * @param pool the pool to run the task on
+     * @param task the task to run (must not already be queued)
+     * @return 0 on success, -1 if the pool is being destroyed
+     */
+    PLATFORM_PUBLIC_API
+    int cb_threadpool_submit(cb_threadpool_t *pool, cb_threadpool_task *task);
+
+    /**
+     * Wait until every task submitted so far (and any task they submit)
+     * has completed. Must not be called from one of the pool's workers.
+     *
+     * @param pool the pool to wait for
+     */
+    PLATFORM_PUBLIC_API
+    void cb_threadpool_wait(cb_threadpool_t *pool);
+
+    /**
+     * Get the number of worker threads in the pool
+     *
+     * @param pool the pool to query
+     */
+    PLATFORM_PUBLIC_API
+    size_t cb_threadpool_size(const cb_threadpool_t *pool);
+
+    /**
+     * Run all queued tasks, stop the worker threads and release all
+     * resources allocated by the pool.
+     *
+     * @param pool the pool to destroy
+     */
+    PLATFORM_PUBLIC_API
+    void cb_threadpool_destroy(cb_threadpool_t *pool);
+
+#ifdef __cplusplus
+}
+
+#include <string>
+
+namespace Couchbase {
+    /**
+     * C++ wrapper around cb_threadpool_t.
+     */
+    class PLATFORM_PUBLIC_API ThreadPool {
+    public:
+        /**
+         * Base class for the tasks run by the pool. As with
+         * cb_threadpool_task the pool doesn't own the task, and will
+         * not access it after run() is called.
+         */
+        class PLATFORM_PUBLIC_API Task : private cb_threadpool_task {
+        public:
+            Task();
+
+            virtual ~Task() {
+            }
+
+            virtual void run() = 0;
+
+        private:
+            friend class ThreadPool;
+            static void execute(cb_threadpool_task *task);
+        };
+
+        /**
+         * Create a pool with the given number of threads (0 means
+         * one per CPU). Throws std::runtime_error upon failure.
+         */
+        ThreadPool(size_t nthreads, const std::string &name);
+
+        ~ThreadPool();
+
+        /**
+         * Queue the task. Throws std::logic_error if the pool is
+         * being destroyed.
+         */
+        void submit(Task &task);
+
+        void wait(void);
+
+        size_t size(void) const;
+
+    private:
+        ThreadPool(const ThreadPool &) = delete;
+        ThreadPool &operator=(const ThreadPool &) = delete;
+
+        cb_threadpool_t *pool;
+    };
+}
+
+#endif
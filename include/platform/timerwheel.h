@@ -0,0 +1,176 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2016 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#pragma once
+
+#include <platform/platform.h>
+#include <platform/visibility.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A hierarchical timing wheel for large numbers of timeouts (expiry,
+ * retries, idle connections).
+ *
+ * Time is divided into ticks of a fixed length, and the wheel has four
+ * levels of 256 slots each: the first level holds the timers which
+ * expire within the next 256 ticks, one slot per tick, and each of the
+ * next levels covers 256 times the span of the previous one. When the
+ * first level wraps around, the timers in the next slot of the second
+ * level are spread out over the first (and so on up the levels).
+ * Scheduling and cancelling a timer is a constant time list operation,
+ * independent of the number of pending timers, and all of the timers
+ * of a tick are expired in one go.
+ *
+ * The times are in the same unit and domain as gethrtime(). A timer
+ * never fires before its expiry time, but may fire up to a tick late
+ * (plus the latency of whoever drives the wheel).
+ *
+ * The wheel is driven either by the caller (with cb_timerwheel_advance)
+ * or by a dedicated thread (cb_timerwheel_start), but not both. The
+ * timers may be scheduled and cancelled from any thread.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /**
+     * A timer for the wheel.
+     *
+     * As with cb_threadpool_task the timer is intrusive: the caller
+     * owns the memory (typically embedded in its own object) and the
+     * wheel only links it into a slot, so scheduling never allocates.
+     * The timer must stay valid while it is scheduled. The wheel does
+     * not touch the timer once its function is invoked, so the function
+     * may free or reschedule it.
+     */
+    typedef struct cb_timer {
+        /** The function to call when the timer expires */
+        void (*func)(struct cb_timer *timer);
+
+        /* Internal use only */
+        struct cb_timer *next;
+        struct cb_timer *prev;
+        struct cb_timer **bucket;
+        uint64_t tick;
+    } cb_timer;
+
+    typedef struct cb_timerwheel cb_timerwheel_t;
+
+    /**
+     * Initialize a timer (it must be initialized before it is scheduled
+     * the first time).
+     *
+     * @param timer the timer to initialize
+     * @param func the function to call when it expires
+     */
+    PLATFORM_PUBLIC_API
+    void cb_timer_init(cb_timer *timer, void (*func)(cb_timer *timer));
+
+    /**
+     * Create a timer wheel
+     *
+     * @param tick the length of a tick (the resolution of the wheel)
+     * @param now the current time (usually gethrtime())
+     * @return the new wheel, or NULL on failure
+     */
+    PLATFORM_PUBLIC_API
+    cb_timerwheel_t *cb_timerwheel_create(hrtime_t tick, hrtime_t now);
+
+    /**
+     * Start a thread which drives the wheel, sleeping until the next
+     * tick with expiring timers (or until a timer is scheduled before
+     * that).
+     *
+     * @param wheel the wheel to drive
+     * @param name the name of the thread (see cb_create_named_thread)
+     * @return 0 on success, -1 if the thread couldn't be created (or is
+     *         already running)
+     */
+    PLATFORM_PUBLIC_API
+    int cb_timerwheel_start(cb_timerwheel_t *wheel, const char *name);
+
+    /**
+     * Schedule a timer. A timer which is already scheduled is moved to
+     * its new expiry time. Timers scheduled in the past expire in the
+     * next tick (not straight away, so a timer rescheduling itself from
+     * its function can't keep the wheel busy).
+     *
+     * @param wheel the wheel to add the timer to
+     * @param timer the timer to schedule
+     * @param expiry when the timer should fire
+     */
+    PLATFORM_PUBLIC_API
+    void cb_timerwheel_schedule(cb_timerwheel_t *wheel, cb_timer *timer,
+                                hrtime_t expiry);
+
+    /**
+     * Cancel a timer
+     *
+     * @param wheel the wheel the timer is scheduled on
+     * @param timer the timer to cancel
+     * @return 0 if the timer was cancelled, -1 if it wasn't scheduled
+     *         (or its function is already being called)
+     */
+    PLATFORM_PUBLIC_API
+    int cb_timerwheel_cancel(cb_timerwheel_t *wheel, cb_timer *timer);
+
+    /**
+     * Fire all of the timers which have expired by the given time. The
+     * functions are called on the calling thread, without any locks
+     * held. Must not be used on a wheel with a thread of its own, and
+     * only one thread may advance the wheel at the time.
+     *
+     * @param wheel the wheel to advance
+     * @param now the current time (usually gethrtime())
+     * @return the number of timers fired
+     */
+    PLATFORM_PUBLIC_API
+    size_t cb_timerwheel_advance(cb_timerwheel_t *wheel, hrtime_t now);
+
+    /**
+     * Get the time of the next tick which needs to be processed, for
+     * callers who drive the wheel themselves and want to know how long
+     * they may sleep. This is a lower bound: timers in the higher levels
+     * only need to be spread out at that time.
+     *
+     * @param wheel the wheel to query
+     * @return the time, or UINT64_MAX if there aren't any timers
+     */
+    PLATFORM_PUBLIC_API
+    hrtime_t cb_timerwheel_next_expiry(cb_timerwheel_t *wheel);
+
+    /**
+     * Get the number of scheduled timers
+     */
+    PLATFORM_PUBLIC_API
+    size_t cb_timerwheel_pending(cb_timerwheel_t *wheel);
+
+    /**
+     * Stop the wheel's thread (if any) and release the wheel. The
+     * timers which are still scheduled are dropped without being
+     * fired.
+     *
+     * @param wheel the wheel to destroy
+     */
+    PLATFORM_PUBLIC_API
+    void cb_timerwheel_destroy(cb_timerwheel_t *wheel);
+
+#ifdef __cplusplus
+}
+#endif
@@ -27,14 +27,40 @@ SOFTWARE.
 */
 
 #include <stdlib.h>
+#include <string.h>
+#include <platform/platform.h>
+#include <platform/threadpool.h>
 #include "JSON_checker.h"
 
-typedef struct JSON_checker_struct {
+#if defined(__x86_64__) || defined(_M_X64) || defined(__SSE2__)
+#include <emmintrin.h>
+#define HAVE_SSE2 1
+#if defined(__clang__) || (defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)))
+#define HAVE_AVX2_DISPATCH 1
+#endif
+#ifdef HAVE_AVX2_DISPATCH
+#include <immintrin.h>
+#endif
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define HAVE_NEON 1
+#endif
+
+/* The number of modes kept inside the checker before the stack moves
+   to the heap */
+#define INLINE_DEPTH 64
+
+struct JSON_checker_struct {
     int state;
-    int depth;
+    int depth; /* The maximum depth of the stack, or 0 for no limit */
     int top;
-    int* stack;
-} * JSON_checker;
+    int size; /* The number of modes stack can hold */
+    int expect; /* Expect UTF code point to extend this many bytes */
+    unsigned char* stack;
+    unsigned char inline_stack[INLINE_DEPTH];
+};
+
+typedef struct JSON_checker_struct * JSON_checker;
 
 
 #define true  1
@@ -203,10 +229,9 @@ static int
 reject(JSON_checker jc)
 {
 /*
-    Delete the JSON_checker object.
+    Mark the JSON_checker as failed. It stays failed until it is reset.
 */
-    free((void*)jc->stack);
-    free((void*)jc);
+    jc->state = -1;
     return false;
 }
 
@@ -218,10 +243,25 @@ push(JSON_checker jc, int mode)
     Push a mode onto the stack. Return false if there is overflow.
 */
     jc->top += 1;
-    if (jc->top >= jc->depth) {
+    if (jc->depth && jc->top >= jc->depth) {
         return false;
     }
-    jc->stack[jc->top] = mode;
+    if (jc->top >= jc->size) {
+        /* Grow the stack; only documents nested deeper than
+           INLINE_DEPTH get here */
+        int size = jc->size * 2;
+        unsigned char* stack = (unsigned char*)malloc(size);
+        if (stack == NULL) {
+            return false;
+        }
+        memcpy(stack, jc->stack, jc->size);
+        if (jc->stack != jc->inline_stack) {
+            free(jc->stack);
+        }
+        jc->stack = stack;
+        jc->size = size;
+    }
+    jc->stack[jc->top] = (unsigned char)mode;
     return true;
 }
 
@@ -241,31 +281,43 @@ pop(JSON_checker jc, int mode)
 }
 
 
-static JSON_checker
-new_JSON_checker(int depth)
+static void
+init_JSON_checker(JSON_checker jc, int depth)
+{
+/*
+    init_JSON_checker prepares a JSON_checker object. It takes a depth
+    parameter that restricts the level of maximum nesting (0 for none).
+*/
+    jc->depth = depth;
+    jc->size = INLINE_DEPTH;
+    jc->stack = jc->inline_stack;
+}
+
+
+static void
+reset_JSON_checker(JSON_checker jc)
 {
 /*
-    new_JSON_checker starts the checking process by constructing a JSON_checker
-    object. It takes a depth parameter that restricts the level of maximum
-    nesting.
+    reset_JSON_checker starts the checking process of a new text. The
+    stack is kept at the size the previous texts needed.
 
     To continue the process, call JSON_checker_char for each character in the
     JSON text, and then call JSON_checker_done to obtain the final result.
     These functions are fully reentrant.
-
-    The JSON_checker object will be deleted by JSON_checker_done.
-    JSON_checker_char will delete the JSON_checker object if it sees an error.
 */
-    JSON_checker jc = (JSON_checker)malloc(sizeof(struct JSON_checker_struct));
-    if (jc != NULL) {
-        /* Modified- we want to accept JSON values, not just JSON-Texts */
-        jc->state = VA;
-        jc->depth = depth;
-        jc->top = -1;
-        jc->stack = (int*)calloc(depth, sizeof(int));
-        push(jc, MODE_DONE);
+    /* Modified- we want to accept JSON values, not just JSON-Texts */
+    jc->state = VA;
+    jc->top = -1;
+    push(jc, MODE_DONE);
+}
+
+
+static void
+release_JSON_checker(JSON_checker jc)
+{
+    if (jc->stack != jc->inline_stack) {
+        free(jc->stack);
     }
-    return jc;
 }
 
 
@@ -273,16 +325,16 @@ static int
 JSON_checker_char(JSON_checker jc, int next_char)
 {
 /*
-    After calling new_JSON_checker, call this function for each character (or
+    After calling reset_JSON_checker, call this function for each character (or
     partial character) in your JSON text. It can accept UTF-8, UTF-16, or
     UTF-32. It returns true if things are looking ok so far. If it rejects the
-    text, it deletes the JSON_checker object and returns false.
+    text, it marks the JSON_checker as failed and returns false.
 */
     int next_class, next_state;
 /*
     Determine the character's class.
 */
-    if (next_char < 0) {
+    if (next_char < 0 || jc->state < 0) {
         return reject(jc);
     }
     if (next_char >= 128) {
@@ -407,33 +459,239 @@ JSON_checker_done(JSON_checker jc)
 /*
     The JSON_checker_done function should be called after all of the characters
     have been processed, but only if every call to JSON_checker_char returned
-    true. This function deletes the JSON_checker and returns true if the JSON
-    text was accepted.
+    true. This function returns true if the JSON text was accepted.
 */
-    int result = (jc->state == OK) && pop(jc, MODE_DONE);
-    reject(jc);
-    return result;
+    return (jc->state == OK) && pop(jc, MODE_DONE);
+}
+
+/*
+    The bytes which leave the state machine where it is can be skipped in
+    blocks: inside a string that is printable ASCII other than " and \,
+    and between tokens it is whitespace. These return the length of the
+    run of such bytes at the start of data.
+*/
+#define STRING_BYTE(c) ((c) >= 0x20 && (c) < 0x80 && (c) != '"' && (c) != '\\')
+#define WHITE_BYTE(c) ((c) == ' ' || (c) == '\t' || (c) == '\n' || (c) == '\r')
+
+static size_t
+scalar_run(const unsigned char *data, size_t offset, size_t size, int string)
+{
+    if (string) {
+        while (offset < size && STRING_BYTE(data[offset])) {
+            offset++;
+        }
+    } else {
+        while (offset < size && WHITE_BYTE(data[offset])) {
+            offset++;
+        }
+    }
+    return offset;
+}
+
+static int
+first_bit(unsigned int mask)
+{
+#if defined(__GNUC__)
+    return __builtin_ctz(mask);
+#else
+    int bit = 0;
+    while (!(mask & 1)) {
+        mask >>= 1;
+        bit++;
+    }
+    return bit;
+#endif
+}
+
+#ifdef HAVE_SSE2
+static size_t
+sse2_run(const unsigned char *data, size_t size, int string)
+{
+    size_t offset = 0;
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i nl = _mm_set1_epi8('\n');
+    const __m128i cr = _mm_set1_epi8('\r');
+    unsigned int mask;
+
+    for (; offset + 16 <= size; offset += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(data + offset));
+        if (string) {
+            /* Signed compare: both controls and bytes >= 0x80 are < 0x20 */
+            __m128i bad = _mm_or_si128(_mm_cmplt_epi8(v, space),
+                                       _mm_or_si128(_mm_cmpeq_epi8(v, quote),
+                                                    _mm_cmpeq_epi8(v, backslash)));
+            mask = (unsigned int)_mm_movemask_epi8(bad);
+        } else {
+            __m128i white = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, space),
+                                                      _mm_cmpeq_epi8(v, tab)),
+                                         _mm_or_si128(_mm_cmpeq_epi8(v, nl),
+                                                      _mm_cmpeq_epi8(v, cr)));
+            mask = (unsigned int)_mm_movemask_epi8(white) ^ 0xFFFF;
+        }
+        if (mask) {
+            return offset + first_bit(mask);
+        }
+    }
+    return scalar_run(data, offset, size, string);
+}
+#endif
+
+#ifdef HAVE_AVX2_DISPATCH
+__attribute__((target("avx2")))
+static size_t
+avx2_run(const unsigned char *data, size_t size, int string)
+{
+    size_t offset = 0;
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i backslash = _mm256_set1_epi8('\\');
+    const __m256i space = _mm256_set1_epi8(' ');
+    const __m256i tab = _mm256_set1_epi8('\t');
+    const __m256i nl = _mm256_set1_epi8('\n');
+    const __m256i cr = _mm256_set1_epi8('\r');
+    unsigned int mask;
+
+    for (; offset + 32 <= size; offset += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(data + offset));
+        if (string) {
+            __m256i bad = _mm256_or_si256(_mm256_cmpgt_epi8(space, v),
+                                          _mm256_or_si256(_mm256_cmpeq_epi8(v, quote),
+                                                          _mm256_cmpeq_epi8(v, backslash)));
+            mask = (unsigned int)_mm256_movemask_epi8(bad);
+        } else {
+            __m256i white = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, space),
+                                                            _mm256_cmpeq_epi8(v, tab)),
+                                            _mm256_or_si256(_mm256_cmpeq_epi8(v, nl),
+                                                            _mm256_cmpeq_epi8(v, cr)));
+            mask = ~(unsigned int)_mm256_movemask_epi8(white);
+        }
+        if (mask) {
+            return offset + first_bit(mask);
+        }
+    }
+    return offset + sse2_run(data + offset, size - offset, string);
+}
+#endif
+
+#ifdef HAVE_NEON
+static size_t
+neon_run(const unsigned char *data, size_t size, int string)
+{
+    size_t offset = 0;
+    uint8x16_t bad;
+
+    for (; offset + 16 <= size; offset += 16) {
+        uint8x16_t v = vld1q_u8(data + offset);
+        if (string) {
+            bad = vorrq_u8(vorrq_u8(vcltq_u8(v, vdupq_n_u8(0x20)),
+                                    vcgeq_u8(v, vdupq_n_u8(0x80))),
+                           vorrq_u8(vceqq_u8(v, vdupq_n_u8('"')),
+                                    vceqq_u8(v, vdupq_n_u8('\\'))));
+        } else {
+            bad = vmvnq_u8(vorrq_u8(vorrq_u8(vceqq_u8(v, vdupq_n_u8(' ')),
+                                             vceqq_u8(v, vdupq_n_u8('\t'))),
+                                    vorrq_u8(vceqq_u8(v, vdupq_n_u8('\n')),
+                                             vceqq_u8(v, vdupq_n_u8('\r')))));
+        }
+        /* No movemask; find the byte in the block with the scalar loop */
+        if (vmaxvq_u8(bad)) {
+            break;
+        }
+    }
+    return scalar_run(data, offset, size, string);
+}
+#endif
+
+typedef size_t (*run_fn)(const unsigned char *data, size_t size, int string);
+
+#if !defined(HAVE_SSE2) && !defined(HAVE_NEON)
+static size_t
+plain_run(const unsigned char *data, size_t size, int string)
+{
+    return scalar_run(data, 0, size, string);
+}
+#endif
+
+static run_fn
+select_run(void)
+{
+#ifdef HAVE_AVX2_DISPATCH
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return avx2_run;
+    }
+#endif
+#if defined(HAVE_SSE2)
+    return sse2_run;
+#elif defined(HAVE_NEON)
+    return neon_run;
+#else
+    return plain_run;
+#endif
+}
+
+#ifdef HAVE_AVX2_DISPATCH
+/* Resolved once when the library is loaded, before any checker threads
+   can exist (so they only ever read it) */
+static run_fn resolved_run = NULL;
+
+__attribute__((constructor))
+static void
+resolve_run(void)
+{
+    resolved_run = select_run();
+}
+#endif
+
+static size_t
+skip_run(const unsigned char *data, size_t size, int string)
+{
+#ifdef HAVE_AVX2_DISPATCH
+    /* Only NULL if called from a constructor which runs before ours */
+    run_fn run = resolved_run ? resolved_run : select_run();
+#else
+    run_fn run = select_run();
+#endif
+    /* Most runs between tokens are empty or a single space */
+    if (size == 0 || !(string ? STRING_BYTE(*data) : WHITE_BYTE(*data))) {
+        return 0;
+    }
+    return run(data, size, string);
+}
+
+static void
+begin(JSON_checker jc) {
+    reset_JSON_checker(jc);
+    jc->expect = 0;
 }
 
 /* Check for both UTF-8ness and JSONness in one pass */
-int
-checkUTF8JSON(const unsigned char* data, size_t size) {
-    int expect = 0; /* Expect UTF code point to extend this many bytes */
-    int badjson = 0;
-    int badutf = 0;
+static int
+feed(JSON_checker jc, const unsigned char* data, size_t size) {
+    int expect = jc->expect;
     const unsigned char *end = data + size;
-    JSON_checker jc = new_JSON_checker((int)(size/2) + 1);
+    if (jc->state < 0) {
+        return false;
+    }
     for(;data < end; data++) {
+        if(expect == 0 && jc->state <= ST) {
+            /* Skip the bytes which can't change the state (GO..AR are
+               the states between tokens) */
+            data += skip_run(data, end - data, jc->state == ST);
+            if(data == end) {
+                break;
+            }
+        }
         if(!JSON_checker_char(jc, *data)) {
-            badjson = 1;
-            break;
+            return false;
         }
 
         if(*data <= 0x7F) {
             if(expect != 0) {
                 /* Must not be expecting >0x7F. */
-                badutf = 1;
-                break;
+                return reject(jc);
             }
             continue;
         }
@@ -441,14 +699,13 @@ checkUTF8JSON(const unsigned char* data, size_t size) {
         if((*data & 0xC0) == 0xC0) {
             if(expect != 0) {
                /* Beginning of UTF-8 multi-byte sequence inside of another one. */
-                badutf = 1;
-                break;
+                return reject(jc);
             }
             expect++;
             if(*data & 0x20) expect++;
             if((*data & 0x10) && expect == 2) expect++;
             /* Verify zero bit separates count bits and codepoint bits */
-            if(expect == 3 && (*data & 0x8)) return false;
+            if(expect == 3 && (*data & 0x8)) return reject(jc);
             continue;
         }
 
@@ -456,19 +713,533 @@ checkUTF8JSON(const unsigned char* data, size_t size) {
             expect--;
         } else {
            /* Got > 0x7F when not expecting it */
-            badutf = 1;
+            return reject(jc);
+        }
+    }
+    jc->expect = expect;
+    return true;
+}
+
+static int
+finish(JSON_checker jc) {
+    if (jc->state < 0 || jc->expect != 0) {
+        return false;
+    }
+    /* Feed fake space to the validator to force it to finish validating */
+    /* numerical values, iff it hasn't marked the current stream as valid */
+    if(jc->state != OK && !JSON_checker_char(jc, 32)) {
+        return false;
+    }
+    return JSON_checker_done(jc);
+}
+
+static int
+validate(JSON_checker jc, const unsigned char* data, size_t size) {
+    begin(jc);
+    return feed(jc, data, size) && finish(jc);
+}
+
+int
+checkUTF8JSON(const unsigned char* data, size_t size) {
+    struct JSON_checker_struct jc;
+    int ret;
+    init_JSON_checker(&jc, 0);
+    ret = validate(&jc, data, size);
+    release_JSON_checker(&jc);
+    return ret;
+}
+
+JSON_validator*
+JSON_validator_create(int max_depth) {
+    JSON_checker jc = (JSON_checker)malloc(sizeof(struct JSON_checker_struct));
+    if (jc != NULL) {
+        /* One more for the MODE_DONE at the bottom of the stack */
+        init_JSON_checker(jc, max_depth > 0 ? max_depth + 1 : 0);
+    }
+    return jc;
+}
+
+void
+JSON_validator_destroy(JSON_validator* validator) {
+    if (validator != NULL) {
+        release_JSON_checker(validator);
+        free(validator);
+    }
+}
+
+int
+JSON_validator_check(JSON_validator* validator, const unsigned char* data,
+                     size_t size) {
+    return validate(validator, data, size);
+}
+
+void
+JSON_validator_begin(JSON_validator* validator) {
+    begin(validator);
+}
+
+int
+JSON_validator_feed(JSON_validator* validator, const unsigned char* data,
+                    size_t size) {
+    return feed(validator, data, size);
+}
+
+int
+JSON_validator_finish(JSON_validator* validator) {
+    return finish(validator);
+}
+
+/*
+    Parallel checking. The document is cut into chunks which are scanned
+    concurrently for the quotes (minding the escapes) and the brackets.
+    Whether a chunk starts inside a string is only known once the chunks
+    before it are stitched together, so every chunk is scanned for both
+    cases: a quote flips the case a byte is outside a string for, so
+    each byte only counts for one of them.
+
+    Stitching the brackets gives the stack of open arrays and objects at
+    the first '{', '[' or ':' of every chunk, which is where the checker
+    state is known (OB, AR or VA). The segments between those points are
+    then checked concurrently, each starting from its assumed state.
+    Segment 0 starts from the real state, and when a segment ends with
+    exactly the state the next one assumed the next one's outcome is the
+    real one as well. Some assumption only fails for invalid documents;
+    the checking then carries on sequentially from the last segment
+    which was right, so the result is always the same as checkUTF8JSON.
+*/
+
+#define PARALLEL_MIN_CHUNK (256 * 1024)
+/* Deeper documents are checked sequentially from there on */
+#define PARALLEL_MAX_DEPTH 4096
+
+typedef struct {
+    unsigned char *data;
+    size_t length;
+    size_t capacity;
+} byte_vector;
+
+static int
+bv_push(byte_vector *v, unsigned char c) {
+    if (v->length == v->capacity) {
+        size_t capacity = v->capacity ? v->capacity * 2 : 64;
+        unsigned char *data = (unsigned char*)malloc(capacity);
+        if (data == NULL) {
+            return false;
+        }
+        if (v->length) {
+            memcpy(data, v->data, v->length);
+        }
+        free(v->data);
+        v->data = data;
+        v->capacity = capacity;
+    }
+    v->data[v->length++] = c;
+    return true;
+}
+
+/*
+    The brackets a part of the document closes which were opened before
+    it (in order), and the ones it leaves open (outermost first).
+*/
+typedef struct {
+    byte_vector closes;
+    byte_vector opens;
+    int broken; /* Mismatched brackets, or memory fail */
+} bracket_effect;
+
+static void
+effect_add(bracket_effect *effect, unsigned char c) {
+    switch (c) {
+    case '{':
+    case '[':
+        if (!bv_push(&effect->opens, c)) {
+            effect->broken = true;
+        }
+        break;
+    case '}':
+    case ']':
+        if (effect->opens.length == 0) {
+            if (!bv_push(&effect->closes, c)) {
+                effect->broken = true;
+            }
+        } else if (effect->opens.data[--effect->opens.length] != c - 2) {
+            /* '{' and '[' are two below their closers */
+            effect->broken = true;
+        }
+        break;
+    }
+}
+
+/* Apply the effect to the stack of open brackets */
+static int
+effect_apply(const bracket_effect *effect, byte_vector *stack) {
+    size_t ii;
+    if (effect->broken) {
+        return false;
+    }
+    for (ii = 0; ii < effect->closes.length; ++ii) {
+        if (stack->length == 0 ||
+            stack->data[--stack->length] != effect->closes.data[ii] - 2) {
+            return false;
+        }
+    }
+    for (ii = 0; ii < effect->opens.length; ++ii) {
+        if (!bv_push(stack, effect->opens.data[ii])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+struct parallel_check;
+
+typedef struct {
+    cb_threadpool_task task;
+    struct parallel_check *check;
+    size_t begin;
+    size_t end;
+    /* Indexed by whether the chunk starts inside a string */
+    size_t split[2]; /* Just past the first '{', '[' or ':', 0 for none */
+    bracket_effect prefix[2]; /* Up to the split */
+    bracket_effect suffix[2]; /* After the split */
+    int parity; /* The number of quotes, modulo 2 */
+} scan_chunk;
+
+typedef struct {
+    cb_threadpool_task task;
+    struct parallel_check *check;
+    size_t begin;
+    size_t end;
+    byte_vector brackets; /* Open at begin */
+    struct JSON_checker_struct jc;
+    int ok;
+} check_segment;
+
+struct parallel_check {
+    const unsigned char *data;
+    cb_mutex_t mutex;
+    cb_cond_t cond;
+    size_t pending;
+};
+
+static void
+task_done(struct parallel_check *check) {
+    cb_mutex_enter(&check->mutex);
+    if (--check->pending == 0) {
+        cb_cond_signal(&check->cond);
+    }
+    cb_mutex_exit(&check->mutex);
+}
+
+/* Run the tasks on the pool (or here if it won't take them), and wait */
+static void
+run_tasks(struct parallel_check *check, cb_threadpool_t *pool,
+          cb_threadpool_task **tasks, size_t ntasks) {
+    size_t ii;
+    check->pending = ntasks;
+    for (ii = 0; ii < ntasks; ++ii) {
+        if (cb_threadpool_submit(pool, tasks[ii]) == -1) {
+            tasks[ii]->func(tasks[ii]);
+        }
+    }
+    cb_mutex_enter(&check->mutex);
+    while (check->pending) {
+        cb_cond_wait(&check->cond, &check->mutex);
+    }
+    cb_mutex_exit(&check->mutex);
+}
+
+/* The bytes the scan cares about in the len (up to 16) bytes at data */
+static unsigned int
+structural_mask(const unsigned char *data, size_t len) {
+    unsigned int mask = 0;
+    size_t ii;
+#ifdef HAVE_SSE2
+    if (len == 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)data);
+        __m128i m = _mm_or_si128(
+            _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('"')),
+                                      _mm_cmpeq_epi8(v, _mm_set1_epi8('\\'))),
+                         _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(':')),
+                                      _mm_cmpeq_epi8(v, _mm_set1_epi8('{')))),
+            _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('}')),
+                                      _mm_cmpeq_epi8(v, _mm_set1_epi8('['))),
+                         _mm_cmpeq_epi8(v, _mm_set1_epi8(']'))));
+        return (unsigned int)_mm_movemask_epi8(m);
+    }
+#endif
+    for (ii = 0; ii < len; ++ii) {
+        switch (data[ii]) {
+        case '"': case '\\': case ':': case '{': case '}': case '[': case ']':
+            mask |= 1u << ii;
+        }
+    }
+    return mask;
+}
+
+static void
+scan_chunk_run(cb_threadpool_task *task) {
+    scan_chunk *chunk = (scan_chunk*)task;
+    const unsigned char *data = chunk->check->data;
+    bracket_effect *effect[2];
+    size_t escaped = (size_t)-1; /* The byte a backslash escapes */
+    size_t block, ii;
+    int quotes = 0;
+
+    effect[0] = &chunk->prefix[0];
+    effect[1] = &chunk->prefix[1];
+    /* A run of backslashes before the chunk may escape its first byte */
+    for (ii = chunk->begin; ii > 0 && data[ii - 1] == '\\'; --ii) {
+    }
+    if ((chunk->begin - ii) & 1) {
+        escaped = chunk->begin;
+    }
+
+    for (block = chunk->begin; block < chunk->end; block += 16) {
+        size_t len = chunk->end - block < 16 ? chunk->end - block : 16;
+        unsigned int mask = structural_mask(data + block, len);
+        while (mask) {
+            unsigned char c;
+            ii = block + first_bit(mask);
+            mask &= mask - 1;
+            c = data[ii];
+            if (c == '\\') {
+                if (ii != escaped) {
+                    escaped = ii + 1;
+                }
+            } else if (c == '"') {
+                if (ii != escaped) {
+                    quotes ^= 1;
+                }
+            } else {
+                /* Outside a string if the chunk started in one iff an
+                   odd number of quotes came before */
+                effect_add(effect[quotes], c);
+                if (chunk->split[quotes] == 0 && (c == '{' || c == '[' || c == ':')) {
+                    chunk->split[quotes] = ii + 1;
+                    effect[quotes] = &chunk->suffix[quotes];
+                }
+            }
+        }
+    }
+    chunk->parity = quotes;
+    task_done(chunk->check);
+}
+
+/* The mode for an open bracket below the top of the stack */
+#define OUTER_MODE(c) ((c) == '[' ? MODE_ARRAY : MODE_OBJECT)
+
+/*
+    The state just past opener (the last byte before the segment) with
+    the brackets open. Returns false if they don't fit together.
+*/
+static int
+segment_state(const byte_vector *brackets, unsigned char opener,
+              int *state, int *top_mode) {
+    unsigned char top;
+    if (brackets->length == 0) {
+        return false;
+    }
+    top = brackets->data[brackets->length - 1];
+    switch (opener) {
+    case '{':
+        *state = OB;
+        *top_mode = MODE_KEY;
+        return top == '{';
+    case '[':
+        *state = AR;
+        *top_mode = MODE_ARRAY;
+        return top == '[';
+    case ':':
+        *state = VA;
+        *top_mode = MODE_OBJECT;
+        return top == '{';
+    }
+    return false;
+}
+
+static int
+segment_begin(JSON_checker jc, const byte_vector *brackets, unsigned char opener) {
+    size_t ii;
+    int state, top_mode;
+    begin(jc);
+    if (!segment_state(brackets, opener, &state, &top_mode)) {
+        return reject(jc);
+    }
+    for (ii = 0; ii + 1 < brackets->length; ++ii) {
+        if (!push(jc, OUTER_MODE(brackets->data[ii]))) {
+            return reject(jc);
+        }
+    }
+    if (!push(jc, top_mode)) {
+        return reject(jc);
+    }
+    jc->state = state;
+    return true;
+}
+
+/* Is jc in the state the segment started in? */
+static int
+segment_matches(JSON_checker jc, const check_segment *segment, unsigned char opener) {
+    size_t ii;
+    int state, top_mode;
+    if (!segment_state(&segment->brackets, opener, &state, &top_mode) ||
+        jc->state != state || jc->expect != 0 ||
+        jc->top != (int)segment->brackets.length ||
+        jc->stack[0] != MODE_DONE || jc->stack[jc->top] != top_mode) {
+        return false;
+    }
+    for (ii = 0; ii + 1 < segment->brackets.length; ++ii) {
+        if (jc->stack[ii + 1] != OUTER_MODE(segment->brackets.data[ii])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void
+check_segment_run(cb_threadpool_task *task) {
+    check_segment *segment = (check_segment*)task;
+    const unsigned char *data = segment->check->data;
+    if (segment->begin == 0) {
+        begin(&segment->jc);
+        segment->ok = true;
+    } else {
+        segment->ok = segment_begin(&segment->jc, &segment->brackets,
+                                    data[segment->begin - 1]);
+    }
+    segment->ok = segment->ok &&
+        feed(&segment->jc, data + segment->begin, segment->end - segment->begin);
+    task_done(segment->check);
+}
+
+int
+checkUTF8JSONParallel(const unsigned char* data, size_t size,
+                      cb_threadpool_t* pool, size_t chunk_size) {
+    struct parallel_check check;
+    scan_chunk *chunks = NULL;
+    check_segment *segments = NULL;
+    cb_threadpool_task **tasks = NULL;
+    byte_vector stack = { NULL, 0, 0 };
+    size_t nchunks, nsegments = 0;
+    size_t ii;
+    int splitting = true;
+    int inside = false;
+    int ret = -1;
+
+    if (chunk_size == 0) {
+        /* A few chunks per thread to even out the load */
+        chunk_size = size / (cb_threadpool_size(pool) * 4);
+        if (chunk_size < PARALLEL_MIN_CHUNK) {
+            chunk_size = PARALLEL_MIN_CHUNK;
+        }
+    }
+    nchunks = size / chunk_size + (size % chunk_size != 0);
+    if (nchunks < 2) {
+        return checkUTF8JSON(data, size);
+    }
+
+    chunks = (scan_chunk*)calloc(nchunks, sizeof(scan_chunk));
+    segments = (check_segment*)calloc(nchunks, sizeof(check_segment));
+    tasks = (cb_threadpool_task**)malloc(nchunks * sizeof(cb_threadpool_task*));
+    if (chunks == NULL || segments == NULL || tasks == NULL) {
+        free(chunks);
+        free(segments);
+        free(tasks);
+        return checkUTF8JSON(data, size);
+    }
+    check.data = data;
+    cb_mutex_initialize(&check.mutex);
+    cb_cond_initialize(&check.cond);
+
+    for (ii = 0; ii < nchunks; ++ii) {
+        chunks[ii].task.func = scan_chunk_run;
+        chunks[ii].check = &check;
+        chunks[ii].begin = ii * chunk_size;
+        chunks[ii].end = ii + 1 < nchunks ? (ii + 1) * chunk_size : size;
+        tasks[ii] = &chunks[ii].task;
+    }
+    run_tasks(&check, pool, tasks, nchunks);
+
+    /* Stitch the chunks together, starting a segment at the split of
+       each chunk where the state is known */
+    segments[0].begin = 0;
+    nsegments = 1;
+    for (ii = 0; ii < nchunks && splitting; ++ii) {
+        scan_chunk *chunk = &chunks[ii];
+        size_t split = chunk->split[inside];
+        if (!effect_apply(&chunk->prefix[inside], &stack)) {
+            splitting = false;
             break;
         }
+        if (ii > 0 && split != 0 && stack.length <= PARALLEL_MAX_DEPTH) {
+            int state, top_mode;
+            check_segment *segment = &segments[nsegments];
+            if (segment_state(&stack, data[split - 1], &state, &top_mode)) {
+                size_t jj;
+                for (jj = 0; jj < stack.length; ++jj) {
+                    if (!bv_push(&segment->brackets, stack.data[jj])) {
+                        break;
+                    }
+                }
+                if (jj == stack.length) {
+                    segments[nsegments - 1].end = split;
+                    segment->begin = split;
+                    ++nsegments;
+                } else {
+                    free(segment->brackets.data);
+                    memset(&segment->brackets, 0, sizeof(segment->brackets));
+                }
+            }
+        }
+        if (split != 0 && !effect_apply(&chunk->suffix[inside], &stack)) {
+            splitting = false;
+        }
+        inside ^= chunk->parity;
+    }
+    segments[nsegments - 1].end = size;
+
+    for (ii = 0; ii < nsegments; ++ii) {
+        init_JSON_checker(&segments[ii].jc, 0);
+        segments[ii].task.func = check_segment_run;
+        segments[ii].check = &check;
+        tasks[ii] = &segments[ii].task;
     }
-    if(!badjson) {
-        /* Feed fake space to the validator to force it to finish validating */
-        /* numerical values, iff it hasn't marked the current stream as valid */
-        if(jc->state != OK) {
-            badjson = !JSON_checker_char(jc, 32);
+    run_tasks(&check, pool, tasks, nsegments);
+
+    for (ii = 0; ii < nsegments && ret == -1; ++ii) {
+        check_segment *segment = &segments[ii];
+        if (!segment->ok) {
+            /* It started in the real state */
+            ret = false;
+        } else if (ii + 1 == nsegments) {
+            ret = finish(&segment->jc);
+        } else if (!segment_matches(&segment->jc, &segments[ii + 1],
+                                    data[segment->end - 1])) {
+            /* The next one was started in the wrong state */
+            ret = feed(&segment->jc, data + segment->end, size - segment->end) &&
+                finish(&segment->jc);
         }
-        if(!badjson) {
-            badjson = !JSON_checker_done(jc);
+    }
+
+    for (ii = 0; ii < nchunks; ++ii) {
+        int hh;
+        for (hh = 0; hh < 2; ++hh) {
+            free(chunks[ii].prefix[hh].closes.data);
+            free(chunks[ii].prefix[hh].opens.data);
+            free(chunks[ii].suffix[hh].closes.data);
+            free(chunks[ii].suffix[hh].opens.data);
         }
     }
-    return (!badjson && !badutf);
+    for (ii = 0; ii < nsegments; ++ii) {
+        release_JSON_checker(&segments[ii].jc);
+        free(segments[ii].brackets.data);
+    }
+    free(stack.data);
+    free(chunks);
+    free(segments);
+    free(tasks);
+    cb_cond_destroy(&check.cond);
+    cb_mutex_destroy(&check.mutex);
+    return ret;
 }
@@ -0,0 +1,457 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2016 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config.h"
+#include "aio_engine.h"
+
+#include <platform/threadpool.h>
+
+#include <cerrno>
+#include <memory>
+#include <new>
+#include <vector>
+
+using namespace Couchbase;
+
+/* The most a single read or write does (what Linux limits them to) */
+#define MAX_IO_LENGTH 0x7ffff000
+
+/* The most worker threads for the thread pool engine */
+#define MAX_WORKERS 16
+
+#ifdef WIN32
+#define AIO_EINVAL ERROR_INVALID_PARAMETER
+#define AIO_EAGAIN ERROR_BUSY
+#define AIO_EBUSY ERROR_BUSY
+#define AIO_ENOMEM ERROR_NOT_ENOUGH_MEMORY
+
+static int fail(DWORD error) {
+    SetLastError(error);
+    return -1;
+}
+#else
+#define AIO_EINVAL EINVAL
+#define AIO_EAGAIN EAGAIN
+#define AIO_EBUSY EBUSY
+#define AIO_ENOMEM ENOMEM
+
+static int fail(int error) {
+    errno = error;
+    return -1;
+}
+#endif
+
+void Couchbase::runBlockingAioOp(const AioOp &op, cb_aio_event_t *event) {
+    event->user_data = op.user_data;
+    event->result = 0;
+    event->error = 0;
+#ifdef WIN32
+    BOOL ok;
+    DWORD nbytes = 0;
+    if (op.opcode == CB_AIO_READ || op.opcode == CB_AIO_WRITE) {
+        OVERLAPPED ov = {};
+        ov.Offset = DWORD(op.offset);
+        ov.OffsetHigh = DWORD(op.offset >> 32);
+        HANDLE done = CreateEvent(NULL, TRUE, FALSE, NULL);
+        if (done == NULL) {
+            event->result = -1;
+            event->error = int(GetLastError());
+            return;
+        }
+        /* The low bit keeps the completion off any completion port */
+        ov.hEvent = HANDLE(uintptr_t(done) | 1);
+        if (op.opcode == CB_AIO_READ) {
+            ok = ReadFile(op.file, op.buffer, DWORD(op.length), &nbytes, &ov);
+        } else {
+            ok = WriteFile(op.file, op.buffer, DWORD(op.length), &nbytes,
+                           &ov);
+        }
+        if (!ok && GetLastError() == ERROR_IO_PENDING) {
+            ok = GetOverlappedResult(op.file, &ov, &nbytes, TRUE);
+        }
+        CloseHandle(done);
+    } else {
+        ok = FlushFileBuffers(op.file);
+    }
+    if (ok) {
+        event->result = ssize_t(nbytes);
+    } else if (GetLastError() != ERROR_HANDLE_EOF) {
+        event->result = -1;
+        event->error = int(GetLastError());
+    }
+#else
+    ssize_t ret;
+    do {
+        switch (op.opcode) {
+        case CB_AIO_READ:
+            ret = pread(op.file, op.buffer, op.length, off_t(op.offset));
+            break;
+        case CB_AIO_WRITE:
+            ret = pwrite(op.file, op.buffer, op.length, off_t(op.offset));
+            break;
+        case CB_AIO_FDATASYNC:
+#ifdef HAVE_FDATASYNC
+            ret = fdatasync(op.file);
+            break;
+#endif
+        default:
+            ret = fsync(op.file);
+        }
+    } while (ret == -1 && errno == EINTR);
+    event->result = ret;
+    if (ret == -1) {
+        event->error = errno;
+    }
+#endif
+}
+
+namespace {
+
+/*
+ * Runs the blocking calls on a thread pool. The jobs are allocated up
+ * front (one per request in flight) and recycled by the thread using
+ * the context, the workers only append them to the done list.
+ */
+class ThreadPoolEngine : public AioEngine {
+public:
+    ThreadPoolEngine() : pool(nullptr), free_jobs(nullptr), done_head(nullptr),
+                         done_tail(nullptr) {
+        cb_mutex_initialize(&mutex);
+        cb_cond_initialize(&cond);
+    }
+
+    ~ThreadPoolEngine() {
+        /* Runs the jobs which are still queued */
+        if (pool != nullptr) {
+            cb_threadpool_destroy(pool);
+        }
+        cb_cond_destroy(&cond);
+        cb_mutex_destroy(&mutex);
+    }
+
+    bool initialize(unsigned int depth) {
+        jobs.resize(depth);
+        for (auto &job : jobs) {
+            job.task.func = execute;
+            job.engine = this;
+            job.next = free_jobs;
+            free_jobs = &job;
+        }
+        pool = cb_threadpool_create(depth < MAX_WORKERS ? depth : MAX_WORKERS,
+                                    "aio");
+        return pool != nullptr;
+    }
+
+    const char *name() const override {
+        return "threadpool";
+    }
+
+    int submit(const AioOp *ops, unsigned int nops) override {
+        for (unsigned int ii = 0; ii < nops; ++ii) {
+            Job *job = free_jobs;
+            free_jobs = job->next;
+            job->op = ops[ii];
+            if (cb_threadpool_submit(pool, &job->task) == -1) {
+                job->next = free_jobs;
+                free_jobs = job;
+                return ii > 0 ? int(ii) : fail(AIO_EBUSY);
+            }
+        }
+        return int(nops);
+    }
+
+    int complete(cb_aio_event_t *events, unsigned int min,
+                 unsigned int max) override {
+        unsigned int count = 0;
+        cb_mutex_enter(&mutex);
+        while (count < max) {
+            Job *job = done_head;
+            if (job == nullptr) {
+                if (count >= min) {
+                    break;
+                }
+                cb_cond_wait(&cond, &mutex);
+                continue;
+            }
+            done_head = job->next;
+            if (done_head == nullptr) {
+                done_tail = nullptr;
+            }
+            events[count++] = job->event;
+            job->next = free_jobs;
+            free_jobs = job;
+        }
+        cb_mutex_exit(&mutex);
+        return int(count);
+    }
+
+private:
+    struct Job {
+        /* Must be first, the task is the job */
+        cb_threadpool_task task;
+        ThreadPoolEngine *engine;
+        AioOp op;
+        cb_aio_event_t event;
+        Job *next;
+    };
+
+    static void execute(cb_threadpool_task *task) {
+        Job *job = reinterpret_cast<Job *>(task);
+        ThreadPoolEngine *engine = job->engine;
+        runBlockingAioOp(job->op, &job->event);
+
+        cb_mutex_enter(&engine->mutex);
+        job->next = nullptr;
+        if (engine->done_tail == nullptr) {
+            engine->done_head = job;
+        } else {
+            engine->done_tail->next = job;
+        }
+        engine->done_tail = job;
+        cb_cond_signal(&engine->cond);
+        cb_mutex_exit(&engine->mutex);
+    }
+
+    cb_threadpool_t *pool;
+    std::vector<Job> jobs;
+    /* Only used by the thread using the context */
+    Job *free_jobs;
+
+    /* The completed jobs in the order they completed */
+    cb_mutex_t mutex;
+    cb_cond_t cond;
+    Job *done_head;
+    Job *done_tail;
+};
+
+}
+
+AioEngine *Couchbase::createThreadPoolEngine(unsigned int depth) {
+    std::unique_ptr<ThreadPoolEngine> engine(new (std::nothrow)
+                                             ThreadPoolEngine);
+    if (!engine || !engine->initialize(depth)) {
+        return nullptr;
+    }
+    return engine.release();
+}
+
+struct cb_aio {
+    std::unique_ptr<AioEngine> engine;
+    unsigned int depth;
+    unsigned int inflight;
+    std::vector<cb_aio_file_t> files;
+    std::vector<cb_aio_buffer_t> buffers;
+    /* The checked requests of the batch being submitted */
+    std::vector<AioOp> ops;
+};
+
+/* Check the request, and look up its registered file and buffer */
+static bool prepare(const cb_aio_t *aio, const cb_aio_request_t &request,
+                    AioOp &op) {
+    if (request.opcode < CB_AIO_READ || request.opcode > CB_AIO_FDATASYNC) {
+        return false;
+    }
+    op.opcode = cb_aio_opcode_t(request.opcode);
+    op.user_data = request.user_data;
+    op.file_index = -1;
+    op.buffer_index = -1;
+    op.buffer = request.buffer;
+    op.length = request.length;
+    op.offset = request.offset;
+
+    if (request.flags & CB_AIO_FIXED_FILE) {
+        if (request.file_index >= aio->files.size()) {
+            return false;
+        }
+        op.file_index = int(request.file_index);
+        op.file = aio->files[request.file_index];
+    } else {
+        op.file = request.file;
+    }
+
+    switch (op.opcode) {
+    case CB_AIO_READ:
+    case CB_AIO_WRITE:
+        break;
+    case CB_AIO_FSYNC:
+    case CB_AIO_FDATASYNC:
+        op.buffer = nullptr;
+        op.length = 0;
+        return true;
+    }
+
+    if (op.length > MAX_IO_LENGTH) {
+        /* It completes short, like a big read(2) does */
+        op.length = MAX_IO_LENGTH;
+    }
+    if (request.flags & CB_AIO_FIXED_BUFFER) {
+        if (request.buffer_index >= aio->buffers.size()) {
+            return false;
+        }
+        const cb_aio_buffer_t &fixed = aio->buffers[request.buffer_index];
+        const char *begin = static_cast<const char *>(fixed.base);
+        const char *buffer = static_cast<const char *>(op.buffer);
+        if (buffer < begin || buffer > begin + fixed.length ||
+            op.length > size_t(begin + fixed.length - buffer)) {
+            return false;
+        }
+        op.buffer_index = int(request.buffer_index);
+    } else if (op.buffer == nullptr && op.length > 0) {
+        return false;
+    }
+    return true;
+}
+
+PLATFORM_PUBLIC_API
+cb_aio_t *cb_aio_create(unsigned int depth, int flags) {
+    if (depth == 0) {
+        fail(AIO_EINVAL);
+        return nullptr;
+    }
+
+    std::unique_ptr<cb_aio_t> aio(new (std::nothrow) cb_aio_t);
+    if (!aio) {
+        fail(AIO_ENOMEM);
+        return nullptr;
+    }
+    aio->depth = depth;
+    aio->inflight = 0;
+    try {
+        aio->ops.resize(depth);
+    } catch (std::bad_alloc &) {
+        fail(AIO_ENOMEM);
+        return nullptr;
+    }
+
+    if (!(flags & CB_AIO_THREADPOOL)) {
+#ifdef WIN32
+        aio->engine.reset(createIocpEngine(depth));
+        if (!aio->engine) {
+            return nullptr;
+        }
+#elif defined(HAVE_LINUX_IO_URING)
+        aio->engine.reset(createUringEngine(depth));
+#endif
+    }
+    if (!aio->engine) {
+        aio->engine.reset(createThreadPoolEngine(depth));
+        if (!aio->engine) {
+            fail(AIO_ENOMEM);
+            return nullptr;
+        }
+    }
+    return aio.release();
+}
+
+PLATFORM_PUBLIC_API
+void cb_aio_destroy(cb_aio_t *aio) {
+    if (aio == nullptr) {
+        return;
+    }
+    std::vector<cb_aio_event_t> events(aio->inflight);
+    while (aio->inflight > 0) {
+        int ret = cb_aio_complete(aio, events.data(), aio->inflight,
+                                  aio->inflight);
+        if (ret == -1) {
+            break;
+        }
+    }
+    delete aio;
+}
+
+PLATFORM_PUBLIC_API
+const char *cb_aio_engine(const cb_aio_t *aio) {
+    return aio->engine->name();
+}
+
+PLATFORM_PUBLIC_API
+int cb_aio_register_files(cb_aio_t *aio, const cb_aio_file_t *files,
+                          unsigned int nfiles) {
+    if (aio->inflight > 0) {
+        return fail(AIO_EBUSY);
+    }
+    aio->files.clear();
+    if (aio->engine->registerFiles(files, nfiles) == -1) {
+        return -1;
+    }
+    aio->files.assign(files, files + nfiles);
+    return 0;
+}
+
+PLATFORM_PUBLIC_API
+int cb_aio_register_buffers(cb_aio_t *aio, const cb_aio_buffer_t *buffers,
+                            unsigned int nbuffers) {
+    if (aio->inflight > 0) {
+        return fail(AIO_EBUSY);
+    }
+    aio->buffers.clear();
+    if (aio->engine->registerBuffers(buffers, nbuffers) == -1) {
+        return -1;
+    }
+    aio->buffers.assign(buffers, buffers + nbuffers);
+    return 0;
+}
+
+PLATFORM_PUBLIC_API
+int cb_aio_submit(cb_aio_t *aio, const cb_aio_request_t *requests,
+                  unsigned int nrequests) {
+    unsigned int room = aio->depth - aio->inflight;
+    if (room == 0 && nrequests > 0) {
+        return fail(AIO_EAGAIN);
+    }
+    if (nrequests > room) {
+        nrequests = room;
+    }
+    /* Check them all before starting any */
+    for (unsigned int ii = 0; ii < nrequests; ++ii) {
+        if (!prepare(aio, requests[ii], aio->ops[ii])) {
+            return fail(AIO_EINVAL);
+        }
+    }
+    if (nrequests == 0) {
+        return 0;
+    }
+
+    int ret = aio->engine->submit(aio->ops.data(), nrequests);
+    if (ret > 0) {
+        aio->inflight += unsigned(ret);
+    }
+    return ret;
+}
+
+PLATFORM_PUBLIC_API
+int cb_aio_complete(cb_aio_t *aio, cb_aio_event_t *events, unsigned int min,
+                    unsigned int max) {
+    if (min > max || min > aio->inflight) {
+        return fail(AIO_EINVAL);
+    }
+    if (max > aio->inflight) {
+        max = aio->inflight;
+    }
+    if (max == 0) {
+        return 0;
+    }
+    int ret = aio->engine->complete(events, min, max);
+    if (ret > 0) {
+        aio->inflight -= unsigned(ret);
+    }
+    return ret;
+}
+
+PLATFORM_PUBLIC_API
+unsigned int cb_aio_inflight(const cb_aio_t *aio) {
+    return aio->inflight;
+}
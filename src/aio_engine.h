@@ -0,0 +1,88 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2016 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#pragma once
+
+/*
+ * Internal interface between the cb_aio_ functions in aio.cc and the
+ * engines doing the I/O (aio_uring.cc, the IOCP engine in cb_win32.cc
+ * and the thread pool engine in aio.cc)
+ */
+
+#include <platform/aio.h>
+
+namespace Couchbase {
+    /**
+     * A request checked by aio.cc, with the registered file and buffer
+     * looked up (file and buffer are always valid)
+     */
+    struct AioOp {
+        cb_aio_opcode_t opcode;
+        cb_aio_file_t file;
+        /* The index of the registered file / buffer, or -1 */
+        int file_index;
+        int buffer_index;
+        void *buffer;
+        size_t length;
+        uint64_t offset;
+        void *user_data;
+    };
+
+    /**
+     * aio.cc makes sure that the engine never has more than the depth
+     * it was created with in flight, and that min is never more than
+     * the number in flight. Failures are returned as -1 with errno (or
+     * the Windows error) set.
+     */
+    class AioEngine {
+    public:
+        virtual ~AioEngine() {
+        }
+
+        virtual const char *name() const = 0;
+
+        /* The tables are available in AioOp, so the engines which can't
+         * make any use of them don't have to do anything */
+        virtual int registerFiles(const cb_aio_file_t *, unsigned int) {
+            return 0;
+        }
+
+        virtual int registerBuffers(const cb_aio_buffer_t *, unsigned int) {
+            return 0;
+        }
+
+        /* Start all of the ops */
+        virtual int submit(const AioOp *ops, unsigned int nops) = 0;
+
+        virtual int complete(cb_aio_event_t *events, unsigned int min,
+                             unsigned int max) = 0;
+    };
+
+    /* NULL if the kernel doesn't support io_uring (or it is disabled) */
+    AioEngine *createUringEngine(unsigned int depth);
+
+    /* NULL upon failure */
+    AioEngine *createIocpEngine(unsigned int depth);
+
+    AioEngine *createThreadPoolEngine(unsigned int depth);
+
+    /*
+     * Run an op with a blocking call. Sets event->result and
+     * event->error. (File "handles" opened for overlapped I/O are
+     * handled on Windows.)
+     */
+    void runBlockingAioOp(const AioOp &op, cb_aio_event_t *event);
+}
@@ -0,0 +1,316 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2016 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config.h"
+#include "aio_engine.h"
+
+#ifdef HAVE_LINUX_IO_URING
+
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <vector>
+
+/*
+ * The io_uring engine talks to the kernel directly (there is no
+ * dependency on liburing). The submission and completion rings are
+ * shared with the kernel: we own the submission tail and the completion
+ * head, the kernel owns the other ends.
+ *
+ * The completion ring is twice the size of the submission ring, and
+ * aio.cc never has more than the depth in flight, so it can't
+ * overflow.
+ */
+
+using namespace Couchbase;
+
+#define load_acquire(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define store_release(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+static int io_uring_setup(unsigned int entries, struct io_uring_params *p) {
+    return int(syscall(__NR_io_uring_setup, entries, p));
+}
+
+static int io_uring_enter(int fd, unsigned int to_submit,
+                          unsigned int min_complete, unsigned int flags) {
+    return int(syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                       flags, NULL, 0));
+}
+
+static int io_uring_register(int fd, unsigned int opcode, const void *arg,
+                             unsigned int nargs) {
+    return int(syscall(__NR_io_uring_register, fd, opcode, arg, nargs));
+}
+
+namespace {
+
+class UringEngine : public AioEngine {
+public:
+    UringEngine() : fd(-1), sq_ring(MAP_FAILED), cq_ring(MAP_FAILED),
+                    sqes(static_cast<struct io_uring_sqe *>(MAP_FAILED)),
+                    registered_files(false), registered_buffers(false) {
+    }
+
+    ~UringEngine() {
+        if (sqes != MAP_FAILED) {
+            munmap(sqes, sqes_size);
+        }
+        if (cq_ring != MAP_FAILED && cq_ring != sq_ring) {
+            munmap(cq_ring, cq_ring_size);
+        }
+        if (sq_ring != MAP_FAILED) {
+            munmap(sq_ring, sq_ring_size);
+        }
+        if (fd != -1) {
+            close(fd);
+        }
+    }
+
+    bool initialize(unsigned int depth) {
+        struct io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        fd = io_uring_setup(depth, &params);
+        /* IORING_OP_READ / WRITE came with RW_CUR_POS in 5.6 */
+        if (fd == -1 || !(params.features & IORING_FEAT_RW_CUR_POS)) {
+            return false;
+        }
+
+        sq_ring_size = params.sq_off.array +
+            params.sq_entries * sizeof(uint32_t);
+        cq_ring_size = params.cq_off.cqes +
+            params.cq_entries * sizeof(struct io_uring_cqe);
+        const bool single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if (single && cq_ring_size > sq_ring_size) {
+            sq_ring_size = cq_ring_size;
+        }
+        sq_ring = mmap(NULL, sq_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        if (sq_ring == MAP_FAILED) {
+            return false;
+        }
+        if (single) {
+            cq_ring = sq_ring;
+        } else {
+            cq_ring = mmap(NULL, cq_ring_size, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+            if (cq_ring == MAP_FAILED) {
+                return false;
+            }
+        }
+        sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+        sqes = static_cast<struct io_uring_sqe *>(
+            mmap(NULL, sqes_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES));
+        if (sqes == MAP_FAILED) {
+            return false;
+        }
+
+        char *sq = static_cast<char *>(sq_ring);
+        sq_head = reinterpret_cast<unsigned int *>(sq + params.sq_off.head);
+        sq_tail = reinterpret_cast<unsigned int *>(sq + params.sq_off.tail);
+        sq_mask = *reinterpret_cast<unsigned int *>(sq +
+                                                    params.sq_off.ring_mask);
+        sq_array = reinterpret_cast<unsigned int *>(sq + params.sq_off.array);
+        char *cq = static_cast<char *>(cq_ring);
+        cq_head = reinterpret_cast<unsigned int *>(cq + params.cq_off.head);
+        cq_tail = reinterpret_cast<unsigned int *>(cq + params.cq_off.tail);
+        cq_mask = *reinterpret_cast<unsigned int *>(cq +
+                                                    params.cq_off.ring_mask);
+        cqes = reinterpret_cast<struct io_uring_cqe *>(cq +
+                                                       params.cq_off.cqes);
+        return true;
+    }
+
+    const char *name() const override {
+        return "io_uring";
+    }
+
+    int registerFiles(const cb_aio_file_t *files,
+                      unsigned int nfiles) override {
+        if (registered_files) {
+            if (io_uring_register(fd, IORING_UNREGISTER_FILES, NULL, 0) == -1) {
+                return -1;
+            }
+            registered_files = false;
+        }
+        if (nfiles == 0) {
+            return 0;
+        }
+        if (io_uring_register(fd, IORING_REGISTER_FILES, files, nfiles) == -1) {
+            return -1;
+        }
+        registered_files = true;
+        return 0;
+    }
+
+    int registerBuffers(const cb_aio_buffer_t *buffers,
+                        unsigned int nbuffers) override {
+        if (registered_buffers) {
+            if (io_uring_register(fd, IORING_UNREGISTER_BUFFERS, NULL,
+                                  0) == -1) {
+                return -1;
+            }
+            registered_buffers = false;
+        }
+        if (nbuffers == 0) {
+            return 0;
+        }
+        std::vector<struct iovec> iov(nbuffers);
+        for (unsigned int ii = 0; ii < nbuffers; ++ii) {
+            iov[ii].iov_base = buffers[ii].base;
+            iov[ii].iov_len = buffers[ii].length;
+        }
+        if (io_uring_register(fd, IORING_REGISTER_BUFFERS, iov.data(),
+                              nbuffers) == -1) {
+            return -1;
+        }
+        registered_buffers = true;
+        return 0;
+    }
+
+    int submit(const AioOp *ops, unsigned int nops) override {
+        const unsigned int head = load_acquire(sq_head);
+        unsigned int tail = *sq_tail;
+        for (unsigned int ii = 0; ii < nops; ++ii, ++tail) {
+            const unsigned int index = tail & sq_mask;
+            prepare(sqes[index], ops[ii]);
+            sq_array[index] = index;
+        }
+        store_release(sq_tail, tail);
+
+        int ret;
+        do {
+            ret = io_uring_enter(fd, tail - head, 0, 0);
+        } while (ret == -1 && errno == EINTR);
+
+        /* Take back what the kernel didn't consume, it isn't looking at
+         * the ring outside of io_uring_enter */
+        const unsigned int consumed = load_acquire(sq_head) - head;
+        store_release(sq_tail, head + consumed);
+        if (consumed == 0) {
+            return -1;
+        }
+        return int(consumed);
+    }
+
+    int complete(cb_aio_event_t *events, unsigned int min,
+                 unsigned int max) override {
+        unsigned int count = reap(events, max);
+        while (count < min) {
+            if (io_uring_enter(fd, 0, min - count,
+                               IORING_ENTER_GETEVENTS) == -1 &&
+                errno != EINTR) {
+                return count > 0 ? int(count) : -1;
+            }
+            count += reap(events + count, max - count);
+        }
+        return int(count);
+    }
+
+private:
+    void prepare(struct io_uring_sqe &sqe, const AioOp &op) {
+        memset(&sqe, 0, sizeof(sqe));
+        if (op.file_index >= 0) {
+            sqe.fd = op.file_index;
+            sqe.flags = IOSQE_FIXED_FILE;
+        } else {
+            sqe.fd = op.file;
+        }
+        sqe.user_data = uint64_t(uintptr_t(op.user_data));
+
+        switch (op.opcode) {
+        case CB_AIO_READ:
+        case CB_AIO_WRITE:
+            if (op.buffer_index >= 0) {
+                sqe.opcode = (op.opcode == CB_AIO_READ) ?
+                    IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+                sqe.buf_index = uint16_t(op.buffer_index);
+            } else {
+                sqe.opcode = (op.opcode == CB_AIO_READ) ?
+                    IORING_OP_READ : IORING_OP_WRITE;
+            }
+            sqe.addr = uint64_t(uintptr_t(op.buffer));
+            sqe.len = uint32_t(op.length);
+            sqe.off = op.offset;
+            break;
+        case CB_AIO_FSYNC:
+        case CB_AIO_FDATASYNC:
+            sqe.opcode = IORING_OP_FSYNC;
+            if (op.opcode == CB_AIO_FDATASYNC) {
+                sqe.fsync_flags = IORING_FSYNC_DATASYNC;
+            }
+            break;
+        }
+    }
+
+    unsigned int reap(cb_aio_event_t *events, unsigned int max) {
+        unsigned int head = *cq_head;
+        const unsigned int tail = load_acquire(cq_tail);
+        unsigned int count = 0;
+        while (head != tail && count < max) {
+            const struct io_uring_cqe &cqe = cqes[head & cq_mask];
+            cb_aio_event_t &event = events[count++];
+            event.user_data = reinterpret_cast<void *>(
+                uintptr_t(cqe.user_data));
+            if (cqe.res < 0) {
+                event.result = -1;
+                event.error = -cqe.res;
+            } else {
+                event.result = cqe.res;
+                event.error = 0;
+            }
+            ++head;
+        }
+        store_release(cq_head, head);
+        return count;
+    }
+
+    int fd;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int sq_mask;
+    unsigned int *sq_array;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int cq_mask;
+    struct io_uring_cqe *cqes;
+
+    bool registered_files;
+    bool registered_buffers;
+};
+
+}
+
+AioEngine *Couchbase::createUringEngine(unsigned int depth) {
+    std::unique_ptr<UringEngine> engine(new (std::nothrow) UringEngine);
+    if (!engine || !engine->initialize(depth)) {
+        return nullptr;
+    }
+    return engine.release();
+}
+
+#endif
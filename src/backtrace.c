@@ -18,6 +18,10 @@
 #include "config.h"
 
 #include <platform/backtrace.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <strings.h>
 
 #if defined(WIN32)
@@ -32,15 +36,53 @@
 #  include <stddef.h> // for ptrdiff_t
 #endif
 
+#if defined(WIN32)
+#  include <io.h> // for _write()
+#else
+#  include <errno.h>
+#  include <fcntl.h>
+#  include <unistd.h>
+#endif
+
+#if defined(__APPLE__)
+#  include <mach-o/dyld.h>
+#endif
+
 // Maximum number of frames that will be printed.
 #define MAX_FRAMES 50
 
+#if defined(WIN32)
+#  define raw_backtrace(frames, size) \
+    (int)CaptureStackBackTrace(0, (DWORD)(size), frames, NULL)
+#elif defined(HAVE_BACKTRACE_SUPPORT)
+#  define raw_backtrace(frames, size) backtrace(frames, size)
+#else
+#  define raw_backtrace(frames, size) 0
+#endif
+
+/* Remove the frame of the function which called raw_backtrace() */
+static int skip_own_frame(void** frames, int nframes) {
+    if (nframes <= 1) {
+        return 0;
+    }
+    memmove(frames, frames + 1, (size_t)(nframes - 1) * sizeof(void*));
+    return nframes - 1;
+}
+
 #if defined(HAVE_BACKTRACE_SUPPORT)
 /**
  * Populates buf with a description of the given address in the program.
  **/
 static void describe_address(char* msg, size_t len, void* addr) {
 #if defined(WIN32)
+    // DbgHelp isn't thread safe, and SymInitialize is expensive
+    static SRWLOCK dbghelp_lock = SRWLOCK_INIT;
+    static int initialized;
+    AcquireSRWLockExclusive(&dbghelp_lock);
+    if (!initialized) {
+        SymInitialize(GetCurrentProcess(), NULL, TRUE);
+        initialized = 1;
+    }
 
     // Get module information
     IMAGEHLP_MODULE64 module_info;
@@ -63,6 +105,7 @@ static void describe_address(char* msg, size_t len, void* addr) {
         // No symbol found.
         snprintf(msg, len, "[0x%p]", addr);
     }
+    ReleaseSRWLockExclusive(&dbghelp_lock);
 #else // !WIN32
     Dl_info info;
     int status = dladdr(addr, &info);
@@ -98,22 +141,140 @@ static void describe_address(char* msg, size_t len, void* addr) {
     }
 #endif // WIN32
 }
+#else
+static void describe_address(char* msg, size_t len, void* addr) {
+    snprintf(msg, len, "[%p]", addr);
+}
+#endif // defined(HAVE_BACKTRACE_SUPPORT)
+
+/*
+ * The descriptions of the addresses we've seen, shared by all threads.
+ * It is an open addressing hash table which only ever grows (there is
+ * a bounded number of return addresses in a program): a slot is
+ * claimed by setting its address, and becomes visible to the readers
+ * once its description is set. Readers take no locks, and if the table
+ * fills up the addresses are described without caching them.
+ */
+#define CACHE_SLOTS 8192
+#define CACHE_PROBES 16
+
+typedef struct {
+    void* addr;
+    char* description;
+} cache_slot_t;
+
+static cache_slot_t cache[CACHE_SLOTS];
+
+#ifdef _MSC_VER
+#define load_ptr(p) InterlockedCompareExchangePointer((PVOID volatile*)(p), NULL, NULL)
+#define store_ptr(p, v) InterlockedExchangePointer((PVOID volatile*)(p), v)
+
+/* Replace *p with desired if it is NULL, and return the old value */
+static void* claim_ptr(void** p, void* desired) {
+    return InterlockedCompareExchangePointer((PVOID volatile*)p, desired, NULL);
+}
+#else
+#define load_ptr(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define store_ptr(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+static void* claim_ptr(void** p, void* desired) {
+    void* expected = NULL;
+    __atomic_compare_exchange_n(p, &expected, desired, 0,
+                                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+    return expected;
+}
+#endif
+
+static size_t cache_hash(void* addr) {
+    uint64_t key = (uint64_t)(uintptr_t)addr;
+    return (size_t)((key * 0x9e3779b97f4a7c15ULL) >> 32) % CACHE_SLOTS;
+}
+
+static void describe_cached(char* msg, size_t len, void* addr) {
+    size_t slot = cache_hash(addr);
+    char* description;
+    size_t length;
+    int ii;
+
+    for (ii = 0; ii < CACHE_PROBES; ++ii) {
+        cache_slot_t* entry = &cache[(slot + ii) % CACHE_SLOTS];
+        void* key = load_ptr(&entry->addr);
+        if (key == NULL) {
+            break;
+        }
+        if (key == addr) {
+            description = load_ptr(&entry->description);
+            if (description != NULL) {
+                snprintf(msg, len, "%s", description);
+                return;
+            }
+            /* Somebody else is just adding it */
+            describe_address(msg, len, addr);
+            return;
+        }
+    }
+
+    describe_address(msg, len, addr);
+    length = strlen(msg) + 1;
+    description = malloc(length);
+    if (description == NULL) {
+        return;
+    }
+    memcpy(description, msg, length);
+    for (ii = 0; ii < CACHE_PROBES; ++ii) {
+        cache_slot_t* entry = &cache[(slot + ii) % CACHE_SLOTS];
+        void* key = claim_ptr(&entry->addr, addr);
+        if (key == NULL) {
+            store_ptr(&entry->description, description);
+            return;
+        }
+        if (key == addr) {
+            /* Added by another thread */
+            break;
+        }
+    }
+    free(description);
+}
+
+PLATFORM_PUBLIC_API
+void cb_backtrace_get(cb_backtrace_t* bt) {
+    bt->nframes = skip_own_frame(bt->frames,
+                                 raw_backtrace(bt->frames,
+                                               CB_BACKTRACE_MAX_FRAMES));
+    /* So that two captures of the same stack compare equal */
+    memset(bt->frames + bt->nframes, 0,
+           (size_t)(CB_BACKTRACE_MAX_FRAMES - bt->nframes) * sizeof(void*));
+}
+
+PLATFORM_PUBLIC_API
+void cb_backtrace_describe(void* address, char* buffer, size_t size) {
+    if (size > 0) {
+        describe_cached(buffer, size, address);
+    }
+}
 
+PLATFORM_PUBLIC_API
+void cb_backtrace_symbolize(const cb_backtrace_t* bt, write_cb_t write_cb,
+                            void* context) {
+    int ii;
+    for (ii = 0; ii < bt->nframes; ++ii) {
+        char msg[200];
+        describe_cached(msg, sizeof(msg), bt->frames[ii]);
+        write_cb(context, msg);
+    }
+}
+
+#if defined(HAVE_BACKTRACE_SUPPORT)
 PLATFORM_PUBLIC_API
 void print_backtrace(write_cb_t write_cb, void* context) {
     void* frames[MAX_FRAMES];
-#if defined(WIN32)
-    int active_frames = CaptureStackBackTrace(0, MAX_FRAMES, frames, NULL);
-    SymInitialize(GetCurrentProcess(), NULL, TRUE);
-#else
-    int active_frames = backtrace(frames, MAX_FRAMES);
-#endif
+    int active_frames = raw_backtrace(frames, MAX_FRAMES);
 
     // Note we start from 1 to skip our own frame.
     for (int ii = 1; ii < active_frames; ii++) {
         // Fixed-sized buffer; possible that description will be cropped.
         char msg[200];
-        describe_address(msg, sizeof(msg), frames[ii]);
+        describe_cached(msg, sizeof(msg), frames[ii]);
         write_cb(context, msg);
     }
     if (active_frames == MAX_FRAMES) {
@@ -129,3 +290,187 @@ void print_backtrace(write_cb_t write_cb, void* context) {
 }
 
 #endif // defined(HAVE_BACKTRACE_SUPPORT)
+
+/*
+ * The fd based variant below only uses functions which are
+ * async-signal-safe (and doesn't allocate), so everything is formatted
+ * by hand into buffers on the stack.
+ */
+
+static void write_all(int fd, const char* buf, size_t len) {
+    while (len > 0) {
+#if defined(WIN32)
+        int nw = _write(fd, buf, (unsigned int)len);
+        if (nw <= 0) {
+            return;
+        }
+#else
+        ssize_t nw = write(fd, buf, len);
+        if (nw == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+#endif
+        buf += nw;
+        len -= (size_t)nw;
+    }
+}
+
+static void write_str(int fd, const char* str) {
+    write_all(fd, str, strlen(str));
+}
+
+/* Format the value in the given base into the end of buf, and return
+ * where the number starts */
+static char* format_number(char* end, uint64_t value, unsigned base) {
+    static const char digits[] = "0123456789abcdef";
+    do {
+        *--end = digits[value % base];
+        value /= base;
+    } while (value != 0);
+    return end;
+}
+
+static void write_hex(int fd, uint64_t value) {
+    char buf[24];
+    char* start = format_number(buf + sizeof(buf), value, 16);
+    *--start = 'x';
+    *--start = '0';
+    write_all(fd, start, (size_t)(buf + sizeof(buf) - start));
+}
+
+static void write_dec(int fd, uint64_t value) {
+    char buf[24];
+    char* start = format_number(buf + sizeof(buf), value, 10);
+    write_all(fd, start, (size_t)(buf + sizeof(buf) - start));
+}
+
+#if defined(HAVE_BACKTRACE) && defined(__GNUC__)
+/*
+ * The first call to backtrace() loads the unwinder (libgcc_s), which
+ * allocates memory and takes the loader locks. Get that done while the
+ * library is loaded rather than in a crash handler.
+ */
+__attribute__((constructor))
+static void load_unwinder(void) {
+    void* frame;
+    backtrace(&frame, 1);
+}
+#endif
+
+PLATFORM_PUBLIC_API
+int cb_backtrace_capture(void** frames, int max_frames) {
+    if (max_frames <= 0) {
+        return 0;
+    }
+    return skip_own_frame(frames, raw_backtrace(frames, max_frames));
+}
+
+#if defined(__linux__)
+/* Copy the executable mappings from /proc/self/maps */
+static void write_mappings(int fd) {
+    char buf[4096];
+    size_t used = 0;
+    int fp = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+    if (fp == -1) {
+        return;
+    }
+
+    for (;;) {
+        ssize_t nr = read(fp, buf + used, sizeof(buf) - used);
+        char* line;
+        char* end;
+        if (nr == -1 && errno == EINTR) {
+            continue;
+        }
+        if (nr <= 0) {
+            break;
+        }
+        used += (size_t)nr;
+
+        /* "start-end perms offset dev inode path", keep r-xp etc */
+        line = buf;
+        while ((end = memchr(line, '\n', used - (size_t)(line - buf)))
+               != NULL) {
+            char* perms = memchr(line, ' ', (size_t)(end - line));
+            if (perms != NULL && end - perms > 4 && perms[3] == 'x') {
+                write_all(fd, line, (size_t)(end - line + 1));
+            }
+            line = end + 1;
+        }
+
+        /* Keep the partial line (or drop a line too long to keep) */
+        used -= (size_t)(line - buf);
+        if (used == sizeof(buf)) {
+            used = 0;
+        } else {
+            memmove(buf, line, used);
+        }
+    }
+    close(fp);
+}
+#elif defined(__APPLE__)
+/* List the address every image is loaded at */
+static void write_mappings(int fd) {
+    uint32_t count = _dyld_image_count();
+    uint32_t ii;
+    for (ii = 0; ii < count; ++ii) {
+        const char* name = _dyld_get_image_name(ii);
+        write_hex(fd, (uint64_t)(uintptr_t)_dyld_get_image_header(ii));
+        write_str(fd, " ");
+        write_str(fd, name != NULL ? name : "?");
+        write_str(fd, "\n");
+    }
+}
+#elif !defined(WIN32)
+static void write_mappings(int fd) {
+    (void)fd;
+}
+#endif
+
+PLATFORM_PUBLIC_API
+void cb_backtrace_write(int fd, void* const* frames, int nframes) {
+    int ii;
+
+    write_str(fd, "backtrace: ");
+    write_dec(fd, nframes > 0 ? (uint64_t)nframes : 0);
+    write_str(fd, " frames\n");
+    for (ii = 0; ii < nframes; ++ii) {
+#if defined(WIN32)
+        /* There is no /proc/self/maps: look up the module (but don't
+         * touch the symbol handler) */
+        HMODULE module = NULL;
+        char name[MAX_PATH];
+#endif
+        write_str(fd, " #");
+        write_dec(fd, (uint64_t)ii);
+        write_str(fd, " ");
+        write_hex(fd, (uint64_t)(uintptr_t)frames[ii]);
+#if defined(WIN32)
+        if (GetModuleHandleExA(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS |
+                               GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT,
+                               (LPCSTR)frames[ii], &module) &&
+            GetModuleFileNameA(module, name, sizeof(name)) != 0) {
+            write_str(fd, " ");
+            write_str(fd, name);
+            write_str(fd, "+");
+            write_hex(fd, (uint64_t)((uintptr_t)frames[ii] -
+                                     (uintptr_t)module));
+        }
+#endif
+        write_str(fd, "\n");
+    }
+#if !defined(WIN32)
+    write_str(fd, "mappings:\n");
+    write_mappings(fd);
+#endif
+}
+
+PLATFORM_PUBLIC_API
+void print_backtrace_to_fd(int fd) {
+    void* frames[MAX_FRAMES];
+    int nframes = skip_own_frame(frames, raw_backtrace(frames, MAX_FRAMES));
+    cb_backtrace_write(fd, frames, nframes);
+}
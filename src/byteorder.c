@@ -1,32 +1,193 @@
 /* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
 #include "config.h"
 
-#ifndef CB_DONT_NEED_BYTEORDER
-static uint64_t swap64(uint64_t in) {
-#ifndef WORDS_BIGENDIAN
-    /* Little endian, flip the bytes around until someone makes a faster/better
-     * way to do this. */
-    uint64_t rv = 0;
-    int i = 0;
-    for (i = 0; i<8; i++) {
-        rv = (rv << 8) | (in & 0xff);
-        in >>= 8;
-    }
-    return rv;
-#else
-    /* big-endian machines don't need byte swapping */
-    return in;
+#include <platform/byteorder.h>
+
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define HAVE_X86_SHUFFLE 1
+#define TARGET(a) __attribute__((target(a)))
+#elif defined(_M_X64)
+#include <intrin.h>
+#include <immintrin.h>
+#define HAVE_X86_SHUFFLE 1
+#define TARGET(a)
+#elif defined(__aarch64__) || (defined(__ARM_NEON) && defined(__GNUC__))
+#include <arm_neon.h>
+#define HAVE_NEON 1
 #endif
-}
 
+#ifndef CB_DONT_NEED_BYTEORDER
 PLATFORM_PUBLIC_API
 uint64_t ntohll(uint64_t val) {
-   return swap64(val);
+   return cb_ntohll(val);
 }
 
 PLATFORM_PUBLIC_API
 uint64_t htonll(uint64_t val) {
-   return swap64(val);
+   return cb_htonll(val);
+}
+
+#endif
+
+#ifdef HAVE_X86_SHUFFLE
+/* pshufb masks reversing each 2, 4 and 8 byte group in both 16 byte
+ * lanes (vpshufb doesn't cross lanes) */
+static const uint8_t shuffle16[32] = {
+    1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+    1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14
+};
+static const uint8_t shuffle32[32] = {
+    3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+    3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12
+};
+static const uint8_t shuffle64[32] = {
+    7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8,
+    7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8
+};
+
+enum { SHUFFLE_UNKNOWN, SHUFFLE_NONE, SHUFFLE_SSSE3, SHUFFLE_AVX2 };
+static int shuffle_support = SHUFFLE_UNKNOWN;
+
+static int detect_shuffle(void) {
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] >= 7) {
+        int ecx;
+        __cpuid(info, 1);
+        ecx = info[2];
+        __cpuidex(info, 7, 0);
+        /* AVX2, and the OS saves the ymm registers (OSXSAVE + xgetbv) */
+        if ((info[1] & (1 << 5)) && (ecx & (1 << 27)) &&
+            (_xgetbv(0) & 6) == 6) {
+            return SHUFFLE_AVX2;
+        }
+        if (ecx & (1 << 9)) {
+            return SHUFFLE_SSSE3;
+        }
+    }
+    return SHUFFLE_NONE;
+#else
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return SHUFFLE_AVX2;
+    }
+    if (__builtin_cpu_supports("ssse3")) {
+        return SHUFFLE_SSSE3;
+    }
+    return SHUFFLE_NONE;
+#endif
+}
+
+TARGET("ssse3")
+static size_t shuffle_ssse3(uint8_t *dst, const uint8_t *src, size_t nbytes,
+                            const uint8_t *mask) {
+    const __m128i m = _mm_loadu_si128((const __m128i *)mask);
+    size_t ii;
+    for (ii = 0; ii + 16 <= nbytes; ii += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + ii));
+        _mm_storeu_si128((__m128i *)(dst + ii), _mm_shuffle_epi8(v, m));
+    }
+    return ii;
+}
+
+TARGET("avx2")
+static size_t shuffle_avx2(uint8_t *dst, const uint8_t *src, size_t nbytes,
+                           const uint8_t *mask) {
+    const __m256i m = _mm256_loadu_si256((const __m256i *)mask);
+    size_t ii;
+    for (ii = 0; ii + 32 <= nbytes; ii += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(src + ii));
+        _mm256_storeu_si256((__m256i *)(dst + ii), _mm256_shuffle_epi8(v, m));
+    }
+    return ii;
 }
 
+/* Swap as many whole vectors as possible, returns the bytes done */
+static size_t shuffle(uint8_t *dst, const uint8_t *src, size_t nbytes,
+                      const uint8_t *mask) {
+    /* Every thread comes to the same answer, so it's fine to race */
+#ifdef _MSC_VER
+    int support = *(volatile int *)&shuffle_support;
+#else
+    int support = __atomic_load_n(&shuffle_support, __ATOMIC_RELAXED);
+#endif
+    size_t done = 0;
+    if (support == SHUFFLE_UNKNOWN) {
+        support = detect_shuffle();
+#ifdef _MSC_VER
+        *(volatile int *)&shuffle_support = support;
+#else
+        __atomic_store_n(&shuffle_support, support, __ATOMIC_RELAXED);
+#endif
+    }
+    if (support == SHUFFLE_AVX2) {
+        done = shuffle_avx2(dst, src, nbytes, mask);
+    }
+    if (support >= SHUFFLE_SSSE3) {
+        done += shuffle_ssse3(dst + done, src + done, nbytes - done, mask);
+    }
+    return done;
+}
+#define SHUFFLE16(d, s, n) shuffle(d, s, n, shuffle16)
+#define SHUFFLE32(d, s, n) shuffle(d, s, n, shuffle32)
+#define SHUFFLE64(d, s, n) shuffle(d, s, n, shuffle64)
+
+#elif defined(HAVE_NEON)
+#define NEON_SHUFFLE(name, rev)                                      \
+    static size_t name(uint8_t *dst, const uint8_t *src, size_t nbytes) { \
+        size_t ii;                                                   \
+        for (ii = 0; ii + 16 <= nbytes; ii += 16) {                  \
+            vst1q_u8(dst + ii, rev(vld1q_u8(src + ii)));             \
+        }                                                            \
+        return ii;                                                   \
+    }
+NEON_SHUFFLE(shuffle_neon16, vrev16q_u8)
+NEON_SHUFFLE(shuffle_neon32, vrev32q_u8)
+NEON_SHUFFLE(shuffle_neon64, vrev64q_u8)
+#define SHUFFLE16(d, s, n) shuffle_neon16(d, s, n)
+#define SHUFFLE32(d, s, n) shuffle_neon32(d, s, n)
+#define SHUFFLE64(d, s, n) shuffle_neon64(d, s, n)
+
+#else
+#define SHUFFLE16(d, s, n) 0
+#define SHUFFLE32(d, s, n) 0
+#define SHUFFLE64(d, s, n) 0
 #endif
+
+/* The remaining values go through memcpy as the buffers may be
+ * unaligned (it compiles to a plain load / store) */
+#define SWAP_TAIL(type, swap)                               \
+    for (; done < n * sizeof(type); done += sizeof(type)) { \
+        type value;                                         \
+        memcpy(&value, s + done, sizeof(value));            \
+        value = swap(value);                                \
+        memcpy(d + done, &value, sizeof(value));            \
+    }
+
+PLATFORM_PUBLIC_API
+void cb_bswap16_array(void *dst, const void *src, size_t n) {
+    uint8_t *d = dst;
+    const uint8_t *s = src;
+    size_t done = SHUFFLE16(d, s, n * sizeof(uint16_t));
+    SWAP_TAIL(uint16_t, cb_bswap16)
+}
+
+PLATFORM_PUBLIC_API
+void cb_bswap32_array(void *dst, const void *src, size_t n) {
+    uint8_t *d = dst;
+    const uint8_t *s = src;
+    size_t done = SHUFFLE32(d, s, n * sizeof(uint32_t));
+    SWAP_TAIL(uint32_t, cb_bswap32)
+}
+
+PLATFORM_PUBLIC_API
+void cb_bswap64_array(void *dst, const void *src, size_t n) {
+    uint8_t *d = dst;
+    const uint8_t *s = src;
+    size_t done = SHUFFLE64(d, s, n * sizeof(uint64_t));
+    SWAP_TAIL(uint64_t, cb_bswap64)
+}
@@ -31,6 +31,8 @@
 #include <float.h>
 #include <limits.h>
 #include <ctype.h>
+#include <locale.h>
+#include <stdint.h>
 #include "cJSON.h"
 
 static int cJSON_strcasecmp(const char *s1, const char *s2)
@@ -76,153 +78,1112 @@ static cJSON *cJSON_New_Item(void)
     return cJSON_calloc(1, sizeof(cJSON));
 }
 
+/* Allocation through an allocator, or the hooks if it is NULL. The
+   strings are always allocated with their exact size (strlen + 1) so
+   that the size can be passed back when they are freed. */
+static void *alloc_malloc(const cJSON_Allocator *allocator, size_t sz)
+{
+    return allocator ? allocator->malloc_fn(allocator->ctx, sz) : cJSON_malloc(sz);
+}
+
+static void alloc_free(const cJSON_Allocator *allocator, void *ptr, size_t sz)
+{
+    if (allocator) {
+        allocator->free_fn(allocator->ctx, ptr, sz);
+    } else {
+        cJSON_free(ptr);
+    }
+}
+
+static char *alloc_strdup(const cJSON_Allocator *allocator, const char *str)
+{
+    size_t len;
+    char *copy;
+    if (!allocator) {
+        return cJSON_strdup(str);
+    }
+    len = strlen(str) + 1;
+    copy = allocator->malloc_fn(allocator->ctx, len);
+    if (copy) {
+        memcpy(copy, str, len);
+    }
+    return copy;
+}
+
+static void alloc_free_string(const cJSON_Allocator *allocator, char *str)
+{
+    alloc_free(allocator, str, allocator ? strlen(str) + 1 : 0);
+}
+
+static cJSON *alloc_new_item(const cJSON_Allocator *allocator)
+{
+    cJSON *item;
+    if (!allocator) {
+        return cJSON_New_Item();
+    }
+    item = allocator->malloc_fn(allocator->ctx, sizeof(cJSON));
+    if (item) {
+        memset(item, 0, sizeof(cJSON));
+        item->allocator = allocator;
+    }
+    return item;
+}
+
+/* Arena allocation. Every allocation is rounded up to keep the items
+   (which contain a double) properly aligned. */
+#define ARENA_ALIGN(sz) (((sz) + 7) & ~((size_t)7))
+#define ARENA_DEFAULT_SLAB_SIZE 16384
+
+typedef struct cJSON_Slab {
+    struct cJSON_Slab *next;
+    size_t size; /* usable bytes following the header */
+    size_t used;
+} cJSON_Slab;
+
+#define SLAB_HEADER_SIZE ARENA_ALIGN(sizeof(cJSON_Slab))
+
+struct cJSON_Arena {
+    cJSON_Slab *head;
+    cJSON_Slab *current;
+    size_t slab_size;
+};
+
+cJSON_Arena *cJSON_CreateArena(size_t slab_size)
+{
+    cJSON_Arena *arena = cJSON_malloc(sizeof(cJSON_Arena));
+    if (!arena) {
+        return NULL;
+    }
+    arena->head = arena->current = NULL;
+    arena->slab_size = slab_size ? ARENA_ALIGN(slab_size) : ARENA_DEFAULT_SLAB_SIZE;
+    return arena;
+}
+
+void cJSON_ResetArena(cJSON_Arena *arena)
+{
+    arena->current = arena->head;
+    if (arena->current) {
+        arena->current->used = 0;
+    }
+}
+
+void cJSON_DeleteArena(cJSON_Arena *arena)
+{
+    cJSON_Slab *slab;
+    if (!arena) {
+        return;
+    }
+    slab = arena->head;
+    while (slab) {
+        cJSON_Slab *next = slab->next;
+        cJSON_free(slab);
+        slab = next;
+    }
+    cJSON_free(arena);
+}
+
+static void *arena_alloc(cJSON_Arena *arena, size_t sz)
+{
+    cJSON_Slab *slab = arena->current;
+    sz = ARENA_ALIGN(sz);
+
+    if (slab && slab->size - slab->used >= sz) {
+        void *ret = (char *)slab + SLAB_HEADER_SIZE + slab->used;
+        slab->used += sz;
+        return ret;
+    }
+
+    /* Move on to (previously allocated) slabs left over from a reset */
+    while (slab && slab->next) {
+        slab = slab->next;
+        slab->used = 0;
+        if (slab->size >= sz) {
+            arena->current = slab;
+            slab->used = sz;
+            return (char *)slab + SLAB_HEADER_SIZE;
+        }
+    }
+
+    {
+        size_t size = sz > arena->slab_size ? sz : arena->slab_size;
+        cJSON_Slab *nslab = cJSON_malloc(SLAB_HEADER_SIZE + size);
+        if (!nslab) {
+            return NULL;
+        }
+        nslab->next = NULL;
+        nslab->size = size;
+        nslab->used = sz;
+        if (slab) {
+            slab->next = nslab;
+        } else {
+            arena->head = nslab;
+        }
+        arena->current = nslab;
+        return (char *)nslab + SLAB_HEADER_SIZE;
+    }
+}
+
+/* The state shared by the parser functions for a single parse. */
+typedef struct parse_ctx {
+    cJSON_Arena *arena; /* NULL: allocate through the allocator */
+    const cJSON_Allocator *allocator; /* NULL: allocate through the hooks */
+    const char *end; /* The parser never reads at or beyond end */
+    int insitu; /* Decode strings in place in the (mutable) input */
+    int depth; /* The number of arrays and objects being parsed */
+} parse_ctx;
+
+/* Are there at least n more bytes to read at ptr? */
+#define can_read(ctx, ptr, n) ((size_t)((ctx)->end - (ptr)) >= (size_t)(n))
+/* Is the next byte at ptr equal to c? */
+#define peek(ctx, ptr, c) ((ptr) < (ctx)->end && *(ptr) == (c))
+
+static cJSON *ctx_new_item(parse_ctx *ctx)
+{
+    cJSON *item;
+    if (!ctx->arena) {
+        return alloc_new_item(ctx->allocator);
+    }
+    item = arena_alloc(ctx->arena, sizeof(cJSON));
+    if (item) {
+        memset(item, 0, sizeof(cJSON));
+    }
+    return item;
+}
+
+static void *ctx_malloc(parse_ctx *ctx, size_t sz)
+{
+    return ctx->arena ? arena_alloc(ctx->arena, sz) : alloc_malloc(ctx->allocator, sz);
+}
+
+/* The lookup index of an array or object (see cJSON_EnableIndex). It
+   is built on the first lookup after it has been enabled or invalidated;
+   appends, detaches and replacements keep it up to date. */
+struct cJSON_Index {
+    int valid; /* 0: rebuild before the next lookup */
+    int duplicates; /* Some names are in the tables for an earlier item */
+    int count; /* The number of children */
+    int capacity; /* The number of slots in items */
+    cJSON **items; /* The children, in order */
+    size_t mask; /* The number of slots in the hash tables - 1 */
+    cJSON **exact; /* Open addressing on the name */
+    cJSON **nocase; /* Open addressing on the lowercase name */
+};
+
+static void index_free(cJSON_Index *index)
+{
+    if (index) {
+        cJSON_free(index->items);
+        cJSON_free(index->exact);
+        cJSON_free(index->nocase);
+        cJSON_free(index);
+    }
+}
+
+/* FNV-1a of the (lowercase) name */
+static size_t index_hash(const char *str, int nocase)
+{
+    size_t hash = 2166136261U;
+    for (; *str; ++str) {
+        unsigned char c = (unsigned char)*str;
+        hash = (hash ^ (nocase ? (unsigned char)tolower(c) : c)) * 16777619U;
+    }
+    return hash;
+}
+
+static int index_keycmp(const char *s1, const char *s2, int nocase)
+{
+    return nocase ? cJSON_strcasecmp(s1, s2) : strcmp(s1, s2);
+}
+
+static cJSON **index_table(cJSON_Index *index, int nocase)
+{
+    return nocase ? index->nocase : index->exact;
+}
+
+/* Add item to the hash table unless the name is already there; like
+   the linear search, a lookup returns the first item with the name. */
+static void index_insert(cJSON_Index *index, cJSON *item, int nocase)
+{
+    cJSON **table = index_table(index, nocase);
+    size_t slot = index_hash(item->string, nocase) & index->mask;
+    while (table[slot]) {
+        if (!index_keycmp(table[slot]->string, item->string, nocase)) {
+            index->duplicates = 1;
+            return;
+        }
+        slot = (slot + 1) & index->mask;
+    }
+    table[slot] = item;
+}
+
+/* Return the slot for string (which is empty if it isn't there) */
+static size_t index_find(cJSON_Index *index, const char *string, int nocase)
+{
+    cJSON **table = index_table(index, nocase);
+    size_t slot = index_hash(string, nocase) & index->mask;
+    while (table[slot] && index_keycmp(table[slot]->string, string, nocase)) {
+        slot = (slot + 1) & index->mask;
+    }
+    return slot;
+}
+
+/* Take item out of the hash table. The entries after it in the probe
+   sequence are shifted back into the hole, so no tombstones are left. */
+static void index_erase(cJSON_Index *index, cJSON *item, int nocase)
+{
+    cJSON **table = index_table(index, nocase);
+    size_t hole = index_find(index, item->string, nocase);
+    size_t next = hole;
+    size_t home;
+    if (table[hole] != item) {
+        return;
+    }
+    table[hole] = NULL;
+    for (;;) {
+        next = (next + 1) & index->mask;
+        if (!table[next]) {
+            break;
+        }
+        /* It may move back unless its home slot is after the hole */
+        home = index_hash(table[next]->string, nocase) & index->mask;
+        if (((next - home) & index->mask) >= ((next - hole) & index->mask)) {
+            table[hole] = table[next];
+            table[next] = NULL;
+            hole = next;
+        }
+    }
+}
+
+static int index_reserve(cJSON_Index *index, int count)
+{
+    cJSON **items;
+    int capacity = index->capacity ? index->capacity : 8;
+    if (count <= index->capacity) {
+        return 0;
+    }
+    while (capacity < count) {
+        capacity *= 2;
+    }
+    items = cJSON_malloc(capacity * sizeof(cJSON *));
+    if (!items) {
+        return -1;
+    }
+    if (index->count) {
+        memcpy(items, index->items, index->count * sizeof(cJSON *));
+    }
+    cJSON_free(index->items);
+    index->items = items;
+    index->capacity = capacity;
+    return 0;
+}
+
+static int index_build(cJSON *item)
+{
+    cJSON_Index *index = item->index;
+    cJSON *c;
+    int count = 0;
+    size_t slots = 8;
+
+    for (c = item->child; c; c = c->next) {
+        ++count;
+    }
+    index->count = 0;
+    index->duplicates = 0;
+    if (index_reserve(index, count) == -1) {
+        return -1;
+    }
+    for (c = item->child; c; c = c->next) {
+        index->items[index->count++] = c;
+    }
+
+    if ((item->type & 255) == cJSON_Object) {
+        /* Keep the tables at most half full */
+        while (slots < (size_t)count * 2) {
+            slots *= 2;
+        }
+        if (slots != index->mask + 1 || !index->exact) {
+            cJSON_free(index->exact);
+            cJSON_free(index->nocase);
+            index->mask = slots - 1;
+            index->exact = cJSON_calloc(slots, sizeof(cJSON *));
+            index->nocase = cJSON_calloc(slots, sizeof(cJSON *));
+            if (!index->exact || !index->nocase) {
+                cJSON_free(index->exact);
+                cJSON_free(index->nocase);
+                index->exact = index->nocase = NULL;
+                return -1;
+            }
+        } else {
+            memset(index->exact, 0, slots * sizeof(cJSON *));
+            memset(index->nocase, 0, slots * sizeof(cJSON *));
+        }
+        for (c = item->child; c; c = c->next) {
+            if (c->string) {
+                index_insert(index, c, 0);
+                index_insert(index, c, 1);
+            }
+        }
+    }
+    index->valid = 1;
+    return 0;
+}
+
+/* Is the index of item usable for a lookup? */
+static int index_ready(cJSON *item)
+{
+    return item->index && (item->index->valid || index_build(item) == 0);
+}
+
+static void index_append(cJSON *array, cJSON *item)
+{
+    cJSON_Index *index = array->index;
+    if (!index || !index->valid) {
+        return;
+    }
+    if (index_reserve(index, index->count + 1) == -1) {
+        index->valid = 0;
+        return;
+    }
+    index->items[index->count++] = item;
+    if ((array->type & 255) == cJSON_Object && item->string) {
+        if ((size_t)index->count * 2 > index->mask + 1) {
+            index->valid = 0; /* grow the tables on the next lookup */
+        } else {
+            index_insert(index, item, 0);
+            index_insert(index, item, 1);
+        }
+    }
+}
+
+/* Point the index at newitem instead of the which'th child olditem */
+static void index_replace(cJSON *array, int which, cJSON *olditem, cJSON *newitem)
+{
+    cJSON_Index *index = array->index;
+    size_t slot;
+    int nocase;
+    if (!index || !index->valid) {
+        return;
+    }
+    index->items[which] = newitem;
+    if ((array->type & 255) != cJSON_Object || !olditem->string) {
+        return;
+    }
+    if (!newitem->string || strcmp(olditem->string, newitem->string)) {
+        /* Another name (or another case of it); when a name is used more
+           than once we can't tell which item the tables should point at */
+        if (!newitem->string || index->duplicates) {
+            index->valid = 0;
+            return;
+        }
+        for (nocase = 0; nocase < 2; ++nocase) {
+            index_erase(index, olditem, nocase);
+            index_insert(index, newitem, nocase);
+        }
+        if (index->duplicates) {
+            index->valid = 0;
+        }
+        return;
+    }
+    for (nocase = 0; nocase < 2; ++nocase) {
+        slot = index_find(index, olditem->string, nocase);
+        if (index_table(index, nocase)[slot] == olditem) {
+            index_table(index, nocase)[slot] = newitem;
+        }
+    }
+}
+
+/* Take the which'th child item out of the index */
+static void index_remove(cJSON *array, int which, cJSON *item)
+{
+    cJSON_Index *index = array->index;
+    if (!index || !index->valid) {
+        return;
+    }
+    memmove(index->items + which, index->items + which + 1,
+            (index->count - which - 1) * sizeof(cJSON *));
+    --index->count;
+    if ((array->type & 255) != cJSON_Object || !item->string) {
+        return;
+    }
+    if (index->duplicates) {
+        /* The next item with the name should take its place */
+        index->valid = 0;
+        return;
+    }
+    index_erase(index, item, 0);
+    index_erase(index, item, 1);
+}
+
+/* The position of item among the children of array */
+static int index_position(cJSON *array, cJSON *item)
+{
+    int i = 0;
+    if (index_ready(array)) {
+        while (array->index->items[i] != item) {
+            ++i;
+        }
+        return i;
+    }
+    for (; array->child != item; item = item->prev) {
+        ++i;
+    }
+    return i;
+}
+
 /* Delete a cJSON structure. */
 void cJSON_Delete(cJSON *c)
 {
     cJSON *next;
     while (c) {
+        const cJSON_Allocator *allocator = c->allocator;
         next = c->next;
         if (!(c->type & cJSON_IsReference) && c->child) {
             cJSON_Delete(c->child);
         }
         if (!(c->type & cJSON_IsReference) && c->valuestring) {
-            cJSON_free(c->valuestring);
+            alloc_free_string(allocator, c->valuestring);
         }
-        if (c->string) {
-            cJSON_free(c->string);
+        if (!(c->type & cJSON_StringIsConst) && c->string) {
+            alloc_free_string(allocator, c->string);
         }
-        cJSON_free(c);
+        index_free(c->index);
+        alloc_free(allocator, c, sizeof(cJSON));
         c = next;
     }
 }
 
+/* Store the double d in the number item, with the integer fields
+   saturated to their range (and flagged as such, so that the saturated
+   valueint64 isn't mistaken for the exact value). */
+static void set_number(cJSON *item, double d)
+{
+    item->valuedouble = d;
+    item->type &= ~cJSON_NumberIsSaturated;
+    if (d != d) {
+        item->valueint64 = 0;
+        item->type |= cJSON_NumberIsSaturated;
+    } else if (d >= 9223372036854775808.0) {
+        item->valueint64 = INT64_MAX;
+        item->type |= cJSON_NumberIsSaturated;
+    } else if (d <= -9223372036854775808.0) {
+        /* -2^63 would fit, but is kept as a double like 2^63 so both
+           ends of the range behave the same */
+        item->valueint64 = INT64_MIN;
+        item->type |= cJSON_NumberIsSaturated;
+    } else {
+        item->valueint64 = (int64_t)d;
+    }
+    if (item->valueint64 >= INT_MAX) {
+        item->valueint = INT_MAX;
+    } else if (item->valueint64 <= INT_MIN) {
+        item->valueint = INT_MIN;
+    } else {
+        item->valueint = (int)item->valueint64;
+    }
+}
+
+/* Store the exact integer v in the number item */
+static void set_int64(cJSON *item, int64_t v)
+{
+    set_number(item, (double)v);
+    item->valueint64 = v;
+    item->type &= ~cJSON_NumberIsSaturated;
+}
+
+/* The powers of ten which are exact as a double */
+static const double exact_powers[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+/* Convert the number text between start and end (which may not be
+   terminated) with strtod in the C locale. */
+static double parse_number_slow(const char *start, const char *end)
+{
+    char buffer[64];
+    char *str = buffer;
+    char *ptr;
+    char point = localeconv()->decimal_point[0];
+    size_t len = end - start;
+    double n;
+
+    if (len >= sizeof(buffer)) {
+        str = cJSON_malloc(len + 1);
+        if (!str) {
+            return 0;
+        }
+    }
+    memcpy(str, start, len);
+    str[len] = 0;
+    if (point != '.' && (ptr = strchr(str, '.')) != NULL) {
+        *ptr = point;
+    }
+    n = strtod(str, NULL);
+    if (str != buffer) {
+        cJSON_free(str);
+    }
+    return n;
+}
+
 /* Parse the input text to generate a number, and populate the result into item. */
-static const char *parse_number(cJSON *item, const char *num)
+static const char *parse_number(parse_ctx *ctx, cJSON *item, const char *num)
 {
-    double n = 0, sign = 1, scale = 0;
+    const char *start = num;
+    const char *end = ctx->end;
+    uint64_t mantissa = 0; /* The first 19 significant digits */
+    int digits = 0;
+    int scale = 0; /* mantissa * 10^scale is the number */
+    int exact = 1; /* No non-zero digits were dropped from mantissa */
+    int integer = 1;
+    int negative = 0;
     int subscale = 0, signsubscale = 1;
+    double n;
 
-    /* Could use sscanf for this? */
     if (*num == '-') {
-        sign = -1, num++; /* Has sign? */
+        negative = 1, num++; /* Has sign? */
     }
-    if (*num == '0') {
+    if (peek(ctx, num, '0')) {
         num++; /* is zero */
     }
-    if (*num >= '1' && *num <= '9') {
-        do {
-            n = (n * 10.0) + (*num++ -'0');
-        } while (*num >= '0' && *num <= '9'); /* Number? */
+    while (num < end && *num >= '0' && *num <= '9') {
+        if (digits < 19) {
+            mantissa = (mantissa * 10) + (*num - '0');
+            digits += (mantissa != 0);
+        } else {
+            scale++;
+            exact &= (*num == '0');
+        }
+        num++;
     }
-    if (*num == '.') {
+    if (peek(ctx, num, '.')) {
         num++; /* Fractional part? */
-        do {
-            n = (n * 10.0) + (*num++ -'0'), scale--;
-        } while (*num >= '0' && *num <= '9');
+        integer = 0;
+        while (num < end && *num >= '0' && *num <= '9') {
+            if (digits < 19) {
+                mantissa = (mantissa * 10) + (*num - '0');
+                digits += (mantissa != 0);
+                scale--;
+            } else {
+                exact &= (*num == '0');
+            }
+            num++;
+        }
     }
-    if (*num == 'e' || *num == 'E') { /* Exponent? */
+    if (num < end && (*num == 'e' || *num == 'E')) { /* Exponent? */
         num++;
-        if (*num == '+') {
+        integer = 0;
+        if (peek(ctx, num, '+')) {
             num++;
-        } else if (*num == '-') {
+        } else if (peek(ctx, num, '-')) {
             signsubscale = -1, num++; /* With sign? */
         }
-        while (*num >= '0' && *num <= '9') {
-            subscale = (subscale * 10) + (*num++ - '0'); /* Number? */
+        while (num < end && *num >= '0' && *num <= '9') {
+            if (subscale < 100000) {
+                subscale = (subscale * 10) + (*num - '0'); /* Number? */
+            }
+            num++;
         }
     }
-
-    n = sign * n * pow(10.0, (scale + subscale * signsubscale)); /* number = +/- number.fraction * 10^+/- exponent */
-
-    item->valuedouble = n;
-    item->valueint = (int)n;
+    scale += subscale * signsubscale;
     item->type = cJSON_Number;
+
+    /* Keep integers which fit in 64 bits exact (but not -0, which
+       only exists as a double). The ones which don't fit are doubles. */
+    if (integer && scale == 0 && (mantissa != 0 || !negative) &&
+        mantissa <= (uint64_t)INT64_MAX + (uint64_t)negative) {
+        int64_t value = negative ? -(int64_t)(mantissa - negative) - negative
+                                 : (int64_t)mantissa;
+        set_int64(item, value);
+        return num;
+    }
+
+    /* Clinger's fast path: both the mantissa and the power of ten are
+       exact as doubles, so one multiplication/division rounds correctly */
+    if (mantissa == 0) {
+        n = 0;
+    } else if (exact && mantissa <= ((uint64_t)1 << 53) && scale >= -22 && scale <= 22) {
+        n = (double)mantissa;
+        n = (scale < 0) ? n / exact_powers[-scale] : n * exact_powers[scale];
+    } else {
+        n = parse_number_slow(start + negative, num);
+    }
+    set_number(item, negative ? -n : n);
     return num;
 }
 
 /* Render the number nicely from the given item into a string. */
-static char *print_number(cJSON *item)
+/* The output of the printer: a buffer which grows as needed, unless it
+   was supplied by the caller. */
+typedef struct printbuffer {
+    char *buffer;
+    size_t length;
+    size_t offset;
+    int noalloc;
+    const cJSON_Allocator *allocator; /* NULL: allocate through the hooks */
+} printbuffer;
+
+/* Return a pointer to the end of the output in p with room for at least
+   needed more bytes, or NULL on memory fail (or if it doesn't fit). */
+static char *ensure(printbuffer *p, size_t needed)
 {
-    char *str;
-    double d = item->valuedouble;
-    if (fabs(((double)item->valueint) - d) <= DBL_EPSILON && d <= INT_MAX && d >= INT_MIN) {
-        str = cJSON_malloc(21); /* 2^64+1 can be represented in 21 chars. */
-        sprintf(str, "%d", item->valueint);
-    } else {
-        str = cJSON_malloc(64); /* This is a nice tradeoff. */
-        if (fabs(floor(d) - d) <= DBL_EPSILON) {
-            sprintf(str, "%.0f", d);
-        } else if (fabs(d) < 1.0e-6 || fabs(d) > 1.0e9) {
-            sprintf(str, "%e", d);
-        } else {
-            sprintf(str, "%f", d);
-        }
+    char *newbuffer;
+    size_t newsize;
+    needed += p->offset;
+    if (needed <= p->length) {
+        return p->buffer + p->offset;
     }
-    return str;
+    if (p->noalloc) {
+        return NULL;
+    }
+    newsize = p->length ? p->length : 256;
+    while (newsize < needed) {
+        newsize *= 2;
+    }
+    newbuffer = alloc_malloc(p->allocator, newsize);
+    if (!newbuffer) {
+        return NULL;
+    }
+    if (p->buffer) {
+        memcpy(newbuffer, p->buffer, p->offset);
+        alloc_free(p->allocator, p->buffer, p->length);
+    }
+    p->buffer = newbuffer;
+    p->length = newsize;
+    return newbuffer + p->offset;
 }
 
-/* Parse the input text into an unescaped cstring, and populate item. */
-static const unsigned char firstByteMark[7] = { 0x00, 0x00, 0xC0, 0xE0, 0xF0, 0xF8, 0xFC };
-static const char *parse_string(cJSON *item, const char *str)
+/* Append the len bytes at str to the output */
+static int append(printbuffer *p, const char *str, size_t len)
 {
-    const char *ptr = str + 1;
-    char *ptr2;
-    char *out;
-    int len = 0;
-    unsigned uc;
-    if (*str != '\"') {
-        return NULL; /* not a string! */
+    char *out = ensure(p, len);
+    if (!out) {
+        return -1;
     }
+    memcpy(out, str, len);
+    p->offset += len;
+    return 0;
+}
 
-    while (*ptr != '\"' && (unsigned char)*ptr > 31 && ++len) {
-        if (*ptr++ == '\\') {
-            ptr++; /* Skip escaped quotes. */
-        }
-    }
+static int append_char(printbuffer *p, char c)
+{
+    return append(p, &c, 1);
+}
 
-    out = cJSON_malloc(len + 1); /* This is how long we need for the string, roughly. */
+/* Append count tabs to the output */
+static int append_tabs(printbuffer *p, int count)
+{
+    char *out = ensure(p, count);
     if (!out) {
-        return NULL;
+        return -1;
     }
+    memset(out, '\t', count);
+    p->offset += count;
+    return 0;
+}
 
-    ptr = str + 1;
-    ptr2 = out;
-    while (*ptr != '\"' && (unsigned char)*ptr > 31) {
-        if (*ptr != '\\') {
-            *ptr2++ = *ptr++;
-        } else {
-            ptr++;
-            switch (*ptr) {
-            case 'b':
-                *ptr2++ = '\b';
-                break;
-            case 'f':
-                *ptr2++ = '\f';
-                break;
-            case 'n':
-                *ptr2++ = '\n';
-                break;
-            case 'r':
-                *ptr2++ = '\r';
-                break;
-            case 't':
-                *ptr2++ = '\t';
-                break;
-            case 'u': /* transcode utf16 to utf8. DOES NOT SUPPORT SURROGATE PAIRS CORRECTLY. */
-                sscanf(ptr + 1, "%4x", &uc); /* get the unicode char. */
-                len = 3;
-                if (uc < 0x80) {
-                    len = 1;
-                } else if (uc < 0x800) {
-                    len = 2;
-                }
-                ptr2 += len;
+/* Write the integer to out (which must have room for 21 bytes) and
+   return the length. */
+static size_t format_int64(int64_t value, char *out)
+{
+    char digits[20];
+    char *ptr = out;
+    uint64_t magnitude = (uint64_t)value;
+    int len = 0;
 
-                switch (len) {
-                case 3:
-                    *--ptr2 = ((uc | 0x80) & 0xBF);
-                    uc >>= 6;
-                case 2:
+    if (value < 0) {
+        *ptr++ = '-';
+        magnitude = 0 - magnitude;
+    }
+    do {
+        digits[len++] = (char)('0' + magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude);
+    while (len) {
+        *ptr++ = digits[--len];
+    }
+    return ptr - out;
+}
+
+/* The shortest representation of a double which reads back as the same
+   double is generated with Florian Loitsch's Grisu2 algorithm ("Printing
+   Floating-Point Numbers Quickly and Accurately with Integers", 2010)
+   using a "do-it-yourself" floating point number of a 64 bit significand
+   f and a binary exponent e. */
+typedef struct diy_fp {
+    uint64_t f;
+    int e;
+} diy_fp;
+
+/* Normalized 10^k for k = -348, -340, ..., 340 (f * 2^e) */
+static const uint64_t cached_powers_f[] = {
+    0xfa8fd5a0081c0288ULL, 0xbaaee17fa23ebf76ULL, 0x8b16fb203055ac76ULL,
+    0xcf42894a5dce35eaULL, 0x9a6bb0aa55653b2dULL, 0xe61acf033d1a45dfULL,
+    0xab70fe17c79ac6caULL, 0xff77b1fcbebcdc4fULL, 0xbe5691ef416bd60cULL,
+    0x8dd01fad907ffc3cULL, 0xd3515c2831559a83ULL, 0x9d71ac8fada6c9b5ULL,
+    0xea9c227723ee8bcbULL, 0xaecc49914078536dULL, 0x823c12795db6ce57ULL,
+    0xc21094364dfb5637ULL, 0x9096ea6f3848984fULL, 0xd77485cb25823ac7ULL,
+    0xa086cfcd97bf97f4ULL, 0xef340a98172aace5ULL, 0xb23867fb2a35b28eULL,
+    0x84c8d4dfd2c63f3bULL, 0xc5dd44271ad3cdbaULL, 0x936b9fcebb25c996ULL,
+    0xdbac6c247d62a584ULL, 0xa3ab66580d5fdaf6ULL, 0xf3e2f893dec3f126ULL,
+    0xb5b5ada8aaff80b8ULL, 0x87625f056c7c4a8bULL, 0xc9bcff6034c13053ULL,
+    0x964e858c91ba2655ULL, 0xdff9772470297ebdULL, 0xa6dfbd9fb8e5b88fULL,
+    0xf8a95fcf88747d94ULL, 0xb94470938fa89bcfULL, 0x8a08f0f8bf0f156bULL,
+    0xcdb02555653131b6ULL, 0x993fe2c6d07b7facULL, 0xe45c10c42a2b3b06ULL,
+    0xaa242499697392d3ULL, 0xfd87b5f28300ca0eULL, 0xbce5086492111aebULL,
+    0x8cbccc096f5088ccULL, 0xd1b71758e219652cULL, 0x9c40000000000000ULL,
+    0xe8d4a51000000000ULL, 0xad78ebc5ac620000ULL, 0x813f3978f8940984ULL,
+    0xc097ce7bc90715b3ULL, 0x8f7e32ce7bea5c70ULL, 0xd5d238a4abe98068ULL,
+    0x9f4f2726179a2245ULL, 0xed63a231d4c4fb27ULL, 0xb0de65388cc8ada8ULL,
+    0x83c7088e1aab65dbULL, 0xc45d1df942711d9aULL, 0x924d692ca61be758ULL,
+    0xda01ee641a708deaULL, 0xa26da3999aef774aULL, 0xf209787bb47d6b85ULL,
+    0xb454e4a179dd1877ULL, 0x865b86925b9bc5c2ULL, 0xc83553c5c8965d3dULL,
+    0x952ab45cfa97a0b3ULL, 0xde469fbd99a05fe3ULL, 0xa59bc234db398c25ULL,
+    0xf6c69a72a3989f5cULL, 0xb7dcbf5354e9beceULL, 0x88fcf317f22241e2ULL,
+    0xcc20ce9bd35c78a5ULL, 0x98165af37b2153dfULL, 0xe2a0b5dc971f303aULL,
+    0xa8d9d1535ce3b396ULL, 0xfb9b7cd9a4a7443cULL, 0xbb764c4ca7a44410ULL,
+    0x8bab8eefb6409c1aULL, 0xd01fef10a657842cULL, 0x9b10a4e5e9913129ULL,
+    0xe7109bfba19c0c9dULL, 0xac2820d9623bf429ULL, 0x80444b5e7aa7cf85ULL,
+    0xbf21e44003acdd2dULL, 0x8e679c2f5e44ff8fULL, 0xd433179d9c8cb841ULL,
+    0x9e19db92b4e31ba9ULL, 0xeb96bf6ebadf77d9ULL, 0xaf87023b9bf0ee6bULL,
+};
+static const int16_t cached_powers_e[] = {
+    -1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980,
+    -954, -927, -901, -874, -847, -821, -794, -768, -741, -715,
+    -688, -661, -635, -608, -582, -555, -529, -502, -475, -449,
+    -422, -396, -369, -343, -316, -289, -263, -236, -210, -183,
+    -157, -130, -103, -77, -50, -24, 3, 30, 56, 83,
+    109, 136, 162, 189, 216, 242, 269, 295, 322, 348,
+    375, 402, 428, 455, 481, 508, 534, 561, 588, 614,
+    641, 667, 694, 720, 747, 774, 800, 827, 853, 880,
+    907, 933, 960, 986, 1013, 1039, 1066,
+};
+
+static const uint64_t powers_of_ten[] = {
+    1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL,
+    10000000ULL, 100000000ULL, 1000000000ULL, 10000000000ULL,
+    100000000000ULL, 1000000000000ULL, 10000000000000ULL,
+    100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL,
+    100000000000000000ULL, 1000000000000000000ULL,
+    10000000000000000000ULL
+};
+
+static diy_fp diy_fp_normalize(diy_fp x)
+{
+    while (!(x.f & 0x8000000000000000ULL)) {
+        x.f <<= 1;
+        x.e--;
+    }
+    return x;
+}
+
+/* x * y rounded to 64 bits */
+static diy_fp diy_fp_multiply(diy_fp x, diy_fp y)
+{
+    const uint64_t mask = 0xFFFFFFFFULL;
+    uint64_t a = x.f >> 32, b = x.f & mask, c = y.f >> 32, d = y.f & mask;
+    uint64_t ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+    uint64_t tmp = (bd >> 32) + (ad & mask) + (bc & mask) + (1ULL << 31);
+    diy_fp r;
+    r.f = ac + (ad >> 32) + (bc >> 32) + (tmp >> 32);
+    r.e = x.e + y.e + 64;
+    return r;
+}
+
+/* Get the value of the (positive, finite) double d, and the normalized
+   boundaries halfway to its neighbours. */
+static diy_fp diy_fp_from_double(double d, diy_fp *minus, diy_fp *plus)
+{
+    uint64_t bits;
+    int biased;
+    diy_fp v;
+
+    memcpy(&bits, &d, sizeof(bits));
+    biased = (int)((bits >> 52) & 0x7FF);
+    v.f = bits & 0x000FFFFFFFFFFFFFULL;
+    if (biased) {
+        v.f |= 0x0010000000000000ULL;
+        v.e = biased - 1075;
+    } else {
+        v.e = -1074;
+    }
+
+    plus->f = (v.f << 1) + 1;
+    plus->e = v.e - 1;
+    *plus = diy_fp_normalize(*plus);
+    if (v.f == 0x0010000000000000ULL && biased > 1) {
+        /* The neighbour below is closer */
+        minus->f = (v.f << 2) - 1;
+        minus->e = v.e - 2;
+    } else {
+        minus->f = (v.f << 1) - 1;
+        minus->e = v.e - 1;
+    }
+    minus->f <<= minus->e - plus->e;
+    minus->e = plus->e;
+    return diy_fp_normalize(v);
+}
+
+/* Get the cached 10^-K which brings the binary exponent e of a product
+   into [-60, -32] */
+static diy_fp cached_power(int e, int *K)
+{
+    double dk = (-61 - e) * 0.30102999566398114 + 347;
+    int k = (int)dk;
+    int index;
+    diy_fp r;
+    if (dk - k > 0.0) {
+        k++;
+    }
+    index = (k >> 3) + 1;
+    *K = -(-348 + (index << 3));
+    r.f = cached_powers_f[index];
+    r.e = cached_powers_e[index];
+    return r;
+}
+
+/* Move the last digit towards w as long as it stays inside the range */
+static void grisu_round(char *buffer, int len, uint64_t delta, uint64_t rest,
+                        uint64_t ten_kappa, uint64_t wp_w)
+{
+    while (rest < wp_w && delta - rest >= ten_kappa &&
+           (rest + ten_kappa < wp_w || wp_w - rest > rest + ten_kappa - wp_w)) {
+        buffer[len - 1]--;
+        rest += ten_kappa;
+    }
+}
+
+/* Generate the shortest digits of a number in [Mp - delta, Mp] close to W */
+static void digit_gen(diy_fp W, diy_fp Mp, uint64_t delta, char *buffer,
+                      int *len, int *K)
+{
+    const int shift = -Mp.e;
+    const uint64_t one = 1ULL << shift;
+    const uint64_t wp_w = Mp.f - W.f;
+    uint32_t p1 = (uint32_t)(Mp.f >> shift);
+    uint64_t p2 = Mp.f & (one - 1);
+    int kappa = 1;
+    uint32_t d;
+
+    while (kappa < 10 && p1 >= powers_of_ten[kappa]) {
+        kappa++;
+    }
+    *len = 0;
+    while (kappa > 0) {
+        uint64_t rest;
+        d = (uint32_t)(p1 / powers_of_ten[kappa - 1]);
+        p1 %= powers_of_ten[kappa - 1];
+        if (d || *len) {
+            buffer[(*len)++] = (char)('0' + d);
+        }
+        kappa--;
+        rest = ((uint64_t)p1 << shift) + p2;
+        if (rest <= delta) {
+            *K += kappa;
+            grisu_round(buffer, *len, delta, rest,
+                        powers_of_ten[kappa] << shift, wp_w);
+            return;
+        }
+    }
+    for (;;) {
+        p2 *= 10;
+        delta *= 10;
+        d = (uint32_t)(p2 >> shift);
+        if (d || *len) {
+            buffer[(*len)++] = (char)('0' + d);
+        }
+        p2 &= one - 1;
+        kappa--;
+        if (p2 < delta) {
+            *K += kappa;
+            grisu_round(buffer, *len, delta, p2, one,
+                        -kappa < 20 ? wp_w * powers_of_ten[-kappa] : 0);
+            return;
+        }
+    }
+}
+
+/* Write the (finite, non-zero) double to out (which must have room for
+   32 bytes) in the shortest form which reads back as the same double,
+   and return the length. */
+static size_t format_double(double d, char *out)
+{
+    char digits[24];
+    char *ptr = out;
+    diy_fp w, minus, plus, c_mk, W, Wp, Wm;
+    int len, K, kk, exponent;
+
+    if (d < 0) {
+        *ptr++ = '-';
+        d = -d;
+    }
+    w = diy_fp_from_double(d, &minus, &plus);
+    c_mk = cached_power(plus.e, &K);
+    W = diy_fp_multiply(w, c_mk);
+    Wp = diy_fp_multiply(plus, c_mk);
+    Wm = diy_fp_multiply(minus, c_mk);
+    Wm.f++;
+    Wp.f--;
+    digit_gen(W, Wp, Wp.f - Wm.f, digits, &len, &K);
+
+    /* The number is digits * 10^K, lay it out like JavaScript does */
+    kk = len + K;
+    if (K >= 0 && kk <= 21) {
+        memcpy(ptr, digits, len);
+        memset(ptr + len, '0', K);
+        ptr += kk;
+    } else if (kk > 0 && kk <= 21) {
+        memcpy(ptr, digits, kk);
+        ptr[kk] = '.';
+        memcpy(ptr + kk + 1, digits + kk, len - kk);
+        ptr += len + 1;
+    } else if (kk > -6 && kk <= 0) {
+        *ptr++ = '0';
+        *ptr++ = '.';
+        memset(ptr, '0', -kk);
+        memcpy(ptr - kk, digits, len);
+        ptr += len - kk;
+    } else {
+        *ptr++ = digits[0];
+        if (len > 1) {
+            *ptr++ = '.';
+            memcpy(ptr, digits + 1, len - 1);
+            ptr += len - 1;
+        }
+        *ptr++ = 'e';
+        exponent = kk - 1;
+        *ptr++ = exponent < 0 ? '-' : '+';
+        ptr += format_int64(exponent < 0 ? -exponent : exponent, ptr);
+    }
+    return ptr - out;
+}
+
+/* Whether valueint64 is the exact value of the number item (bit for
+   bit, to keep -0) */
+static int number_is_int64(const cJSON *item)
+{
+    double d = (double)item->valueint64;
+    return !(item->type & cJSON_NumberIsSaturated) &&
+           !memcmp(&d, &item->valuedouble, sizeof(d));
+}
+
+static int print_number(cJSON *item, printbuffer *p)
+{
+    char str[32];
+    size_t len;
+    double d = item->valuedouble;
+    if (number_is_int64(item)) {
+        len = format_int64(item->valueint64, str);
+    } else if (d != d || d - d != 0) {
+        /* NaN and infinity can't be represented in JSON */
+        return append(p, "null", 4);
+    } else if (d == 0) {
+        return append(p, "-0", 2);
+    } else {
+        len = format_double(d, str);
+    }
+    return append(p, str, len);
+}
+
+/* Parse the input text into an unescaped cstring, and populate item. */
+static const unsigned char firstByteMark[7] = { 0x00, 0x00, 0xC0, 0xE0, 0xF0, 0xF8, 0xFC };
+static const char *parse_hex4(parse_ctx *ctx, const char *str, unsigned *uc)
+{
+    int ii;
+    if (!can_read(ctx, str, 4)) {
+        return NULL;
+    }
+    *uc = 0;
+    for (ii = 0; ii < 4; ++ii, ++str) {
+        *uc <<= 4;
+        if (*str >= '0' && *str <= '9') {
+            *uc += *str - '0';
+        } else if (*str >= 'A' && *str <= 'F') {
+            *uc += 10 + *str - 'A';
+        } else if (*str >= 'a' && *str <= 'f') {
+            *uc += 10 + *str - 'a';
+        } else {
+            return NULL;
+        }
+    }
+    return str;
+}
+
+static const char *parse_string(parse_ctx *ctx, cJSON *item, const char *str)
+{
+    const char *ptr = str + 1;
+    const char *end = ctx->end;
+    char *ptr2;
+    char *out;
+    int len = 0;
+    size_t size = 0;
+    unsigned uc;
+    if (*str != '\"') {
+        return NULL; /* not a string! */
+    }
+
+    if (ctx->insitu) {
+        /* Unescaping never makes the string longer, so decode it over
+           itself and terminate it where the closing quote was. */
+        out = (char *)ptr;
+    } else {
+        while (ptr < end && *ptr != '\"' && (unsigned char)*ptr > 31 && ++len) {
+            if (*ptr++ == '\\' && ptr < end) {
+                ptr++; /* Skip escaped quotes. */
+            }
+        }
+
+        size = len + 1;
+        out = ctx_malloc(ctx, size); /* This is how long we need for the string, roughly. */
+        if (!out) {
+            return NULL;
+        }
+    }
+
+    ptr = str + 1;
+    ptr2 = out;
+    while (ptr < end && *ptr != '\"' && (unsigned char)*ptr > 31) {
+        if (*ptr != '\\') {
+            *ptr2++ = *ptr++;
+        } else {
+            if (++ptr == end) {
+                break;
+            }
+            switch (*ptr) {
+            case 'b':
+                *ptr2++ = '\b';
+                break;
+            case 'f':
+                *ptr2++ = '\f';
+                break;
+            case 'n':
+                *ptr2++ = '\n';
+                break;
+            case 'r':
+                *ptr2++ = '\r';
+                break;
+            case 't':
+                *ptr2++ = '\t';
+                break;
+            case 'u': /* transcode utf16 to utf8. DOES NOT SUPPORT SURROGATE PAIRS CORRECTLY. */
+                if (!parse_hex4(ctx, ptr + 1, &uc)) {
+                    if (!ctx->arena && !ctx->insitu) {
+                        alloc_free(ctx->allocator, out, size);
+                    }
+                    return NULL; /* invalid unicode escape */
+                }
+                len = 3;
+                if (uc < 0x80) {
+                    len = 1;
+                } else if (uc < 0x800) {
+                    len = 2;
+                }
+                ptr2 += len;
+
+                switch (len) {
+                case 3:
+                    *--ptr2 = ((uc | 0x80) & 0xBF);
+                    uc >>= 6;
+                case 2:
                     *--ptr2 = ((uc | 0x80) & 0xBF);
                     uc >>= 6;
                 case 1:
@@ -238,752 +1199,2469 @@ static const char *parse_string(cJSON *item, const char *str)
             ptr++;
         }
     }
-    *ptr2 = 0;
-    if (*ptr == '\"') {
+    if (peek(ctx, ptr, '\"')) {
         ptr++;
+    } else if (ctx->insitu) {
+        return NULL; /* no room for the terminator */
+    }
+    *ptr2 = 0;
+    if (ctx->allocator && !ctx->arena && !ctx->insitu &&
+        strlen(out) + 1 != size) {
+        /* Shorter after unescaping: the allocator needs the exact size */
+        char *exact = alloc_strdup(ctx->allocator, out);
+        alloc_free(ctx->allocator, out, size);
+        if (!exact) {
+            return NULL;
+        }
+        out = exact;
     }
     item->valuestring = out;
     item->type = cJSON_String;
+    if (ctx->insitu && !ctx->arena) {
+        item->type |= cJSON_IsReference; /* owned by the input buffer */
+    }
     return ptr;
 }
 
-/* Render the cstring provided to an escaped version that can be printed. */
-static char *print_string_ptr(const char *str)
+/* Render the cstring provided to an escaped version that can be printed. */
+static int print_string_ptr(const char *str, printbuffer *p)
+{
+    const char *ptr;
+    char *ptr2;
+    size_t len = 0;
+
+    if (!str) {
+        return 0;
+    }
+    for (ptr = str; *ptr; ++ptr, ++len) {
+        if ((unsigned char)*ptr < 32 || *ptr == '\"' || *ptr == '\\') {
+            len++;
+        }
+    }
+
+    ptr2 = ensure(p, len + 2);
+    if (!ptr2) {
+        return -1;
+    }
+    ptr = str;
+    *ptr2++ = '\"';
+    while (*ptr) {
+        if ((unsigned char)*ptr > 31 && *ptr != '\"' && *ptr != '\\') {
+            *ptr2++ = *ptr++;
+        } else {
+            *ptr2++ = '\\';
+            switch (*ptr++) {
+            case '\\':
+                *ptr2++ = '\\';
+                break;
+            case '\"':
+                *ptr2++ = '\"';
+                break;
+            case '\b':
+                *ptr2++ = 'b';
+                break;
+            case '\f':
+                *ptr2++ = 'f';
+                break;
+            case '\n':
+                *ptr2++ = 'n';
+                break;
+            case '\r':
+                *ptr2++ = 'r';
+                break;
+            case '\t':
+                *ptr2++ = 't';
+                break;
+            default:
+                ptr2--;
+                break; /* eviscerate with prejudice. */
+            }
+        }
+    }
+    *ptr2++ = '\"';
+    p->offset = ptr2 - p->buffer;
+    return 0;
+}
+
+/* Predeclare these prototypes. */
+static const char *parse_value(parse_ctx *ctx, cJSON *item, const char *value);
+static int print_value(cJSON *item, int depth, int fmt, printbuffer *p);
+static const char *parse_array(parse_ctx *ctx, cJSON *item, const char *value);
+static int print_array(cJSON *item, int depth, int fmt, printbuffer *p);
+static const char *parse_object(parse_ctx *ctx, cJSON *item, const char *value);
+static int print_object(cJSON *item, int depth, int fmt, printbuffer *p);
+
+/* Utility to jump whitespace and cr/lf */
+static const char *skip(parse_ctx *ctx, const char *in)
+{
+    while (in && in < ctx->end && *in && (unsigned char)*in <= 32) {
+        in++;
+    }
+    return in;
+}
+
+/* Parse an object - create a new root, and populate. */
+cJSON *cJSON_Parse(const char *value)
+{
+    return cJSON_ParseWithLength(value, strlen(value));
+}
+
+cJSON *cJSON_ParseWithLength(const char *value, size_t length)
+{
+    return cJSON_ParseWithAllocator(value, length, NULL);
+}
+
+cJSON *cJSON_ParseWithAllocator(const char *value, size_t length,
+                                const cJSON_Allocator *allocator)
+{
+    parse_ctx ctx;
+    cJSON *c = alloc_new_item(allocator);
+    if (!c) {
+        return NULL; /* memory fail */
+    }
+
+    ctx.arena = NULL;
+    ctx.allocator = allocator;
+    ctx.end = value + length;
+    ctx.insitu = 0;
+    ctx.depth = 0;
+    if (!parse_value(&ctx, c, skip(&ctx, value))) {
+        cJSON_Delete(c);
+        return NULL;
+    }
+    return c;
+}
+
+/* Parse into the arena, giving back the space used on failure. */
+static cJSON *parse_into_arena(parse_ctx *ctx, const char *value)
+{
+    cJSON *c;
+    /* Remember where we started so that a failed parse doesn't
+       consume any space */
+    cJSON_Slab *mark = ctx->arena->current;
+    size_t used = mark ? mark->used : 0;
+
+    c = ctx_new_item(ctx);
+    if (c && parse_value(ctx, c, skip(ctx, value))) {
+        return c;
+    }
+
+    if (mark) {
+        ctx->arena->current = mark;
+        mark->used = used;
+    } else {
+        cJSON_ResetArena(ctx->arena);
+    }
+    return NULL;
+}
+
+cJSON *cJSON_ParseWithArena(const char *value, cJSON_Arena *arena)
+{
+    parse_ctx ctx;
+    ctx.arena = arena;
+    ctx.allocator = NULL;
+    ctx.end = value + strlen(value);
+    ctx.insitu = 0;
+    ctx.depth = 0;
+    return parse_into_arena(&ctx, value);
+}
+
+cJSON *cJSON_ParseInSitu(char *buffer, size_t length, cJSON_Arena *arena)
+{
+    parse_ctx ctx;
+    cJSON *c;
+
+    ctx.arena = arena;
+    ctx.allocator = NULL;
+    ctx.end = buffer + length;
+    ctx.insitu = 1;
+    ctx.depth = 0;
+    if (arena) {
+        return parse_into_arena(&ctx, buffer);
+    }
+
+    c = cJSON_New_Item();
+    if (!c) {
+        return NULL; /* memory fail */
+    }
+    if (!parse_value(&ctx, c, skip(&ctx, buffer))) {
+        cJSON_Delete(c);
+        return NULL;
+    }
+    return c;
+}
+
+/* Render a cJSON item/entity/structure to text. */
+char *cJSON_PrintWithAllocator(cJSON *item, int fmt,
+                               const cJSON_Allocator *allocator, size_t *size)
+{
+    printbuffer p;
+    memset(&p, 0, sizeof(p));
+    p.allocator = allocator;
+    if (print_value(item, 0, fmt, &p) == -1 || append_char(&p, 0) == -1) {
+        if (p.buffer) {
+            alloc_free(allocator, p.buffer, p.length);
+        }
+        return NULL;
+    }
+    if (size) {
+        *size = p.length;
+    }
+    return p.buffer;
+}
+
+char *cJSON_Print(cJSON *item)
+{
+    return cJSON_PrintWithAllocator(item, 1, NULL, NULL);
+}
+
+char *cJSON_PrintUnformatted(cJSON *item)
+{
+    return cJSON_PrintWithAllocator(item, 0, NULL, NULL);
+}
+
+int cJSON_PrintToBuffer(cJSON *item, char *buf, size_t len, int fmt)
+{
+    printbuffer p;
+    p.buffer = buf;
+    p.length = len;
+    p.offset = 0;
+    p.noalloc = 1;
+    p.allocator = NULL;
+    if (print_value(item, 0, fmt, &p) == -1 || append_char(&p, 0) == -1) {
+        return -1;
+    }
+    return 0;
+}
+
+void cJSON_Free(char *ptr)
+{
+    cJSON_free(ptr);
+}
+
+/* Parser core - when encountering text, process appropriately. */
+static const char *parse_value(parse_ctx *ctx, cJSON *item, const char *value)
+{
+    if (!value || value >= ctx->end) {
+        return NULL; /* Fail on null. */
+    }
+    if (*value == '\"') {
+        return parse_string(ctx, item, value);
+    }
+    if (*value == '-' || (*value >= '0' && *value <= '9')) {
+        return parse_number(ctx, item, value);
+    }
+    if (*value == '[' || *value == '{') {
+        if (ctx->depth >= CJSON_NESTING_LIMIT) {
+            return NULL; /* too deep */
+        }
+        ++ctx->depth;
+        value = (*value == '[') ? parse_array(ctx, item, value)
+                                : parse_object(ctx, item, value);
+        --ctx->depth;
+        return value;
+    }
+    if (can_read(ctx, value, 4) && !strncmp(value, "null", 4)) {
+        item->type = cJSON_NULL;
+        return value + 4;
+    }
+    if (can_read(ctx, value, 5) && !strncmp(value, "false", 5)) {
+        item->type = cJSON_False;
+        return value + 5;
+    }
+    if (can_read(ctx, value, 4) && !strncmp(value, "true", 4)) {
+        item->type = cJSON_True;
+        item->valueint = 1;
+        return value + 4;
+    }
+
+    return NULL; /* failure. */
+}
+
+/* Render a value to text. */
+static int print_value(cJSON *item, int depth, int fmt, printbuffer *p)
+{
+    if (!item) {
+        return -1;
+    }
+    switch ((item->type) & 255) {
+    case cJSON_NULL:
+        return append(p, "null", 4);
+    case cJSON_False:
+        return append(p, "false", 5);
+    case cJSON_True:
+        return append(p, "true", 4);
+    case cJSON_Number:
+        return print_number(item, p);
+    case cJSON_String:
+        return print_string_ptr(item->valuestring, p);
+    case cJSON_Array:
+        return print_array(item, depth, fmt, p);
+    case cJSON_Object:
+        return print_object(item, depth, fmt, p);
+    }
+    return -1;
+}
+
+/* Build an array from input text. */
+static const char *parse_array(parse_ctx *ctx, cJSON *item, const char *value)
+{
+    cJSON *child;
+    if (*value != '[') {
+        return NULL; /* not an array! */
+    }
+
+    item->type = cJSON_Array;
+    value = skip(ctx, value + 1);
+    if (peek(ctx, value, ']')) {
+        return value + 1; /* empty array. */
+    }
+
+    item->child = child = ctx_new_item(ctx);
+    if (!item->child) {
+        return NULL; /* memory fail */
+    }
+    value = skip(ctx, parse_value(ctx, child, skip(ctx, value))); /* skip any spacing, get the value. */
+    if (!value) {
+        return NULL;
+    }
+
+    while (peek(ctx, value, ',')) {
+        cJSON *new_item;
+        if (!(new_item = ctx_new_item(ctx))) {
+            return NULL; /* memory fail */
+        }
+        child->next = new_item;
+        new_item->prev = child;
+        child = new_item;
+        value = skip(ctx, parse_value(ctx, child, skip(ctx, value + 1)));
+        if (!value) {
+            return NULL; /* memory fail */
+        }
+    }
+
+    if (peek(ctx, value, ']')) {
+        return value + 1; /* end of array */
+    }
+    return NULL; /* malformed. */
+}
+
+/* Render an array to text */
+static int print_array(cJSON *item, int depth, int fmt, printbuffer *p)
+{
+    cJSON *child;
+
+    if (append_char(p, '[') == -1) {
+        return -1;
+    }
+    for (child = item->child; child; child = child->next) {
+        if (print_value(child, depth + 1, fmt, p) == -1) {
+            return -1;
+        }
+        if (child->next && append(p, ", ", fmt ? 2 : 1) == -1) {
+            return -1;
+        }
+    }
+    return append_char(p, ']');
+}
+
+/* Parse a "name":value pair of an object into child. */
+static const char *parse_member(parse_ctx *ctx, cJSON *child, const char *value)
+{
+    /* An in-situ key points into the input buffer; flag it as soon as
+       it is in place (and again after the value has set the type) so
+       that cJSON_Delete never frees it, even for a partial parse. */
+    int flags = (ctx->insitu && !ctx->arena) ? cJSON_StringIsConst : 0;
+
+    if (!peek(ctx, value, '\"')) {
+        return NULL; /* fail! */
+    }
+    value = skip(ctx, parse_string(ctx, child, value));
+    if (!value) {
+        return NULL;
+    }
+    child->string = child->valuestring;
+    child->valuestring = 0;
+    child->type |= flags;
+    if (!peek(ctx, value, ':')) {
+        return NULL; /* fail! */
+    }
+    value = parse_value(ctx, child, skip(ctx, value + 1)); /* skip any spacing, get the value. */
+    child->type |= flags;
+    return skip(ctx, value);
+}
+
+/* Build an object from the text. */
+static const char *parse_object(parse_ctx *ctx, cJSON *item, const char *value)
+{
+    cJSON *child;
+    if (*value != '{') {
+        return NULL; /* not an object! */
+    }
+
+    item->type = cJSON_Object;
+    value = skip(ctx, value + 1);
+    if (peek(ctx, value, '}')) {
+        return value + 1; /* empty array. */
+    }
+
+    item->child = child = ctx_new_item(ctx);
+    if (!item->child) {
+        return NULL; /* memory fail */
+    }
+    value = parse_member(ctx, child, skip(ctx, value));
+    if (!value) {
+        return NULL;
+    }
+
+    while (peek(ctx, value, ',')) {
+        cJSON *new_item;
+        if (!(new_item = ctx_new_item(ctx))) {
+            return NULL; /* memory fail */
+        }
+        child->next = new_item;
+        new_item->prev = child;
+        child = new_item;
+        value = parse_member(ctx, child, skip(ctx, value + 1));
+        if (!value) {
+            return NULL;
+        }
+    }
+
+    if (peek(ctx, value, '}')) {
+        return value + 1; /* end of array */
+    }
+
+    return NULL; /* malformed. */
+}
+
+/* Render an object to text. */
+static int print_object(cJSON *item, int depth, int fmt, printbuffer *p)
+{
+    cJSON *child;
+
+    depth++;
+    if (append(p, "{\n", fmt ? 2 : 1) == -1) {
+        return -1;
+    }
+    for (child = item->child; child; child = child->next) {
+        if (fmt && append_tabs(p, depth) == -1) {
+            return -1;
+        }
+        if (print_string_ptr(child->string, p) == -1 ||
+            append(p, ":\t", fmt ? 2 : 1) == -1 ||
+            print_value(child, depth, fmt, p) == -1) {
+            return -1;
+        }
+        if (child->next && append_char(p, ',') == -1) {
+            return -1;
+        }
+        if (fmt && append_char(p, '\n') == -1) {
+            return -1;
+        }
+    }
+    if (fmt && append_tabs(p, depth - 1) == -1) {
+        return -1;
+    }
+    return append_char(p, '}');
+}
+
+/* Get Array size/item / object item. */
+int cJSON_GetArraySize(cJSON *array)
+{
+    cJSON *c = array->child;
+    int i = 0;
+    if (index_ready(array)) {
+        return array->index->count;
+    }
+    while (c) {
+        i++, c = c->next;
+    }
+    return i;
+}
+
+cJSON *cJSON_GetArrayItem(cJSON *array, int item)
+{
+    cJSON *c = array->child;
+    if (item < 0) {
+        return NULL;
+    }
+    if (index_ready(array)) {
+        if (item >= array->index->count) {
+            return NULL;
+        }
+        return array->index->items[item];
+    }
+    while (c && item > 0) {
+        item--, c = c->next;
+    }
+    return c;
+}
+
+static cJSON *get_object_item(cJSON *object, const char *string, int nocase)
+{
+    cJSON *c = object->child;
+    if (string && index_ready(object) && object->index->exact) {
+        return index_table(object->index, nocase)[index_find(object->index, string, nocase)];
+    }
+    if (nocase) {
+        while (c && cJSON_strcasecmp(c->string, string)) {
+            c = c->next;
+        }
+    } else {
+        while (c && (!c->string || !string || strcmp(c->string, string))) {
+            c = c->next;
+        }
+    }
+    return c;
+}
+
+cJSON *cJSON_GetObjectItem(cJSON *object, const char *string)
+{
+    return get_object_item(object, string, 1);
+}
+
+cJSON *cJSON_GetObjectItemCaseSensitive(cJSON *object, const char *string)
+{
+    return get_object_item(object, string, 0);
+}
+
+int cJSON_EnableIndex(cJSON *item)
+{
+    if (!item->index) {
+        item->index = cJSON_calloc(1, sizeof(cJSON_Index));
+        if (!item->index) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void cJSON_DisableIndex(cJSON *item)
+{
+    index_free(item->index);
+    item->index = NULL;
+}
+
+/* JSON Pointer */
+typedef struct {
+    const char *name; /* Unescaped */
+    size_t hash; /* index_hash(name, 0) */
+    int index; /* The array index, or -1 if the name isn't one */
+} path_segment;
+
+struct cJSON_Path {
+    int count;
+    path_segment *segments;
+    /* followed by the segments and then their names */
+};
+
+static int path_array_index(const char *name)
+{
+    long value = 0;
+    if (!*name || (name[0] == '0' && name[1])) {
+        return -1;
+    }
+    for (; *name; ++name) {
+        if (*name < '0' || *name > '9') {
+            return -1;
+        }
+        value = value * 10 + (*name - '0');
+        if (value > INT_MAX) {
+            return -1;
+        }
+    }
+    return (int)value;
+}
+
+cJSON_Path *cJSON_CompilePath(const char *pointer)
+{
+    cJSON_Path *path;
+    const char *ptr;
+    char *names;
+    int count = 0;
+    int ii;
+
+    if (*pointer && *pointer != '/') {
+        return NULL;
+    }
+    for (ptr = pointer; *ptr; ++ptr) {
+        if (*ptr == '/') {
+            ++count;
+        } else if (*ptr == '~' && ptr[1] != '0' && ptr[1] != '1') {
+            return NULL;
+        }
+    }
+
+    path = cJSON_malloc(sizeof(cJSON_Path) + count * sizeof(path_segment) +
+                        strlen(pointer) + 1);
+    if (!path) {
+        return NULL;
+    }
+    path->count = count;
+    path->segments = (path_segment *)(path + 1);
+    names = (char *)(path->segments + count);
+
+    ptr = pointer;
+    for (ii = 0; ii < count; ++ii) {
+        path_segment *segment = &path->segments[ii];
+        segment->name = names;
+        for (++ptr; *ptr && *ptr != '/'; ++ptr) {
+            if (*ptr == '~') {
+                ++ptr;
+                *names++ = (*ptr == '0') ? '~' : '/';
+            } else {
+                *names++ = *ptr;
+            }
+        }
+        *names++ = '\0';
+        segment->hash = index_hash(segment->name, 0);
+        segment->index = path_array_index(segment->name);
+    }
+    return path;
+}
+
+void cJSON_DeletePath(cJSON_Path *path)
+{
+    cJSON_free(path);
+}
+
+/* index_find with the hash of the name already known */
+static cJSON *index_find_hashed(cJSON_Index *index, const path_segment *segment)
+{
+    size_t slot = segment->hash & index->mask;
+    while (index->exact[slot] && strcmp(index->exact[slot]->string, segment->name)) {
+        slot = (slot + 1) & index->mask;
+    }
+    return index->exact[slot];
+}
+
+static cJSON *path_child(cJSON *item, const path_segment *segment)
+{
+    cJSON *c;
+    int type = item->type & 255;
+    if (type == cJSON_Object) {
+        if (index_ready(item) && item->index->exact) {
+            return index_find_hashed(item->index, segment);
+        }
+        for (c = item->child; c; c = c->next) {
+            if (c->string && !strcmp(c->string, segment->name)) {
+                return c;
+            }
+        }
+    } else if (type == cJSON_Array && segment->index >= 0) {
+        return cJSON_GetArrayItem(item, segment->index);
+    }
+    return NULL;
+}
+
+cJSON *cJSON_GetPath(cJSON *item, const cJSON_Path *path)
+{
+    int ii;
+    for (ii = 0; item && ii < path->count; ++ii) {
+        item = path_child(item, &path->segments[ii]);
+    }
+    return item;
+}
+
+cJSON *cJSON_GetPointer(cJSON *item, const char *pointer)
+{
+    cJSON_Path *path = cJSON_CompilePath(pointer);
+    cJSON *ret = NULL;
+    if (path) {
+        ret = cJSON_GetPath(item, path);
+        cJSON_DeletePath(path);
+    }
+    return ret;
+}
+
+typedef struct {
+    const cJSON_Path *const *paths;
+    cJSON **results;
+    int found;
+} path_walk;
+
+/* Does the child at position pos of an object (hash is that of its
+   name) or array match the segment? */
+static int path_matches(const path_segment *segment, int type, cJSON *child,
+                        int pos, size_t hash)
+{
+    if (type == cJSON_Object) {
+        return segment->hash == hash && !strcmp(segment->name, child->string);
+    }
+    return segment->index == pos;
+}
+
+/* Follow the active paths (which have matched up to depth) below item.
+   The list is consumed, and the space after it is used for the lists
+   of the children. */
+static void path_descend(path_walk *walk, cJSON *item, int depth, int *active,
+                         int nactive)
+{
+    int *next = active + nactive;
+    int type = item->type & 255;
+    cJSON *c;
+    int pos;
+    int ii;
+
+    /* The paths which end here */
+    for (ii = 0; ii < nactive;) {
+        if (walk->paths[active[ii]]->count == depth) {
+            walk->results[active[ii]] = item;
+            ++walk->found;
+            active[ii] = active[--nactive];
+        } else {
+            ++ii;
+        }
+    }
+    if (nactive == 0 || (type != cJSON_Object && type != cJSON_Array)) {
+        return;
+    }
+
+    if (index_ready(item)) {
+        /* Direct lookups are cheaper than the scan. The paths with the
+           same segment here lead to the same child, so it is looked up
+           once and they are followed together. */
+        while (nactive > 0) {
+            const path_segment *segment =
+                &walk->paths[active[0]]->segments[depth];
+            int nnext = 0;
+            c = path_child(item, segment);
+            for (ii = 0; ii < nactive;) {
+                const path_segment *other =
+                    &walk->paths[active[ii]]->segments[depth];
+                if (other->hash == segment->hash &&
+                    !strcmp(other->name, segment->name)) {
+                    next[nnext++] = active[ii];
+                    active[ii] = active[--nactive];
+                } else {
+                    ++ii;
+                }
+            }
+            if (c) {
+                path_descend(walk, c, depth + 1, next, nnext);
+            }
+        }
+        return;
+    }
+
+    for (c = item->child, pos = 0; c && nactive > 0; c = c->next, ++pos) {
+        size_t hash = 0;
+        int nnext = 0;
+        if (type == cJSON_Object) {
+            if (!c->string) {
+                continue;
+            }
+            hash = index_hash(c->string, 0);
+        }
+        /* A path only takes the first match (duplicate names) */
+        for (ii = 0; ii < nactive;) {
+            const cJSON_Path *path = walk->paths[active[ii]];
+            if (path_matches(&path->segments[depth], type, c, pos, hash)) {
+                next[nnext++] = active[ii];
+                active[ii] = active[--nactive];
+            } else {
+                ++ii;
+            }
+        }
+        if (nnext) {
+            path_descend(walk, c, depth + 1, next, nnext);
+        }
+    }
+}
+
+int cJSON_GetPaths(cJSON *item, const cJSON_Path *const *paths, int count,
+                   cJSON **results)
+{
+    path_walk walk;
+    int *active;
+    int depth = 0;
+    int ii;
+
+    for (ii = 0; ii < count; ++ii) {
+        results[ii] = NULL;
+        if (paths[ii]->count > depth) {
+            depth = paths[ii]->count;
+        }
+    }
+    if (count == 0) {
+        return 0;
+    }
+
+    /* Every level of the descent needs at most count entries */
+    active = cJSON_malloc((size_t)count * (depth + 1) * sizeof(int));
+    if (!active) {
+        return -1;
+    }
+    for (ii = 0; ii < count; ++ii) {
+        active[ii] = ii;
+    }
+    walk.paths = paths;
+    walk.results = results;
+    walk.found = 0;
+    path_descend(&walk, item, 0, active, count);
+    cJSON_free(active);
+    return walk.found;
+}
+
+/* Utility for array list handling. */
+static void suffix_object(cJSON *prev, cJSON *item)
+{
+    prev->next = item;
+    item->prev = prev;
+}
+
+/* Utility for handling references. */
+static cJSON *create_reference(cJSON *item)
+{
+    cJSON *ref = cJSON_New_Item();
+    memcpy(ref, item, sizeof(cJSON));
+    ref->string = 0;
+    ref->type = (ref->type & ~cJSON_StringIsConst) | cJSON_IsReference;
+    ref->next = ref->prev = 0;
+    ref->index = 0;
+    ref->allocator = NULL;
+    return ref;
+}
+
+/* Add item to array/object. */
+void cJSON_AddItemToArray(cJSON *array, cJSON *item)
+{
+    cJSON *c = array->child;
+    if (!c) {
+        array->child = item;
+    } else {
+        if (array->index && array->index->valid && array->index->count) {
+            c = array->index->items[array->index->count - 1];
+        }
+        while (c && c->next) {
+            c = c->next;
+        }
+        suffix_object(c, item);
+    }
+    index_append(array, item);
+}
+
+void cJSON_AddItemToObject(cJSON *object, const char *string, cJSON *item)
+{
+    if (!(item->type & cJSON_StringIsConst) && item->string) {
+        alloc_free_string(item->allocator, item->string);
+    }
+    item->string = alloc_strdup(item->allocator, string);
+    item->type &= ~cJSON_StringIsConst;
+    cJSON_AddItemToArray(object, item);
+}
+
+void cJSON_AddItemReferenceToArray(cJSON *array, cJSON *item)
+{
+    cJSON_AddItemToArray(array, create_reference(item));
+}
+
+void cJSON_AddItemReferenceToObject(cJSON *object, const char *string, cJSON *item)
+{
+    cJSON_AddItemToObject(object, string, create_reference(item));
+}
+
+/* Unlink the which'th child c of array */
+static cJSON *detach_item(cJSON *array, int which, cJSON *c)
+{
+    index_remove(array, which, c);
+    if (c->prev) {
+        c->prev->next = c->next;
+    }
+    if (c->next) {
+        c->next->prev = c->prev;
+    }
+    if (c == array->child) {
+        array->child = c->next;
+    }
+    c->prev = c->next = 0;
+    return c;
+}
+
+cJSON *cJSON_DetachItemFromArray(cJSON *array, int which)
+{
+    cJSON *c = array->child;
+    int i = 0;
+    if (which < 0) {
+        which = 0;
+    }
+    if (index_ready(array)) {
+        if (which >= array->index->count) {
+            return NULL;
+        }
+        return detach_item(array, which, array->index->items[which]);
+    }
+    while (c && i < which) {
+        c = c->next, i++;
+    }
+    if (!c) {
+        return NULL;
+    }
+    return detach_item(array, i, c);
+}
+
+void cJSON_DeleteItemFromArray(cJSON *array, int which)
+{
+    cJSON_Delete(cJSON_DetachItemFromArray(array, which));
+}
+
+cJSON *cJSON_DetachItemFromObject(cJSON *object, const char *string)
+{
+    cJSON *c = get_object_item(object, string, 1);
+    if (c) {
+        return detach_item(object, index_position(object, c), c);
+    }
+    return NULL;
+}
+
+void cJSON_DeleteItemFromObject(cJSON *object, const char *string)
+{
+    cJSON_Delete(cJSON_DetachItemFromObject(object, string));
+}
+
+/* Replace array/object items with new ones. */
+void cJSON_ReplaceItemInArray(cJSON *array, int which, cJSON *newitem)
+{
+    cJSON *c = array->child;
+    int i = 0;
+    if (which < 0) {
+        which = 0;
+    }
+    if (index_ready(array)) {
+        if (which >= array->index->count) {
+            return;
+        }
+        c = array->index->items[which];
+        i = which;
+    } else {
+        while (c && i < which) {
+            c = c->next, i++;
+        }
+        if (!c) {
+            return;
+        }
+    }
+    index_replace(array, i, c, newitem);
+    newitem->next = c->next;
+    newitem->prev = c->prev;
+    if (newitem->next) {
+        newitem->next->prev = newitem;
+    }
+    if (c == array->child) {
+        array->child = newitem;
+    } else {
+        newitem->prev->next = newitem;
+    }
+    c->next = c->prev = 0;
+    cJSON_Delete(c);
+}
+
+void cJSON_ReplaceItemInObject(cJSON *object, const char *string, cJSON *newitem)
+{
+    cJSON *c = get_object_item(object, string, 1);
+    if (c) {
+        if (!(newitem->type & cJSON_StringIsConst) && newitem->string) {
+            alloc_free_string(newitem->allocator, newitem->string);
+        }
+        newitem->string = alloc_strdup(newitem->allocator, string);
+        newitem->type &= ~cJSON_StringIsConst;
+        cJSON_ReplaceItemInArray(object, index_position(object, c), newitem);
+    }
+}
+
+/* Create basic types: */
+cJSON *cJSON_CreateNull(void)
+{
+    cJSON *item = cJSON_New_Item();
+    item->type = cJSON_NULL;
+    return item;
+}
+
+cJSON *cJSON_CreateTrue(void)
+{
+    cJSON *item = cJSON_New_Item();
+    item->type = cJSON_True;
+    return item;
+}
+
+cJSON *cJSON_CreateFalse(void)
+{
+    cJSON *item = cJSON_New_Item();
+    item->type = cJSON_False;
+    return item;
+}
+
+cJSON *cJSON_CreateNumber(double num)
+{
+    cJSON *item = cJSON_New_Item();
+    item->type = cJSON_Number;
+    set_number(item, num);
+    return item;
+}
+
+cJSON *cJSON_CreateInt64(int64_t num)
+{
+    cJSON *item = cJSON_New_Item();
+    item->type = cJSON_Number;
+    set_int64(item, num);
+    return item;
+}
+
+cJSON *cJSON_CreateString(const char *string)
+{
+    cJSON *item = cJSON_New_Item();
+    item->type = cJSON_String;
+    item->valuestring = cJSON_strdup(string);
+    return item;
+}
+
+cJSON *cJSON_CreateArray(void)
+{
+    cJSON *item = cJSON_New_Item();
+    item->type = cJSON_Array;
+    return item;
+}
+
+cJSON *cJSON_CreateObject(void)
+{
+    cJSON *item = cJSON_New_Item();
+    item->type = cJSON_Object;
+    return item;
+}
+
+cJSON *cJSON_CreateWithAllocator(int type, const cJSON_Allocator *allocator)
+{
+    cJSON *item = alloc_new_item(allocator);
+    if (item) {
+        item->type = type;
+    }
+    return item;
+}
+
+cJSON *cJSON_CreateNumberWithAllocator(double num, const cJSON_Allocator *allocator)
+{
+    cJSON *item = cJSON_CreateWithAllocator(cJSON_Number, allocator);
+    if (item) {
+        set_number(item, num);
+    }
+    return item;
+}
+
+cJSON *cJSON_CreateInt64WithAllocator(int64_t num, const cJSON_Allocator *allocator)
+{
+    cJSON *item = cJSON_CreateWithAllocator(cJSON_Number, allocator);
+    if (item) {
+        set_int64(item, num);
+    }
+    return item;
+}
+
+cJSON *cJSON_CreateStringWithAllocator(const char *string,
+                                       const cJSON_Allocator *allocator)
+{
+    cJSON *item = cJSON_CreateWithAllocator(cJSON_String, allocator);
+    if (item && !(item->valuestring = alloc_strdup(allocator, string))) {
+        alloc_free(allocator, item, sizeof(cJSON));
+        return NULL;
+    }
+    return item;
+}
+
+/* Create Arrays: */
+cJSON *cJSON_CreateIntArray(int *numbers, int count)
+{
+    int i;
+    cJSON *n = 0, *p = 0, *a = cJSON_CreateArray();
+    for (i = 0; i < count; i++) {
+        n = cJSON_CreateNumber(numbers[i]);
+        if (!i) {
+            a->child = n;
+        } else {
+            suffix_object(p, n);
+        }
+        p = n;
+    }
+    return a;
+}
+
+cJSON *cJSON_CreateFloatArray(float *numbers, int count)
+{
+    int i;
+    cJSON *n = 0, *p = 0, *a = cJSON_CreateArray();
+    for (i = 0; i < count; i++) {
+        n = cJSON_CreateNumber(numbers[i]);
+        if (!i) {
+            a->child = n;
+        } else {
+            suffix_object(p, n);
+        }
+        p = n;
+    }
+    return a;
+}
+
+cJSON *cJSON_CreateDoubleArray(double *numbers, int count)
+{
+    int i;
+    cJSON *n = 0, *p = 0, *a = cJSON_CreateArray();
+    for (i = 0; i < count; i++) {
+        n = cJSON_CreateNumber(numbers[i]);
+        if (!i) {
+            a->child = n;
+        } else {
+            suffix_object(p, n);
+        }
+        p = n;
+    }
+    return a;
+}
+
+cJSON *cJSON_CreateStringArray(const char **strings, int count)
+{
+    int i;
+    cJSON *n = 0, *p = 0, *a = cJSON_CreateArray();
+    for (i = 0; i < count; i++) {
+        n = cJSON_CreateString(strings[i]);
+        if (!i) {
+            a->child = n;
+        } else {
+            suffix_object(p, n);
+        }
+        p = n;
+    }
+    return a;
+}
+
+/* The streaming parser. It keeps the nesting in an explicit stack, and
+   buffers a token which is split between two chunks; complete scalars
+   are decoded by parse_value (in place, into the token buffer for
+   strings) into an item on the stack. */
+enum {
+    SAX_VALUE, /* Expect a value (or ']' if allow_close) */
+    SAX_KEY, /* Expect a name (or '}' if allow_close) */
+    SAX_COLON,
+    SAX_NEXT, /* Expect ',' or the end of the container */
+    SAX_DONE,
+    SAX_ERROR
+};
+
+enum {
+    SAX_TOKEN_NONE,
+    SAX_TOKEN_STRING,
+    SAX_TOKEN_NUMBER,
+    SAX_TOKEN_LITERAL
+};
+
+struct cJSON_Sax {
+    cJSON_SaxCallbacks callbacks;
+    void *ctx;
+    int state;
+    int allow_close;
+    char *stack; /* '{' or '[' for each open container */
+    size_t depth;
+    size_t stack_size;
+    int token_kind; /* The kind of the token in token, if any */
+    int escape; /* The last byte of a partial string was a backslash */
+    char *token;
+    size_t token_len;
+    size_t token_size;
+};
+
+cJSON_Sax *cJSON_CreateSax(const cJSON_SaxCallbacks *callbacks, void *ctx)
+{
+    cJSON_Sax *sax = cJSON_calloc(1, sizeof(cJSON_Sax));
+    if (sax) {
+        sax->callbacks = *callbacks;
+        sax->ctx = ctx;
+        sax->state = SAX_VALUE;
+    }
+    return sax;
+}
+
+void cJSON_DeleteSax(cJSON_Sax *sax)
+{
+    if (sax) {
+        cJSON_free(sax->stack);
+        cJSON_free(sax->token);
+        cJSON_free(sax);
+    }
+}
+
+/* Make room for size bytes in the buffer of *capacity bytes at *buffer */
+static int sax_reserve(char **buffer, size_t *capacity, size_t used, size_t size)
+{
+    char *newbuffer;
+    size_t newsize = *capacity ? *capacity : 64;
+    if (size <= *capacity) {
+        return 0;
+    }
+    while (newsize < size) {
+        newsize *= 2;
+    }
+    newbuffer = cJSON_malloc(newsize);
+    if (!newbuffer) {
+        return -1;
+    }
+    if (used) {
+        memcpy(newbuffer, *buffer, used);
+    }
+    cJSON_free(*buffer);
+    *buffer = newbuffer;
+    *capacity = newsize;
+    return 0;
+}
+
+static int sax_append_token(cJSON_Sax *sax, const char *data, size_t len)
+{
+    /* Leave room for a terminator */
+    if (sax_reserve(&sax->token, &sax->token_size, sax->token_len,
+                    sax->token_len + len + 1) == -1) {
+        return -1;
+    }
+    memcpy(sax->token + sax->token_len, data, len);
+    sax->token_len += len;
+    return 0;
+}
+
+/* Return the end of the token of the given kind which continues at
+   ptr, and set *complete if it ends before end. */
+static const char *sax_scan(cJSON_Sax *sax, int kind, const char *ptr,
+                            const char *end, int *complete)
+{
+    *complete = 1;
+    switch (kind) {
+    case SAX_TOKEN_STRING:
+        for (; ptr < end; ++ptr) {
+            if (sax->escape) {
+                sax->escape = 0;
+            } else if (*ptr == '\\') {
+                sax->escape = 1;
+            } else if (*ptr == '\"') {
+                return ptr + 1;
+            }
+        }
+        break;
+    case SAX_TOKEN_NUMBER:
+        for (; ptr < end; ++ptr) {
+            if (!((*ptr >= '0' && *ptr <= '9') || *ptr == '-' || *ptr == '+' ||
+                  *ptr == '.' || *ptr == 'e' || *ptr == 'E')) {
+                return ptr;
+            }
+        }
+        break;
+    default:
+        for (; ptr < end; ++ptr) {
+            if (*ptr < 'a' || *ptr > 'z') {
+                return ptr;
+            }
+        }
+        break;
+    }
+    *complete = 0;
+    return ptr;
+}
+
+/* The end of a value: see what comes next */
+static void sax_after_value(cJSON_Sax *sax)
+{
+    sax->state = sax->depth ? SAX_NEXT : SAX_DONE;
+    sax->allow_close = 0;
+}
+
+/* Decode the complete token of len bytes at tok (which must be writable
+   for strings) and deliver it. */
+static int sax_token(cJSON_Sax *sax, const char *tok, size_t len)
+{
+    parse_ctx ctx;
+    cJSON item;
+
+    memset(&item, 0, sizeof(item));
+    ctx.arena = NULL;
+    ctx.allocator = NULL;
+    ctx.end = tok + len;
+    ctx.insitu = 1;
+    ctx.depth = 0;
+    if (parse_value(&ctx, &item, tok) != tok + len) {
+        return -1;
+    }
+    item.type &= 255;
+
+    if (sax->state == SAX_KEY) {
+        if (item.type != cJSON_String) {
+            return -1;
+        }
+        if (sax->callbacks.key && sax->callbacks.key(sax->ctx, item.valuestring)) {
+            return -1;
+        }
+        sax->state = SAX_COLON;
+        return 0;
+    }
+    if (sax->callbacks.value && sax->callbacks.value(sax->ctx, &item)) {
+        return -1;
+    }
+    sax_after_value(sax);
+    return 0;
+}
+
+/* Deliver the token collected in the token buffer */
+static int sax_buffered_token(cJSON_Sax *sax)
+{
+    size_t len = sax->token_len;
+    sax->token_kind = SAX_TOKEN_NONE;
+    sax->token_len = 0;
+    return sax_token(sax, sax->token, len);
+}
+
+static int sax_open(cJSON_Sax *sax, char c)
+{
+    if (sax_reserve(&sax->stack, &sax->stack_size, sax->depth, sax->depth + 1) == -1) {
+        return -1;
+    }
+    if (c == '{') {
+        if (sax->callbacks.start_object && sax->callbacks.start_object(sax->ctx)) {
+            return -1;
+        }
+        sax->state = SAX_KEY;
+    } else {
+        if (sax->callbacks.start_array && sax->callbacks.start_array(sax->ctx)) {
+            return -1;
+        }
+        sax->state = SAX_VALUE;
+    }
+    sax->stack[sax->depth++] = c;
+    sax->allow_close = 1;
+    return 0;
+}
+
+static int sax_close(cJSON_Sax *sax, char c)
 {
-    const char *ptr;
-    char *ptr2, *out;
-    int len = 0;
+    if (!sax->depth || sax->stack[sax->depth - 1] != (c == '}' ? '{' : '[')) {
+        return -1;
+    }
+    --sax->depth;
+    if (c == '}') {
+        if (sax->callbacks.end_object && sax->callbacks.end_object(sax->ctx)) {
+            return -1;
+        }
+    } else if (sax->callbacks.end_array && sax->callbacks.end_array(sax->ctx)) {
+        return -1;
+    }
+    sax_after_value(sax);
+    return 0;
+}
 
-    if (!str) {
-        return cJSON_strdup("");
+/* Handle the byte c which isn't part of a token. Returns the kind of
+   token c starts (if any), or -1 on error. */
+static int sax_byte(cJSON_Sax *sax, char c)
+{
+    if (c && (unsigned char)c <= 32) {
+        return SAX_TOKEN_NONE;
     }
-    ptr = str;
-    while (*ptr && ++len) {
-        if ((unsigned char)*ptr < 32 || *ptr == '\"' || *ptr == '\\') {
-            len++;
+    switch (sax->state) {
+    case SAX_VALUE:
+        if (c == '{' || c == '[') {
+            return sax_open(sax, c);
         }
-        ptr++;
+        if (c == ']' && sax->allow_close) {
+            return sax_close(sax, c);
+        }
+        if (c == '\"') {
+            return SAX_TOKEN_STRING;
+        }
+        if (c == '-' || (c >= '0' && c <= '9')) {
+            return SAX_TOKEN_NUMBER;
+        }
+        if (c >= 'a' && c <= 'z') {
+            return SAX_TOKEN_LITERAL;
+        }
+        break;
+    case SAX_KEY:
+        if (c == '\"') {
+            return SAX_TOKEN_STRING;
+        }
+        if (c == '}' && sax->allow_close) {
+            return sax_close(sax, c);
+        }
+        break;
+    case SAX_COLON:
+        if (c == ':') {
+            sax->state = SAX_VALUE;
+            return SAX_TOKEN_NONE;
+        }
+        break;
+    case SAX_NEXT:
+        if (c == ',') {
+            sax->state = (sax->stack[sax->depth - 1] == '{') ? SAX_KEY : SAX_VALUE;
+            return SAX_TOKEN_NONE;
+        }
+        if (c == '}' || c == ']') {
+            return sax_close(sax, c);
+        }
+        break;
     }
+    return -1;
+}
 
-    out = cJSON_malloc(len + 3);
-    ptr2 = out;
-    ptr = str;
-    *ptr2++ = '\"';
-    while (*ptr) {
-        if ((unsigned char)*ptr > 31 && *ptr != '\"' && *ptr != '\\') {
-            *ptr2++ = *ptr++;
+int cJSON_SaxFeed(cJSON_Sax *sax, const char *data, size_t len)
+{
+    const char *ptr = data;
+    const char *end = data + len;
+    const char *start;
+    int complete;
+    int kind;
+
+    while (ptr < end && sax->state != SAX_ERROR) {
+        if (sax->token_kind != SAX_TOKEN_NONE) {
+            /* Finish the token started in an earlier chunk */
+            start = ptr;
+            ptr = sax_scan(sax, sax->token_kind, ptr, end, &complete);
+            if (sax_append_token(sax, start, ptr - start) == -1 ||
+                (complete && sax_buffered_token(sax) == -1)) {
+                sax->state = SAX_ERROR;
+            }
+            continue;
+        }
+
+        kind = sax_byte(sax, *ptr);
+        if (kind == -1) {
+            sax->state = SAX_ERROR;
+        } else if (kind == SAX_TOKEN_NONE) {
+            ptr++;
         } else {
-            *ptr2++ = '\\';
-            switch (*ptr++) {
-            case '\\':
-                *ptr2++ = '\\';
-                break;
-            case '\"':
-                *ptr2++ = '\"';
-                break;
-            case '\b':
-                *ptr2++ = 'b';
-                break;
-            case '\f':
-                *ptr2++ = 'f';
-                break;
-            case '\n':
-                *ptr2++ = 'n';
-                break;
-            case '\r':
-                *ptr2++ = 'r';
-                break;
-            case '\t':
-                *ptr2++ = 't';
-                break;
-            default:
-                ptr2--;
-                break; /* eviscerate with prejudice. */
+            start = ptr;
+            sax->escape = 0;
+            ptr = sax_scan(sax, kind, ptr + (kind == SAX_TOKEN_STRING), end, &complete);
+            if (complete && kind != SAX_TOKEN_STRING) {
+                /* Numbers and literals are decoded without a copy */
+                if (sax_token(sax, start, ptr - start) == -1) {
+                    sax->state = SAX_ERROR;
+                }
+            } else if (sax_append_token(sax, start, ptr - start) == -1) {
+                sax->state = SAX_ERROR;
+            } else if (complete) {
+                if (sax_buffered_token(sax) == -1) {
+                    sax->state = SAX_ERROR;
+                }
+            } else {
+                sax->token_kind = kind;
             }
         }
     }
-    *ptr2++ = '\"';
-    *ptr2++ = 0;
-    return out;
+    return sax->state == SAX_ERROR ? -1 : 0;
 }
-/* Invote print_string_ptr (which is useful) on an item. */
-static char *print_string(cJSON *item)
+
+int cJSON_SaxFinish(cJSON_Sax *sax)
 {
-    return print_string_ptr(item->valuestring);
+    /* The end of the input terminates a number or literal */
+    if (sax->state != SAX_ERROR && sax->token_kind != SAX_TOKEN_NONE) {
+        if (sax->token_kind == SAX_TOKEN_STRING || sax_buffered_token(sax) == -1) {
+            sax->state = SAX_ERROR;
+        }
+    }
+    return sax->state == SAX_DONE ? 0 : -1;
 }
 
-/* Predeclare these prototypes. */
-static const char *parse_value(cJSON *item, const char *value);
-static char *print_value(cJSON *item, int depth, int fmt);
-static const char *parse_array(cJSON *item, const char *value);
-static char *print_array(cJSON *item, int depth, int fmt);
-static const char *parse_object(cJSON *item, const char *value);
-static char *print_object(cJSON *item, int depth, int fmt);
+/* Binary encoding (see cJSON_EncodeBinary in cJSON.h for the layout) */
+#define BINARY_HEADER 16
+#define BINARY_MAX 0xffffffffU
 
-/* Utility to jump whitespace and cr/lf */
-static const char *skip(const char *in)
+static const unsigned char binary_magic[4] = { 'c', 'J', 'B', 1 };
+
+static void put_u32(unsigned char *out, uint32_t value)
 {
-    while (in && (unsigned char)*in <= 32) {
-        in++;
-    }
-    return in;
+    out[0] = (unsigned char)value;
+    out[1] = (unsigned char)(value >> 8);
+    out[2] = (unsigned char)(value >> 16);
+    out[3] = (unsigned char)(value >> 24);
 }
 
-/* Parse an object - create a new root, and populate. */
-cJSON *cJSON_Parse(const char *value)
+static uint32_t get_u32(const unsigned char *in)
 {
-    cJSON *c = cJSON_New_Item();
-    if (!c) {
-        return NULL; /* memory fail */
-    }
+    return (uint32_t)in[0] | ((uint32_t)in[1] << 8) |
+           ((uint32_t)in[2] << 16) | ((uint32_t)in[3] << 24);
+}
 
-    if (!parse_value(c, skip(value))) {
-        cJSON_Delete(c);
-        return NULL;
-    }
-    return c;
+static void put_u64(unsigned char *out, uint64_t value)
+{
+    put_u32(out, (uint32_t)value);
+    put_u32(out + 4, (uint32_t)(value >> 32));
 }
 
-/* Render a cJSON item/entity/structure to text. */
-char *cJSON_Print(cJSON *item)
+static uint64_t get_u64(const unsigned char *in)
 {
-    return print_value(item, 0, 1);
+    return (uint64_t)get_u32(in) | ((uint64_t)get_u32(in + 4) << 32);
 }
 
-char *cJSON_PrintUnformatted(cJSON *item)
+static uint32_t binary_hash(const char *str)
 {
-    return print_value(item, 0, 0);
+    uint32_t hash = 2166136261U;
+    for (; *str; ++str) {
+        hash = (hash ^ (unsigned char)*str) * 16777619U;
+    }
+    return hash;
 }
 
-void cJSON_Free(char *ptr)
+typedef struct {
+    printbuffer out;
+    /* The dictionary: an open addressing table of the names, and the
+       names by their id */
+    const char **table;
+    uint32_t *ids;
+    const char **keys;
+    size_t mask;
+    uint32_t count;
+} binary_encoder;
+
+static int dict_grow(binary_encoder *enc)
 {
-    free(ptr);
+    size_t slots = enc->table ? (enc->mask + 1) * 2 : 64;
+    const char **table = cJSON_calloc(slots, sizeof(char *));
+    uint32_t *ids = cJSON_malloc(slots * sizeof(uint32_t));
+    const char **keys = cJSON_malloc(slots / 2 * sizeof(char *));
+    uint32_t ii;
+    if (!table || !ids || !keys) {
+        cJSON_free(table);
+        cJSON_free(ids);
+        cJSON_free(keys);
+        return -1;
+    }
+    for (ii = 0; ii < enc->count; ++ii) {
+        size_t slot = binary_hash(enc->keys[ii]) & (slots - 1);
+        while (table[slot]) {
+            slot = (slot + 1) & (slots - 1);
+        }
+        table[slot] = enc->keys[ii];
+        ids[slot] = ii;
+        keys[ii] = enc->keys[ii];
+    }
+    cJSON_free(enc->table);
+    cJSON_free(enc->ids);
+    cJSON_free(enc->keys);
+    enc->table = table;
+    enc->ids = ids;
+    enc->keys = keys;
+    enc->mask = slots - 1;
+    return 0;
 }
 
-/* Parser core - when encountering text, process appropriately. */
-static const char *parse_value(cJSON *item, const char *value)
+/* Return the id of the name, adding it to the dictionary if add is set
+   (-1 on memory fail) */
+static int64_t dict_id(binary_encoder *enc, const char *name, int add)
 {
-    if (!value) {
-        return NULL; /* Fail on null. */
-    }
-    if (*value == '\"') {
-        return parse_string(item, value);
+    size_t slot;
+    if (!name) {
+        name = "";
+    }
+    if (add && (!enc->table || (size_t)enc->count * 2 >= enc->mask + 1) &&
+        dict_grow(enc) == -1) {
+        return -1;
+    }
+    slot = binary_hash(name) & enc->mask;
+    while (enc->table[slot]) {
+        if (!strcmp(enc->table[slot], name)) {
+            return enc->ids[slot];
+        }
+        slot = (slot + 1) & enc->mask;
     }
-    if (*value == '-' || (*value >= '0' && *value <= '9')) {
-        return parse_number(item, value);
+    enc->table[slot] = name;
+    enc->ids[slot] = enc->count;
+    enc->keys[enc->count] = name;
+    return enc->count++;
+}
+
+static int collect_names(binary_encoder *enc, cJSON *item)
+{
+    int type = item->type & 255;
+    cJSON *c;
+    if (type != cJSON_Array && type != cJSON_Object) {
+        return 0;
+    }
+    for (c = item->child; c; c = c->next) {
+        if ((type == cJSON_Object && dict_id(enc, c->string, 1) == -1) ||
+            collect_names(enc, c) == -1) {
+            return -1;
+        }
     }
-    if (*value == '[') {
-        return parse_array(item, value);
+    return 0;
+}
+
+/* Reserve size bytes at the end of the output, and return them (they
+   are only valid until the next call) */
+static unsigned char *binary_reserve(binary_encoder *enc, size_t size)
+{
+    unsigned char *out = (unsigned char *)ensure(&enc->out, size);
+    if (!out || enc->out.offset + size > BINARY_MAX) {
+        return NULL;
     }
-    if (*value == '{') {
-        return parse_object(item, value);
+    enc->out.offset += size;
+    return out;
+}
+
+static int encode_string(binary_encoder *enc, char tag, const char *str,
+                         uint32_t hash, int with_hash)
+{
+    size_t len = str ? strlen(str) : 0;
+    /* The dictionary keys don't have a tag */
+    unsigned char *out = binary_reserve(enc, (tag != 0) + 4 + 4 * with_hash +
+                                        len + 1);
+    if (!out) {
+        return -1;
     }
-    if (!strncmp(value, "null", 4)) {
-        item->type = cJSON_NULL;
-        return value + 4;
+    if (tag) {
+        *out++ = (unsigned char)tag;
     }
-    if (!strncmp(value, "false", 5)) {
-        item->type = cJSON_False;
-        return value + 5;
+    put_u32(out, (uint32_t)len);
+    out += 4;
+    if (with_hash) {
+        put_u32(out, hash);
+        out += 4;
     }
-    if (!strncmp(value, "true", 4)) {
-        item->type = cJSON_True;
-        item->valueint = 1;
-        return value + 4;
+    if (len) {
+        memcpy(out, str, len);
     }
-
-    return NULL; /* failure. */
+    out[len] = '\0';
+    return 0;
 }
 
-/* Render a value to text. */
-static char *print_value(cJSON *item, int depth, int fmt)
+static int encode_value(binary_encoder *enc, cJSON *item)
 {
-    char *out = 0;
-    if (!item) {
-        return NULL;
-    }
-    switch ((item->type) & 255) {
-    case cJSON_NULL:
-        out = cJSON_strdup("null");
-        break;
+    int type = item->type & 255;
+    unsigned char *out;
+    size_t entry = type == cJSON_Object ? 8 : 4;
+    size_t table;
+    uint32_t count = 0;
+    uint32_t ii;
+    cJSON *c;
+
+    switch (type) {
     case cJSON_False:
-        out = cJSON_strdup("false");
-        break;
     case cJSON_True:
-        out = cJSON_strdup("true");
-        break;
-    case cJSON_Number:
-        out = print_number(item);
-        break;
+    case cJSON_NULL:
+        if (!(out = binary_reserve(enc, 1))) {
+            return -1;
+        }
+        *out = type == cJSON_False ? 'f' : type == cJSON_True ? 't' : 'n';
+        return 0;
+    case cJSON_Number: {
+        uint64_t bits;
+        if (!(out = binary_reserve(enc, 9))) {
+            return -1;
+        }
+        if (number_is_int64(item)) {
+            out[0] = 'i';
+            put_u64(out + 1, (uint64_t)item->valueint64);
+        } else {
+            out[0] = 'd';
+            memcpy(&bits, &item->valuedouble, sizeof(bits));
+            put_u64(out + 1, bits);
+        }
+        return 0;
+    }
     case cJSON_String:
-        out = print_string(item);
-        break;
+        return encode_string(enc, 's', item->valuestring, 0, 0);
     case cJSON_Array:
-        out = print_array(item, depth, fmt);
-        break;
     case cJSON_Object:
-        out = print_object(item, depth, fmt);
         break;
-    }
-    return out;
-}
-
-/* Build an array from input text. */
-static const char *parse_array(cJSON *item, const char *value)
-{
-    cJSON *child;
-    if (*value != '[') {
-        return NULL; /* not an array! */
+    default:
+        return -1;
     }
 
-    item->type = cJSON_Array;
-    value = skip(value + 1);
-    if (*value == ']') {
-        return value + 1; /* empty array. */
-    }
-
-    item->child = child = cJSON_New_Item();
-    if (!item->child) {
-        return NULL; /* memory fail */
+    for (c = item->child; c; c = c->next) {
+        ++count;
     }
-    value = skip(parse_value(child, skip(value))); /* skip any spacing, get the value. */
-    if (!value) {
-        return NULL;
+    if (!(out = binary_reserve(enc, 5 + count * entry))) {
+        return -1;
     }
-
-    while (*value == ',') {
-        cJSON *new_item;
-        if (!(new_item = cJSON_New_Item())) {
-            return NULL; /* memory fail */
+    out[0] = type == cJSON_Object ? 'o' : 'a';
+    put_u32(out + 1, count);
+    table = enc->out.offset - count * entry;
+    for (c = item->child, ii = 0; c; c = c->next, ++ii) {
+        size_t offset = enc->out.offset;
+        if (encode_value(enc, c) == -1) {
+            return -1;
         }
-        child->next = new_item;
-        new_item->prev = child;
-        child = new_item;
-        value = skip(parse_value(child, skip(value + 1)));
-        if (!value) {
-            return NULL; /* memory fail */
+        out = (unsigned char *)enc->out.buffer + table + ii * entry;
+        if (type == cJSON_Object) {
+            put_u32(out, (uint32_t)dict_id(enc, c->string, 0));
+            out += 4;
         }
+        put_u32(out, (uint32_t)offset);
     }
+    return 0;
+}
 
-    if (*value == ']') {
-        return value + 1; /* end of array */
+char *cJSON_EncodeBinary(cJSON *item, size_t *length)
+{
+    binary_encoder enc;
+    unsigned char *out;
+    size_t dict;
+    uint32_t ii;
+    int ok;
+
+    memset(&enc, 0, sizeof(enc));
+    ok = dict_grow(&enc) == 0 && collect_names(&enc, item) == 0 &&
+         binary_reserve(&enc, BINARY_HEADER) != NULL;
+
+    /* The dictionary */
+    dict = enc.out.offset;
+    ok = ok && binary_reserve(&enc, 4 + 4 * (size_t)enc.count) != NULL;
+    for (ii = 0; ok && ii < enc.count; ++ii) {
+        put_u32((unsigned char *)enc.out.buffer + dict + 4 + 4 * ii,
+                (uint32_t)enc.out.offset);
+        ok = encode_string(&enc, 0, enc.keys[ii], binary_hash(enc.keys[ii]),
+                           1) == 0;
+    }
+
+    if (ok) {
+        out = (unsigned char *)enc.out.buffer;
+        put_u32(out + dict, enc.count);
+        memcpy(out, binary_magic, sizeof(binary_magic));
+        put_u32(out + 8, (uint32_t)dict);
+        put_u32(out + 12, (uint32_t)enc.out.offset);
+        ok = encode_value(&enc, item) == 0;
+    }
+
+    cJSON_free(enc.table);
+    cJSON_free(enc.ids);
+    cJSON_free(enc.keys);
+    if (!ok) {
+        cJSON_free(enc.out.buffer);
+        return NULL;
     }
-    return NULL; /* malformed. */
+    put_u32((unsigned char *)enc.out.buffer + 4, (uint32_t)enc.out.offset);
+    *length = enc.out.offset;
+    return enc.out.buffer;
 }
 
-/* Render an array to text */
-static char *print_array(cJSON *item, int depth, int fmt)
+/* Are there size bytes at offset? */
+static int binary_has(const cJSON_BinaryValue *value, size_t offset, size_t size)
 {
-    char **entries;
-    char *out = 0, *ptr, *ret;
-    size_t len = 5;
-    cJSON *child = item->child;
-    int numentries = 0, i = 0, fail = 0;
+    return offset <= value->length && size <= value->length - offset;
+}
 
-    /* How many entries in the array? */
-    while (child) {
-        numentries++, child = child->next;
-    }
-    /* Allocate an array to hold the values for each */
-    entries = cJSON_calloc(numentries, sizeof(char *));
-    if (!entries) {
-        return NULL;
+static int binary_tag(const cJSON_BinaryValue *value)
+{
+    return binary_has(value, value->offset, 1) ? value->buffer[value->offset] : -1;
+}
+
+/* The number of items in the array or object, or -1 if it isn't one or
+   its table is outside the buffer */
+static int64_t binary_count(const cJSON_BinaryValue *value, int tag)
+{
+    uint32_t count;
+    if (binary_tag(value) != tag || !binary_has(value, value->offset + 1, 4)) {
+        return -1;
     }
-    /* Retrieve all the results: */
-    child = item->child;
-    while (child && !fail) {
-        ret = print_value(child, depth + 1, fmt);
-        entries[i++] = ret;
-        if (ret) {
-            len += (int)strlen(ret) + 2 + (fmt ? 1 : 0);
-        } else {
-            fail = 1;
-        }
-        child = child->next;
+    count = get_u32(value->buffer + value->offset + 1);
+    if (!binary_has(value, value->offset + 5, (size_t)count * (tag == 'o' ? 8 : 4))) {
+        return -1;
     }
+    return count;
+}
 
-    /* If we didn't fail, try to malloc the output string */
-    if (!fail) {
-        out = cJSON_malloc(len);
-    }
-    /* If that fails, we fail. */
-    if (!out) {
-        fail = 1;
+/* Children always follow their parent, so walking the buffer can't
+   loop */
+static int binary_child(const cJSON_BinaryValue *parent, uint32_t offset,
+                        cJSON_BinaryValue *child)
+{
+    if (offset <= parent->offset || offset >= parent->length) {
+        return -1;
     }
+    child->buffer = parent->buffer;
+    child->length = parent->length;
+    child->offset = offset;
+    return 0;
+}
 
-    /* Handle failure. */
-    if (fail) {
-        for (i = 0; i < numentries; i++) {
-            if (entries[i]) {
-                cJSON_free(entries[i]);
-            }
-        }
-        cJSON_free(entries);
+/* A length prefixed and NUL terminated string at offset (after the
+   extra bytes following the length) */
+static const char *binary_string(const cJSON_BinaryValue *value, size_t offset,
+                                 size_t extra)
+{
+    uint32_t len;
+    if (!binary_has(value, offset, 4 + extra)) {
+        return NULL;
+    }
+    len = get_u32(value->buffer + offset);
+    offset += 4 + extra;
+    if (!binary_has(value, offset, (size_t)len + 1) ||
+        value->buffer[offset + len] != '\0') {
         return NULL;
     }
+    return (const char *)value->buffer + offset;
+}
 
-    /* Compose the output array. */
-    *out = '[';
-    ptr = out + 1;
-    *ptr = 0;
-    for (i = 0; i < numentries; i++) {
-        strcpy(ptr, entries[i]);
-        ptr += strlen(entries[i]);
-        if (i != numentries - 1) {
-            *ptr++ = ',';
-            if (fmt) {
-                *ptr++ = ' ';
-            }*ptr = 0;
-        }
-        cJSON_free(entries[i]);
-    }
-    cJSON_free(entries);
-    *ptr++ = ']';
-    *ptr++ = 0;
-    return out;
+/* The offset of the key with the given id in the dictionary (which has
+   room for its length and hash), or 0 if it is invalid */
+static size_t binary_key_offset(const cJSON_BinaryValue *value, uint32_t id)
+{
+    size_t dict = get_u32(value->buffer + 8);
+    size_t offset;
+    if (!binary_has(value, dict, 4) || id >= get_u32(value->buffer + dict) ||
+        !binary_has(value, dict + 4 + 4 * (size_t)id, 4)) {
+        return 0;
+    }
+    offset = get_u32(value->buffer + dict + 4 + 4 * (size_t)id);
+    return binary_has(value, offset, 8) ? offset : 0;
 }
 
-/* Build an object from the text. */
-static const char *parse_object(cJSON *item, const char *value)
+/* Look up the key with the given id in the dictionary */
+static const char *binary_key(const cJSON_BinaryValue *value, uint32_t id)
 {
-    cJSON *child;
-    if (*value != '{') {
-        return NULL; /* not an object! */
+    size_t offset = binary_key_offset(value, id);
+    return offset ? binary_string(value, offset, 4) : NULL;
+}
+
+int cJSON_BinaryOpen(const char *buffer, size_t length, cJSON_BinaryValue *root)
+{
+    const unsigned char *in = (const unsigned char *)buffer;
+    size_t total;
+    if (length < BINARY_HEADER || memcmp(in, binary_magic, sizeof(binary_magic))) {
+        return -1;
+    }
+    total = get_u32(in + 4);
+    if (total < BINARY_HEADER || total > length) {
+        return -1;
+    }
+    root->buffer = in;
+    root->length = total;
+    root->offset = get_u32(in + 12);
+    return binary_tag(root) == -1 ? -1 : 0;
+}
+
+int cJSON_BinaryType(const cJSON_BinaryValue *value)
+{
+    switch (binary_tag(value)) {
+    case 'f':
+        return cJSON_False;
+    case 't':
+        return cJSON_True;
+    case 'n':
+        return cJSON_NULL;
+    case 'i':
+    case 'd':
+        return cJSON_Number;
+    case 's':
+        return cJSON_String;
+    case 'a':
+        return cJSON_Array;
+    case 'o':
+        return cJSON_Object;
+    default:
+        return -1;
     }
+}
 
-    item->type = cJSON_Object;
-    value = skip(value + 1);
-    if (*value == '}') {
-        return value + 1; /* empty array. */
+int cJSON_BinaryGetSize(const cJSON_BinaryValue *value)
+{
+    int64_t count = binary_count(value, binary_tag(value) == 'o' ? 'o' : 'a');
+    return count > INT_MAX ? -1 : (int)count;
+}
+
+int cJSON_BinaryGetArrayItem(const cJSON_BinaryValue *array, int which,
+                             cJSON_BinaryValue *item)
+{
+    int64_t count = binary_count(array, 'a');
+    if (which < 0 || which >= count) {
+        return -1;
     }
+    return binary_child(array, get_u32(array->buffer + array->offset + 5 +
+                                       4 * (size_t)which), item);
+}
 
-    item->child = child = cJSON_New_Item();
-    value = skip(parse_string(child, skip(value)));
-    if (!value) {
-        return NULL;
+int cJSON_BinaryGetObjectEntry(const cJSON_BinaryValue *object, int which,
+                               const char **string, cJSON_BinaryValue *item)
+{
+    int64_t count = binary_count(object, 'o');
+    const unsigned char *entry;
+    const char *name;
+    if (which < 0 || which >= count) {
+        return -1;
     }
-    child->string = child->valuestring;
-    child->valuestring = 0;
-    if (*value != ':') {
-        return NULL; /* fail! */
+    entry = object->buffer + object->offset + 5 + 8 * (size_t)which;
+    name = binary_key(object, get_u32(entry));
+    if (!name) {
+        return -1;
     }
-    value = skip(parse_value(child, skip(value + 1))); /* skip any spacing, get the value. */
-    if (!value) {
-        return NULL;
+    if (string) {
+        *string = name;
     }
+    return binary_child(object, get_u32(entry + 4), item);
+}
 
-    while (*value == ',') {
-        cJSON *new_item;
-        if (!(new_item = cJSON_New_Item())) {
-            return NULL; /* memory fail */
+int cJSON_BinaryGetObjectItem(const cJSON_BinaryValue *object, const char *string,
+                              cJSON_BinaryValue *item)
+{
+    int64_t count = binary_count(object, 'o');
+    uint32_t wanted = binary_hash(string);
+    int64_t ii;
+    for (ii = 0; ii < count; ++ii) {
+        const unsigned char *entry = object->buffer + object->offset + 5 + 8 * ii;
+        size_t key = binary_key_offset(object, get_u32(entry));
+        const char *name;
+        if (!key) {
+            return -1;
         }
-        child->next = new_item;
-        new_item->prev = child;
-        child = new_item;
-        value = skip(parse_string(child, skip(value + 1)));
-        if (!value) {
-            return NULL;
+        /* Only the keys with the same hash need to be compared */
+        if (get_u32(object->buffer + key + 4) != wanted) {
+            continue;
         }
-        child->string = child->valuestring;
-        child->valuestring = 0;
-        if (*value != ':') {
-            return NULL; /* fail! */
+        if (!(name = binary_string(object, key, 4))) {
+            return -1;
         }
-        value = skip(parse_value(child, skip(value + 1))); /* skip any spacing, get the value. */
-        if (!value) {
-            return NULL;
+        if (!strcmp(name, string)) {
+            return binary_child(object, get_u32(entry + 4), item);
         }
     }
-
-    if (*value == '}') {
-        return value + 1; /* end of array */
-    }
-
-    return NULL; /* malformed. */
+    return -1;
 }
 
-/* Render an object to text. */
-static char *print_object(cJSON *item, int depth, int fmt)
-{
-    char **entries = 0, **names = 0;
-    char *out = 0, *ptr, *ret, *str;
-    size_t len = 7;
-    int i = 0, j;
-    cJSON *child = item->child;
-    int numentries = 0, fail = 0;
-    /* Count the number of entries. */
-    while (child) {
-        numentries++, child = child->next;
-    }
-    /* Allocate space for the names and the objects */
-    entries = cJSON_calloc(numentries, sizeof(char *));
-    if (!entries) {
-        return NULL;
-    }
-    names = cJSON_calloc(numentries, sizeof(char *));
-    if (!names) {
-        cJSON_free(entries);
+const char *cJSON_BinaryGetString(const cJSON_BinaryValue *value)
+{
+    if (binary_tag(value) != 's') {
         return NULL;
     }
+    return binary_string(value, value->offset + 1, 0);
+}
 
-    /* Collect all the results into our arrays: */
-    child = item->child;
-    depth++;
-    if (fmt) {
-        len += depth;
-    }
-    while (child) {
-        names[i] = str = print_string_ptr(child->string);
-        entries[i++] = ret = print_value(child, depth, fmt);
-        if (str && ret) {
-            len += (int)strlen(ret) + (int)strlen(str) + 2 + (fmt ? 2 + depth : 0);
-        } else {
-            fail = 1;
-        }
-        child = child->next;
+int cJSON_BinaryGetNumber(const cJSON_BinaryValue *value, int64_t *valueint64,
+                          double *valuedouble)
+{
+    int tag = binary_tag(value);
+    cJSON number;
+    uint64_t bits;
+    number.type = cJSON_Number;
+    if ((tag != 'i' && tag != 'd') || !binary_has(value, value->offset + 1, 8)) {
+        return -1;
+    }
+    bits = get_u64(value->buffer + value->offset + 1);
+    if (tag == 'i') {
+        number.valueint64 = (int64_t)bits;
+        number.valuedouble = (double)number.valueint64;
+    } else {
+        memcpy(&number.valuedouble, &bits, sizeof(bits));
+        set_number(&number, number.valuedouble);
     }
-
-    /* Try to allocate the output string */
-    if (!fail) {
-        out = cJSON_malloc(len);
+    if (valueint64) {
+        *valueint64 = number.valueint64;
     }
-    if (!out) {
-        fail = 1;
+    if (valuedouble) {
+        *valuedouble = number.valuedouble;
     }
+    return 0;
+}
 
-    /* Handle failure */
-    if (fail) {
-        for (i = 0; i < numentries; i++) {
-            if (names[i]) {
-                free(names[i]);
-            }
-            if (entries[i]) {
-                free(entries[i]);
-            }
-        }
-        free(names);
-        free(entries);
+static cJSON *decode_value(const cJSON_BinaryValue *value, int depth)
+{
+    cJSON *item = cJSON_New_Item();
+    cJSON *prev = NULL;
+    cJSON_BinaryValue child;
+    const char *str;
+    int count;
+    int ii;
+
+    if (!item) {
         return NULL;
     }
-
-    /* Compose the output: */
-    *out = '{';
-    ptr = out + 1;
-    if (fmt) {
-        *ptr++ = '\n';
-    }*ptr = 0;
-    for (i = 0; i < numentries; i++) {
-        if (fmt) {
-            for (j = 0; j < depth; j++) {
-                *ptr++ = '\t';
+    item->type = cJSON_BinaryType(value);
+    switch (item->type) {
+    case cJSON_False:
+    case cJSON_True:
+    case cJSON_NULL:
+        return item;
+    case cJSON_Number:
+        if (cJSON_BinaryGetNumber(value, &item->valueint64, &item->valuedouble) == 0) {
+            if (binary_tag(value) == 'i') {
+                set_int64(item, item->valueint64);
+            } else {
+                set_number(item, item->valuedouble);
             }
+            return item;
         }
-        strcpy(ptr, names[i]);
-        ptr += strlen(names[i]);
-        *ptr++ = ':';
-        if (fmt) {
-            *ptr++ = '\t';
+        break;
+    case cJSON_String:
+        if ((str = cJSON_BinaryGetString(value)) &&
+            (item->valuestring = cJSON_strdup(str))) {
+            return item;
         }
-        strcpy(ptr, entries[i]);
-        ptr += strlen(entries[i]);
-        if (i != numentries - 1) {
-            *ptr++ = ',';
+        break;
+    case cJSON_Array:
+    case cJSON_Object:
+        if (depth >= CJSON_NESTING_LIMIT) {
+            break;
         }
-        if (fmt) {
-            *ptr++ = '\n';
-        }*ptr = 0;
-        cJSON_free(names[i]);
-        cJSON_free(entries[i]);
-    }
-
-    cJSON_free(names);
-    cJSON_free(entries);
-    if (fmt) {
-        for (i = 0; i < depth - 1; i++) {
-            *ptr++ = '\t';
+        count = cJSON_BinaryGetSize(value);
+        for (ii = 0; ii < count; ++ii) {
+            cJSON *c;
+            str = NULL;
+            if ((item->type == cJSON_Object
+                 ? cJSON_BinaryGetObjectEntry(value, ii, &str, &child)
+                 : cJSON_BinaryGetArrayItem(value, ii, &child)) == -1 ||
+                !(c = decode_value(&child, depth + 1))) {
+                break;
+            }
+            if (str && !(c->string = cJSON_strdup(str))) {
+                cJSON_Delete(c);
+                break;
+            }
+            if (prev) {
+                suffix_object(prev, c);
+            } else {
+                item->child = c;
+            }
+            prev = c;
+        }
+        if (count >= 0 && ii == count) {
+            return item;
         }
+        break;
     }
-    *ptr++ = '}';
-    *ptr++ = 0;
-    return out;
+    cJSON_Delete(item);
+    return NULL;
 }
 
-/* Get Array size/item / object item. */
-int cJSON_GetArraySize(cJSON *array)
+cJSON *cJSON_DecodeBinary(const char *buffer, size_t length)
 {
-    cJSON *c = array->child;
-    int i = 0;
-    while (c) {
-        i++, c = c->next;
+    cJSON_BinaryValue root;
+    if (cJSON_BinaryOpen(buffer, length, &root) == -1) {
+        return NULL;
     }
-    return i;
+    return decode_value(&root, 0);
 }
 
-cJSON *cJSON_GetArrayItem(cJSON *array, int item)
+/* The compact representation (see cJSON_Tape in cJSON.h). Every node
+   is 16 bytes: a value, or the name of the member following it. The
+   children of an array or object follow it in the array, and aux is
+   the index past its last descendant, so a sibling is one step away. */
+#define TAPE_KEY 255 /* The type of a member name */
+#define TAPE_INLINE 1 /* The string is in the node (up to 7 bytes) */
+#define TAPE_INT64 2 /* The number is i, otherwise d */
+
+typedef struct tape_node {
+    unsigned char type;
+    unsigned char flags;
+    uint16_t unused;
+    uint32_t aux; /* Arrays/objects: the index past the subtree.
+                     Strings: the length */
+    union {
+        int64_t i;
+        double d;
+        uint64_t count; /* Arrays/objects: the number of children */
+        uint64_t offset; /* Strings: the offset in the string pool */
+        char str[8];
+    } u;
+} tape_node;
+
+/* Fails to compile if the node isn't 16 bytes */
+typedef char tape_node_size_check[sizeof(tape_node) == 16 ? 1 : -1];
+
+struct cJSON_Tape {
+    tape_node *nodes;
+    size_t count;
+    const char *strings;
+    size_t strings_size;
+};
+
+typedef struct tape_builder {
+    tape_node *nodes;
+    size_t count;
+    size_t capacity;
+    printbuffer strings;
+} tape_builder;
+
+/* Add a node, returning its index or -1 on memory fail */
+static int64_t tape_push(tape_builder *b, int type)
 {
-    cJSON *c = array->child;
-    while (c && item > 0) {
-        item--, c = c->next;
+    if (b->count == b->capacity) {
+        size_t capacity = b->capacity ? b->capacity * 2 : 64;
+        tape_node *nodes;
+        if (capacity > INT_MAX) {
+            if (b->capacity == INT_MAX) {
+                return -1;
+            }
+            capacity = INT_MAX;
+        }
+        nodes = cJSON_malloc(capacity * sizeof(tape_node));
+        if (!nodes) {
+            return -1;
+        }
+        if (b->nodes) {
+            memcpy(nodes, b->nodes, b->count * sizeof(tape_node));
+            cJSON_free(b->nodes);
+        }
+        b->nodes = nodes;
+        b->capacity = capacity;
     }
-    return c;
+    memset(&b->nodes[b->count], 0, sizeof(tape_node));
+    b->nodes[b->count].type = (unsigned char)type;
+    return (int64_t)b->count++;
 }
 
-cJSON *cJSON_GetObjectItem(cJSON *object, const char *string)
+static int tape_push_string(tape_builder *b, int type, const char *str)
 {
-    cJSON *c = object->child;
-    while (c && cJSON_strcasecmp(c->string, string)) {
-        c = c->next;
-    }
-    return c;
+    size_t len = strlen(str);
+    int64_t index;
+    tape_node *node;
+    if (len > UINT32_MAX || (index = tape_push(b, type)) == -1) {
+        return -1;
+    }
+    node = &b->nodes[index];
+    node->aux = (uint32_t)len;
+    if (len < sizeof(node->u.str)) {
+        node->flags = TAPE_INLINE;
+        memcpy(node->u.str, str, len);
+        return 0;
+    }
+    node->u.offset = b->strings.offset;
+    return append(&b->strings, str, len + 1);
 }
 
-/* Utility for array list handling. */
-static void suffix_object(cJSON *prev, cJSON *item)
+static int tape_push_number(tape_builder *b, const cJSON *item)
 {
-    prev->next = item;
-    item->prev = prev;
+    int64_t index = tape_push(b, cJSON_Number);
+    if (index == -1) {
+        return -1;
+    }
+    if (number_is_int64(item)) {
+        b->nodes[index].flags = TAPE_INT64;
+        b->nodes[index].u.i = item->valueint64;
+    } else {
+        b->nodes[index].u.d = item->valuedouble;
+    }
+    return 0;
 }
 
-/* Utility for handling references. */
-static cJSON *create_reference(cJSON *item)
+static void tape_close(tape_builder *b, int64_t index, uint64_t count)
 {
-    cJSON *ref = cJSON_New_Item();
-    memcpy(ref, item, sizeof(cJSON));
-    ref->string = 0;
-    ref->type |= cJSON_IsReference;
-    ref->next = ref->prev = 0;
-    return ref;
+    b->nodes[index].aux = (uint32_t)b->count;
+    b->nodes[index].u.count = count;
 }
 
-/* Add item to array/object. */
-void cJSON_AddItemToArray(cJSON *array, cJSON *item)
+static int tape_add_item(tape_builder *b, cJSON *item)
 {
-    cJSON *c = array->child;
-    if (!c) {
-        array->child = item;
-    } else {
-        while (c && c->next) {
-            c = c->next;
-        }
-        suffix_object(c, item);
-    }
-}
+    int type = item->type & 255;
+    cJSON *child;
+    uint64_t count = 0;
+    int64_t index;
 
-void cJSON_AddItemToObject(cJSON *object, const char *string, cJSON *item)
-{
-    if (item->string) {
-        cJSON_free(item->string);
+    switch (type) {
+    case cJSON_False:
+    case cJSON_True:
+    case cJSON_NULL:
+        return tape_push(b, type) == -1 ? -1 : 0;
+    case cJSON_Number:
+        return tape_push_number(b, item);
+    case cJSON_String:
+        return tape_push_string(b, type, item->valuestring);
+    case cJSON_Array:
+    case cJSON_Object:
+        if ((index = tape_push(b, type)) == -1) {
+            return -1;
+        }
+        for (child = item->child; child; child = child->next, ++count) {
+            if (type == cJSON_Object &&
+                tape_push_string(b, TAPE_KEY, child->string ? child->string : "") == -1) {
+                return -1;
+            }
+            if (tape_add_item(b, child) == -1) {
+                return -1;
+            }
+        }
+        tape_close(b, index, count);
+        return 0;
     }
-    item->string = cJSON_strdup(string);
-    cJSON_AddItemToArray(object, item);
+    return -1;
 }
 
-void cJSON_AddItemReferenceToArray(cJSON *array, cJSON *item)
+/* Parse a string into a node of type. The unescaped string is decoded
+   into the (scratch) arena of ctx, which is reset afterwards. */
+static const char *tape_parse_string(tape_builder *b, parse_ctx *ctx,
+                                     int type, const char *value)
 {
-    cJSON_AddItemToArray(array, create_reference(item));
+    cJSON item;
+    memset(&item, 0, sizeof(item));
+    value = parse_string(ctx, &item, value);
+    if (value && tape_push_string(b, type, item.valuestring) == -1) {
+        value = NULL;
+    }
+    cJSON_ResetArena(ctx->arena);
+    return value;
 }
 
-void cJSON_AddItemReferenceToObject(cJSON *object, const char *string, cJSON *item)
+static const char *tape_parse_value(tape_builder *b, parse_ctx *ctx, const char *value)
 {
-    cJSON_AddItemToObject(object, string, create_reference(item));
-}
+    cJSON item;
+    uint64_t count = 0;
+    int64_t index;
+    char closer;
 
-cJSON *cJSON_DetachItemFromArray(cJSON *array, int which)
-{
-    cJSON *c = array->child;
-    while (c && which > 0) {
-        c = c->next, which--;
-    }
-    if (!c) {
+    if (!value || value >= ctx->end) {
         return NULL;
     }
-    if (c->prev) {
-        c->prev->next = c->next;
+    if (*value == '\"') {
+        return tape_parse_string(b, ctx, cJSON_String, value);
     }
-    if (c->next) {
-        c->next->prev = c->prev;
+    if (*value == '-' || (*value >= '0' && *value <= '9')) {
+        memset(&item, 0, sizeof(item));
+        value = parse_number(ctx, &item, value);
+        if (value && tape_push_number(b, &item) == -1) {
+            return NULL;
+        }
+        return value;
     }
-    if (c == array->child) {
-        array->child = c->next;
+    if (*value == '[' || *value == '{') {
+        const int object = (*value == '{');
+        closer = object ? '}' : ']';
+        if (ctx->depth >= CJSON_NESTING_LIMIT ||
+            (index = tape_push(b, object ? cJSON_Object : cJSON_Array)) == -1) {
+            return NULL;
+        }
+        ++ctx->depth;
+        value = skip(ctx, value + 1);
+        if (!peek(ctx, value, closer)) {
+            for (;;) {
+                if (object) {
+                    if (!peek(ctx, value, '\"')) {
+                        return NULL;
+                    }
+                    value = skip(ctx, tape_parse_string(b, ctx, TAPE_KEY, value));
+                    if (!value || !peek(ctx, value, ':')) {
+                        return NULL;
+                    }
+                    value = skip(ctx, value + 1);
+                }
+                value = skip(ctx, tape_parse_value(b, ctx, value));
+                if (!value) {
+                    return NULL;
+                }
+                ++count;
+                if (!peek(ctx, value, ',')) {
+                    break;
+                }
+                value = skip(ctx, value + 1);
+            }
+            if (!peek(ctx, value, closer)) {
+                return NULL;
+            }
+        }
+        tape_close(b, index, count);
+        --ctx->depth;
+        return value + 1;
     }
-    c->prev = c->next = 0;
-    return c;
+    if (can_read(ctx, value, 4) && !strncmp(value, "null", 4)) {
+        return tape_push(b, cJSON_NULL) == -1 ? NULL : value + 4;
+    }
+    if (can_read(ctx, value, 5) && !strncmp(value, "false", 5)) {
+        return tape_push(b, cJSON_False) == -1 ? NULL : value + 5;
+    }
+    if (can_read(ctx, value, 4) && !strncmp(value, "true", 4)) {
+        return tape_push(b, cJSON_True) == -1 ? NULL : value + 4;
+    }
+    return NULL;
 }
 
-void cJSON_DeleteItemFromArray(cJSON *array, int which)
+/* Copy the nodes and strings into a single exactly sized block */
+static cJSON_Tape *tape_finish(tape_builder *b)
 {
-    cJSON_Delete(cJSON_DetachItemFromArray(array, which));
+    size_t nodes_size = b->count * sizeof(tape_node);
+    cJSON_Tape *tape = NULL;
+    char *block;
+
+    if (b->count) {
+        tape = cJSON_malloc(sizeof(cJSON_Tape) + nodes_size + b->strings.offset);
+    }
+    if (tape) {
+        block = (char *)(tape + 1);
+        memcpy(block, b->nodes, nodes_size);
+        if (b->strings.offset) {
+            memcpy(block + nodes_size, b->strings.buffer, b->strings.offset);
+        }
+        tape->nodes = (tape_node *)block;
+        tape->count = b->count;
+        tape->strings = block + nodes_size;
+        tape->strings_size = b->strings.offset;
+    }
+    cJSON_free(b->nodes);
+    if (b->strings.buffer) {
+        cJSON_free(b->strings.buffer);
+    }
+    return tape;
 }
 
-cJSON *cJSON_DetachItemFromObject(cJSON *object, const char *string)
+cJSON_Tape *cJSON_TapeParse(const char *value, size_t length)
 {
-    int i = 0;
-    cJSON *c = object->child;
-    while (c && cJSON_strcasecmp(c->string, string)) {
-        i++, c = c->next;
+    tape_builder b;
+    parse_ctx ctx;
+    const char *end;
+
+    memset(&b, 0, sizeof(b));
+    ctx.arena = cJSON_CreateArena(0);
+    ctx.allocator = NULL;
+    ctx.end = value + length;
+    ctx.insitu = 0;
+    ctx.depth = 0;
+    if (!ctx.arena) {
+        return NULL;
     }
-    if (c) {
-        return cJSON_DetachItemFromArray(object, i);
+    end = tape_parse_value(&b, &ctx, skip(&ctx, value));
+    cJSON_DeleteArena(ctx.arena);
+    if (!end) {
+        b.count = 0;
     }
-    return NULL;
+    return tape_finish(&b);
 }
 
-void cJSON_DeleteItemFromObject(cJSON *object, const char *string)
+cJSON_Tape *cJSON_TapeFromTree(cJSON *item)
 {
-    cJSON_Delete(cJSON_DetachItemFromObject(object, string));
+    tape_builder b;
+    memset(&b, 0, sizeof(b));
+    if (tape_add_item(&b, item) == -1) {
+        b.count = 0;
+    }
+    return tape_finish(&b);
 }
 
-/* Replace array/object items with new ones. */
-void cJSON_ReplaceItemInArray(cJSON *array, int which, cJSON *newitem)
+void cJSON_DeleteTape(cJSON_Tape *tape)
 {
-    cJSON *c = array->child;
-    while (c && which > 0) {
-        c = c->next, which--;
-    }
-    if (!c) {
-        return;
-    }
-    newitem->next = c->next;
-    newitem->prev = c->prev;
-    if (newitem->next) {
-        newitem->next->prev = newitem;
-    }
-    if (c == array->child) {
-        array->child = newitem;
-    } else {
-        newitem->prev->next = newitem;
-    }
-    c->next = c->prev = 0;
-    cJSON_Delete(c);
+    cJSON_free(tape);
 }
 
-void cJSON_ReplaceItemInObject(cJSON *object, const char *string, cJSON *newitem)
+size_t cJSON_TapeSize(const cJSON_Tape *tape)
 {
-    int i = 0;
-    cJSON *c = object->child;
-    while (c && cJSON_strcasecmp(c->string, string)) {
-        i++, c = c->next;
-    }
-    if (c) {
-        newitem->string = cJSON_strdup(string);
-        cJSON_ReplaceItemInArray(object, i, newitem);
+    return sizeof(cJSON_Tape) + tape->count * sizeof(tape_node) + tape->strings_size;
+}
+
+/* Get node, or NULL if it isn't a value in the tape */
+static const tape_node *tape_value(const cJSON_Tape *tape, int node)
+{
+    if (node < 0 || (size_t)node >= tape->count || tape->nodes[node].type == TAPE_KEY) {
+        return NULL;
     }
+    return &tape->nodes[node];
 }
 
-/* Create basic types: */
-cJSON *cJSON_CreateNull(void)
+static int tape_is_container(const tape_node *n)
 {
-    cJSON *item = cJSON_New_Item();
-    item->type = cJSON_NULL;
-    return item;
+    return n && (n->type == cJSON_Array || n->type == cJSON_Object);
 }
 
-cJSON *cJSON_CreateTrue(void)
+static const char *tape_string(const cJSON_Tape *tape, const tape_node *n)
 {
-    cJSON *item = cJSON_New_Item();
-    item->type = cJSON_True;
-    return item;
+    return (n->flags & TAPE_INLINE) ? n->u.str : tape->strings + n->u.offset;
 }
 
-cJSON *cJSON_CreateFalse(void)
+int cJSON_TapeType(const cJSON_Tape *tape, int node)
 {
-    cJSON *item = cJSON_New_Item();
-    item->type = cJSON_False;
-    return item;
+    const tape_node *n = tape_value(tape, node);
+    return n ? n->type : -1;
 }
 
-cJSON *cJSON_CreateNumber(double num)
+int cJSON_TapeGetArraySize(const cJSON_Tape *tape, int node)
 {
-    cJSON *item = cJSON_New_Item();
-    item->type = cJSON_Number;
-    item->valuedouble = num;
-    item->valueint = (int)num;
-    return item;
+    const tape_node *n = tape_value(tape, node);
+    return tape_is_container(n) ? (int)n->u.count : 0;
 }
 
-cJSON *cJSON_CreateString(const char *string)
+int cJSON_TapeGetChild(const cJSON_Tape *tape, int node)
 {
-    cJSON *item = cJSON_New_Item();
-    item->type = cJSON_String;
-    item->valuestring = cJSON_strdup(string);
-    return item;
+    const tape_node *n = tape_value(tape, node);
+    if (!tape_is_container(n) || n->u.count == 0) {
+        return -1;
+    }
+    return n->type == cJSON_Object ? node + 2 : node + 1;
 }
 
-cJSON *cJSON_CreateArray(void)
+int cJSON_TapeGetNext(const cJSON_Tape *tape, int parent, int node)
 {
-    cJSON *item = cJSON_New_Item();
-    item->type = cJSON_Array;
-    return item;
+    const tape_node *p = tape_value(tape, parent);
+    const tape_node *n = tape_value(tape, node);
+    int next;
+    if (!tape_is_container(p) || !n || node <= parent || (uint32_t)node >= p->aux) {
+        return -1;
+    }
+    next = tape_is_container(n) ? (int)n->aux : node + 1;
+    if (p->type == cJSON_Object) {
+        ++next; /* Step over the name */
+    }
+    return (uint32_t)next < p->aux ? next : -1;
 }
 
-cJSON *cJSON_CreateObject(void)
+int cJSON_TapeGetArrayItem(const cJSON_Tape *tape, int array, int which)
 {
-    cJSON *item = cJSON_New_Item();
-    item->type = cJSON_Object;
-    return item;
+    int child = cJSON_TapeGetChild(tape, array);
+    while (child != -1 && which > 0) {
+        child = cJSON_TapeGetNext(tape, array, child);
+        --which;
+    }
+    return which == 0 ? child : -1;
 }
 
-/* Create Arrays: */
-cJSON *cJSON_CreateIntArray(int *numbers, int count)
+static int tape_get_object_item(const cJSON_Tape *tape, int object, const char *string,
+                                int nocase)
 {
-    int i;
-    cJSON *n = 0, *p = 0, *a = cJSON_CreateArray();
-    for (i = 0; i < count; i++) {
-        n = cJSON_CreateNumber(numbers[i]);
-        if (!i) {
-            a->child = n;
-        } else {
-            suffix_object(p, n);
+    int child;
+    if (cJSON_TapeType(tape, object) != cJSON_Object) {
+        return -1;
+    }
+    for (child = cJSON_TapeGetChild(tape, object); child != -1;
+         child = cJSON_TapeGetNext(tape, object, child)) {
+        const char *name = tape_string(tape, &tape->nodes[child - 1]);
+        if (nocase ? !cJSON_strcasecmp(name, string) : !strcmp(name, string)) {
+            return child;
         }
-        p = n;
     }
-    return a;
+    return -1;
 }
 
-cJSON *cJSON_CreateFloatArray(float *numbers, int count)
+int cJSON_TapeGetObjectItem(const cJSON_Tape *tape, int object, const char *string)
 {
-    int i;
-    cJSON *n = 0, *p = 0, *a = cJSON_CreateArray();
-    for (i = 0; i < count; i++) {
-        n = cJSON_CreateNumber(numbers[i]);
-        if (!i) {
-            a->child = n;
-        } else {
-            suffix_object(p, n);
-        }
-        p = n;
+    return tape_get_object_item(tape, object, string, 1);
+}
+
+int cJSON_TapeGetObjectItemCaseSensitive(const cJSON_Tape *tape, int object,
+                                         const char *string)
+{
+    return tape_get_object_item(tape, object, string, 0);
+}
+
+const char *cJSON_TapeGetName(const cJSON_Tape *tape, int node)
+{
+    if (!tape_value(tape, node) || node == 0 || tape->nodes[node - 1].type != TAPE_KEY) {
+        return NULL;
     }
-    return a;
+    return tape_string(tape, &tape->nodes[node - 1]);
 }
 
-cJSON *cJSON_CreateDoubleArray(double *numbers, int count)
+const char *cJSON_TapeGetString(const cJSON_Tape *tape, int node)
 {
-    int i;
-    cJSON *n = 0, *p = 0, *a = cJSON_CreateArray();
-    for (i = 0; i < count; i++) {
-        n = cJSON_CreateNumber(numbers[i]);
-        if (!i) {
-            a->child = n;
-        } else {
-            suffix_object(p, n);
-        }
-        p = n;
+    const tape_node *n = tape_value(tape, node);
+    if (!n || n->type != cJSON_String) {
+        return NULL;
     }
-    return a;
+    return tape_string(tape, n);
 }
 
-cJSON *cJSON_CreateStringArray(const char **strings, int count)
+int cJSON_TapeGetNumber(const cJSON_Tape *tape, int node, int64_t *valueint64,
+                        double *valuedouble)
 {
-    int i;
-    cJSON *n = 0, *p = 0, *a = cJSON_CreateArray();
-    for (i = 0; i < count; i++) {
-        n = cJSON_CreateString(strings[i]);
-        if (!i) {
-            a->child = n;
-        } else {
-            suffix_object(p, n);
-        }
-        p = n;
+    const tape_node *n = tape_value(tape, node);
+    cJSON number;
+    if (!n || n->type != cJSON_Number) {
+        return -1;
+    }
+    if (n->flags & TAPE_INT64) {
+        number.valueint64 = n->u.i;
+        number.valuedouble = (double)n->u.i;
+    } else {
+        number.type = cJSON_Number;
+        set_number(&number, n->u.d);
     }
-    return a;
+    if (valueint64) {
+        *valueint64 = number.valueint64;
+    }
+    if (valuedouble) {
+        *valuedouble = number.valuedouble;
+    }
+    return 0;
 }
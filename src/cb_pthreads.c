@@ -1,4 +1,6 @@
 #include "config.h"
+#include "mutex_profile.h"
+#include <platform/epoch.h>
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -7,12 +9,48 @@
 #include <dlfcn.h>
 #include <errno.h>
 
+#include <sched.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
 struct thread_execute {
     cb_thread_main_func func;
     const char* name;
     void *argument;
+    int priority;
 };
 
+static void set_current_thread_priority(int priority)
+{
+#ifdef __linux__
+    /* Linux keeps a nice value per thread (SCHED_OTHER has no
+     * static priorities), relative to the rest of the process */
+    int nice = getpriority(PRIO_PROCESS, 0);
+    nice += (priority < 0) ? 10 : -10;
+    (void)setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), nice);
+#else
+    struct sched_param param;
+    int policy;
+    int min, max;
+
+    if (pthread_getschedparam(pthread_self(), &policy, &param) != 0) {
+        return;
+    }
+    min = sched_get_priority_min(policy);
+    max = sched_get_priority_max(policy);
+    if (min == -1 || max == -1) {
+        return;
+    }
+    if (priority < 0) {
+        param.sched_priority = min + (max - min) / 4;
+    } else {
+        param.sched_priority = max - (max - min) / 4;
+    }
+    (void)pthread_setschedparam(pthread_self(), policy, &param);
+#endif
+}
+
 static void *platform_thread_wrap(void *arg)
 {
     struct thread_execute *ctx = arg;
@@ -20,7 +58,11 @@ static void *platform_thread_wrap(void *arg)
     if (ctx->name != NULL) {
         cb_set_thread_name(ctx->name);
     }
+    if (ctx->priority != CB_THREAD_PRIORITY_NORMAL) {
+        set_current_thread_priority(ctx->priority);
+    }
     ctx->func(ctx->argument);
+    cb_epoch_unregister_thread();
     free((void*)ctx->name);
     free(ctx);
     return NULL;
@@ -38,37 +80,180 @@ int cb_create_thread(cb_thread_t *id,
 int cb_create_named_thread(cb_thread_t *id, cb_thread_main_func func, void *arg,
                            int detached, const char* name)
 {
-    int ret;
-    struct thread_execute *ctx = malloc(sizeof(struct thread_execute));
-    if (ctx == NULL) {
+    cb_thread_attr_t attr;
+
+    /* cb_create_thread_ex refuses names which are too long */
+    cb_thread_attr_initialize(&attr);
+    attr.name = name;
+    attr.detached = detached;
+    return cb_create_thread_ex(id, func, arg, &attr);
+}
+
+void cb_thread_attr_initialize(cb_thread_attr_t *attr)
+{
+    memset(attr, 0, sizeof(*attr));
+    attr->numa_node = -1;
+    attr->priority = CB_THREAD_PRIORITY_NORMAL;
+}
+
+#ifdef __linux__
+/*
+ * Parse a kernel cpulist ("0-3,8,10-11") from the named sysfs file.
+ * Returns the highest number in the list, or -1 on failure
+ */
+static int read_cpulist(const char *fname, cpu_set_t *set)
+{
+    char buffer[4096];
+    char *ptr;
+    size_t nr;
+    int highest = -1;
+    FILE *fp = fopen(fname, "r");
+
+    if (fp == NULL) {
         return -1;
     }
+    nr = fread(buffer, 1, sizeof(buffer) - 1, fp);
+    fclose(fp);
+    buffer[nr] = '\0';
 
-    ctx->func = func;
-    ctx->argument = arg;
-    if (name != NULL) {
-        if (strlen(name) > 15) {
-            return 0;
+    if (set != NULL) {
+        CPU_ZERO(set);
+    }
+    ptr = buffer;
+    while (*ptr >= '0' && *ptr <= '9') {
+        long first = strtol(ptr, &ptr, 10);
+        long last = first;
+        long ii;
+        if (*ptr == '-') {
+            last = strtol(ptr + 1, &ptr, 10);
+        }
+        for (ii = first; set != NULL && ii <= last && ii < CPU_SETSIZE; ++ii) {
+            CPU_SET(ii, set);
+        }
+        if (last > highest) {
+            highest = (int)last;
+        }
+        if (*ptr == ',') {
+            ++ptr;
+        }
+    }
+
+    return highest;
+}
+
+static int build_cpuset(const cb_thread_attr_t *attr, cpu_set_t *set)
+{
+    if (attr->numa_node >= 0) {
+        char fname[80];
+        snprintf(fname, sizeof(fname),
+                 "/sys/devices/system/node/node%d/cpulist", attr->numa_node);
+        if (read_cpulist(fname, set) == -1) {
+            return -1;
         }
-        ctx->name = strdup(name);
     } else {
-        ctx->name = NULL;
+        CPU_ZERO(set);
     }
 
-    if (detached) {
-        pthread_attr_t attr;
+    if (attr->cpus != NULL && attr->ncpus > 0) {
+        cpu_set_t requested;
+        size_t ii;
+        CPU_ZERO(&requested);
+        for (ii = 0; ii < attr->ncpus; ++ii) {
+            if (attr->cpus[ii] < CPU_SETSIZE) {
+                CPU_SET(attr->cpus[ii], &requested);
+            }
+        }
+        if (attr->numa_node >= 0) {
+            CPU_AND(set, set, &requested);
+        } else {
+            CPU_OR(set, set, &requested);
+        }
+    }
 
-        if (pthread_attr_init(&attr) != 0 ||
-                pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED) != 0) {
+    /* Drop the CPUs we're not allowed to use (or which don't exist) */
+    {
+        cpu_set_t allowed;
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+            CPU_AND(set, set, &allowed);
+        }
+    }
+
+    return CPU_COUNT(set) == 0 ? -1 : 0;
+}
+#endif
+
+int cb_get_numa_node_count(void)
+{
+#ifdef __linux__
+    int highest = read_cpulist("/sys/devices/system/node/online", NULL);
+    return highest < 0 ? 1 : highest + 1;
+#else
+    return 1;
+#endif
+}
+
+int cb_create_thread_ex(cb_thread_t *id, cb_thread_main_func func, void *arg,
+                        const cb_thread_attr_t *attr)
+{
+    int ret;
+    pthread_attr_t pattr;
+    struct thread_execute *ctx;
+    cb_thread_attr_t defaults;
+
+    if (attr == NULL) {
+        cb_thread_attr_initialize(&defaults);
+        attr = &defaults;
+    }
+
+    if (attr->name != NULL && strlen(attr->name) > 15) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (pthread_attr_init(&pattr) != 0) {
+        return -1;
+    }
+
+    if ((attr->detached &&
+         pthread_attr_setdetachstate(&pattr, PTHREAD_CREATE_DETACHED) != 0) ||
+        (attr->stack_size != 0 &&
+         pthread_attr_setstacksize(&pattr, attr->stack_size) != 0)) {
+        pthread_attr_destroy(&pattr);
+        return -1;
+    }
+
+#ifdef __linux__
+    if (attr->numa_node >= 0 || (attr->cpus != NULL && attr->ncpus > 0)) {
+        cpu_set_t set;
+        if (build_cpuset(attr, &set) != 0 ||
+            pthread_attr_setaffinity_np(&pattr, sizeof(set), &set) != 0) {
+            pthread_attr_destroy(&pattr);
+            errno = EINVAL;
             return -1;
         }
+    }
+#endif
 
-        ret = pthread_create(id, &attr, platform_thread_wrap, ctx);
+    ctx = malloc(sizeof(struct thread_execute));
+    if (ctx == NULL) {
+        pthread_attr_destroy(&pattr);
+        return -1;
+    }
+
+    ctx->func = func;
+    ctx->argument = arg;
+    ctx->priority = attr->priority;
+    if (attr->name != NULL) {
+        ctx->name = strdup(attr->name);
     } else {
-        ret = pthread_create(id, NULL, platform_thread_wrap, ctx);
+        ctx->name = NULL;
     }
 
+    ret = pthread_create(id, &pattr, platform_thread_wrap, ctx);
+    pthread_attr_destroy(&pattr);
+
     if (ret != 0) {
+        free((void*)ctx->name);
         free(ctx);
     }
 
@@ -107,10 +292,11 @@ void cb_mutex_initialize(cb_mutex_t *mutex)
 
 void cb_mutex_destroy(cb_mutex_t *mutex)
 {
+    cb_mutex_profile_forget(mutex);
     pthread_mutex_destroy(mutex);
 }
 
-void cb_mutex_enter(cb_mutex_t *mutex)
+static void mutex_lock(cb_mutex_t *mutex)
 {
     int rv = pthread_mutex_lock(mutex);
     if (rv != 0) {
@@ -120,13 +306,40 @@ void cb_mutex_enter(cb_mutex_t *mutex)
     }
 }
 
+void cb_mutex_enter(cb_mutex_t *mutex)
+{
+    if (cb_mutex_profiling) {
+        hrtime_t start;
+        if (pthread_mutex_trylock(mutex) == 0) {
+            cb_mutex_profile_acquired(mutex, 0, 0);
+            return;
+        }
+        start = gethrtime();
+        mutex_lock(mutex);
+        cb_mutex_profile_acquired(mutex, 1, gethrtime() - start);
+        return;
+    }
+
+    mutex_lock(mutex);
+}
+
 int cb_mutex_try_enter(cb_mutex_t *mutex) {
-    return pthread_mutex_trylock(mutex) == 0 ? 0 : -1;
+    if (pthread_mutex_trylock(mutex) != 0) {
+        return -1;
+    }
+    if (cb_mutex_profiling) {
+        cb_mutex_profile_acquired(mutex, 0, 0);
+    }
+    return 0;
 }
 
 void cb_mutex_exit(cb_mutex_t *mutex)
 {
-    int rv = pthread_mutex_unlock(mutex);
+    int rv;
+    if (cb_mutex_profiling) {
+        cb_mutex_profile_release(mutex);
+    }
+    rv = pthread_mutex_unlock(mutex);
     if (rv != 0) {
         fprintf(stderr, "FATAL: Failed to release mutex: %d %s",
                 rv, strerror(rv));
@@ -134,9 +347,146 @@ void cb_mutex_exit(cb_mutex_t *mutex)
     }
 }
 
+static void cpu_relax(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+    __asm__ __volatile__("pause");
+#elif defined(__aarch64__) || defined(__arm__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+void cb_adaptive_mutex_initialize(cb_adaptive_mutex_t *mutex,
+                                  unsigned int spins)
+{
+#ifdef HAVE_PTHREAD_MUTEX_ADAPTIVE_NP
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_ADAPTIVE_NP);
+    pthread_mutex_init(&mutex->mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+#else
+    pthread_mutex_init(&mutex->mutex, NULL);
+#endif
+    mutex->spins = spins ? spins : CB_ADAPTIVE_MUTEX_DEFAULT_SPINS;
+}
+
+void cb_adaptive_mutex_destroy(cb_adaptive_mutex_t *mutex)
+{
+    pthread_mutex_destroy(&mutex->mutex);
+}
+
+void cb_adaptive_mutex_enter(cb_adaptive_mutex_t *mutex)
+{
+    unsigned int ii;
+    unsigned int backoff = 1;
+
+    for (ii = 0; ii < mutex->spins; ++ii) {
+        unsigned int jj;
+        if (pthread_mutex_trylock(&mutex->mutex) == 0) {
+            return;
+        }
+        /* Back off exponentially, and let somebody else run on this
+         * core once we've been spinning for a while */
+        if (backoff < 64) {
+            for (jj = 0; jj < backoff; ++jj) {
+                cpu_relax();
+            }
+            backoff <<= 1;
+        } else {
+            sched_yield();
+        }
+    }
+
+    cb_mutex_enter(&mutex->mutex);
+}
+
+int cb_adaptive_mutex_try_enter(cb_adaptive_mutex_t *mutex)
+{
+    return cb_mutex_try_enter(&mutex->mutex);
+}
+
+void cb_adaptive_mutex_exit(cb_adaptive_mutex_t *mutex)
+{
+    cb_mutex_exit(&mutex->mutex);
+}
+
+void cb_rwlock_initialize(cb_rwlock_t *rwlock, int prefer_writer)
+{
+#ifdef HAVE_PTHREAD_RWLOCKATTR_SETKIND_NP
+    if (prefer_writer) {
+        /* glibc defaults to preferring readers */
+        pthread_rwlockattr_t attr;
+        pthread_rwlockattr_init(&attr);
+        pthread_rwlockattr_setkind_np(&attr,
+                              PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+        pthread_rwlock_init(rwlock, &attr);
+        pthread_rwlockattr_destroy(&attr);
+        return;
+    }
+#else
+    (void)prefer_writer;
+#endif
+    pthread_rwlock_init(rwlock, NULL);
+}
+
+void cb_rwlock_destroy(cb_rwlock_t *rwlock)
+{
+    pthread_rwlock_destroy(rwlock);
+}
+
+static void rwlock_check(int rv, const char *what)
+{
+    if (rv != 0) {
+        fprintf(stderr, "FATAL: Failed to %s rwlock: %d %s",
+                what, rv, strerror(rv));
+        abort();
+    }
+}
+
+void cb_rwlock_reader_enter(cb_rwlock_t *rwlock)
+{
+    rwlock_check(pthread_rwlock_rdlock(rwlock), "read lock");
+}
+
+int cb_rwlock_reader_try_enter(cb_rwlock_t *rwlock)
+{
+    return pthread_rwlock_tryrdlock(rwlock) == 0 ? 0 : -1;
+}
+
+void cb_rwlock_reader_exit(cb_rwlock_t *rwlock)
+{
+    rwlock_check(pthread_rwlock_unlock(rwlock), "release");
+}
+
+void cb_rwlock_writer_enter(cb_rwlock_t *rwlock)
+{
+    rwlock_check(pthread_rwlock_wrlock(rwlock), "write lock");
+}
+
+int cb_rwlock_writer_try_enter(cb_rwlock_t *rwlock)
+{
+    return pthread_rwlock_trywrlock(rwlock) == 0 ? 0 : -1;
+}
+
+void cb_rwlock_writer_exit(cb_rwlock_t *rwlock)
+{
+    rwlock_check(pthread_rwlock_unlock(rwlock), "release");
+}
+
 void cb_cond_initialize(cb_cond_t *cond)
 {
+#ifdef HAVE_PTHREAD_CONDATTR_SETCLOCK
+    /* Let cb_cond_timedwait_ns use deadlines which aren't affected by
+     * changes to the wall clock */
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+#else
     pthread_cond_init(cond, NULL);
+#endif
 }
 
 void cb_cond_destroy(cb_cond_t *cond)
@@ -146,7 +496,14 @@ void cb_cond_destroy(cb_cond_t *cond)
 
 void cb_cond_wait(cb_cond_t *cond, cb_mutex_t *mutex)
 {
+    /* The mutex isn't held while waiting */
+    if (cb_mutex_profiling) {
+        cb_mutex_profile_release(mutex);
+    }
     pthread_cond_wait(cond, mutex);
+    if (cb_mutex_profiling) {
+        cb_mutex_profile_acquired(mutex, 0, 0);
+    }
 }
 
 void cb_cond_signal(cb_cond_t *cond)
@@ -160,38 +517,64 @@ void cb_cond_broadcast(cb_cond_t *cond)
 }
 
 void cb_cond_timedwait(cb_cond_t *cond, cb_mutex_t *mutex, unsigned int ms)
+{
+    (void)cb_cond_timedwait_ns(cond, mutex, (uint64_t)ms * 1000000);
+}
+
+int cb_cond_timedwait_ns(cb_cond_t *cond, cb_mutex_t *mutex, uint64_t ns)
 {
     struct timespec ts;
-    struct timeval tp;
     int ret;
-    uint64_t wakeup;
 
-    memset(&ts, 0, sizeof(ts));
+    /* The mutex isn't held while waiting */
+    if (cb_mutex_profiling) {
+        cb_mutex_profile_release(mutex);
+    }
 
+#if defined(HAVE_PTHREAD_CONDATTR_SETCLOCK)
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_sec += (time_t)(ns / 1000000000);
+    ts.tv_nsec += (long)(ns % 1000000000);
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_nsec -= 1000000000;
+        ++ts.tv_sec;
+    }
+    ret = pthread_cond_timedwait(cond, mutex, &ts);
+#elif defined(__APPLE__)
+    ts.tv_sec = (time_t)(ns / 1000000000);
+    ts.tv_nsec = (long)(ns % 1000000000);
+    ret = pthread_cond_timedwait_relative_np(cond, mutex, &ts);
+#else
     /*
      * Unfortunately pthreads don't support relative sleeps so we need
-     * to convert back to an absolute time...
+     * to convert back to an absolute (wall clock) time...
      */
+    struct timeval tp;
+    uint64_t wakeup;
     gettimeofday(&tp, NULL);
-    wakeup = ((uint64_t)(tp.tv_sec) * 1000) + (tp.tv_usec / 1000) + ms;
-    /* Round up for sub ms */
-    if ((tp.tv_usec % 1000) > 499) {
-        ++wakeup;
-    }
+    wakeup = (uint64_t)tp.tv_sec * 1000000000 +
+             (uint64_t)tp.tv_usec * 1000 + ns;
+    ts.tv_sec = (time_t)(wakeup / 1000000000);
+    ts.tv_nsec = (long)(wakeup % 1000000000);
+    ret = pthread_cond_timedwait(cond, mutex, &ts);
+#endif
 
-    ts.tv_sec = wakeup / 1000;
-    wakeup %= 1000;
-    ts.tv_nsec = wakeup * 1000000;
+    if (cb_mutex_profiling) {
+        cb_mutex_profile_acquired(mutex, 0, 0);
+    }
 
-    ret = pthread_cond_timedwait(cond, mutex, &ts);
     switch (ret) {
+    case 0:
+        return 0;
+    case ETIMEDOUT:
+        return -1;
     case EINVAL:
     case EPERM:
         fprintf(stderr, "FATAL: pthread_cond_timewait: %s\n",
                 strerror(ret));
         abort();
     default:
-        ;
+        return 0;
     }
 }
 
@@ -240,7 +623,7 @@ cb_dlhandle_t cb_dlopen(const char *library, char **errmsg)
         if (handle == NULL) {
             buffer = malloc(strlen(library) + 20);
             if (buffer == NULL) {
-                if (*errmsg) {
+                if (errmsg != NULL) {
                     *errmsg = strdup("Failed to allocate memory");
                 }
                 return NULL;
@@ -0,0 +1,304 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2016 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config.h"
+
+#include <errno.h>
+#include <limits.h>
+
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#elif defined(__APPLE__)
+/* Not in any public header, but exported by libSystem since 10.12 */
+extern int __ulock_wait(uint32_t operation, void *addr, uint64_t value,
+                        uint32_t timeout_us);
+extern int __ulock_wake(uint32_t operation, void *addr, uint64_t wake_value);
+#define UL_COMPARE_AND_WAIT 1
+#define ULF_WAKE_ALL 0x00000100
+#endif
+
+/*
+ * The count is only ever changed with atomic operations. A thread about
+ * to sleep first bumps the number of waiters and then sleeps only if
+ * the count is still the value it saw, so the posting side only needs
+ * to wake somebody (the system call) when there are waiters.
+ */
+
+#ifdef _MSC_VER
+#define atomic_load32(p) \
+    ((uint32_t)InterlockedCompareExchange((volatile LONG *)(p), 0, 0))
+#define atomic_cas32(p, expected, desired) \
+    (InterlockedCompareExchange((volatile LONG *)(p), (LONG)(desired), \
+                                (LONG)(expected)) == (LONG)(expected))
+#define atomic_add32(p, v) \
+    InterlockedExchangeAdd((volatile LONG *)(p), (LONG)(v))
+#define atomic_xchg32(p, v) \
+    ((uint32_t)InterlockedExchange((volatile LONG *)(p), (LONG)(v)))
+#else
+#define atomic_load32(p) __atomic_load_n(p, __ATOMIC_SEQ_CST)
+#define atomic_cas32(p, expected, desired) \
+    __sync_bool_compare_and_swap(p, expected, desired)
+#define atomic_add32(p, v) __atomic_fetch_add(p, v, __ATOMIC_SEQ_CST)
+#define atomic_xchg32(p, v) __atomic_exchange_n(p, v, __ATOMIC_SEQ_CST)
+#endif
+
+#define WAIT_FOREVER UINT64_MAX
+#define WAKE_ALL UINT32_MAX
+
+/*
+ * Block while *addr == expected, for at most ns nanoseconds. May
+ * return early (spuriously). Returns -1 if the wait timed out.
+ */
+static int addr_wait(cb_semaphore_t *sem, volatile uint32_t *addr,
+                     uint32_t expected, uint64_t ns)
+{
+#if defined(__linux__)
+    struct timespec ts;
+    struct timespec *tsp = NULL;
+    (void)sem;
+    if (ns != WAIT_FOREVER) {
+        ts.tv_sec = (time_t)(ns / 1000000000);
+        ts.tv_nsec = (long)(ns % 1000000000);
+        tsp = &ts;
+    }
+    if (syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, expected, tsp,
+                NULL, 0) == -1 && errno == ETIMEDOUT) {
+        return -1;
+    }
+    return 0;
+#elif defined(__APPLE__)
+    uint32_t timeout = 0; /* forever */
+    (void)sem;
+    if (ns != WAIT_FOREVER) {
+        uint64_t us = (ns + 999) / 1000;
+        timeout = us == 0 ? 1 : (us > UINT32_MAX ? UINT32_MAX : (uint32_t)us);
+    }
+    if (__ulock_wait(UL_COMPARE_AND_WAIT, (void *)addr, expected,
+                     timeout) == -1 && errno == ETIMEDOUT) {
+        return -1;
+    }
+    return 0;
+#elif defined(WIN32)
+    DWORD ms = INFINITE;
+    (void)sem;
+    if (ns != WAIT_FOREVER) {
+        uint64_t msec = (ns + 999999) / 1000000;
+        ms = msec >= INFINITE ? INFINITE - 1 : (DWORD)msec;
+    }
+    if (!WaitOnAddress(addr, &expected, sizeof(expected), ms)) {
+        return GetLastError() == ERROR_TIMEOUT ? -1 : 0;
+    }
+    return 0;
+#else
+    int ret = 0;
+    cb_mutex_enter(&sem->mutex);
+    if (*addr == expected) {
+        if (ns == WAIT_FOREVER) {
+            cb_cond_wait(&sem->cond, &sem->mutex);
+        } else {
+            ret = cb_cond_timedwait_ns(&sem->cond, &sem->mutex, ns);
+        }
+    }
+    cb_mutex_exit(&sem->mutex);
+    return ret;
+#endif
+}
+
+/* Wake up to n threads blocked in addr_wait on addr */
+static void addr_wake(cb_semaphore_t *sem, volatile uint32_t *addr,
+                      uint32_t n)
+{
+#if defined(__linux__)
+    (void)sem;
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE,
+            n > INT_MAX ? INT_MAX : (int)n, NULL, NULL, 0);
+#elif defined(__APPLE__)
+    (void)sem;
+    __ulock_wake(UL_COMPARE_AND_WAIT | (n == 1 ? 0 : ULF_WAKE_ALL),
+                 (void *)addr, 0);
+#elif defined(WIN32)
+    (void)sem;
+    if (n == 1) {
+        WakeByAddressSingle((PVOID)addr);
+    } else {
+        WakeByAddressAll((PVOID)addr);
+    }
+#else
+    /* Taking the mutex orders us after a waiter which checked the
+     * value but hasn't started waiting yet */
+    (void)addr;
+    cb_mutex_enter(&sem->mutex);
+    if (n == 1) {
+        cb_cond_signal(&sem->cond);
+    } else {
+        cb_cond_broadcast(&sem->cond);
+    }
+    cb_mutex_exit(&sem->mutex);
+#endif
+}
+
+/* Wait while sem->count == expected, keeping track of the deadline */
+static int wait_for_change(cb_semaphore_t *sem, uint32_t expected,
+                           uint64_t ns, hrtime_t deadline)
+{
+    int ret;
+    if (ns != WAIT_FOREVER) {
+        hrtime_t now = gethrtime();
+        if (now >= deadline) {
+            return -1;
+        }
+        ns = deadline - now;
+    }
+
+    atomic_add32(&sem->waiters, 1);
+    ret = addr_wait(sem, &sem->count, expected, ns);
+    atomic_add32(&sem->waiters, (uint32_t)-1);
+    return ret;
+}
+
+void cb_semaphore_initialize(cb_semaphore_t *sem, uint32_t count)
+{
+    sem->count = count;
+    sem->waiters = 0;
+#ifndef CB_SEMAPHORE_USE_FUTEX
+    cb_mutex_initialize(&sem->mutex);
+    cb_cond_initialize(&sem->cond);
+#endif
+}
+
+void cb_semaphore_destroy(cb_semaphore_t *sem)
+{
+#ifndef CB_SEMAPHORE_USE_FUTEX
+    cb_mutex_destroy(&sem->mutex);
+    cb_cond_destroy(&sem->cond);
+#else
+    (void)sem;
+#endif
+}
+
+void cb_semaphore_post(cb_semaphore_t *sem, uint32_t n)
+{
+    atomic_add32(&sem->count, n);
+    if (atomic_load32(&sem->waiters) != 0) {
+        addr_wake(sem, &sem->count, n);
+    }
+}
+
+int cb_semaphore_try_wait(cb_semaphore_t *sem)
+{
+    uint32_t count = atomic_load32(&sem->count);
+    while (count != 0) {
+        if (atomic_cas32(&sem->count, count, count - 1)) {
+            return 0;
+        }
+        count = atomic_load32(&sem->count);
+    }
+    return -1;
+}
+
+static int semaphore_wait(cb_semaphore_t *sem, uint64_t ns)
+{
+    hrtime_t deadline = 0;
+    if (ns != WAIT_FOREVER) {
+        deadline = gethrtime() + ns;
+        if (deadline < ns) {
+            /* That's a few hundred years from now... */
+            ns = WAIT_FOREVER;
+        }
+    }
+
+    while (cb_semaphore_try_wait(sem) != 0) {
+        if (wait_for_change(sem, 0, ns, deadline) == -1) {
+            /* One last attempt, we might have been posted since */
+            return cb_semaphore_try_wait(sem);
+        }
+    }
+    return 0;
+}
+
+void cb_semaphore_wait(cb_semaphore_t *sem)
+{
+    (void)semaphore_wait(sem, WAIT_FOREVER);
+}
+
+int cb_semaphore_timedwait_ns(cb_semaphore_t *sem, uint64_t ns)
+{
+    if (ns == WAIT_FOREVER) {
+        --ns;
+    }
+    return semaphore_wait(sem, ns);
+}
+
+void cb_event_initialize(cb_event_t *event)
+{
+    cb_semaphore_initialize(event, 0);
+}
+
+void cb_event_destroy(cb_event_t *event)
+{
+    cb_semaphore_destroy(event);
+}
+
+void cb_event_set(cb_event_t *event)
+{
+    if (atomic_xchg32(&event->count, 1) == 0 &&
+        atomic_load32(&event->waiters) != 0) {
+        addr_wake(event, &event->count, WAKE_ALL);
+    }
+}
+
+void cb_event_reset(cb_event_t *event)
+{
+    (void)atomic_xchg32(&event->count, 0);
+}
+
+int cb_event_is_set(cb_event_t *event)
+{
+    return atomic_load32(&event->count) != 0;
+}
+
+static int event_wait(cb_event_t *event, uint64_t ns)
+{
+    hrtime_t deadline = 0;
+    if (ns != WAIT_FOREVER) {
+        deadline = gethrtime() + ns;
+        if (deadline < ns) {
+            /* That's a few hundred years from now... */
+            ns = WAIT_FOREVER;
+        }
+    }
+
+    while (atomic_load32(&event->count) == 0) {
+        if (wait_for_change(event, 0, ns, deadline) == -1) {
+            return cb_event_is_set(event) ? 0 : -1;
+        }
+    }
+    return 0;
+}
+
+void cb_event_wait(cb_event_t *event)
+{
+    (void)event_wait(event, WAIT_FOREVER);
+}
+
+int cb_event_timedwait_ns(cb_event_t *event, uint64_t ns)
+{
+    if (ns == WAIT_FOREVER) {
+        --ns;
+    }
+    return event_wait(event, ns);
+}
@@ -29,42 +29,105 @@
 
 static uint64_t timeofday_offset = 0;
 
+#ifdef _MSC_VER
+#define atomic_load64(p) \
+    ((uint64_t)InterlockedCompareExchange64((volatile LONG64 *)(p), 0, 0))
+#define atomic_store64(p, v) \
+    InterlockedExchange64((volatile LONG64 *)(p), (LONG64)(v))
+#else
+#define atomic_load64(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define atomic_store64(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#endif
+
 /*
-    return a monotonically increasing value with a seconds frequency.
-*/
-uint64_t cb_get_monotonic_seconds() {
-    uint64_t seconds = 0;
+ * The values published by the ticker thread. ticker_running is only
+ * set once both clocks have been cached.
+ */
+static volatile uint64_t cached_monotonic_ms;
+static volatile uint64_t cached_timeofday_us;
+static volatile uint64_t ticker_running;
+
+static cb_mutex_t ticker_mutex;
+static cb_cond_t ticker_cond;
+static cb_thread_t ticker_tid;
+static int ticker_stop;
+static unsigned int ticker_interval;
+
+#if defined(__APPLE__)
+static mach_timebase_info_data_t timebase;
+static pthread_once_t timebase_once = PTHREAD_ONCE_INIT;
+
+static void init_timebase(void)
+{
+    mach_timebase_info(&timebase);
+}
+#endif
+
+static uint64_t monotonic_ms_now(void)
+{
 #if defined(WIN32)
     /* GetTickCound64 gives us near 60years of ticks...*/
-    seconds =  (GetTickCount64() / 1000);
+    return GetTickCount64();
 #elif defined(__APPLE__)
     uint64_t time = mach_absolute_time();
-
-    static mach_timebase_info_data_t timebase;
-    if (timebase.denom == 0) {
-      mach_timebase_info(&timebase);
-    }
-
-    seconds = (double)time * timebase.numer / timebase.denom * 1e-9;
+    pthread_once(&timebase_once, init_timebase);
+    return (uint64_t)((double)time * timebase.numer / timebase.denom * 1e-6);
 #elif defined(__linux__) || defined(__sun) || defined(__FreeBSD__)
     /* Linux and Solaris can use clock_gettime */
     struct timespec tm;
+#if defined(CLOCK_MONOTONIC_COARSE)
+    /* Read from the vDSO without touching the clock hardware */
+    if (clock_gettime(CLOCK_MONOTONIC_COARSE, &tm) == -1) {
+        abort();
+    }
+#elif defined(CLOCK_MONOTONIC_FAST)
+    if (clock_gettime(CLOCK_MONOTONIC_FAST, &tm) == -1) {
+        abort();
+    }
+#else
     if (clock_gettime(CLOCK_MONOTONIC, &tm) == -1) {
         abort();
     }
-    seconds = tm.tv_sec;
+#endif
+    return (uint64_t)tm.tv_sec * 1000 + tm.tv_nsec / 1000000;
 #else
 #error "Don't know how to build cb_get_monotonic_seconds"
 #endif
+}
 
-    return seconds;
+static uint64_t timeofday_us_now(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/*
+    return a monotonically increasing value with a seconds frequency.
+*/
+uint64_t cb_get_monotonic_seconds() {
+    return cb_get_monotonic_milliseconds() / 1000;
+}
+
+uint64_t cb_get_monotonic_milliseconds(void) {
+    if (atomic_load64(&ticker_running)) {
+        return atomic_load64(&cached_monotonic_ms);
+    }
+    return monotonic_ms_now();
 }
 
 /*
     obtain a timeval structure containing the current time since EPOCH.
 */
 int cb_get_timeofday(struct timeval *tv) {
-    int rv = gettimeofday(tv, NULL);
+    int rv = 0;
+    if (atomic_load64(&ticker_running)) {
+        uint64_t now = atomic_load64(&cached_timeofday_us);
+        tv->tv_sec = (long)(now / 1000000);
+        tv->tv_usec = (long)(now % 1000000);
+    } else {
+        rv = gettimeofday(tv, NULL);
+    }
 #if defined(WIN32)
     // WIN32: tv_sec is less precise than normal (it's a long); so explicitly
     // downcast to silence implicit downcast warning.
@@ -83,6 +146,59 @@ void cb_set_timeofday_offset(uint64_t offset) {
     timeofday_offset = offset;
 }
 
+static void update_clocks(void) {
+    atomic_store64(&cached_monotonic_ms, monotonic_ms_now());
+    atomic_store64(&cached_timeofday_us, timeofday_us_now());
+}
+
+static void ticker_main(void *arg) {
+    (void)arg;
+    cb_mutex_enter(&ticker_mutex);
+    while (!ticker_stop) {
+        cb_cond_timedwait_ns(&ticker_cond, &ticker_mutex,
+                             (uint64_t)ticker_interval * 1000000);
+        update_clocks();
+    }
+    cb_mutex_exit(&ticker_mutex);
+}
+
+int cb_start_clock_ticker(unsigned int interval_ms) {
+    if (atomic_load64(&ticker_running)) {
+        return -1;
+    }
+
+    cb_mutex_initialize(&ticker_mutex);
+    cb_cond_initialize(&ticker_cond);
+    ticker_stop = 0;
+    ticker_interval = interval_ms ? interval_ms : 1;
+    update_clocks();
+
+    if (cb_create_named_thread(&ticker_tid, ticker_main, NULL, 0,
+                               "cb_clock") != 0) {
+        cb_cond_destroy(&ticker_cond);
+        cb_mutex_destroy(&ticker_mutex);
+        return -1;
+    }
+    atomic_store64(&ticker_running, 1);
+    return 0;
+}
+
+void cb_stop_clock_ticker(void) {
+    if (!atomic_load64(&ticker_running)) {
+        return;
+    }
+    atomic_store64(&ticker_running, 0);
+
+    cb_mutex_enter(&ticker_mutex);
+    ticker_stop = 1;
+    cb_cond_signal(&ticker_cond);
+    cb_mutex_exit(&ticker_mutex);
+    cb_join_thread(ticker_tid);
+
+    cb_cond_destroy(&ticker_cond);
+    cb_mutex_destroy(&ticker_mutex);
+}
+
 
 int cb_gmtime_r(const time_t *clock, struct tm *result)
 {
@@ -15,12 +15,19 @@
  *   limitations under the License.
  */
 #include "config.h"
+#include "mutex_profile.h"
+#include "aio_engine.h"
 
+#include <platform/epoch.h>
 #include <platform/strerror.h>
+#include <platform/threadpool.h>
 #include <assert.h>
 #include <stdio.h>
 #include <fcntl.h>
 #include <io.h>
+#include <memory>
+#include <new>
+#include <unordered_set>
 #include <vector>
 
 struct thread_execute {
@@ -33,6 +40,7 @@ static DWORD WINAPI platform_thread_wrap(LPVOID arg)
     auto *ctx = reinterpret_cast<struct thread_execute*>(arg);
     assert(ctx);
     ctx->func(ctx->argument);
+    cb_epoch_unregister_thread();
     delete ctx;
     return 0;
 }
@@ -44,7 +52,101 @@ int cb_create_thread(cb_thread_t *id,
                      void *arg,
                      int detached)
 {
-    HANDLE handle;
+    cb_thread_attr_t attr;
+    cb_thread_attr_initialize(&attr);
+    attr.detached = detached;
+    return cb_create_thread_ex(id, func, arg, &attr);
+}
+
+__declspec(dllexport)
+int cb_create_named_thread(cb_thread_t *id, void (*func)(void *arg), void *arg,
+                     int detached, const char* name)
+{
+    // Thread naming not supported on WIN32, but cb_create_thread_ex
+    // still checks the length of the name like the other platforms
+    cb_thread_attr_t attr;
+    cb_thread_attr_initialize(&attr);
+    attr.name = name;
+    attr.detached = detached;
+    return cb_create_thread_ex(id, func, arg, &attr);
+}
+
+__declspec(dllexport)
+void cb_thread_attr_initialize(cb_thread_attr_t *attr)
+{
+    memset(attr, 0, sizeof(*attr));
+    attr->numa_node = -1;
+    attr->priority = CB_THREAD_PRIORITY_NORMAL;
+}
+
+__declspec(dllexport)
+int cb_get_numa_node_count(void)
+{
+    ULONG highest;
+    if (!GetNumaHighestNodeNumber(&highest)) {
+        return 1;
+    }
+    return int(highest) + 1;
+}
+
+/*
+ * Build the group affinity for the requested CPUs / NUMA node. Returns
+ * false if the set is empty (or spans multiple processor groups)
+ */
+static bool build_affinity(const cb_thread_attr_t *attr,
+                           GROUP_AFFINITY &affinity)
+{
+    memset(&affinity, 0, sizeof(affinity));
+    if (attr->numa_node >= 0) {
+        if (!GetNumaNodeProcessorMaskEx(USHORT(attr->numa_node), &affinity)) {
+            return false;
+        }
+    }
+
+    if (attr->cpus != nullptr && attr->ncpus > 0) {
+        WORD group = WORD(attr->cpus[0] / 64);
+        KAFFINITY mask = 0;
+        for (size_t ii = 0; ii < attr->ncpus; ++ii) {
+            if (attr->cpus[ii] / 64 != group) {
+                return false;
+            }
+            mask |= KAFFINITY(1) << (attr->cpus[ii] % 64);
+        }
+        if (attr->numa_node >= 0) {
+            if (affinity.Group != group) {
+                return false;
+            }
+            affinity.Mask &= mask;
+        } else {
+            affinity.Group = group;
+            affinity.Mask = mask;
+        }
+    }
+
+    return affinity.Mask != 0;
+}
+
+__declspec(dllexport)
+int cb_create_thread_ex(cb_thread_t *id, cb_thread_main_func func, void *arg,
+                        const cb_thread_attr_t *attr)
+{
+    cb_thread_attr_t defaults;
+    if (attr == nullptr) {
+        cb_thread_attr_initialize(&defaults);
+        attr = &defaults;
+    }
+
+    // The name is ignored, but be consistent with the other platforms
+    if (attr->name != nullptr && strlen(attr->name) > 15) {
+        return -1;
+    }
+
+    GROUP_AFFINITY affinity;
+    bool setaffinity = attr->numa_node >= 0 ||
+                       (attr->cpus != nullptr && attr->ncpus > 0);
+    if (setaffinity && !build_affinity(attr, affinity)) {
+        return -1;
+    }
 
     struct thread_execute *ctx;
     try {
@@ -56,26 +158,38 @@ int cb_create_thread(cb_thread_t *id,
     ctx->func = func;
     ctx->argument = arg;
 
-    handle = CreateThread(NULL, 0, platform_thread_wrap, ctx, 0, id);
+    // Create the thread suspended so that the affinity and priority
+    // is in place before it starts running
+    DWORD flags = CREATE_SUSPENDED;
+    if (attr->stack_size != 0) {
+        flags |= STACK_SIZE_PARAM_IS_A_RESERVATION;
+    }
+    HANDLE handle = CreateThread(NULL, attr->stack_size, platform_thread_wrap,
+                                 ctx, flags, id);
     if (handle == NULL) {
         delete ctx;
         return -1;
-    } else {
-        if (detached) {
-            CloseHandle(handle);
-        }
     }
 
-    return 0;
-}
+    if (setaffinity && !SetThreadGroupAffinity(handle, &affinity, NULL)) {
+        TerminateThread(handle, 1);
+        CloseHandle(handle);
+        delete ctx;
+        return -1;
+    }
 
-__declspec(dllexport)
-int cb_create_named_thread(cb_thread_t *id, void (*func)(void *arg), void *arg,
-                     int detached, const char* name)
-{
-    // Thread naming not supported on WIN32, just call down to non-named
-    // variant.
-    return cb_create_thread(id, func, arg, detached);
+    if (attr->priority < 0) {
+        SetThreadPriority(handle, THREAD_PRIORITY_BELOW_NORMAL);
+    } else if (attr->priority > 0) {
+        SetThreadPriority(handle, THREAD_PRIORITY_ABOVE_NORMAL);
+    }
+
+    ResumeThread(handle);
+    if (attr->detached) {
+        CloseHandle(handle);
+    }
+
+    return 0;
 }
 
 __declspec(dllexport)
@@ -118,27 +232,131 @@ void cb_mutex_initialize(cb_mutex_t *mutex)
 __declspec(dllexport)
 void cb_mutex_destroy(cb_mutex_t *mutex)
 {
+    cb_mutex_profile_forget(mutex);
     DeleteCriticalSection(mutex);
 }
 
 __declspec(dllexport)
 void cb_mutex_enter(cb_mutex_t *mutex)
 {
+    if (cb_mutex_profiling) {
+        if (TryEnterCriticalSection(mutex)) {
+            cb_mutex_profile_acquired(mutex, 0, 0);
+            return;
+        }
+        hrtime_t start = gethrtime();
+        EnterCriticalSection(mutex);
+        cb_mutex_profile_acquired(mutex, 1, gethrtime() - start);
+        return;
+    }
+
     EnterCriticalSection(mutex);
 }
 
 __declspec(dllexport)
 int cb_mutex_try_enter(cb_mutex_t *mutex)
 {
-    return TryEnterCriticalSection(mutex) ? 0 : -1;
+    if (!TryEnterCriticalSection(mutex)) {
+        return -1;
+    }
+    if (cb_mutex_profiling) {
+        cb_mutex_profile_acquired(mutex, 0, 0);
+    }
+    return 0;
 }
 
 __declspec(dllexport)
 void cb_mutex_exit(cb_mutex_t *mutex)
 {
+    if (cb_mutex_profiling) {
+        cb_mutex_profile_release(mutex);
+    }
     LeaveCriticalSection(mutex);
 }
 
+__declspec(dllexport)
+void cb_adaptive_mutex_initialize(cb_adaptive_mutex_t *mutex,
+                                  unsigned int spins)
+{
+    mutex->spins = spins ? spins : CB_ADAPTIVE_MUTEX_DEFAULT_SPINS;
+    // The critical section does the spinning for us
+    InitializeCriticalSectionAndSpinCount(&mutex->mutex, mutex->spins);
+}
+
+__declspec(dllexport)
+void cb_adaptive_mutex_destroy(cb_adaptive_mutex_t *mutex)
+{
+    DeleteCriticalSection(&mutex->mutex);
+}
+
+__declspec(dllexport)
+void cb_adaptive_mutex_enter(cb_adaptive_mutex_t *mutex)
+{
+    EnterCriticalSection(&mutex->mutex);
+}
+
+__declspec(dllexport)
+int cb_adaptive_mutex_try_enter(cb_adaptive_mutex_t *mutex)
+{
+    return TryEnterCriticalSection(&mutex->mutex) ? 0 : -1;
+}
+
+__declspec(dllexport)
+void cb_adaptive_mutex_exit(cb_adaptive_mutex_t *mutex)
+{
+    LeaveCriticalSection(&mutex->mutex);
+}
+
+__declspec(dllexport)
+void cb_rwlock_initialize(cb_rwlock_t *rwlock, int prefer_writer)
+{
+    (void)prefer_writer;
+    InitializeSRWLock(rwlock);
+}
+
+__declspec(dllexport)
+void cb_rwlock_destroy(cb_rwlock_t *rwlock)
+{
+    // SRW locks don't allocate any resources
+    (void)rwlock;
+}
+
+__declspec(dllexport)
+void cb_rwlock_reader_enter(cb_rwlock_t *rwlock)
+{
+    AcquireSRWLockShared(rwlock);
+}
+
+__declspec(dllexport)
+int cb_rwlock_reader_try_enter(cb_rwlock_t *rwlock)
+{
+    return TryAcquireSRWLockShared(rwlock) ? 0 : -1;
+}
+
+__declspec(dllexport)
+void cb_rwlock_reader_exit(cb_rwlock_t *rwlock)
+{
+    ReleaseSRWLockShared(rwlock);
+}
+
+__declspec(dllexport)
+void cb_rwlock_writer_enter(cb_rwlock_t *rwlock)
+{
+    AcquireSRWLockExclusive(rwlock);
+}
+
+__declspec(dllexport)
+int cb_rwlock_writer_try_enter(cb_rwlock_t *rwlock)
+{
+    return TryAcquireSRWLockExclusive(rwlock) ? 0 : -1;
+}
+
+__declspec(dllexport)
+void cb_rwlock_writer_exit(cb_rwlock_t *rwlock)
+{
+    ReleaseSRWLockExclusive(rwlock);
+}
+
 __declspec(dllexport)
 void cb_cond_initialize(cb_cond_t *cond)
 {
@@ -151,15 +369,44 @@ void cb_cond_destroy(cb_cond_t *cond)
     (void)cond;
 }
 
+// The mutex isn't held while waiting, so don't count it as a hold
+static BOOL cond_sleep(cb_cond_t *cond, cb_mutex_t *mutex, DWORD msec)
+{
+    if (cb_mutex_profiling) {
+        cb_mutex_profile_release(mutex);
+    }
+    BOOL ret = SleepConditionVariableCS(cond, mutex, msec);
+    DWORD error = GetLastError();
+    if (cb_mutex_profiling) {
+        cb_mutex_profile_acquired(mutex, 0, 0);
+    }
+    SetLastError(error);
+    return ret;
+}
+
 __declspec(dllexport)
 void cb_cond_wait(cb_cond_t *cond, cb_mutex_t *mutex)
 {
-    SleepConditionVariableCS(cond, mutex, INFINITE);
+    (void)cond_sleep(cond, mutex, INFINITE);
 }
 
 __declspec(dllexport)
 void cb_cond_timedwait(cb_cond_t *cond, cb_mutex_t *mutex, unsigned int msec) {
-    SleepConditionVariableCS(cond, mutex, msec);
+    (void)cond_sleep(cond, mutex, msec);
+}
+
+__declspec(dllexport)
+int cb_cond_timedwait_ns(cb_cond_t *cond, cb_mutex_t *mutex, uint64_t ns)
+{
+    // Round up, and don't let a huge timeout turn into INFINITE
+    uint64_t msec = (ns + 999999) / 1000000;
+    if (msec >= INFINITE) {
+        msec = INFINITE - 1;
+    }
+    if (cond_sleep(cond, mutex, DWORD(msec))) {
+        return 0;
+    }
+    return GetLastError() == ERROR_TIMEOUT ? -1 : 0;
 }
 
 __declspec(dllexport)
@@ -278,3 +525,218 @@ int platform_set_binary_mode(FILE *fp)
 {
     return _setmode(_fileno(fp), _O_BINARY);
 }
+
+/*
+ * The IOCP engine for cb_aio_t. Every request in flight has a slot with
+ * the OVERLAPPED the kernel completes, and the completions are reaped
+ * in batches with GetQueuedCompletionStatusEx. Windows has no
+ * asynchronous flush, so FlushFileBuffers is run on a thread pool which
+ * posts the result to the port. So do requests which fail to start, so
+ * that all of the results come the same way.
+ */
+
+/* The completion key of the packets we post ourselves */
+#define IOCP_POSTED 1
+
+namespace {
+
+class IocpEngine : public Couchbase::AioEngine {
+public:
+    IocpEngine() : port(NULL), flusher(nullptr), free_slots(nullptr) {
+    }
+
+    ~IocpEngine() {
+        if (flusher != nullptr) {
+            cb_threadpool_destroy(flusher);
+        }
+        if (port != NULL) {
+            CloseHandle(port);
+        }
+    }
+
+    bool initialize(unsigned int depth) {
+        port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+        if (port == NULL) {
+            return false;
+        }
+        slots.resize(depth);
+        for (auto &slot : slots) {
+            slot.engine = this;
+            slot.task.func = flush;
+            slot.next = free_slots;
+            free_slots = &slot;
+        }
+        return true;
+    }
+
+    const char *name() const override {
+        return "iocp";
+    }
+
+    int registerFiles(const cb_aio_file_t *files,
+                      unsigned int nfiles) override {
+        registered.clear();
+        for (unsigned int ii = 0; ii < nfiles; ++ii) {
+            if (!associate(files[ii])) {
+                registered.clear();
+                return -1;
+            }
+            registered.insert(files[ii]);
+        }
+        return 0;
+    }
+
+    int submit(const Couchbase::AioOp *ops, unsigned int nops) override {
+        for (unsigned int ii = 0; ii < nops; ++ii) {
+            const Couchbase::AioOp &op = ops[ii];
+            if ((registered.find(op.file) == registered.end() &&
+                 !associate(op.file)) ||
+                (op.opcode != CB_AIO_READ && op.opcode != CB_AIO_WRITE &&
+                 !startFlusher())) {
+                return ii > 0 ? int(ii) : -1;
+            }
+
+            Slot *slot = free_slots;
+            free_slots = slot->next;
+            memset(&slot->ov, 0, sizeof(slot->ov));
+            slot->ov.Offset = DWORD(op.offset);
+            slot->ov.OffsetHigh = DWORD(op.offset >> 32);
+            slot->op = op;
+            slot->error = 0;
+
+            BOOL ok;
+            switch (op.opcode) {
+            case CB_AIO_READ:
+                ok = ReadFile(op.file, op.buffer, DWORD(op.length), NULL,
+                              &slot->ov);
+                break;
+            case CB_AIO_WRITE:
+                ok = WriteFile(op.file, op.buffer, DWORD(op.length), NULL,
+                               &slot->ov);
+                break;
+            default:
+                cb_threadpool_submit(flusher, &slot->task);
+                continue;
+            }
+            if (!ok && GetLastError() != ERROR_IO_PENDING) {
+                /* Nothing is queued to the port for this one */
+                slot->error = GetLastError();
+                post(slot);
+            }
+        }
+        return int(nops);
+    }
+
+    int complete(cb_aio_event_t *events, unsigned int min,
+                 unsigned int max) override {
+        OVERLAPPED_ENTRY entries[64];
+        unsigned int count = 0;
+        while (count < max) {
+            ULONG wanted = ULONG(max - count);
+            if (wanted > 64) {
+                wanted = 64;
+            }
+            ULONG nentries = 0;
+            if (!GetQueuedCompletionStatusEx(port, entries, wanted, &nentries,
+                                             count < min ? INFINITE : 0,
+                                             FALSE)) {
+                if (GetLastError() == WAIT_TIMEOUT) {
+                    break;
+                }
+                return count > 0 ? int(count) : -1;
+            }
+            for (ULONG ii = 0; ii < nentries; ++ii) {
+                Slot *slot = CONTAINING_RECORD(entries[ii].lpOverlapped,
+                                               Slot, ov);
+                finish(slot, entries[ii].lpCompletionKey == IOCP_POSTED,
+                       events[count++]);
+            }
+        }
+        return int(count);
+    }
+
+private:
+    struct Slot {
+        /* The kernel's (or our own) completion */
+        OVERLAPPED ov;
+        /* For running the flush on the flusher */
+        cb_threadpool_task task;
+        IocpEngine *engine;
+        Couchbase::AioOp op;
+        /* Set by the flusher, or if the request failed to start */
+        DWORD error;
+        Slot *next;
+    };
+
+    /*
+     * A handle can only be bound to a port once, and fails with
+     * ERROR_INVALID_PARAMETER after that. We can't remember which
+     * handles we bound, as the values are reused once a file is closed,
+     * so the unregistered files are simply bound again for every
+     * request.
+     */
+    bool associate(HANDLE file) {
+        return CreateIoCompletionPort(file, port, 0, 0) != NULL ||
+            GetLastError() == ERROR_INVALID_PARAMETER;
+    }
+
+    bool startFlusher(void) {
+        if (flusher == nullptr) {
+            flusher = cb_threadpool_create(0, "aio flush");
+        }
+        return flusher != nullptr;
+    }
+
+    void post(Slot *slot) {
+        PostQueuedCompletionStatus(port, 0, IOCP_POSTED, &slot->ov);
+    }
+
+    static void flush(cb_threadpool_task *task) {
+        Slot *slot = CONTAINING_RECORD(task, Slot, task);
+        if (!FlushFileBuffers(slot->op.file)) {
+            slot->error = GetLastError();
+        }
+        slot->engine->post(slot);
+    }
+
+    void finish(Slot *slot, bool posted, cb_aio_event_t &event) {
+        event.user_data = slot->op.user_data;
+        event.result = 0;
+        event.error = 0;
+        DWORD error = slot->error;
+        if (!posted) {
+            DWORD nbytes;
+            if (GetOverlappedResult(slot->op.file, &slot->ov, &nbytes,
+                                    FALSE)) {
+                event.result = ssize_t(nbytes);
+            } else {
+                error = GetLastError();
+            }
+        }
+        /* Reading at the end of the file just reads nothing */
+        if (error != 0 && error != ERROR_HANDLE_EOF) {
+            event.result = -1;
+            event.error = int(error);
+        }
+        slot->next = free_slots;
+        free_slots = slot;
+    }
+
+    HANDLE port;
+    cb_threadpool_t *flusher;
+    std::vector<Slot> slots;
+    Slot *free_slots;
+    /* The registered files (which stay open while they are registered) */
+    std::unordered_set<HANDLE> registered;
+};
+
+}
+
+Couchbase::AioEngine *Couchbase::createIocpEngine(unsigned int depth)
+{
+    std::unique_ptr<IocpEngine> engine(new (std::nothrow) IocpEngine);
+    if (!engine || !engine->initialize(depth)) {
+        return nullptr;
+    }
+    return engine.release();
+}
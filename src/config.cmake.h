@@ -5,6 +5,23 @@
 #cmakedefine HAVE_BACKTRACE 1
 #cmakedefine HAVE_DLADDR 1
 #cmakedefine HAVE_PTHREAD_SETNAME_NP 1
+#cmakedefine HAVE_PTHREAD_MUTEX_ADAPTIVE_NP 1
+#cmakedefine HAVE_PTHREAD_RWLOCKATTR_SETKIND_NP 1
+#cmakedefine HAVE_PTHREAD_CONDATTR_SETCLOCK 1
+#cmakedefine HAVE_GETRANDOM 1
+#cmakedefine HAVE_ARC4RANDOM_BUF 1
+#cmakedefine HAVE_MEMFD_CREATE 1
+#cmakedefine HAVE_COPY_FILE_RANGE 1
+#cmakedefine HAVE_FALLOCATE 1
+#cmakedefine HAVE_POSIX_FALLOCATE 1
+#cmakedefine HAVE_FICLONE 1
+#cmakedefine HAVE_CLONEFILE 1
+#cmakedefine HAVE_SENDMMSG 1
+#cmakedefine HAVE_RECVMMSG 1
+#cmakedefine HAVE_LINUX_SENDFILE 1
+#cmakedefine HAVE_BSD_SENDFILE 1
+#cmakedefine HAVE_FDATASYNC 1
+#cmakedefine HAVE_LINUX_IO_URING 1
 
 #ifdef WIN32
 #include <winsock2.h>
@@ -0,0 +1,190 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2016 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config.h"
+
+#include <platform/counter.h>
+#include <cJSON.h>
+
+#include <atomic>
+#include <cstdlib>
+#include <map>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+
+/*
+ * Every thread is given the next shard number the first time it uses a
+ * counter, so the threads spread evenly over the shards (and the first
+ * ones get a shard each). The number of shards is the same for all of
+ * the counters, so a thread uses the same slot index in all of them.
+ */
+
+#define CACHELINE 64
+#define MAX_SHARDS 256
+
+struct cb_counter_shard {
+    std::atomic<uint64_t> value;
+    char pad[CACHELINE - sizeof(std::atomic<uint64_t>)];
+};
+
+struct cb_counter {
+    cb_counter_shard *shards;
+    /* What was allocated, shards is aligned to a cache line inside it */
+    void *memory;
+    std::string name;
+    bool registered;
+};
+
+static std::mutex registry_mutex;
+static std::map<std::string, cb_counter_t *> registry;
+
+static std::atomic<size_t> next_shard;
+
+static size_t shard_count(void) {
+    static const size_t count = [] {
+        size_t cpus = std::thread::hardware_concurrency();
+        size_t ret = 1;
+        while (ret < 2 * cpus && ret < MAX_SHARDS) {
+            ret *= 2;
+        }
+        return ret;
+    }();
+    return count;
+}
+
+static size_t my_shard(void) {
+    static thread_local size_t shard = next_shard.fetch_add(
+        1, std::memory_order_relaxed) & (shard_count() - 1);
+    return shard;
+}
+
+PLATFORM_PUBLIC_API
+cb_counter_t *cb_counter_create(const char *name) {
+    cb_counter_t *counter = new (std::nothrow) cb_counter_t;
+    if (counter == nullptr) {
+        return nullptr;
+    }
+
+    const size_t nshards = shard_count();
+    counter->memory = malloc(nshards * sizeof(cb_counter_shard) + CACHELINE);
+    if (counter->memory == nullptr) {
+        delete counter;
+        return nullptr;
+    }
+    uintptr_t aligned = (reinterpret_cast<uintptr_t>(counter->memory) +
+                         CACHELINE - 1) & ~uintptr_t(CACHELINE - 1);
+    counter->shards = reinterpret_cast<cb_counter_shard *>(aligned);
+    for (size_t ii = 0; ii < nshards; ++ii) {
+        new (&counter->shards[ii]) cb_counter_shard;
+        counter->shards[ii].value.store(0, std::memory_order_relaxed);
+    }
+
+    counter->registered = false;
+    if (name != nullptr) {
+        counter->name = name;
+        std::lock_guard<std::mutex> guard(registry_mutex);
+        if (!registry.emplace(counter->name, counter).second) {
+            free(counter->memory);
+            delete counter;
+            return nullptr;
+        }
+        counter->registered = true;
+    }
+    return counter;
+}
+
+PLATFORM_PUBLIC_API
+void cb_counter_destroy(cb_counter_t *counter) {
+    if (counter == nullptr) {
+        return;
+    }
+    if (counter->registered) {
+        std::lock_guard<std::mutex> guard(registry_mutex);
+        registry.erase(counter->name);
+    }
+    free(counter->memory);
+    delete counter;
+}
+
+PLATFORM_PUBLIC_API
+void cb_counter_add(cb_counter_t *counter, uint64_t value) {
+    counter->shards[my_shard()].value.fetch_add(value,
+                                                std::memory_order_relaxed);
+}
+
+PLATFORM_PUBLIC_API
+void cb_counter_increment(cb_counter_t *counter) {
+    cb_counter_add(counter, 1);
+}
+
+PLATFORM_PUBLIC_API
+uint64_t cb_counter_get(const cb_counter_t *counter) {
+    uint64_t ret = 0;
+    const size_t nshards = shard_count();
+    for (size_t ii = 0; ii < nshards; ++ii) {
+        ret += counter->shards[ii].value.load(std::memory_order_relaxed);
+    }
+    return ret;
+}
+
+PLATFORM_PUBLIC_API
+uint64_t cb_counter_reset(cb_counter_t *counter) {
+    uint64_t ret = 0;
+    const size_t nshards = shard_count();
+    for (size_t ii = 0; ii < nshards; ++ii) {
+        ret += counter->shards[ii].value.exchange(0, std::memory_order_relaxed);
+    }
+    return ret;
+}
+
+PLATFORM_PUBLIC_API
+const char *cb_counter_get_name(const cb_counter_t *counter) {
+    return counter->registered ? counter->name.c_str() : nullptr;
+}
+
+PLATFORM_PUBLIC_API
+cb_counter_t *cb_counter_find(const char *name) {
+    std::lock_guard<std::mutex> guard(registry_mutex);
+    auto iter = registry.find(name);
+    return iter == registry.end() ? nullptr : iter->second;
+}
+
+PLATFORM_PUBLIC_API
+void cb_counter_stats_iterate(cb_counter_callback callback, void *ctx) {
+    std::lock_guard<std::mutex> guard(registry_mutex);
+    for (const auto &entry : registry) {
+        callback(entry.first.c_str(), cb_counter_get(entry.second), ctx);
+    }
+}
+
+static void add_json_stats(const char *name, uint64_t value, void *ctx) {
+    cJSON *obj = reinterpret_cast<cJSON *>(ctx);
+    // JSON integers are signed, so clamp rather than turning the values
+    // above INT64_MAX (such as a counter which wrapped) negative
+    cJSON_AddItemToObject(obj, name,
+                          cJSON_CreateInt64(value > uint64_t(INT64_MAX)
+                                                ? INT64_MAX
+                                                : int64_t(value)));
+}
+
+PLATFORM_PUBLIC_API
+struct cJSON *cb_counter_stats_to_json(void) {
+    cJSON *obj = cJSON_CreateObject();
+    cb_counter_stats_iterate(add_json_stats, obj);
+    return obj;
+}
@@ -15,16 +15,281 @@
  *   limitations under the License.
  */
 #include "config.h"
+#include <atomic>
 #include <chrono>
+#include <cstdio>
+#include <cstring>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__i386__) || defined(__x86_64__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
+
+/*
+ * gethrtime reads the CPU's cycle counter where it is known to tick at
+ * a constant rate on all cores (an invariant TSC on x86, the generic
+ * timer's virtual counter on ARMv8), and scales it to nanoseconds on
+ * the std::chrono::steady_clock timeline. Everywhere else (or until
+ * the counter is calibrated) it uses steady_clock directly.
+ *
+ * The x86 TSC frequency isn't architecturally visible, so it is
+ * calibrated against steady_clock: first over ~10ms (which takes no
+ * time at startup; we just wait for enough time to pass between the
+ * calls), and then once more after about a second for extra precision.
+ * Each calibration starts at the current reading of the previous one
+ * so the time never jumps. A calibration is filled in before it is
+ * published through current and never changed afterwards, so a reader
+ * always sees a base and scale which belong together.
+ *
+ * A thread may still read a slightly smaller time after moving to a
+ * new calibration (the scale changes), or from a core whose counter is
+ * behind the one the calibration was read on, so every thread's time is
+ * clamped to be at least the last one it returned.
+ */
+
+#if (defined(__x86_64__) || defined(_M_X64)) || defined(__aarch64__)
+#define HAVE_CYCLE_COUNTER 1
+#endif
+
+static uint64_t steady_ns(void) {
+    auto now = std::chrono::steady_clock::now();
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(now.time_since_epoch()).count();
+}
+
+#ifdef HAVE_CYCLE_COUNTER
+
+struct calibration {
+    /* ns = base_ns + ((ticks - base_ticks) * mult) >> 32 */
+    uint64_t base_ticks;
+    uint64_t base_ns;
+    uint64_t mult;
+    /* Recalibrate once ticks passes this value */
+    uint64_t refine_at;
+};
+
+static bool use_rdtscp;
+
+static inline uint64_t read_ticks(void) {
+#if defined(__aarch64__)
+    uint64_t value;
+    __asm__ __volatile__("isb; mrs %0, cntvct_el0" : "=r"(value) : : "memory");
+    return value;
+#else
+    if (use_rdtscp) {
+        unsigned int aux;
+        return __rdtscp(&aux);
+    }
+    _mm_lfence();
+    return __rdtsc();
+#endif
+}
+
+static inline uint64_t mul_shift32(uint64_t a, uint64_t b) {
+#if defined(_MSC_VER)
+    uint64_t hi;
+    uint64_t lo = _umul128(a, b, &hi);
+    return (hi << 32) | (lo >> 32);
+#else
+    return uint64_t(((unsigned __int128)a * b) >> 32);
+#endif
+}
+
+#if defined(__x86_64__) || defined(_M_X64)
+static void cpuid(unsigned int leaf, unsigned int regs[4]) {
+#if defined(_MSC_VER)
+    __cpuid(reinterpret_cast<int *>(regs), int(leaf));
+#else
+    __cpuid(leaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+#endif
+
+static bool counter_usable(void) {
+#if defined(__aarch64__)
+    return true;
+#else
+    unsigned int regs[4];
+    cpuid(0x80000000, regs);
+    if (regs[0] < 0x80000007) {
+        return false;
+    }
+    cpuid(0x80000001, regs);
+    use_rdtscp = (regs[3] & (1U << 27)) != 0;
+    cpuid(0x80000007, regs);
+    if ((regs[3] & (1U << 8)) == 0) {
+        /* No invariant TSC */
+        return false;
+    }
+#ifdef __linux__
+    /* The kernel checks that the TSC is in sync between the sockets
+     * (and stable under the hypervisor), and stops using it if not */
+    FILE *fp = fopen("/sys/devices/system/clocksource/clocksource0/"
+                     "current_clocksource", "r");
+    if (fp != NULL) {
+        char source[32] = {0};
+        bool tsc = fgets(source, sizeof(source), fp) != NULL &&
+                   strncmp(source, "tsc", 3) == 0;
+        fclose(fp);
+        return tsc;
+    }
+#endif
+    return true;
+#endif
+}
+
+static calibration calibrations[2];
+static std::atomic<const calibration *> current(nullptr);
+static std::atomic<bool> calibrating(false);
+/* 0: not initialized yet, -1: no usable counter, 1: use the counter */
+static std::atomic<int> phase(0);
+static uint64_t start_ticks;
+static uint64_t start_ns;
+
+static inline uint64_t ticks_to_ns(const calibration *cal, uint64_t ticks) {
+    if (ticks < cal->base_ticks) {
+        /* Another core's counter is a little behind */
+        return cal->base_ns;
+    }
+    return cal->base_ns + mul_shift32(ticks - cal->base_ticks, cal->mult);
+}
+
+/* The last time returned on this thread */
+static thread_local uint64_t last_ns = 0;
+
+static inline uint64_t monotonic(uint64_t ns) {
+    if (ns < last_ns) {
+        return last_ns;
+    }
+    last_ns = ns;
+    return ns;
+}
+
+/*
+ * Read the counter and steady_clock as close together as possible
+ * (keeping the sample where the two counter reads are the closest)
+ */
+static void read_pair(uint64_t &ticks, uint64_t &ns) {
+    uint64_t best = UINT64_MAX;
+    for (int ii = 0; ii < 5; ++ii) {
+        uint64_t before = read_ticks();
+        uint64_t now = steady_ns();
+        uint64_t after = read_ticks();
+        if (after - before < best) {
+            best = after - before;
+            ticks = before + (after - before) / 2;
+            ns = now;
+        }
+    }
+}
+
+/*
+ * Replace the calibration prev with the next one computed from the
+ * time passed since start (unless somebody else already did).
+ */
+static bool try_calibrate(const calibration *prev) {
+    bool expected = false;
+    if (!calibrating.compare_exchange_strong(expected, true)) {
+        return false;
+    }
+    if (current.load(std::memory_order_acquire) != prev) {
+        calibrating.store(false);
+        return false;
+    }
+
+    calibration *cal = &calibrations[prev == nullptr ? 0 : 1];
+    uint64_t ticks, now;
+    read_pair(ticks, now);
+    double ticks_per_ns = double(ticks - start_ticks) / double(now - start_ns);
+    cal->base_ticks = ticks;
+    cal->base_ns = prev ? ticks_to_ns(prev, ticks) : now;
+    cal->mult = uint64_t(4294967296.0 / ticks_per_ns + 0.5);
+    if (prev == nullptr) {
+        /* Refine once we've got a full second to measure */
+        uint64_t second = uint64_t(ticks_per_ns * 1e9);
+        if (ticks - start_ticks < second) {
+            cal->refine_at = start_ticks + second;
+        } else {
+            cal->refine_at = ticks + second;
+        }
+    } else {
+        cal->refine_at = UINT64_MAX;
+    }
+    current.store(cal, std::memory_order_release);
+    calibrating.store(false);
+    return true;
+}
+
+namespace {
+    /* Take the starting point of the calibration as the library loads */
+    struct CounterInit {
+        CounterInit() {
+            if (!counter_usable()) {
+                phase.store(-1);
+                return;
+            }
+            read_pair(start_ticks, start_ns);
+#if defined(__aarch64__)
+            /* The frequency is known, no need to calibrate */
+            uint64_t freq;
+            __asm__ __volatile__("mrs %0, cntfrq_el0" : "=r"(freq));
+            calibrations[1].base_ticks = start_ticks;
+            calibrations[1].base_ns = start_ns;
+            calibrations[1].mult = uint64_t(1e9 * 4294967296.0 / freq);
+            calibrations[1].refine_at = UINT64_MAX;
+            current.store(&calibrations[1]);
+#endif
+            phase.store(1);
+        }
+    } counter_init;
+}
 
 extern "C" hrtime_t gethrtime(void)
 {
-    auto now = std::chrono::high_resolution_clock::now();
-    return std::chrono::duration_cast<std::chrono::nanoseconds>(now.time_since_epoch()).count();
+    const calibration *cal = current.load(std::memory_order_acquire);
+    if (cal != nullptr) {
+        uint64_t ticks = read_ticks();
+        if (ticks >= cal->refine_at) {
+            try_calibrate(cal);
+        }
+        return monotonic(ticks_to_ns(cal, ticks));
+    }
+
+    uint64_t now = steady_ns();
+    if (phase.load(std::memory_order_acquire) == 1 &&
+        now - start_ns >= 10000000) {
+        if (try_calibrate(nullptr)) {
+            return monotonic(ticks_to_ns(current.load(), read_ticks()));
+        }
+    }
+    return monotonic(now);
+}
+
+extern "C" hrtime_t gethrtime_period(void)
+{
+    const calibration *cal = current.load(std::memory_order_acquire);
+    if (cal != nullptr) {
+        /* Sub-nanosecond resolution is reported as 1ns */
+        uint64_t ns = cal->mult >> 32;
+        return ns == 0 ? 1 : ns;
+    }
+
+    std::chrono::nanoseconds ns = std::chrono::steady_clock::duration(1);
+    return ns.count() > 0 ? ns.count() : 1;
+}
+
+#else
+
+extern "C" hrtime_t gethrtime(void)
+{
+    return steady_ns();
 }
 
 extern "C" hrtime_t gethrtime_period(void)
 {
-    std::chrono::nanoseconds ns = std::chrono::high_resolution_clock::duration(1);
-    return ns.count();
+    std::chrono::nanoseconds ns = std::chrono::steady_clock::duration(1);
+    return ns.count() > 0 ? ns.count() : 1;
 }
+
+#endif
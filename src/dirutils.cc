@@ -16,6 +16,7 @@
  */
 #include "config.h"
 #include <platform/dirutils.h>
+#include <platform/threadpool.h>
 
 #ifdef _MSC_VER
 #include <direct.h>
@@ -23,9 +24,23 @@
 #define mkdir(a, b) _mkdir(a)
 #else
 #include <dirent.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
 #include <unistd.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+#ifdef HAVE_FICLONE
+#include <linux/fs.h>
+#endif
+#ifdef HAVE_CLONEFILE
+#include <sys/clonefile.h>
+#endif
 #endif
 
+#include <cerrno>
+#include <stdexcept>
+#include <vector>
 #include <stdio.h>
 #include <string.h>
 #include <sys/stat.h>
@@ -191,6 +206,198 @@ namespace CouchbaseDirectoryUtilities
     }
 #endif
 
+#ifdef _MSC_VER
+    struct DirectoryIterator::Impl {
+        Impl(const std::string &dir) : match(dir + "\\*"), first(true) {
+            hFind = FindFirstFileEx(match.c_str(), FindExInfoBasic, &data,
+                                    FindExSearchNameMatch, NULL,
+                                    FIND_FIRST_EX_LARGE_FETCH);
+        }
+
+        ~Impl() {
+            if (hFind != INVALID_HANDLE_VALUE) {
+                FindClose(hFind);
+            }
+        }
+
+        std::string match;
+        HANDLE hFind;
+        WIN32_FIND_DATA data;
+        /* FindFirstFileEx already returned the first entry */
+        bool first;
+    };
+
+    bool DirectoryIterator::open(const std::string &directory) {
+        impl.reset(new Impl(directory));
+        if (impl->hFind == INVALID_HANDLE_VALUE) {
+            impl.reset();
+            return false;
+        }
+        return true;
+    }
+
+    bool DirectoryIterator::next(void) {
+        if (!impl) {
+            return false;
+        }
+        do {
+            if (impl->first) {
+                impl->first = false;
+            } else if (!FindNextFile(impl->hFind, &impl->data)) {
+                impl.reset();
+                return false;
+            }
+        } while (strcmp(impl->data.cFileName, ".") == 0 ||
+                 strcmp(impl->data.cFileName, "..") == 0);
+        return true;
+    }
+
+    const char *DirectoryIterator::getName(void) const {
+        return impl->data.cFileName;
+    }
+
+    DirectoryIterator::Type DirectoryIterator::getType(void) const {
+        DWORD attr = impl->data.dwFileAttributes;
+        if ((attr & FILE_ATTRIBUTE_REPARSE_POINT) != 0) {
+            return Type::Symlink;
+        }
+        if ((attr & FILE_ATTRIBUTE_DIRECTORY) != 0) {
+            return Type::Directory;
+        }
+        if ((attr & FILE_ATTRIBUTE_DEVICE) != 0) {
+            return Type::Other;
+        }
+        return Type::File;
+    }
+
+    bool DirectoryIterator::getSize(uint64_t &size) const {
+        size = (uint64_t(impl->data.nFileSizeHigh) << 32) |
+               impl->data.nFileSizeLow;
+        return true;
+    }
+#else
+    struct DirectoryIterator::Impl {
+        Impl(DIR *d) : dp(d), de(NULL), statted(false), statok(false) {
+        }
+
+        ~Impl() {
+            closedir(dp);
+        }
+
+        /* Stat the current entry (once) */
+        bool statEntry(void) {
+            if (!statted) {
+                statted = true;
+                statok = fstatat(dirfd(dp), de->d_name, &st,
+                                 AT_SYMLINK_NOFOLLOW) == 0;
+            }
+            return statok;
+        }
+
+        DIR *dp;
+        struct dirent *de;
+        bool statted;
+        bool statok;
+        struct stat st;
+    };
+
+    bool DirectoryIterator::open(const std::string &directory) {
+        impl.reset();
+        DIR *dp = opendir(directory.c_str());
+        if (dp == NULL) {
+            return false;
+        }
+        impl.reset(new Impl(dp));
+        return true;
+    }
+
+    bool DirectoryIterator::next(void) {
+        if (!impl) {
+            return false;
+        }
+        do {
+            impl->de = readdir(impl->dp);
+            if (impl->de == NULL) {
+                impl.reset();
+                return false;
+            }
+        } while (strcmp(impl->de->d_name, ".") == 0 ||
+                 strcmp(impl->de->d_name, "..") == 0);
+        impl->statted = false;
+        return true;
+    }
+
+    const char *DirectoryIterator::getName(void) const {
+        return impl->de->d_name;
+    }
+
+    DirectoryIterator::Type DirectoryIterator::getType(void) const {
+#ifdef DT_DIR
+        switch (impl->de->d_type) {
+        case DT_REG:
+            return Type::File;
+        case DT_DIR:
+            return Type::Directory;
+        case DT_LNK:
+            return Type::Symlink;
+        case DT_UNKNOWN:
+            break;
+        default:
+            return Type::Other;
+        }
+#endif
+        if (!impl->statEntry()) {
+            return Type::Unknown;
+        }
+        if (S_ISREG(impl->st.st_mode)) {
+            return Type::File;
+        } else if (S_ISDIR(impl->st.st_mode)) {
+            return Type::Directory;
+        } else if (S_ISLNK(impl->st.st_mode)) {
+            return Type::Symlink;
+        }
+        return Type::Other;
+    }
+
+    bool DirectoryIterator::getSize(uint64_t &size) const {
+        if (!impl->statEntry()) {
+            return false;
+        }
+        size = uint64_t(impl->st.st_size);
+        return true;
+    }
+#endif
+
+    DirectoryIterator::DirectoryIterator() {
+    }
+
+    DirectoryIterator::~DirectoryIterator() {
+    }
+
+    void DirectoryIterator::close(void) {
+        impl.reset();
+    }
+
+    size_t DirectoryIterator::getNameLength(void) const {
+        return strlen(getName());
+    }
+
+    PLATFORM_PUBLIC_API
+    bool forEachEntry(const std::string &directory,
+                      const std::function<bool(const DirectoryIterator &)> &callback)
+    {
+        DirectoryIterator iter;
+        if (!iter.open(directory)) {
+            return false;
+        }
+        while (iter.next()) {
+            if (!callback(iter)) {
+                break;
+            }
+        }
+        return true;
+    }
+
     PLATFORM_PUBLIC_API
     bool rmrf(const std::string &path) {
         struct stat st;
@@ -232,6 +439,260 @@ namespace CouchbaseDirectoryUtilities
         return rmdir(path.c_str()) == 0;
     }
 
+    /*
+     * The removal of a directory. It holds a reference on its parent,
+     * and each subdirectory holds one on it (as does the scan of its
+     * own entries). The directory is removed (and the reference on
+     * the parent dropped) when the last one goes away, so a directory
+     * is only ever removed after everything below it.
+     */
+    struct TreeRemover::Directory : public Couchbase::ThreadPool::Task {
+        Directory(TreeRemover &o, Directory *p, const std::string &nm)
+            : owner(o),
+              parent(p),
+              name(nm),
+              pending(1),
+              isdir(false)
+#ifndef WIN32
+              , fd(-1)
+#endif
+        {
+        }
+
+        void run() override;
+
+        void spawn(const std::string &nm) {
+            Directory *child = new Directory(owner, this, nm);
+            ++pending;
+            owner.pool->submit(*child);
+        }
+
+        void release(void);
+
+        TreeRemover &owner;
+        Directory *parent;
+        /* The full path on Windows, relative to the parent on POSIX */
+        std::string name;
+        std::atomic<int> pending;
+        bool isdir;
+#ifndef WIN32
+        int parentFd(void) const {
+            return parent == nullptr ? AT_FDCWD : parent->fd;
+        }
+
+        int fd;
+#endif
+    };
+
+#ifdef WIN32
+    void TreeRemover::Directory::run() {
+        DWORD attr = GetFileAttributes(name.c_str());
+        if (attr == INVALID_FILE_ATTRIBUTES) {
+            if (parent == nullptr || GetLastError() != ERROR_FILE_NOT_FOUND) {
+                ++owner.failures;
+            }
+        } else if ((attr & FILE_ATTRIBUTE_DIRECTORY) == 0) {
+            if (DeleteFile(name.c_str())) {
+                ++owner.files;
+            } else {
+                ++owner.failures;
+            }
+        } else {
+            isdir = true;
+        }
+
+        /* Junctions are removed, but not followed */
+        if (isdir && (attr & FILE_ATTRIBUTE_REPARSE_POINT) == 0) {
+            WIN32_FIND_DATA data;
+            std::string match = name + "\\*";
+            HANDLE hFind = FindFirstFileEx(match.c_str(), FindExInfoBasic,
+                                           &data, FindExSearchNameMatch,
+                                           NULL, FIND_FIRST_EX_LARGE_FETCH);
+            if (hFind != INVALID_HANDLE_VALUE) {
+                do {
+                    if (strcmp(data.cFileName, ".") == 0 ||
+                        strcmp(data.cFileName, "..") == 0) {
+                        continue;
+                    }
+                    std::string entry = name + "\\" + data.cFileName;
+                    DWORD type = data.dwFileAttributes;
+                    if ((type & FILE_ATTRIBUTE_DIRECTORY) == 0) {
+                        if (DeleteFile(entry.c_str())) {
+                            ++owner.files;
+                        } else {
+                            ++owner.failures;
+                        }
+                    } else if ((type & FILE_ATTRIBUTE_REPARSE_POINT) == 0) {
+                        spawn(entry);
+                    } else if (RemoveDirectory(entry.c_str())) {
+                        ++owner.directories;
+                    } else {
+                        ++owner.failures;
+                    }
+                } while (FindNextFile(hFind, &data));
+                FindClose(hFind);
+            }
+        }
+        release();
+    }
+
+    void TreeRemover::Directory::release(void) {
+        if (--pending != 0) {
+            return;
+        }
+        if (isdir) {
+            if (RemoveDirectory(name.c_str())) {
+                ++owner.directories;
+            } else {
+                ++owner.failures;
+            }
+        }
+
+        Directory *p = parent;
+        TreeRemover &o = owner;
+        delete this;
+        if (p == nullptr) {
+            o.finished();
+        } else {
+            p->release();
+        }
+    }
+#else
+    void TreeRemover::Directory::run() {
+        fd = openat(parentFd(), name.c_str(),
+                    O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd == -1) {
+            if (errno == ENOTDIR || errno == ELOOP || errno == EMLINK) {
+                /* Not a directory (or a symbolic link, which we don't
+                 * follow) */
+                if (unlinkat(parentFd(), name.c_str(), 0) == 0) {
+                    ++owner.files;
+                } else {
+                    ++owner.failures;
+                }
+            } else if (parent == nullptr || errno != ENOENT) {
+                ++owner.failures;
+            }
+            release();
+            return;
+        }
+        isdir = true;
+
+        /* fdopendir owns the descriptor it is given, and we need ours
+         * until the subdirectories are gone */
+        int dirfd = dup(fd);
+        DIR *dp = dirfd == -1 ? NULL : fdopendir(dirfd);
+        if (dp == NULL) {
+            if (dirfd != -1) {
+                close(dirfd);
+            }
+            /* Removing the directory fails if there is anything in it */
+            release();
+            return;
+        }
+
+        struct dirent *de;
+        while ((de = readdir(dp)) != NULL) {
+            const char *nm = de->d_name;
+            if (strcmp(nm, ".") == 0 || strcmp(nm, "..") == 0) {
+                continue;
+            }
+#ifdef DT_DIR
+            if (de->d_type == DT_DIR) {
+                spawn(nm);
+                continue;
+            }
+            bool unknown = de->d_type == DT_UNKNOWN;
+#else
+            bool unknown = true;
+#endif
+            if (unlinkat(fd, nm, 0) == 0) {
+                ++owner.files;
+            } else if (unknown && (errno == EISDIR || errno == EPERM)) {
+                /* The file system doesn't report the type, and this
+                 * one is a directory */
+                spawn(nm);
+            } else if (errno != ENOENT) {
+                ++owner.failures;
+            }
+        }
+        closedir(dp);
+        release();
+    }
+
+    void TreeRemover::Directory::release(void) {
+        if (--pending != 0) {
+            return;
+        }
+        if (isdir) {
+            close(fd);
+            if (unlinkat(parentFd(), name.c_str(), AT_REMOVEDIR) == 0) {
+                ++owner.directories;
+            } else {
+                ++owner.failures;
+            }
+        }
+
+        Directory *p = parent;
+        TreeRemover &o = owner;
+        delete this;
+        if (p == nullptr) {
+            o.finished();
+        } else {
+            p->release();
+        }
+    }
+#endif
+
+    TreeRemover::TreeRemover(const std::string &p, size_t n)
+        : path(p),
+          nthreads(n),
+          files(0),
+          directories(0),
+          failures(0),
+          done(false) {
+    }
+
+    TreeRemover::~TreeRemover() {
+        wait();
+    }
+
+    void TreeRemover::start(Callback cb) {
+        if (pool) {
+            throw std::logic_error("TreeRemover::start: already started");
+        }
+        callback = cb;
+        pool.reset(new Couchbase::ThreadPool(nthreads, "cb_rmrf"));
+        pool->submit(*new Directory(*this, nullptr, path));
+    }
+
+    bool TreeRemover::wait(void) {
+        if (!pool) {
+            return false;
+        }
+        pool->wait();
+        return failures.load() == 0;
+    }
+
+    void TreeRemover::finished(void) {
+        if (callback) {
+            callback(failures.load() == 0);
+        }
+        done.store(true);
+    }
+
+    PLATFORM_PUBLIC_API
+    bool rmrf(const std::string &path, size_t nthreads) {
+        TreeRemover remover(path, nthreads);
+        try {
+            remover.start();
+        } catch (std::runtime_error &) {
+            /* Couldn't create the threads */
+            return rmrf(path);
+        }
+        return remover.wait();
+    }
+
     PLATFORM_PUBLIC_API
     bool isDirectory(const std::string &directory) {
 #ifdef WIN32
@@ -275,4 +736,223 @@ namespace CouchbaseDirectoryUtilities
 
         return true;
     }
+
+#ifdef _MSC_VER
+    PLATFORM_PUBLIC_API
+    bool copyFile(const std::string &source, const std::string &destination) {
+        return CopyFile(source.c_str(), destination.c_str(), FALSE) != 0;
+    }
+
+    PLATFORM_PUBLIC_API
+    bool preallocate(const std::string &path, uint64_t size) {
+        HANDLE fh = CreateFile(path.c_str(), GENERIC_WRITE,
+                               FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+                               OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (fh == INVALID_HANDLE_VALUE) {
+            return false;
+        }
+
+        LARGE_INTEGER current;
+        bool ok = GetFileSizeEx(fh, &current) != 0;
+        if (ok && uint64_t(current.QuadPart) < size) {
+            FILE_ALLOCATION_INFO alloc;
+            alloc.AllocationSize.QuadPart = LONGLONG(size);
+            ok = SetFileInformationByHandle(fh, FileAllocationInfo,
+                                            &alloc, sizeof(alloc)) != 0;
+            if (ok) {
+                FILE_END_OF_FILE_INFO eof;
+                eof.EndOfFile.QuadPart = LONGLONG(size);
+                ok = SetFileInformationByHandle(fh, FileEndOfFileInfo,
+                                                &eof, sizeof(eof)) != 0;
+            }
+        }
+        CloseHandle(fh);
+        return ok;
+    }
+#else
+    /* The in-kernel copies are done in chunks of this size */
+    static const size_t copy_chunk = 1 << 30;
+
+    /* The errors telling us to try another way of copying */
+    static bool copy_unsupported(int error) {
+        return error == ENOSYS || error == EXDEV || error == EINVAL ||
+               error == EOPNOTSUPP || error == ENOTSUP;
+    }
+
+    /*
+     * Copy everything from the current offset of in to out. Every method
+     * continues from where the previous one stopped, since they all
+     * move the file offsets.
+     */
+    static bool copy_data(int in, int out) {
+#ifdef HAVE_FICLONE
+        if (ioctl(out, FICLONE, in) == 0) {
+            return true;
+        }
+#endif
+        ssize_t nr;
+
+#ifdef HAVE_COPY_FILE_RANGE
+        while ((nr = copy_file_range(in, NULL, out, NULL, copy_chunk, 0)) != 0) {
+            if (nr == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (copy_unsupported(errno)) {
+                    break;
+                }
+                return false;
+            }
+        }
+        if (nr == 0) {
+            return true;
+        }
+#endif
+
+#ifdef __linux__
+        while ((nr = sendfile(out, in, NULL, copy_chunk)) != 0) {
+            if (nr == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (copy_unsupported(errno)) {
+                    break;
+                }
+                return false;
+            }
+        }
+        if (nr == 0) {
+            return true;
+        }
+#endif
+
+        std::vector<char> buffer(1024 * 1024);
+        while ((nr = read(in, buffer.data(), buffer.size())) != 0) {
+            if (nr == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }
+            const char *ptr = buffer.data();
+            while (nr > 0) {
+                ssize_t nw = write(out, ptr, size_t(nr));
+                if (nw == -1) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    return false;
+                }
+                ptr += nw;
+                nr -= nw;
+            }
+        }
+        return true;
+    }
+
+    PLATFORM_PUBLIC_API
+    bool copyFile(const std::string &source, const std::string &destination) {
+        int in = open(source.c_str(), O_RDONLY | O_CLOEXEC);
+        if (in == -1) {
+            return false;
+        }
+        struct stat st;
+        if (fstat(in, &st) == -1) {
+            int error = errno;
+            close(in);
+            errno = error;
+            return false;
+        }
+
+#ifdef HAVE_CLONEFILE
+        /* Only works if the destination doesn't exist */
+        if (clonefile(source.c_str(), destination.c_str(), 0) == 0) {
+            close(in);
+            return true;
+        }
+#endif
+
+        int out = open(destination.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC,
+                       st.st_mode & 0777);
+        if (out == -1) {
+            int error = errno;
+            close(in);
+            errno = error;
+            return false;
+        }
+
+        struct stat dst;
+        bool ok;
+        if (fstat(out, &dst) == -1) {
+            ok = false;
+        } else if (dst.st_dev == st.st_dev && dst.st_ino == st.st_ino) {
+            /* Don't truncate the source */
+            errno = EINVAL;
+            ok = false;
+        } else {
+            ok = ftruncate(out, 0) == 0 && copy_data(in, out);
+        }
+
+        int error = errno;
+        close(in);
+        if (close(out) == -1 && ok) {
+            error = errno;
+            ok = false;
+        }
+        errno = error;
+        return ok;
+    }
+
+    PLATFORM_PUBLIC_API
+    bool preallocate(const std::string &path, uint64_t size) {
+        int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0666);
+        if (fd == -1) {
+            return false;
+        }
+
+        struct stat st;
+        bool ok = fstat(fd, &st) == 0;
+        if (ok && uint64_t(st.st_size) < size) {
+            /* 0 once the space is reserved and the file extended */
+            int error = EOPNOTSUPP;
+#ifdef HAVE_FALLOCATE
+            error = fallocate(fd, 0, 0, off_t(size)) == 0 ? 0 : errno;
+#endif
+#ifdef HAVE_POSIX_FALLOCATE
+            if (error == EOPNOTSUPP || error == ENOSYS) {
+                error = posix_fallocate(fd, 0, off_t(size));
+            }
+#endif
+#ifdef __APPLE__
+            /* This only reserves the space, the size is set below */
+            fstore_t store = { F_ALLOCATECONTIG, F_PEOFPOSMODE, 0,
+                               off_t(size) - st.st_size, 0 };
+            if (fcntl(fd, F_PREALLOCATE, &store) == -1) {
+                /* Settle for a fragmented allocation */
+                store.fst_flags = F_ALLOCATEALL;
+                if (fcntl(fd, F_PREALLOCATE, &store) == -1 &&
+                    errno == ENOSPC) {
+                    error = ENOSPC;
+                }
+            }
+#endif
+            if (error == ENOSPC || error == EFBIG) {
+                errno = error;
+                ok = false;
+            } else if (error != 0) {
+                /* The file system can't reserve the space, but we can
+                 * still give the file its size */
+                ok = ftruncate(fd, off_t(size)) == 0;
+            }
+        }
+
+        int error = errno;
+        if (close(fd) == -1 && ok) {
+            error = errno;
+            ok = false;
+        }
+        errno = error;
+        return ok;
+    }
+#endif
 }
@@ -0,0 +1,422 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2016 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config.h"
+#include <platform/dirutils.h>
+#include <platform/platform.h>
+
+#include <cerrno>
+#include <cstring>
+
+#if defined(__linux__)
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#define USE_INOTIFY 1
+#elif !defined(WIN32)
+#include <fcntl.h>
+#include <set>
+#include <sys/event.h>
+#include <unistd.h>
+#define USE_KQUEUE 1
+#endif
+
+namespace CouchbaseDirectoryUtilities
+{
+    struct DirectoryWatcher::Impl {
+        Impl(const std::string &dir, const std::string &pfx, Callback cb)
+            : directory(dir),
+              prefix(pfx),
+              callback(cb),
+              running(false) {
+        }
+
+        /* Start watching (in the caller's thread, so nothing done
+         * after start() returns is missed) */
+        bool open(void);
+
+        /* The event loop, run by the thread until stop() */
+        void run(void);
+
+        static void threadMain(void *arg) {
+            static_cast<Impl *>(arg)->run();
+        }
+
+        /* Make run() return */
+        void wakeup(void);
+
+        void close(void);
+
+        void deliver(Event event, const std::string &name) {
+            if (name.compare(0, prefix.length(), prefix) == 0) {
+                callback(event, name);
+            }
+        }
+
+        std::string directory;
+        std::string prefix;
+        Callback callback;
+        cb_thread_t tid;
+        bool running;
+
+#ifdef WIN32
+        HANDLE dir;
+        HANDLE stopEvent;
+        OVERLAPPED overlapped;
+        /* FILE_NOTIFY_INFORMATION must be DWORD aligned */
+        DWORD buffer[16384];
+
+        bool read(void);
+#else
+        /* Written to by stop() to wake up the thread */
+        int pipefd[2];
+#ifdef USE_INOTIFY
+        int fd;
+#else
+        int kq;
+        int dirfd;
+        std::set<std::string> names;
+
+        std::set<std::string> scan(void);
+#endif
+#endif
+    };
+
+#ifdef WIN32
+    static std::string to_utf8(const WCHAR *name, DWORD length) {
+        int nchars = int(length / sizeof(WCHAR));
+        int size = WideCharToMultiByte(CP_UTF8, 0, name, nchars,
+                                       NULL, 0, NULL, NULL);
+        std::string ret(size_t(size), '\0');
+        if (size > 0) {
+            WideCharToMultiByte(CP_UTF8, 0, name, nchars, &ret[0], size,
+                                NULL, NULL);
+        }
+        return ret;
+    }
+
+    bool DirectoryWatcher::Impl::read(void) {
+        ResetEvent(overlapped.hEvent);
+        return ReadDirectoryChangesW(dir, buffer, sizeof(buffer), FALSE,
+                                     FILE_NOTIFY_CHANGE_FILE_NAME |
+                                     FILE_NOTIFY_CHANGE_DIR_NAME,
+                                     NULL, &overlapped, NULL) != 0;
+    }
+
+    bool DirectoryWatcher::Impl::open(void) {
+        dir = CreateFile(directory.c_str(), FILE_LIST_DIRECTORY,
+                         FILE_SHARE_READ | FILE_SHARE_WRITE |
+                         FILE_SHARE_DELETE,
+                         NULL, OPEN_EXISTING,
+                         FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED,
+                         NULL);
+        if (dir == INVALID_HANDLE_VALUE) {
+            return false;
+        }
+        memset(&overlapped, 0, sizeof(overlapped));
+        overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+        stopEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+        if (overlapped.hEvent != NULL && stopEvent != NULL && read()) {
+            return true;
+        }
+        close();
+        return false;
+    }
+
+    void DirectoryWatcher::Impl::run(void) {
+        HANDLE handles[2] = { stopEvent, overlapped.hEvent };
+        for (;;) {
+            DWORD ret = WaitForMultipleObjects(2, handles, FALSE, INFINITE);
+            DWORD nbytes;
+            if (ret != WAIT_OBJECT_0 + 1) {
+                CancelIo(dir);
+                GetOverlappedResult(dir, &overlapped, &nbytes, TRUE);
+                return;
+            }
+            if (!GetOverlappedResult(dir, &overlapped, &nbytes, FALSE)) {
+                return;
+            }
+
+            if (nbytes == 0) {
+                /* The buffer was too small for the changes */
+                callback(Event::Overflow, std::string());
+            } else {
+                const char *ptr = reinterpret_cast<const char *>(buffer);
+                for (;;) {
+                    const FILE_NOTIFY_INFORMATION *info =
+                        reinterpret_cast<const FILE_NOTIFY_INFORMATION *>(ptr);
+                    std::string name = to_utf8(info->FileName,
+                                               info->FileNameLength);
+                    switch (info->Action) {
+                    case FILE_ACTION_ADDED:
+                        deliver(Event::Created, name);
+                        break;
+                    case FILE_ACTION_REMOVED:
+                        deliver(Event::Deleted, name);
+                        break;
+                    case FILE_ACTION_RENAMED_OLD_NAME:
+                        deliver(Event::RenamedFrom, name);
+                        break;
+                    case FILE_ACTION_RENAMED_NEW_NAME:
+                        deliver(Event::RenamedTo, name);
+                        break;
+                    }
+                    if (info->NextEntryOffset == 0) {
+                        break;
+                    }
+                    ptr += info->NextEntryOffset;
+                }
+            }
+
+            if (!read()) {
+                return;
+            }
+        }
+    }
+
+    void DirectoryWatcher::Impl::wakeup(void) {
+        SetEvent(stopEvent);
+    }
+
+    void DirectoryWatcher::Impl::close(void) {
+        if (overlapped.hEvent != NULL) {
+            CloseHandle(overlapped.hEvent);
+        }
+        if (stopEvent != NULL) {
+            CloseHandle(stopEvent);
+        }
+        CloseHandle(dir);
+    }
+#else
+    void DirectoryWatcher::Impl::wakeup(void) {
+        char c = 0;
+        while (write(pipefd[1], &c, 1) == -1 && errno == EINTR) {
+        }
+    }
+
+#ifdef USE_INOTIFY
+    bool DirectoryWatcher::Impl::open(void) {
+        fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (fd == -1) {
+            return false;
+        }
+        if (inotify_add_watch(fd, directory.c_str(),
+                              IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+                              IN_MOVED_TO | IN_ONLYDIR) == -1) {
+            ::close(fd);
+            return false;
+        }
+        if (pipe(pipefd) == -1) {
+            ::close(fd);
+            return false;
+        }
+        return true;
+    }
+
+    void DirectoryWatcher::Impl::run(void) {
+        /* Room for a good number of events with their names */
+        union {
+            struct inotify_event event;
+            char data[64 * 1024];
+        } buffer;
+        struct pollfd fds[2];
+        fds[0].fd = fd;
+        fds[0].events = POLLIN;
+        fds[1].fd = pipefd[0];
+        fds[1].events = POLLIN;
+
+        for (;;) {
+            if (poll(fds, 2, -1) == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return;
+            }
+            if (fds[1].revents != 0) {
+                return;
+            }
+
+            ssize_t nr = ::read(fd, buffer.data, sizeof(buffer.data));
+            if (nr == -1) {
+                if (errno == EINTR || errno == EAGAIN) {
+                    continue;
+                }
+                return;
+            }
+
+            const char *ptr = buffer.data;
+            while (ptr < buffer.data + nr) {
+                const struct inotify_event *ev =
+                    reinterpret_cast<const struct inotify_event *>(ptr);
+                ptr += sizeof(struct inotify_event) + ev->len;
+
+                if ((ev->mask & IN_Q_OVERFLOW) != 0) {
+                    callback(Event::Overflow, std::string());
+                    continue;
+                }
+                if ((ev->mask & IN_IGNORED) != 0) {
+                    /* The directory is gone */
+                    return;
+                }
+                if (ev->len == 0) {
+                    continue;
+                }
+                std::string name(ev->name);
+                if ((ev->mask & IN_CREATE) != 0) {
+                    deliver(Event::Created, name);
+                } else if ((ev->mask & IN_DELETE) != 0) {
+                    deliver(Event::Deleted, name);
+                } else if ((ev->mask & IN_MOVED_FROM) != 0) {
+                    deliver(Event::RenamedFrom, name);
+                } else if ((ev->mask & IN_MOVED_TO) != 0) {
+                    deliver(Event::RenamedTo, name);
+                }
+            }
+        }
+    }
+
+    void DirectoryWatcher::Impl::close(void) {
+        ::close(fd);
+        ::close(pipefd[0]);
+        ::close(pipefd[1]);
+    }
+#else
+#ifndef O_EVTONLY
+#define O_EVTONLY O_RDONLY
+#endif
+
+    std::set<std::string> DirectoryWatcher::Impl::scan(void) {
+        std::set<std::string> ret;
+        DirectoryIterator iter;
+        if (iter.open(directory)) {
+            while (iter.next()) {
+                if (strncmp(iter.getName(), prefix.c_str(),
+                            prefix.length()) == 0) {
+                    ret.insert(iter.getName());
+                }
+            }
+        }
+        return ret;
+    }
+
+    bool DirectoryWatcher::Impl::open(void) {
+        dirfd = ::open(directory.c_str(), O_EVTONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dirfd == -1) {
+            return false;
+        }
+        kq = kqueue();
+        if (kq == -1) {
+            ::close(dirfd);
+            return false;
+        }
+        if (pipe(pipefd) == -1) {
+            ::close(kq);
+            ::close(dirfd);
+            return false;
+        }
+
+        struct kevent changes[2];
+        EV_SET(&changes[0], dirfd, EVFILT_VNODE, EV_ADD | EV_CLEAR,
+               NOTE_WRITE | NOTE_DELETE | NOTE_RENAME, 0, NULL);
+        EV_SET(&changes[1], pipefd[0], EVFILT_READ, EV_ADD, 0, 0, NULL);
+        if (kevent(kq, changes, 2, NULL, 0, NULL) == -1) {
+            close();
+            return false;
+        }
+        names = scan();
+        return true;
+    }
+
+    void DirectoryWatcher::Impl::run(void) {
+        for (;;) {
+            struct kevent ev;
+            int nr = kevent(kq, NULL, 0, &ev, 1, NULL);
+            if (nr == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return;
+            }
+            if (nr == 0) {
+                continue;
+            }
+            if (ev.filter == EVFILT_READ ||
+                (ev.fflags & (NOTE_DELETE | NOTE_RENAME)) != 0) {
+                /* Stopped, or the directory is gone */
+                return;
+            }
+
+            std::set<std::string> current = scan();
+            for (const auto &name : names) {
+                if (current.find(name) == current.end()) {
+                    callback(Event::Deleted, name);
+                }
+            }
+            for (const auto &name : current) {
+                if (names.find(name) == names.end()) {
+                    callback(Event::Created, name);
+                }
+            }
+            names.swap(current);
+        }
+    }
+
+    void DirectoryWatcher::Impl::close(void) {
+        ::close(kq);
+        ::close(dirfd);
+        ::close(pipefd[0]);
+        ::close(pipefd[1]);
+    }
+#endif
+#endif
+
+    DirectoryWatcher::DirectoryWatcher(const std::string &directory,
+                                       const std::string &prefix,
+                                       Callback callback)
+        : impl(new Impl(directory, prefix, callback)) {
+    }
+
+    DirectoryWatcher::~DirectoryWatcher() {
+        stop();
+    }
+
+    bool DirectoryWatcher::start(void) {
+        if (impl->running) {
+            return false;
+        }
+        if (!impl->open()) {
+            return false;
+        }
+        if (cb_create_named_thread(&impl->tid, Impl::threadMain, impl.get(), 0,
+                                   "cb_dirwatch") != 0) {
+            impl->close();
+            return false;
+        }
+        impl->running = true;
+        return true;
+    }
+
+    void DirectoryWatcher::stop(void) {
+        if (!impl->running) {
+            return;
+        }
+        impl->wakeup();
+        cb_join_thread(impl->tid);
+        impl->close();
+        impl->running = false;
+    }
+}
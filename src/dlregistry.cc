@@ -0,0 +1,194 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2016 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/*
+ * The system loader already returns the same handle every time a
+ * library is opened, so the handle identifies the library it resolved
+ * to. The registry keeps one entry per handle with our reference count
+ * and the symbol cache, and maps every name it was opened by to the
+ * handle so that the next open skips the loader (and the retry with the
+ * platform's file name extension) completely.
+ */
+
+namespace {
+
+struct Symbol {
+    void *address;
+    /* Why the lookup failed, if it did */
+    std::string error;
+};
+
+struct Library {
+    size_t refcount;
+    std::vector<std::string> names;
+    std::unordered_map<std::string, Symbol> symbols;
+};
+
+std::mutex registry_mutex;
+std::unordered_map<cb_dlhandle_t, std::unique_ptr<Library>> libraries;
+std::unordered_map<std::string, cb_dlhandle_t> names;
+
+char *copy_string(const std::string &str) {
+    char *ret = static_cast<char *>(malloc(str.size() + 1));
+    if (ret != nullptr) {
+        memcpy(ret, str.c_str(), str.size() + 1);
+    }
+    return ret;
+}
+
+/* NULL (the program itself) gets a name which can't be a file */
+std::string name_of(const char *library) {
+    return library == nullptr ? std::string("\0self", 5) : library;
+}
+
+/* Called with registry_mutex held */
+const Symbol &lookup(Library &library, cb_dlhandle_t handle,
+                     const char *symbol) {
+    auto iter = library.symbols.find(symbol);
+    if (iter != library.symbols.end()) {
+        return iter->second;
+    }
+
+    Symbol entry;
+    char *errmsg = nullptr;
+    entry.address = cb_dlsym(handle, symbol, &errmsg);
+    if (entry.address == nullptr) {
+        entry.error = errmsg != nullptr ? errmsg : "symbol not found";
+    }
+    free(errmsg);
+    return library.symbols.emplace(symbol, std::move(entry)).first->second;
+}
+
+}
+
+PLATFORM_PUBLIC_API
+cb_dlhandle_t cb_dlregistry_open(const char *library, char **errmsg)
+{
+    std::string name = name_of(library);
+    {
+        std::lock_guard<std::mutex> guard(registry_mutex);
+        auto iter = names.find(name);
+        if (iter != names.end()) {
+            ++libraries[iter->second]->refcount;
+            return iter->second;
+        }
+    }
+
+    /* Not under the lock, as the library's constructors may want to
+     * load other libraries */
+    cb_dlhandle_t handle = cb_dlopen(library, errmsg);
+    if (handle == NULL) {
+        return NULL;
+    }
+
+    bool again = false;
+    {
+        std::lock_guard<std::mutex> guard(registry_mutex);
+        auto &entry = libraries[handle];
+        if (entry) {
+            /* Already open under another name (or by another thread) */
+            ++entry->refcount;
+            again = true;
+        } else {
+            entry.reset(new Library());
+            entry->refcount = 1;
+        }
+        if (names.emplace(name, handle).second) {
+            entry->names.push_back(name);
+        }
+    }
+
+    if (again) {
+        /* Drop the loader's extra reference, we count it ourselves */
+        cb_dlclose(handle);
+    }
+    return handle;
+}
+
+PLATFORM_PUBLIC_API
+void *cb_dlregistry_sym(cb_dlhandle_t handle, const char *symbol,
+                        char **errmsg)
+{
+    std::unique_lock<std::mutex> guard(registry_mutex);
+    auto iter = libraries.find(handle);
+    if (iter == libraries.end()) {
+        guard.unlock();
+        return cb_dlsym(handle, symbol, errmsg);
+    }
+
+    const Symbol &entry = lookup(*iter->second, handle, symbol);
+    if (entry.address == nullptr && errmsg != nullptr) {
+        *errmsg = copy_string(entry.error);
+    }
+    return entry.address;
+}
+
+PLATFORM_PUBLIC_API
+int cb_dlregistry_bind(cb_dlhandle_t handle, const cb_dlsymbol_t *symbols,
+                       size_t nsymbols, void *functions, char **errmsg)
+{
+    std::lock_guard<std::mutex> guard(registry_mutex);
+    auto iter = libraries.find(handle);
+    if (iter == libraries.end()) {
+        if (errmsg != nullptr) {
+            *errmsg = copy_string("Not opened with cb_dlregistry_open");
+        }
+        return -1;
+    }
+
+    int ret = 0;
+    for (size_t ii = 0; ii < nsymbols; ++ii) {
+        const Symbol &entry = lookup(*iter->second, handle, symbols[ii].name);
+        memcpy(static_cast<char *>(functions) + symbols[ii].offset,
+               &entry.address, sizeof(entry.address));
+        if (entry.address == nullptr && !symbols[ii].optional && ret == 0) {
+            ret = -1;
+            if (errmsg != nullptr) {
+                *errmsg = copy_string(entry.error);
+            }
+        }
+    }
+    return ret;
+}
+
+PLATFORM_PUBLIC_API
+void cb_dlregistry_close(cb_dlhandle_t handle)
+{
+    {
+        std::lock_guard<std::mutex> guard(registry_mutex);
+        auto iter = libraries.find(handle);
+        if (iter != libraries.end()) {
+            if (--iter->second->refcount > 0) {
+                return;
+            }
+            for (const auto &name : iter->second->names) {
+                names.erase(name);
+            }
+            libraries.erase(iter);
+        }
+    }
+    cb_dlclose(handle);
+}
@@ -0,0 +1,199 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2016 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config.h"
+
+#include <platform/cbassert.h>
+#include <platform/epoch.h>
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+ * There is a global epoch, and every registered thread has a state
+ * word holding the epoch it saw when it entered its critical section
+ * (shifted up by one, with the low bit set while it is inside one).
+ *
+ * The global epoch is only moved from E to E + 1 when every thread
+ * inside a critical section has announced E. An object retired in
+ * epoch E may still be seen by the readers which announced E (or
+ * earlier), but once the epoch has reached E + 2 all of them have left:
+ * the ones announcing E + 1 entered after the move to E + 1, which came
+ * after the object was unlinked. So it may be released then.
+ *
+ * The retired objects are kept in a single list under the registry
+ * mutex, as retiring is the rare (writer) side.
+ */
+
+#define CACHELINE 64
+
+/* Try to release objects after this many have been retired */
+#define RECLAIM_THRESHOLD 64
+
+namespace {
+
+struct ThreadRecord {
+    char pad0[CACHELINE];
+    std::atomic<uint64_t> state;
+    /* Only used by the owning thread */
+    unsigned int nesting;
+    char pad1[CACHELINE];
+};
+
+struct Retired {
+    void *ptr;
+    cb_epoch_destructor destructor;
+    uint64_t epoch;
+};
+
+std::atomic<uint64_t> global_epoch(1);
+
+std::mutex registry_mutex;
+std::vector<ThreadRecord *> threads;
+std::vector<Retired> retired;
+size_t retired_since_reclaim;
+
+thread_local ThreadRecord *current = nullptr;
+
+ThreadRecord *register_thread(void) {
+    ThreadRecord *record = new ThreadRecord;
+    record->state.store(0, std::memory_order_relaxed);
+    record->nesting = 0;
+    std::lock_guard<std::mutex> guard(registry_mutex);
+    threads.push_back(record);
+    return record;
+}
+
+/*
+ * Move the epoch on if every active thread has seen the current one.
+ * Called with registry_mutex held.
+ */
+bool try_advance(void) {
+    /* Order the unlinking of the retired objects before the scan */
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    const uint64_t epoch = global_epoch.load(std::memory_order_relaxed);
+    for (const auto *record : threads) {
+        uint64_t state = record->state.load(std::memory_order_seq_cst);
+        if ((state & 1) && (state >> 1) != epoch) {
+            return false;
+        }
+    }
+    global_epoch.store(epoch + 1, std::memory_order_seq_cst);
+    return true;
+}
+
+/*
+ * Move the objects which may be released from the retired list to
+ * done. Called with registry_mutex held.
+ */
+void collect(std::vector<Retired> &done) {
+    const uint64_t epoch = global_epoch.load(std::memory_order_relaxed);
+    auto safe = std::stable_partition(retired.begin(), retired.end(),
+                                      [epoch](const Retired &entry) {
+        return entry.epoch + 2 > epoch;
+    });
+    done.insert(done.end(), safe, retired.end());
+    retired.erase(safe, retired.end());
+    retired_since_reclaim = 0;
+}
+
+/* Not under the mutex, as the destructors may retire more objects */
+void release(const std::vector<Retired> &done) {
+    for (const auto &entry : done) {
+        entry.destructor(entry.ptr);
+    }
+}
+
+}
+
+PLATFORM_PUBLIC_API
+void cb_epoch_enter(void) {
+    ThreadRecord *record = current;
+    if (record == nullptr) {
+        record = current = register_thread();
+    }
+    if (record->nesting++ == 0) {
+        /* The exchange is a full barrier, so the loads in the critical
+         * section can't be done before the state is visible */
+        uint64_t epoch = global_epoch.load(std::memory_order_relaxed);
+        record->state.exchange((epoch << 1) | 1, std::memory_order_seq_cst);
+    }
+}
+
+PLATFORM_PUBLIC_API
+void cb_epoch_exit(void) {
+    ThreadRecord *record = current;
+    cb_assert(record != nullptr && record->nesting > 0);
+    if (--record->nesting == 0) {
+        record->state.store(0, std::memory_order_release);
+    }
+}
+
+PLATFORM_PUBLIC_API
+void cb_epoch_retire(void *ptr, cb_epoch_destructor destructor) {
+    std::vector<Retired> done;
+    {
+        std::lock_guard<std::mutex> guard(registry_mutex);
+        Retired entry;
+        entry.ptr = ptr;
+        entry.destructor = destructor;
+        entry.epoch = global_epoch.load(std::memory_order_relaxed);
+        retired.push_back(entry);
+        if (++retired_since_reclaim >= RECLAIM_THRESHOLD) {
+            try_advance();
+            collect(done);
+        }
+    }
+    release(done);
+}
+
+PLATFORM_PUBLIC_API
+void cb_epoch_synchronize(void) {
+    cb_assert(current == nullptr || current->nesting == 0);
+
+    std::vector<Retired> done;
+    std::unique_lock<std::mutex> guard(registry_mutex);
+    const uint64_t target = global_epoch.load(std::memory_order_relaxed) + 2;
+    while (global_epoch.load(std::memory_order_relaxed) < target) {
+        if (!try_advance()) {
+            /* Let the readers finish */
+            guard.unlock();
+            std::this_thread::yield();
+            guard.lock();
+        }
+    }
+    collect(done);
+    guard.unlock();
+    release(done);
+}
+
+PLATFORM_PUBLIC_API
+void cb_epoch_unregister_thread(void) {
+    ThreadRecord *record = current;
+    if (record == nullptr) {
+        return;
+    }
+    cb_assert(record->nesting == 0);
+    {
+        std::lock_guard<std::mutex> guard(registry_mutex);
+        threads.erase(std::find(threads.begin(), threads.end(), record));
+    }
+    delete record;
+    current = nullptr;
+}
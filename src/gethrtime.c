@@ -18,21 +18,26 @@
 
 hrtime_t gethrtime_period(void)
 {
-    /* this isn't actually completely accurate, but who cares ;-) */
-    hrtime_t start = gethrtime();
-    hrtime_t end = gethrtime() - start;
-    if (end == 0) {
-       end = 1;
+    struct timespec res;
+#ifdef __sun
+    if (clock_getres(CLOCK_HIGHRES, &res) == -1) {
+#else
+    if (clock_getres(CLOCK_MONOTONIC_FAST, &res) == -1) {
+#endif
+        return 1;
     }
-
-    return end;
+    if (res.tv_sec == 0 && res.tv_nsec == 0) {
+        return 1;
+    }
+    return (hrtime_t)res.tv_sec * 1000000000 + res.tv_nsec;
 }
 
 #ifndef __sun
 hrtime_t gethrtime(void)
 {
     struct timespec tp;
-    clock_gettime(CLOCK_REALTIME_FAST, &tp);
+    /* gethrtime is used for intervals; don't follow wall clock changes */
+    clock_gettime(CLOCK_MONOTONIC_FAST, &tp);
     hrtime_t ret = tp.tv_sec;
     ret *= 1000; // ms
     ret *= 1000; // us
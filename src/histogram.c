@@ -0,0 +1,270 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2016 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config.h"
+
+#include <platform/histogram.h>
+#include <cJSON.h>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+/*
+ * Bucket layout: the values 0 .. 2 * SUB - 1 have a bucket each. Above
+ * that a value with its most significant bit at position msb is
+ * shifted right by shift = msb - SUB_BITS, leaving its top SUB_BITS + 1
+ * bits (SUB .. 2 * SUB - 1), and lands in bucket shift * SUB + top.
+ */
+
+#define SUB_BITS CB_HISTOGRAM_SUB_BUCKET_BITS
+#define SUB CB_HISTOGRAM_SUB_BUCKETS
+
+#ifdef _MSC_VER
+#define atomic_load64(p) \
+    ((uint64_t)InterlockedCompareExchange64((volatile LONG64 *)(p), 0, 0))
+#define atomic_add64(p, v) \
+    InterlockedExchangeAdd64((volatile LONG64 *)(p), (LONG64)(v))
+#else
+#define atomic_load64(p) __atomic_load_n(p, __ATOMIC_RELAXED)
+#define atomic_add64(p, v) __atomic_fetch_add(p, v, __ATOMIC_RELAXED)
+#endif
+
+/* Replace *ptr with desired if it is *expected, else update *expected */
+static int atomic_cas64(uint64_t *ptr, uint64_t *expected, uint64_t desired)
+{
+#ifdef _MSC_VER
+    uint64_t old = (uint64_t)InterlockedCompareExchange64(
+        (volatile LONG64 *)ptr, (LONG64)desired, (LONG64)*expected);
+    if (old == *expected) {
+        return 1;
+    }
+    *expected = old;
+    return 0;
+#else
+    return __atomic_compare_exchange_n(ptr, expected, desired, 0,
+                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+#endif
+}
+
+static int msb64(uint64_t value)
+{
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanReverse64(&index, value);
+    return (int)index;
+#else
+    return 63 - __builtin_clzll(value);
+#endif
+}
+
+static int bucket_of(uint64_t value)
+{
+    int shift;
+    if (value < 2 * SUB) {
+        return (int)value;
+    }
+    shift = msb64(value) - SUB_BITS;
+    return shift * SUB + (int)(value >> shift);
+}
+
+/* The largest value which ends up in the given bucket */
+static uint64_t bucket_upper(int bucket)
+{
+    int shift;
+    uint64_t top;
+    if (bucket < 2 * SUB) {
+        return (uint64_t)bucket;
+    }
+    shift = bucket / SUB - 1;
+    top = (uint64_t)(bucket % SUB + SUB);
+    /* Wraps to UINT64_MAX for the very last bucket */
+    return ((top + 1) << shift) - 1;
+}
+
+static void update_min(uint64_t *min, uint64_t value)
+{
+    uint64_t current = atomic_load64(min);
+    while (value < current && !atomic_cas64(min, &current, value)) {
+    }
+}
+
+static void update_max(uint64_t *max, uint64_t value)
+{
+    uint64_t current = atomic_load64(max);
+    while (value > current && !atomic_cas64(max, &current, value)) {
+    }
+}
+
+void cb_histogram_initialize(cb_histogram_t *histogram)
+{
+    int ii;
+    histogram->count = 0;
+    histogram->sum = 0;
+    histogram->min = UINT64_MAX;
+    histogram->max = 0;
+    for (ii = 0; ii < CB_HISTOGRAM_BUCKETS; ++ii) {
+        histogram->buckets[ii] = 0;
+    }
+}
+
+void cb_histogram_record_n(cb_histogram_t *histogram, uint64_t value,
+                           uint64_t count)
+{
+    if (count == 0) {
+        return;
+    }
+    atomic_add64(&histogram->buckets[bucket_of(value)], count);
+    atomic_add64(&histogram->count, count);
+    atomic_add64(&histogram->sum, value * count);
+    update_min(&histogram->min, value);
+    update_max(&histogram->max, value);
+}
+
+void cb_histogram_record(cb_histogram_t *histogram, uint64_t value)
+{
+    cb_histogram_record_n(histogram, value, 1);
+}
+
+void cb_histogram_merge(cb_histogram_t *dest, const cb_histogram_t *src)
+{
+    int ii;
+    uint64_t count = 0;
+    for (ii = 0; ii < CB_HISTOGRAM_BUCKETS; ++ii) {
+        uint64_t value = atomic_load64(&src->buckets[ii]);
+        if (value != 0) {
+            atomic_add64(&dest->buckets[ii], value);
+            count += value;
+        }
+    }
+    if (count == 0) {
+        return;
+    }
+    /* Use the number of values we actually copied, so that dest stays
+     * consistent if src is being recorded into */
+    atomic_add64(&dest->count, count);
+    atomic_add64(&dest->sum, atomic_load64(&src->sum));
+    update_min(&dest->min, atomic_load64(&src->min));
+    update_max(&dest->max, atomic_load64(&src->max));
+}
+
+uint64_t cb_histogram_count(const cb_histogram_t *histogram)
+{
+    return atomic_load64(&histogram->count);
+}
+
+uint64_t cb_histogram_min(const cb_histogram_t *histogram)
+{
+    uint64_t min = atomic_load64(&histogram->min);
+    return min == UINT64_MAX ? 0 : min;
+}
+
+uint64_t cb_histogram_max(const cb_histogram_t *histogram)
+{
+    return atomic_load64(&histogram->max);
+}
+
+double cb_histogram_mean(const cb_histogram_t *histogram)
+{
+    uint64_t count = atomic_load64(&histogram->count);
+    if (count == 0) {
+        return 0;
+    }
+    return (double)atomic_load64(&histogram->sum) / (double)count;
+}
+
+uint64_t cb_histogram_percentile(const cb_histogram_t *histogram,
+                                 double percentile)
+{
+    uint64_t counts[CB_HISTOGRAM_BUCKETS];
+    uint64_t total = 0;
+    uint64_t rank;
+    uint64_t seen = 0;
+    uint64_t max;
+    int ii;
+
+    /* Work on a snapshot so that the total matches the buckets */
+    for (ii = 0; ii < CB_HISTOGRAM_BUCKETS; ++ii) {
+        counts[ii] = atomic_load64(&histogram->buckets[ii]);
+        total += counts[ii];
+    }
+    if (total == 0) {
+        return 0;
+    }
+
+    if (percentile < 0.0) {
+        percentile = 0.0;
+    } else if (percentile > 100.0) {
+        percentile = 100.0;
+    }
+    rank = (uint64_t)(percentile / 100.0 * (double)total + 0.5);
+    if (rank == 0) {
+        rank = 1;
+    } else if (rank > total) {
+        rank = total;
+    }
+
+    max = atomic_load64(&histogram->max);
+    for (ii = 0; ii < CB_HISTOGRAM_BUCKETS; ++ii) {
+        seen += counts[ii];
+        if (seen >= rank) {
+            uint64_t value = bucket_upper(ii);
+            return value > max ? max : value;
+        }
+    }
+    return max;
+}
+
+/* JSON integers are signed, so the values above INT64_MAX (such as the
+   upper bound of the last bucket) are clamped rather than wrapping
+   around to negative numbers */
+static cJSON *create_uint64(uint64_t value)
+{
+    return cJSON_CreateInt64(value > INT64_MAX ? INT64_MAX : (int64_t)value);
+}
+
+static void add_int64(cJSON *obj, const char *name, uint64_t value)
+{
+    cJSON_AddItemToObject(obj, name, create_uint64(value));
+}
+
+cJSON *cb_histogram_to_json(const cb_histogram_t *histogram)
+{
+    cJSON *obj = cJSON_CreateObject();
+    cJSON *buckets = cJSON_CreateArray();
+    int ii;
+
+    add_int64(obj, "count", cb_histogram_count(histogram));
+    add_int64(obj, "min", cb_histogram_min(histogram));
+    add_int64(obj, "max", cb_histogram_max(histogram));
+    cJSON_AddNumberToObject(obj, "mean", cb_histogram_mean(histogram));
+    add_int64(obj, "p50", cb_histogram_percentile(histogram, 50.0));
+    add_int64(obj, "p90", cb_histogram_percentile(histogram, 90.0));
+    add_int64(obj, "p99", cb_histogram_percentile(histogram, 99.0));
+    add_int64(obj, "p99.9", cb_histogram_percentile(histogram, 99.9));
+
+    for (ii = 0; ii < CB_HISTOGRAM_BUCKETS; ++ii) {
+        uint64_t count = atomic_load64(&histogram->buckets[ii]);
+        if (count != 0) {
+            cJSON *pair = cJSON_CreateArray();
+            cJSON_AddItemToArray(pair, create_uint64(bucket_upper(ii)));
+            cJSON_AddItemToArray(pair, create_uint64(count));
+            cJSON_AddItemToArray(buckets, pair);
+        }
+    }
+    cJSON_AddItemToObject(obj, "buckets", buckets);
+    return obj;
+}
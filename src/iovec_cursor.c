@@ -0,0 +1,106 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2016 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config.h"
+
+#include <platform/socket.h>
+
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+#ifdef WIN32
+#define interrupted() (WSAGetLastError() == WSAEINTR)
+#else
+#define interrupted() (errno == EINTR)
+#endif
+
+/* Skip the buffers we're done with (including empty ones) */
+static void skip_empty(cb_iovec_cursor_t *cursor)
+{
+    while (cursor->iovcnt > 0 && cursor->iov->iov_len == 0) {
+        ++cursor->iov;
+        --cursor->iovcnt;
+    }
+}
+
+void cb_iovec_cursor_init(cb_iovec_cursor_t *cursor, struct iovec *iov,
+                          int iovcnt)
+{
+    cursor->iov = iov;
+    cursor->iovcnt = iovcnt;
+    skip_empty(cursor);
+}
+
+void cb_iovec_cursor_advance(cb_iovec_cursor_t *cursor, size_t nbytes)
+{
+    while (nbytes > 0 && cursor->iovcnt > 0) {
+        struct iovec *iov = cursor->iov;
+        if (nbytes < iov->iov_len) {
+            iov->iov_base = (char *)iov->iov_base + nbytes;
+            iov->iov_len -= nbytes;
+            return;
+        }
+        nbytes -= iov->iov_len;
+        iov->iov_len = 0;
+        skip_empty(cursor);
+    }
+    skip_empty(cursor);
+}
+
+size_t cb_iovec_cursor_remaining(const cb_iovec_cursor_t *cursor)
+{
+    size_t ret = 0;
+    int ii;
+    for (ii = 0; ii < cursor->iovcnt; ++ii) {
+        ret += cursor->iov[ii].iov_len;
+    }
+    return ret;
+}
+
+ssize_t cb_writev_cursor(cb_socket_t sock, cb_iovec_cursor_t *cursor,
+                         int flags)
+{
+    ssize_t total = 0;
+
+    while (cursor->iovcnt > 0) {
+        struct msghdr msg;
+        ssize_t nw;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = cursor->iov;
+        msg.msg_iovlen = cursor->iovcnt < IOV_MAX ? cursor->iovcnt : IOV_MAX;
+        nw = sendmsg(sock, &msg, flags);
+        if (nw < 0) {
+            if (interrupted()) {
+                continue;
+            }
+            /* Report the progress now, and the error on the next call */
+            return total > 0 ? total : -1;
+        }
+        if (nw == 0) {
+            break;
+        }
+        total += nw;
+        cb_iovec_cursor_advance(cursor, (size_t)nw);
+    }
+
+    return total;
+}
@@ -15,11 +15,14 @@
  *   limitations under the License.
  */
 
+#include "config.h"
+
 #include <sys/mman.h>
 #ifdef __sun
 const int MAP_FILE = 0;
 #endif
 
+#include <algorithm>
 #include <sstream>
 #include <cerrno>
 #include <cstring>
@@ -28,13 +31,112 @@ const int MAP_FILE = 0;
 #include <unistd.h>
 #include <sys/stat.h>
 
+#ifdef __linux__
+#include <sys/vfs.h>
+#include <fstream>
+
+#ifndef HUGETLBFS_MAGIC
+#define HUGETLBFS_MAGIC 0x958458f6
+#endif
+#endif
+
+static size_t page_align(size_t value, size_t pagesize) {
+    return (value + pagesize - 1) & ~(pagesize - 1);
+}
+
+#ifdef MADV_HUGEPAGE
+/* The size of a transparent huge page */
+static size_t thp_size(void) {
+    size_t ret = 2 * 1024 * 1024;
+    std::ifstream in("/sys/kernel/mm/transparent_hugepage/hpage_pmd_size");
+    in >> ret;
+    return ret;
+}
+
+/*
+ * Huge pages can only be used for the parts of the mapping which are
+ * aligned to the huge page size, so reserve enough address space to
+ * place the mapping on a huge page boundary and trim off the rest.
+ */
+static void *mmap_aligned(size_t length, int prot, int flags, int fd,
+                          off_t offset, size_t alignment) {
+    size_t reserved = length + alignment;
+    void *reservation = mmap(NULL, reserved, PROT_NONE,
+                             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                             -1, 0);
+    if (reservation == MAP_FAILED) {
+        return mmap(NULL, length, prot, flags, fd, offset);
+    }
+
+    char *base = static_cast<char *>(reservation);
+    char *aligned = reinterpret_cast<char *>(
+        (reinterpret_cast<uintptr_t>(base) + alignment - 1) & ~(alignment - 1));
+    void *ret = mmap(aligned, length, prot, flags | MAP_FIXED, fd, offset);
+    if (ret == MAP_FAILED) {
+        munmap(reservation, reserved);
+        return MAP_FAILED;
+    }
+    if (aligned > base) {
+        munmap(base, size_t(aligned - base));
+    }
+    char *end = base + reserved;
+    if (aligned + length < end) {
+        munmap(aligned + length, size_t(end - (aligned + length)));
+    }
+    return ret;
+}
+#endif
+
+/* The number of bytes in the range currently mapped by huge pages */
+static size_t huge_page_bytes(const void *addr, size_t length) {
+    size_t ret = 0;
+#ifdef __linux__
+    /* Add up the huge pages of all of the VMAs in our range (there
+     * may be more than one after madvise) */
+    const uintptr_t begin = reinterpret_cast<uintptr_t>(addr);
+    const uintptr_t end = begin + length;
+    std::ifstream smaps("/proc/self/smaps");
+    std::string line;
+    bool ours = false;
+    while (std::getline(smaps, line)) {
+        unsigned long long from, to;
+        char dash;
+        std::istringstream in(line);
+        if (line.find(':') == std::string::npos ||
+            line.find('-') < line.find(':')) {
+            if (in >> std::hex >> from >> dash >> to && dash == '-') {
+                ours = from >= begin && to <= end;
+                continue;
+            }
+        }
+        if (!ours) {
+            continue;
+        }
+        std::string key;
+        size_t kb;
+        if (in >> key >> std::dec >> kb &&
+            (key == "AnonHugePages:" || key == "ShmemPmdMapped:" ||
+             key == "FilePmdMapped:")) {
+            ret += kb * 1024;
+        }
+    }
+#else
+    (void)addr;
+    (void)length;
+#endif
+    return ret;
+}
+
 Couchbase::MemoryMappedFile::MemoryMappedFile(const char *fname, bool share, bool rdonly) :
         filename(fname),
         filehandle(-1),
-        root(NULL),
-        size(0),
         sharedMapping(share),
-        readonly(rdonly) {
+        readonly(rdonly),
+        prefault(false),
+        hugePages(HugePages::None),
+        locked(false),
+        pageSize(0),
+        fileOffset(0) {
     // Empty
 }
 
@@ -49,7 +151,7 @@ void Couchbase::MemoryMappedFile::close(void) {
     }
     std::stringstream ss;
 
-    if (munmap(root, size) != 0) {
+    if (munmap(root, page_align(size, pageSize)) != 0) {
         ss << "munmap failed: " << strerror(errno);
     }
     ::close(filehandle);
@@ -64,9 +166,110 @@ void Couchbase::MemoryMappedFile::close(void) {
 }
 
 void Couchbase::MemoryMappedFile::open(void) {
+    open(0, 0);
+}
+
+void *Couchbase::MemoryMappedFile::mapRange(size_t length) {
+    int mapMode = MAP_FILE | (sharedMapping ? MAP_SHARED : MAP_PRIVATE);
+    int protection = PROT_READ;
+    if (!readonly) {
+        protection |= PROT_WRITE;
+    }
+
+    size_t alignment = 0;
+#ifdef MADV_HUGEPAGE
+    if (hugePages == HugePages::Transparent) {
+        alignment = thp_size();
+    }
+#endif
+
+#ifdef MAP_POPULATE
+    if (prefault || locked) {
+        mapMode |= MAP_POPULATE;
+    }
+#endif
+
+    const off_t offset = off_t(fileOffset);
+    length = page_align(length, pageSize);
+    void *addr;
+#ifdef MADV_HUGEPAGE
+    if (alignment > pageSize) {
+        addr = mmap_aligned(length, protection, mapMode, filehandle, offset,
+                            alignment);
+    } else {
+        addr = mmap(NULL, length, protection, mapMode, filehandle, offset);
+    }
+#else
+    addr = mmap(NULL, length, protection, mapMode, filehandle, offset);
+#endif
+    if (addr == MAP_FAILED) {
+        std::stringstream ss;
+        ss << "mmap failed: " << strerror(errno);
+        throw ss.str();
+    }
+
+#ifdef MADV_HUGEPAGE
+    if (hugePages == HugePages::Transparent) {
+        /* Only a request; it fails if THP is disabled */
+        (void)madvise(addr, length, MADV_HUGEPAGE);
+    }
+#endif
+
+    if (locked && mlock(addr, length) != 0) {
+        std::stringstream ss;
+        ss << "mlock failed: " << strerror(errno);
+        munmap(addr, length);
+        throw ss.str();
+    }
+
+#ifndef MAP_POPULATE
+    if (prefault && !locked) {
+        /* Read the pages in ahead of time, then touch every page so
+         * that it gets mapped */
+        (void)madvise(addr, length, MADV_WILLNEED);
+        const volatile char *ptr = static_cast<const volatile char *>(addr);
+        for (size_t ii = 0; ii < length; ii += pageSize) {
+            (void)ptr[ii];
+        }
+    }
+#endif
+    return addr;
+}
+
+/*
+ * Make sure the file covers fileOffset + length bytes, extending it if
+ * this is a shared writable mapping (in which case the mapping may be
+ * used to append to the file).
+ */
+void Couchbase::MemoryMappedFile::ensureFileSize(size_t length) {
+    struct stat st;
+    if (fstat(filehandle, &st) == -1) {
+        std::stringstream ss;
+        ss << "fstat(" << filename << ") failed: " << strerror(errno);
+        throw ss.str();
+    }
+    const size_t end = fileOffset + length;
+    if (size_t(st.st_size) >= end) {
+        return;
+    }
+    if (!sharedMapping || readonly) {
+        throw std::string("The mapping can't extend beyond the end of the "
+                          "file unless it is shared and writable");
+    }
+    if (ftruncate(filehandle, off_t(end)) == -1) {
+        std::stringstream ss;
+        ss << "ftruncate(" << filename << ") failed: " << strerror(errno);
+        throw ss.str();
+    }
+}
+
+void Couchbase::MemoryMappedFile::open(size_t offset, size_t length) {
     if (sharedMapping && readonly) {
         throw std::string("Invalid mode: shared and readonly don't make sense");
     }
+    if (root != NULL) {
+        throw std::string("The mapping is already open");
+    }
 
     struct stat st;
     if (stat(filename.c_str(), &st) == -1) {
@@ -74,23 +277,16 @@ void Couchbase::MemoryMappedFile::open(void) {
         ss << "stat(" << filename << ") failed: " << strerror(errno);
         throw ss.str();
     }
-    size = st.st_size;
-
-    int mapMode = MAP_FILE;
-    int openMode;
-    if (sharedMapping) {
-        openMode = O_RDWR;
-        mapMode |= MAP_SHARED;
-    } else {
-        openMode = O_RDONLY;
-        mapMode |= MAP_PRIVATE;
+    if (offset > size_t(st.st_size)) {
+        throw std::string("The offset is beyond the end of the file");
+    }
+    if (length == 0) {
+        length = size_t(st.st_size) - offset;
     }
 
-    int protection = PROT_READ;
-    if (readonly) {
-        openMode = O_RDONLY;
-    } else {
-        protection |= PROT_WRITE;
+    int openMode = O_RDONLY;
+    if (sharedMapping && !readonly) {
+        openMode = O_RDWR;
     }
 
     if ((filehandle = ::open(filename.c_str(), openMode)) == -1) {
@@ -99,14 +295,438 @@ void Couchbase::MemoryMappedFile::open(void) {
         throw ss.str();
     }
 
-    root = mmap(NULL, size, protection, mapMode, filehandle, 0);
-    if (root == MAP_FAILED) {
-        std::stringstream ss;
-        ss << "mmap failed: " << strerror(errno);
+    try {
+        pageSize = size_t(sysconf(_SC_PAGESIZE));
+        if (hugePages == HugePages::Explicit) {
+#ifdef __linux__
+            /* The pages of a file on hugetlbfs are always huge pages */
+            struct statfs fs;
+            if (fstatfs(filehandle, &fs) != 0 ||
+                uint32_t(fs.f_type) != uint32_t(HUGETLBFS_MAGIC)) {
+                throw std::string("Explicit huge pages need a file on hugetlbfs");
+            }
+            pageSize = size_t(fs.f_bsize);
+#else
+            throw std::string("Explicit huge pages need a file on hugetlbfs");
+#endif
+        }
+        if (offset % pageSize != 0) {
+            std::stringstream ss;
+            ss << "The offset must be a multiple of the page size ("
+               << pageSize << ")";
+            throw ss.str();
+        }
+
+        fileOffset = offset;
+        ensureFileSize(length);
+        root = mapRange(length);
+        size = length;
+    } catch (...) {
         ::close(filehandle);
         filehandle = -1;
         root = NULL;
         size = 0;
+        throw;
+    }
+}
+
+void Couchbase::MemoryMappedFile::remap(size_t length) {
+    if (root == NULL) {
+        throw std::string("Internal error, open() not called");
+    }
+    if (length == 0) {
+        throw std::string("remap: the length can't be 0");
+    }
+    ensureFileSize(length);
+
+    const size_t oldLength = page_align(size, pageSize);
+#ifdef MREMAP_MAYMOVE
+    /* The new pages of a locked mapping are locked (and populated)
+     * by mremap */
+    void *addr = mremap(root, oldLength, page_align(length, pageSize),
+                        MREMAP_MAYMOVE);
+    if (addr != MAP_FAILED) {
+        root = addr;
+        size = length;
+        return;
+    }
+#endif
+
+    /* Map the new range before dropping the old one, so the old
+     * mapping is still in place if we fail */
+    void *mapped = mapRange(length);
+    if (!sharedMapping && !readonly) {
+        /* The changes to a private mapping only exist in its pages */
+        memcpy(mapped, root, std::min(oldLength,
+                                      page_align(length, pageSize)));
+    }
+    (void)munmap(root, oldLength);
+    root = mapped;
+    size = length;
+}
+
+void Couchbase::MemoryMappedFile::sync(size_t offset, size_t length,
+                                       bool async) {
+    if (root == NULL) {
+        throw std::string("Internal error, open() not called");
+    }
+    if (offset > size) {
+        throw std::string("sync: offset is outside the mapping");
+    }
+    if (length == 0 || length > size - offset) {
+        length = size - offset;
+    }
+    if (length == 0) {
+        return;
+    }
+
+    const size_t start = offset & ~(pageSize - 1);
+    length += offset - start;
+    if (msync(static_cast<char *>(root) + start, length,
+              async ? MS_ASYNC : MS_SYNC) != 0) {
+        std::stringstream ss;
+        ss << "msync failed: " << strerror(errno);
+        throw ss.str();
+    }
+}
+
+Couchbase::MemoryMappedFile::Backing
+Couchbase::MemoryMappedFile::getBacking(void) const {
+    if (root == NULL) {
+        throw std::string("Internal error, open() not called");
+    }
+    Backing backing;
+    backing.pageSize = pageSize;
+    backing.locked = locked;
+    if (pageSize > size_t(sysconf(_SC_PAGESIZE))) {
+        backing.hugePageBytes = page_align(size, pageSize);
+    } else {
+        backing.hugePageBytes = huge_page_bytes(root,
+                                                page_align(size, pageSize));
+    }
+    return backing;
+}
+
+void Couchbase::MemoryMappedFile::advise(Advice advice, size_t offset,
+                                         size_t length) {
+    if (root == NULL) {
+        throw std::string("Internal error, open() not called");
+    }
+    if (offset > size) {
+        throw std::string("advise: offset is outside the mapping");
+    }
+    if (length == 0 || length > size - offset) {
+        length = size - offset;
+    }
+    if (length == 0) {
+        return;
+    }
+
+    /* madvise wants a page aligned address */
+    const size_t pagesize = pageSize;
+    const size_t start = offset & ~(pagesize - 1);
+    length += offset - start;
+
+    int madv;
+    int fadv = -1;
+    switch (advice) {
+    case Advice::Normal:
+        madv = MADV_NORMAL;
+#ifdef POSIX_FADV_NORMAL
+        fadv = POSIX_FADV_NORMAL;
+#endif
+        break;
+    case Advice::Sequential:
+        madv = MADV_SEQUENTIAL;
+#ifdef POSIX_FADV_SEQUENTIAL
+        fadv = POSIX_FADV_SEQUENTIAL;
+#endif
+        break;
+    case Advice::Random:
+        madv = MADV_RANDOM;
+#ifdef POSIX_FADV_RANDOM
+        fadv = POSIX_FADV_RANDOM;
+#endif
+        break;
+    case Advice::WillNeed:
+        madv = MADV_WILLNEED;
+#ifdef POSIX_FADV_WILLNEED
+        fadv = POSIX_FADV_WILLNEED;
+#endif
+        break;
+    case Advice::DontNeed:
+        /* MADV_DONTNEED throws away our changes to a private mapping */
+        madv = (sharedMapping || readonly) ? MADV_DONTNEED : -1;
+#ifdef POSIX_FADV_DONTNEED
+        fadv = POSIX_FADV_DONTNEED;
+#endif
+        break;
+    default:
+        throw std::string("advise: unknown advice");
+    }
+
+    char *addr = static_cast<char *>(root) + start;
+    if (madv != -1 && madvise(addr, length, madv) != 0) {
+        std::stringstream ss;
+        ss << "madvise failed: " << strerror(errno);
+        throw ss.str();
+    }
+
+#ifdef POSIX_FADV_NORMAL
+    /* Let the readahead of the file itself follow the same pattern */
+    if (fadv != -1) {
+        (void)posix_fadvise(filehandle, off_t(fileOffset + start),
+                            off_t(length), fadv);
+    }
+#else
+    (void)fadv;
+#endif
+}
+
+#ifdef __linux__
+/* The size of the pages in the default hugetlb pool */
+static size_t hugetlb_size(void) {
+    std::ifstream meminfo("/proc/meminfo");
+    std::string line;
+    while (std::getline(meminfo, line)) {
+        size_t kb;
+        if (sscanf(line.c_str(), "Hugepagesize: %zu kB", &kb) == 1) {
+            return kb * 1024;
+        }
+    }
+    return 0;
+}
+#endif
+
+static std::string shm_name(const std::string &name) {
+    if (name.empty() || name[0] == '/') {
+        return name;
+    }
+    return "/" + name;
+}
+
+Couchbase::SharedMemorySegment::SharedMemorySegment(const char *nm,
+                                                    bool rdonly) :
+        name(nm == NULL ? "" : shm_name(nm)),
+        fd(-1),
+        readonly(rdonly),
+        hugePages(HugePages::None),
+        locked(false),
+        pageSize(0) {
+    // Empty
+}
+
+Couchbase::SharedMemorySegment::~SharedMemorySegment() {
+    close();
+}
+
+void *Couchbase::SharedMemorySegment::mapSegment(size_t length,
+                                                 bool writable) {
+    int flags = MAP_SHARED;
+    int protection = PROT_READ | (writable ? PROT_WRITE : 0);
+    if (fd == -1) {
+        flags |= MAP_ANONYMOUS;
+#ifdef MAP_HUGETLB
+        if (hugePages == HugePages::Explicit) {
+            flags |= MAP_HUGETLB;
+        }
+#endif
+    }
+#ifdef MAP_POPULATE
+    if (locked) {
+        flags |= MAP_POPULATE;
+    }
+#endif
+
+    void *addr;
+#ifdef MADV_HUGEPAGE
+    if (hugePages == HugePages::Transparent) {
+        addr = mmap_aligned(length, protection, flags, fd, 0, thp_size());
+    } else {
+        addr = mmap(NULL, length, protection, flags, fd, 0);
+    }
+#else
+    addr = mmap(NULL, length, protection, flags, fd, 0);
+#endif
+    if (addr == MAP_FAILED) {
+        std::stringstream ss;
+        ss << "mmap failed: " << strerror(errno);
+        throw ss.str();
+    }
+
+#ifdef MADV_HUGEPAGE
+    if (hugePages == HugePages::Transparent) {
+        (void)madvise(addr, length, MADV_HUGEPAGE);
+    }
+#endif
+
+    if (locked && mlock(addr, length) != 0) {
+        std::stringstream ss;
+        ss << "mlock failed: " << strerror(errno);
+        munmap(addr, length);
+        throw ss.str();
+    }
+    return addr;
+}
+
+void Couchbase::SharedMemorySegment::create(size_t length) {
+    if (root != NULL) {
+        throw std::string("The segment is already mapped");
+    }
+    if (readonly) {
+        throw std::string("Invalid mode: can't create a readonly segment");
+    }
+    if (length == 0) {
+        throw std::string("The size of the segment can't be 0");
+    }
+
+    pageSize = size_t(sysconf(_SC_PAGESIZE));
+    if (hugePages == HugePages::Explicit) {
+#if defined(__linux__) && defined(MAP_HUGETLB)
+        if (!name.empty()) {
+            throw std::string("Explicit huge pages are only available for "
+                              "anonymous segments");
+        }
+        pageSize = hugetlb_size();
+        if (pageSize == 0) {
+            throw std::string("hugetlb pages are not supported");
+        }
+#else
+        throw std::string("Explicit huge pages are not supported");
+#endif
+    }
+    const size_t mapped = page_align(length, pageSize);
+
+    if (name.empty()) {
+#ifdef HAVE_MEMFD_CREATE
+        /* Use a memfd rather than MAP_ANONYMOUS so the anonymous
+         * segments have a descriptor like the named ones (and show up
+         * as "cb_shm" in /proc/<pid>/maps) */
+        unsigned int flags = MFD_CLOEXEC;
+#ifdef MFD_HUGETLB
+        if (hugePages == HugePages::Explicit) {
+            flags |= MFD_HUGETLB;
+        }
+#endif
+        fd = memfd_create("cb_shm", flags);
+        if (fd == -1) {
+            std::stringstream ss;
+            ss << "memfd_create failed: " << strerror(errno);
+            throw ss.str();
+        }
+#endif
+    } else {
+        fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd == -1) {
+            std::stringstream ss;
+            ss << "shm_open(" << name << ") failed: " << strerror(errno);
+            throw ss.str();
+        }
+    }
+
+    try {
+        if (fd != -1 && ftruncate(fd, off_t(mapped)) == -1) {
+            std::stringstream ss;
+            ss << "ftruncate failed: " << strerror(errno);
+            throw ss.str();
+        }
+        root = mapSegment(mapped, true);
+        size = length;
+    } catch (...) {
+        if (fd != -1) {
+            ::close(fd);
+            fd = -1;
+            if (!name.empty()) {
+                shm_unlink(name.c_str());
+            }
+        }
+        throw;
+    }
+}
+
+void Couchbase::SharedMemorySegment::open(void) {
+    if (root != NULL) {
+        throw std::string("The segment is already mapped");
+    }
+    if (name.empty()) {
+        throw std::string("Only named segments can be opened");
+    }
+    if (hugePages == HugePages::Explicit) {
+        throw std::string("Explicit huge pages are only available for "
+                          "anonymous segments");
+    }
+
+    fd = shm_open(name.c_str(), readonly ? O_RDONLY : O_RDWR, 0);
+    if (fd == -1) {
+        std::stringstream ss;
+        ss << "shm_open(" << name << ") failed: " << strerror(errno);
+        throw ss.str();
+    }
+
+    try {
+        struct stat st;
+        if (fstat(fd, &st) == -1) {
+            std::stringstream ss;
+            ss << "fstat(" << name << ") failed: " << strerror(errno);
+            throw ss.str();
+        }
+        if (st.st_size == 0) {
+            throw std::string("The segment is empty");
+        }
+        pageSize = size_t(sysconf(_SC_PAGESIZE));
+        root = mapSegment(size_t(st.st_size), !readonly);
+        size = size_t(st.st_size);
+    } catch (...) {
+        ::close(fd);
+        fd = -1;
+        throw;
+    }
+}
+
+void Couchbase::SharedMemorySegment::close(void) {
+    if (root == NULL) {
+        return;
+    }
+    std::stringstream ss;
+
+    if (munmap(root, page_align(size, pageSize)) != 0) {
+        ss << "munmap failed: " << strerror(errno);
+    }
+    if (fd != -1) {
+        ::close(fd);
+        fd = -1;
+    }
+    root = NULL;
+    size = 0;
+
+    std::string str = ss.str();
+    if (str.length() > 0) {
+        throw str;
+    }
+}
+
+Couchbase::MemoryMapping::Backing
+Couchbase::SharedMemorySegment::getBacking(void) const {
+    if (root == NULL) {
+        throw std::string("Internal error, create() or open() not called");
+    }
+    Backing backing;
+    backing.pageSize = pageSize;
+    backing.locked = locked;
+    if (pageSize > size_t(sysconf(_SC_PAGESIZE))) {
+        backing.hugePageBytes = page_align(size, pageSize);
+    } else {
+        backing.hugePageBytes = huge_page_bytes(root,
+                                                page_align(size, pageSize));
+    }
+    return backing;
+}
+
+void Couchbase::SharedMemorySegment::unlink(const char *nm) {
+    std::string name = shm_name(nm);
+    if (shm_unlink(name.c_str()) == -1) {
+        std::stringstream ss;
+        ss << "shm_unlink(" << name << ") failed: " << strerror(errno);
         throw ss.str();
     }
 }
@@ -15,6 +15,8 @@
  *   limitations under the License.
  */
 #include <windows.h>
+#include <algorithm>
+#include <cstring>
 #include <sstream>
 #include <platform/strerror.h>
 #include "platform/memorymap.h"
@@ -24,10 +26,13 @@ Couchbase::MemoryMappedFile::MemoryMappedFile(const char *fname, bool share, boo
         filename(fname),
         filehandle(INVALID_HANDLE_VALUE),
         maphandle(INVALID_HANDLE_VALUE),
-        root(NULL),
-        size(0),
         sharedMapping(share),
-        readonly(rdonly) {
+        readonly(rdonly),
+        prefault(false),
+        hugePages(HugePages::None),
+        locked(false),
+        pageSize(0),
+        fileOffset(0) {
 }
 
 Couchbase::MemoryMappedFile::~MemoryMappedFile() {
@@ -58,30 +63,114 @@ void Couchbase::MemoryMappedFile::close(void) {
 }
 
 void Couchbase::MemoryMappedFile::open(void) {
-    if (sharedMapping && readonly) {
-        throw std::string("Invalid mode: shared and readonly don't make sense");
-    }
+    open(0, 0);
+}
 
-    WIN32_FILE_ATTRIBUTE_DATA fad;
-    if (GetFileAttributesEx(filename.c_str(), GetFileExInfoStandard,
-            &fad) == 0) {
+static uint64_t file_size(HANDLE handle) {
+    LARGE_INTEGER sz;
+    if (!GetFileSizeEx(handle, &sz)) {
         std::stringstream ss;
         ss << "failed to determine file size: " << cb_strerror();
         throw ss.str();
     }
-    LARGE_INTEGER sz;
-    sz.HighPart = fad.nFileSizeHigh;
-    sz.LowPart = fad.nFileSizeLow;
-    size = (size_t) sz.QuadPart;
+    return uint64_t(sz.QuadPart);
+}
+
+void Couchbase::MemoryMappedFile::ensureFileSize(size_t length) {
+    const uint64_t end = uint64_t(fileOffset) + length;
+    if (file_size(filehandle) >= end) {
+        return;
+    }
+    if (!sharedMapping || readonly) {
+        throw std::string("The mapping can't extend beyond the end of the "
+                          "file unless it is shared and writable");
+    }
+    /* CreateFileMapping extends the file to the size of the section */
+}
+
+void *Couchbase::MemoryMappedFile::mapRange(size_t length) {
+    DWORD access = readonly ? FILE_MAP_READ : FILE_MAP_READ | FILE_MAP_WRITE;
+    const uint64_t end = uint64_t(fileOffset) + length;
+
+    /* Size the section to cover the window (it is never made smaller
+     * than the file) */
+    uint64_t sectionSize = file_size(filehandle);
+    if (sectionSize < end) {
+        sectionSize = end;
+    }
+    HANDLE section = CreateFileMapping(filehandle, NULL,
+            readonly ? PAGE_READONLY : PAGE_READWRITE,
+            DWORD(sectionSize >> 32), DWORD(sectionSize & 0xffffffff), NULL);
+    if (section == NULL) {
+        std::stringstream ss;
+        ss << "failed to create file mapping: " << cb_strerror();
+        throw ss.str();
+    }
+
+    void *addr = MapViewOfFile(section, access,
+                               DWORD(uint64_t(fileOffset) >> 32),
+                               DWORD(uint64_t(fileOffset) & 0xffffffff),
+                               length);
+    if (addr == NULL) {
+        std::stringstream ss;
+        ss << "mapviewoffile failed: " << cb_strerror();
+        CloseHandle(section);
+        throw ss.str();
+    }
+
+    if (prefault) {
+        WIN32_MEMORY_RANGE_ENTRY range;
+        range.VirtualAddress = addr;
+        range.NumberOfBytes = length;
+        (void)PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+
+        const volatile char *ptr = static_cast<const volatile char *>(addr);
+        for (size_t offset = 0; offset < length; offset += pageSize) {
+            (void)ptr[offset];
+        }
+    }
+
+    if (locked) {
+        /* The locked pages count against the minimum working set */
+        SIZE_T minimum, maximum;
+        HANDLE process = GetCurrentProcess();
+        if (GetProcessWorkingSetSize(process, &minimum, &maximum)) {
+            (void)SetProcessWorkingSetSize(process, minimum + length,
+                                           maximum + length);
+        }
+        if (!VirtualLock(addr, length)) {
+            std::stringstream ss;
+            ss << "VirtualLock failed: " << cb_strerror();
+            UnmapViewOfFile(addr);
+            CloseHandle(section);
+            throw ss.str();
+        }
+    }
+
+    if (maphandle != INVALID_HANDLE_VALUE) {
+        CloseHandle(maphandle);
+    }
+    maphandle = section;
+    return addr;
+}
+
+void Couchbase::MemoryMappedFile::open(size_t offset, size_t length) {
+    if (sharedMapping && readonly) {
+        throw std::string("Invalid mode: shared and readonly don't make sense");
+    }
+    if (hugePages == HugePages::Explicit) {
+        throw std::string("Large pages can't be used for file mappings");
+    }
+    /* Transparent huge pages are not available on Windows */
+    if (root != NULL) {
+        throw std::string("The mapping is already open");
+    }
 
     DWORD mode;
-    DWORD access;
     if (readonly) {
         mode = GENERIC_READ;
-        access = FILE_MAP_READ;
     } else {
         mode = GENERIC_READ | GENERIC_WRITE;
-        access = FILE_MAP_READ | FILE_MAP_WRITE;
     }
 
     DWORD shared = 0;
@@ -100,24 +189,333 @@ void Couchbase::MemoryMappedFile::open(void) {
         throw ss.str();
     }
 
-    maphandle = CreateFileMapping(filehandle, NULL,
-            readonly ? PAGE_READONLY : PAGE_READWRITE,
-            0, 0, NULL);
-    if (maphandle == INVALID_HANDLE_VALUE) {
-        std::stringstream ss;
-        ss << "failed to create file mapping: " << cb_strerror();
+    try {
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        pageSize = info.dwPageSize;
+        if (offset % info.dwAllocationGranularity != 0) {
+            std::stringstream ss;
+            ss << "The offset must be a multiple of the allocation "
+               << "granularity (" << info.dwAllocationGranularity << ")";
+            throw ss.str();
+        }
+
+        const uint64_t filesize = file_size(filehandle);
+        if (offset > filesize) {
+            throw std::string("The offset is beyond the end of the file");
+        }
+        if (length == 0) {
+            length = size_t(filesize - offset);
+        }
+
+        fileOffset = offset;
+        ensureFileSize(length);
+        root = mapRange(length);
+        size = length;
+    } catch (...) {
         CloseHandle(filehandle);
+        filehandle = INVALID_HANDLE_VALUE;
+        root = NULL;
         size = 0;
+        throw;
+    }
+}
+
+void Couchbase::MemoryMappedFile::remap(size_t length) {
+    if (root == NULL) {
+        throw std::string("Internal error, open() not called");
+    }
+    if (length == 0) {
+        throw std::string("remap: the length can't be 0");
+    }
+    ensureFileSize(length);
+
+    /* Map the new range before dropping the old one, so the old
+     * mapping is still in place if we fail */
+    void *mapped = mapRange(length);
+    if (!sharedMapping && !readonly) {
+        /* The changes to a private mapping only exist in its pages */
+        memcpy(mapped, root, std::min(size, length));
+    }
+    UnmapViewOfFile(root);
+    root = mapped;
+    size = length;
+}
+
+void Couchbase::MemoryMappedFile::sync(size_t offset, size_t length,
+                                       bool async) {
+    if (root == NULL) {
+        throw std::string("Internal error, open() not called");
+    }
+    if (offset > size) {
+        throw std::string("sync: offset is outside the mapping");
+    }
+    if (length == 0 || length > size - offset) {
+        length = size - offset;
+    }
+    if (length == 0) {
+        return;
+    }
+
+    if (!FlushViewOfFile(static_cast<char *>(root) + offset, length)) {
+        std::stringstream ss;
+        ss << "FlushViewOfFile failed: " << cb_strerror();
+        throw ss.str();
+    }
+    /* FlushViewOfFile only starts the writes of the pages */
+    if (!async && !FlushFileBuffers(filehandle)) {
+        std::stringstream ss;
+        ss << "FlushFileBuffers failed: " << cb_strerror();
         throw ss.str();
     }
+}
+
+Couchbase::MemoryMappedFile::Backing
+Couchbase::MemoryMappedFile::getBacking(void) const {
+    if (root == NULL) {
+        throw std::string("Internal error, open() not called");
+    }
+    Backing backing;
+    backing.pageSize = pageSize;
+    backing.hugePageBytes = 0;
+    backing.locked = locked;
+    return backing;
+}
 
-    root = MapViewOfFile(maphandle, access, 0, 0, 0);
+void Couchbase::MemoryMappedFile::advise(Advice advice, size_t offset,
+                                         size_t length) {
     if (root == NULL) {
+        throw std::string("Internal error, open() not called");
+    }
+    if (offset > size) {
+        throw std::string("advise: offset is outside the mapping");
+    }
+    if (length == 0 || length > size - offset) {
+        length = size - offset;
+    }
+    if (length == 0) {
+        return;
+    }
+
+    void *addr = static_cast<char *>(root) + offset;
+    switch (advice) {
+    case Advice::WillNeed:
+        {
+            WIN32_MEMORY_RANGE_ENTRY range;
+            range.VirtualAddress = addr;
+            range.NumberOfBytes = length;
+            if (!PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0)) {
+                std::stringstream ss;
+                ss << "PrefetchVirtualMemory failed: " << cb_strerror();
+                throw ss.str();
+            }
+        }
+        break;
+    case Advice::DontNeed:
+        /* Unlocking pages which aren't locked removes them from the
+         * working set (and fails with ERROR_NOT_LOCKED) */
+        (void)VirtualUnlock(addr, length);
+        break;
+    case Advice::Normal:
+    case Advice::Sequential:
+    case Advice::Random:
+        /* Windows only takes these hints when the file is opened */
+        break;
+    default:
+        throw std::string("advise: unknown advice");
+    }
+}
+
+/*
+ * Large pages need the "Lock pages in memory" privilege, which must be
+ * enabled in the token before it can be used.
+ */
+static bool enable_lock_memory_privilege(void) {
+    HANDLE token;
+    if (!OpenProcessToken(GetCurrentProcess(),
+                          TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token)) {
+        return false;
+    }
+    TOKEN_PRIVILEGES privileges;
+    privileges.PrivilegeCount = 1;
+    privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+    bool ok = LookupPrivilegeValue(NULL, SE_LOCK_MEMORY_NAME,
+                                   &privileges.Privileges[0].Luid) &&
+              AdjustTokenPrivileges(token, FALSE, &privileges, 0, NULL, 0) &&
+              GetLastError() == ERROR_SUCCESS;
+    CloseHandle(token);
+    return ok;
+}
+
+Couchbase::SharedMemorySegment::SharedMemorySegment(const char *nm,
+                                                    bool rdonly) :
+        name(nm == NULL ? "" : nm),
+        maphandle(INVALID_HANDLE_VALUE),
+        readonly(rdonly),
+        hugePages(HugePages::None),
+        locked(false),
+        pageSize(0) {
+}
+
+Couchbase::SharedMemorySegment::~SharedMemorySegment() {
+    close();
+}
+
+void *Couchbase::SharedMemorySegment::mapSegment(size_t length,
+                                                 bool writable) {
+    DWORD access = writable ? FILE_MAP_ALL_ACCESS : FILE_MAP_READ;
+    if (hugePages == HugePages::Explicit) {
+        access |= FILE_MAP_LARGE_PAGES;
+    }
+    void *addr = MapViewOfFile(maphandle, access, 0, 0, length);
+    if (addr == NULL) {
         std::stringstream ss;
-        ss << "mapviewoffile failed: " << cb_strerror();
+        ss << "MapViewOfFile failed: " << cb_strerror();
+        throw ss.str();
+    }
+
+    if (locked) {
+        SIZE_T minimum, maximum;
+        HANDLE process = GetCurrentProcess();
+        if (GetProcessWorkingSetSize(process, &minimum, &maximum)) {
+            (void)SetProcessWorkingSetSize(process, minimum + length,
+                                           maximum + length);
+        }
+        if (!VirtualLock(addr, length)) {
+            std::stringstream ss;
+            ss << "VirtualLock failed: " << cb_strerror();
+            UnmapViewOfFile(addr);
+            throw ss.str();
+        }
+    }
+    return addr;
+}
+
+void Couchbase::SharedMemorySegment::create(size_t length) {
+    if (root != NULL) {
+        throw std::string("The segment is already mapped");
+    }
+    if (readonly) {
+        throw std::string("Invalid mode: can't create a readonly segment");
+    }
+    if (length == 0) {
+        throw std::string("The size of the segment can't be 0");
+    }
+
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    pageSize = info.dwPageSize;
+
+    DWORD protection = PAGE_READWRITE;
+    if (hugePages == HugePages::Explicit) {
+        pageSize = GetLargePageMinimum();
+        if (pageSize == 0 || !enable_lock_memory_privilege()) {
+            throw std::string("Large pages are not available (they need "
+                              "the \"Lock pages in memory\" privilege)");
+        }
+        protection |= SEC_COMMIT | SEC_LARGE_PAGES;
+    }
+    const uint64_t mapped = (uint64_t(length) + pageSize - 1) &
+                            ~uint64_t(pageSize - 1);
+
+    maphandle = CreateFileMapping(INVALID_HANDLE_VALUE, NULL, protection,
+                                  DWORD(mapped >> 32),
+                                  DWORD(mapped & 0xffffffff),
+                                  name.empty() ? NULL : name.c_str());
+    if (maphandle == NULL) {
+        maphandle = INVALID_HANDLE_VALUE;
+        std::stringstream ss;
+        ss << "CreateFileMapping failed: " << cb_strerror();
+        throw ss.str();
+    }
+    if (GetLastError() == ERROR_ALREADY_EXISTS) {
         CloseHandle(maphandle);
-        CloseHandle(filehandle);
-        size = 0;
+        maphandle = INVALID_HANDLE_VALUE;
+        throw std::string("The segment already exists: ") + name;
+    }
+
+    try {
+        root = mapSegment(size_t(mapped), true);
+        size = length;
+    } catch (...) {
+        CloseHandle(maphandle);
+        maphandle = INVALID_HANDLE_VALUE;
+        throw;
+    }
+}
+
+void Couchbase::SharedMemorySegment::open(void) {
+    if (root != NULL) {
+        throw std::string("The segment is already mapped");
+    }
+    if (name.empty()) {
+        throw std::string("Only named segments can be opened");
+    }
+
+    maphandle = OpenFileMapping(readonly ? FILE_MAP_READ : FILE_MAP_ALL_ACCESS,
+                                FALSE, name.c_str());
+    if (maphandle == NULL) {
+        maphandle = INVALID_HANDLE_VALUE;
+        std::stringstream ss;
+        ss << "OpenFileMapping(" << name << ") failed: " << cb_strerror();
         throw ss.str();
     }
+
+    try {
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        pageSize = info.dwPageSize;
+        void *addr = mapSegment(0, !readonly);
+        /* The section size isn't available, but the view covers all
+         * of it (rounded up to the page size) */
+        MEMORY_BASIC_INFORMATION mbi;
+        if (VirtualQuery(addr, &mbi, sizeof(mbi)) == 0) {
+            std::stringstream ss;
+            ss << "VirtualQuery failed: " << cb_strerror();
+            UnmapViewOfFile(addr);
+            throw ss.str();
+        }
+        root = addr;
+        size = mbi.RegionSize;
+    } catch (...) {
+        CloseHandle(maphandle);
+        maphandle = INVALID_HANDLE_VALUE;
+        throw;
+    }
+}
+
+void Couchbase::SharedMemorySegment::close(void) {
+    if (root == NULL) {
+        return;
+    }
+    std::stringstream ss;
+
+    if (!UnmapViewOfFile(root)) {
+        ss << "UnmapViewOfFile() failed: " << cb_strerror();
+    }
+    CloseHandle(maphandle);
+    maphandle = INVALID_HANDLE_VALUE;
+    root = NULL;
+    size = 0;
+
+    std::string str = ss.str();
+    if (str.length() > 0) {
+        throw str;
+    }
+}
+
+Couchbase::MemoryMapping::Backing
+Couchbase::SharedMemorySegment::getBacking(void) const {
+    if (root == NULL) {
+        throw std::string("Internal error, create() or open() not called");
+    }
+    Backing backing;
+    backing.pageSize = pageSize;
+    backing.hugePageBytes = hugePages == HugePages::Explicit ? size : 0;
+    backing.locked = locked;
+    return backing;
+}
+
+void Couchbase::SharedMemorySegment::unlink(const char *) {
+    /* The section goes away with the last handle */
 }
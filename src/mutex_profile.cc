@@ -0,0 +1,259 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2016 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config.h"
+#include "mutex_profile.h"
+
+#include <cJSON.h>
+
+#include <atomic>
+#include <cstring>
+#include <mutex>
+
+/*
+ * The registry is a fixed size open addressing table keyed on the
+ * address of the mutex, so that the lookup done by cb_mutex_enter
+ * doesn't need a lock. Slots are only claimed (and released) while
+ * holding registry_mutex.
+ *
+ * All of the statistics for a mutex are updated while holding that
+ * mutex, so they don't need atomic read-modify-write operations. They
+ * are atomics only so that the readers see consistent values.
+ */
+
+#define REGISTRY_SIZE 1024
+
+static cb_mutex_t *const tombstone = reinterpret_cast<cb_mutex_t *>(1);
+
+struct mutex_entry {
+    std::atomic<cb_mutex_t *> key;
+    char name[32];
+    std::atomic<uint64_t> acquisitions;
+    std::atomic<uint64_t> contended;
+    std::atomic<uint64_t> total_wait;
+    std::atomic<uint64_t> max_wait;
+    std::atomic<uint64_t> max_hold;
+    /* Only accessed by the thread currently holding the mutex */
+    hrtime_t acquired_at;
+    uint64_t acquired_session;
+};
+
+static mutex_entry registry[REGISTRY_SIZE];
+static std::mutex registry_mutex;
+/* Set once the first mutex is named; until then there is nothing to find */
+static std::atomic<bool> registry_used(false);
+/* The slots which aren't empty (named or tombstones), under registry_mutex */
+static size_t registry_filled = 0;
+
+volatile int cb_mutex_profiling = 0;
+/* Bumped every time profiling is enabled. A mutex may be released while
+   profiling is off, which leaves its acquired_at behind, so only a time
+   from the current session is used to measure the hold. */
+static std::atomic<uint64_t> profiling_session(0);
+
+static size_t slot_of(const cb_mutex_t *mutex) {
+    uint64_t h = uint64_t(reinterpret_cast<uintptr_t>(mutex));
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return size_t(h & (REGISTRY_SIZE - 1));
+}
+
+static mutex_entry *lookup(const cb_mutex_t *mutex) {
+    if (!registry_used.load(std::memory_order_relaxed)) {
+        return nullptr;
+    }
+    size_t slot = slot_of(mutex);
+    for (size_t ii = 0; ii < REGISTRY_SIZE; ++ii) {
+        mutex_entry *entry = &registry[(slot + ii) & (REGISTRY_SIZE - 1)];
+        cb_mutex_t *key = entry->key.load(std::memory_order_acquire);
+        if (key == mutex) {
+            return entry;
+        }
+        if (key == nullptr) {
+            break;
+        }
+    }
+    return nullptr;
+}
+
+static void relaxed_add(std::atomic<uint64_t> &counter, uint64_t value) {
+    counter.store(counter.load(std::memory_order_relaxed) + value,
+                  std::memory_order_relaxed);
+}
+
+static void relaxed_max(std::atomic<uint64_t> &counter, uint64_t value) {
+    if (value > counter.load(std::memory_order_relaxed)) {
+        counter.store(value, std::memory_order_relaxed);
+    }
+}
+
+static void clear_stats(mutex_entry *entry) {
+    entry->acquisitions.store(0, std::memory_order_relaxed);
+    entry->contended.store(0, std::memory_order_relaxed);
+    entry->total_wait.store(0, std::memory_order_relaxed);
+    entry->max_wait.store(0, std::memory_order_relaxed);
+    entry->max_hold.store(0, std::memory_order_relaxed);
+}
+
+void cb_mutex_profile_acquired(cb_mutex_t *mutex, int contended,
+                               hrtime_t wait) {
+    mutex_entry *entry = lookup(mutex);
+    if (entry == nullptr) {
+        return;
+    }
+    relaxed_add(entry->acquisitions, 1);
+    if (contended) {
+        relaxed_add(entry->contended, 1);
+        relaxed_add(entry->total_wait, wait);
+        relaxed_max(entry->max_wait, wait);
+    }
+    entry->acquired_at = gethrtime();
+    entry->acquired_session = profiling_session.load(std::memory_order_relaxed);
+}
+
+void cb_mutex_profile_release(cb_mutex_t *mutex) {
+    mutex_entry *entry = lookup(mutex);
+    if (entry == nullptr || entry->acquired_at == 0 ||
+        entry->acquired_session !=
+            profiling_session.load(std::memory_order_relaxed)) {
+        // The mutex was acquired before profiling was (re)enabled
+        return;
+    }
+    relaxed_max(entry->max_hold, gethrtime() - entry->acquired_at);
+    entry->acquired_at = 0;
+}
+
+void cb_mutex_profile_forget(cb_mutex_t *mutex) {
+    if (lookup(mutex) == nullptr) {
+        // Don't serialize the destruction of all of the unnamed mutexes
+        return;
+    }
+    std::lock_guard<std::mutex> guard(registry_mutex);
+    mutex_entry *entry = lookup(mutex);
+    if (entry == nullptr) {
+        return;
+    }
+    entry->key.store(tombstone, std::memory_order_release);
+
+    // A tombstone just before an empty slot doesn't continue any probe
+    // sequence, so it (and the ones before it) can be emptied. That keeps
+    // the lookups short once many named mutexes have come and gone.
+    size_t slot = size_t(entry - registry);
+    while (registry[(slot + 1) & (REGISTRY_SIZE - 1)].key.load(
+               std::memory_order_relaxed) == nullptr &&
+           registry[slot].key.load(std::memory_order_relaxed) == tombstone) {
+        registry[slot].key.store(nullptr, std::memory_order_release);
+        --registry_filled;
+        slot = (slot - 1) & (REGISTRY_SIZE - 1);
+    }
+}
+
+PLATFORM_PUBLIC_API
+int cb_mutex_set_name(cb_mutex_t *mutex, const char *name) {
+    std::lock_guard<std::mutex> guard(registry_mutex);
+    mutex_entry *entry = lookup(mutex);
+    if (entry == nullptr) {
+        size_t slot = slot_of(mutex);
+        for (size_t ii = 0; ii < REGISTRY_SIZE; ++ii) {
+            mutex_entry *e = &registry[(slot + ii) & (REGISTRY_SIZE - 1)];
+            cb_mutex_t *key = e->key.load(std::memory_order_relaxed);
+            if (key == tombstone) {
+                entry = e;
+                break;
+            }
+            // Always keep an empty slot, so every probe sequence ends
+            if (key == nullptr) {
+                if (registry_filled + 1 < REGISTRY_SIZE) {
+                    entry = e;
+                    ++registry_filled;
+                }
+                break;
+            }
+        }
+        if (entry == nullptr) {
+            return -1;
+        }
+        clear_stats(entry);
+        entry->acquired_at = 0;
+    }
+
+    strncpy(entry->name, name, sizeof(entry->name) - 1);
+    entry->name[sizeof(entry->name) - 1] = '\0';
+    entry->key.store(mutex, std::memory_order_release);
+    registry_used.store(true, std::memory_order_release);
+    return 0;
+}
+
+PLATFORM_PUBLIC_API
+void cb_mutex_profiling_enable(int enable) {
+    std::lock_guard<std::mutex> guard(registry_mutex);
+    if (enable && !cb_mutex_profiling) {
+        profiling_session.fetch_add(1, std::memory_order_relaxed);
+    }
+    cb_mutex_profiling = enable;
+}
+
+PLATFORM_PUBLIC_API
+void cb_mutex_stats_iterate(cb_mutex_stats_callback callback, void *ctx) {
+    std::lock_guard<std::mutex> guard(registry_mutex);
+    for (auto &entry : registry) {
+        cb_mutex_t *key = entry.key.load(std::memory_order_acquire);
+        if (key == nullptr || key == tombstone) {
+            continue;
+        }
+        cb_mutex_stats_t stats;
+        stats.name = entry.name;
+        stats.acquisitions = entry.acquisitions.load(std::memory_order_relaxed);
+        stats.contended = entry.contended.load(std::memory_order_relaxed);
+        stats.total_wait_ns = entry.total_wait.load(std::memory_order_relaxed);
+        stats.max_wait_ns = entry.max_wait.load(std::memory_order_relaxed);
+        stats.max_hold_ns = entry.max_hold.load(std::memory_order_relaxed);
+        callback(&stats, ctx);
+    }
+}
+
+PLATFORM_PUBLIC_API
+void cb_mutex_stats_reset(void) {
+    std::lock_guard<std::mutex> guard(registry_mutex);
+    for (auto &entry : registry) {
+        clear_stats(&entry);
+    }
+}
+
+static void add_json_stats(const cb_mutex_stats_t *stats, void *ctx) {
+    cJSON *array = reinterpret_cast<cJSON *>(ctx);
+    cJSON *obj = cJSON_CreateObject();
+    cJSON_AddStringToObject(obj, "name", stats->name);
+    cJSON_AddItemToObject(obj, "acquisitions",
+                          cJSON_CreateInt64(int64_t(stats->acquisitions)));
+    cJSON_AddItemToObject(obj, "contended",
+                          cJSON_CreateInt64(int64_t(stats->contended)));
+    cJSON_AddItemToObject(obj, "total_wait_ns",
+                          cJSON_CreateInt64(int64_t(stats->total_wait_ns)));
+    cJSON_AddItemToObject(obj, "max_wait_ns",
+                          cJSON_CreateInt64(int64_t(stats->max_wait_ns)));
+    cJSON_AddItemToObject(obj, "max_hold_ns",
+                          cJSON_CreateInt64(int64_t(stats->max_hold_ns)));
+    cJSON_AddItemToArray(array, obj);
+}
+
+PLATFORM_PUBLIC_API
+struct cJSON *cb_mutex_stats_to_json(void) {
+    cJSON *array = cJSON_CreateArray();
+    cb_mutex_stats_iterate(add_json_stats, array);
+    return array;
+}
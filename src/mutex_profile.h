@@ -0,0 +1,45 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2016 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#pragma once
+
+/*
+ * Internal interface between the cb_mutex_ implementations and the
+ * contention profiler in mutex_profile.cc
+ */
+
+#include <platform/platform.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /* Set by cb_mutex_profiling_enable. Only read it as a hint */
+    extern volatile int cb_mutex_profiling;
+
+    /* The calling thread just got the mutex after waiting wait ns */
+    void cb_mutex_profile_acquired(cb_mutex_t *mutex, int contended,
+                                   hrtime_t wait);
+
+    /* The calling thread is about to release the mutex */
+    void cb_mutex_profile_release(cb_mutex_t *mutex);
+
+    /* The mutex is being destroyed */
+    void cb_mutex_profile_forget(cb_mutex_t *mutex);
+
+#ifdef __cplusplus
+}
+#endif
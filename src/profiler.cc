@@ -0,0 +1,439 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2016 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config.h"
+
+#include <platform/platform.h>
+#include <platform/profiler.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+#ifdef WIN32
+#include <tlhelp32.h>
+#else
+#include <signal.h>
+#include <sys/time.h>
+#endif
+
+/*
+ * The samples are written into a bounded ring by the signal handler
+ * (or the Windows sampling thread) and aggregated into a map from stack
+ * to count by the collector thread.
+ *
+ * A producer claims a slot by advancing head (if the ring isn't full),
+ * fills it in and then publishes it by setting its sequence number to
+ * the index + 1. The collector consumes the slots in order, and only
+ * moves tail past a slot once it has copied it.
+ */
+
+namespace {
+    const size_t RING_SIZE = 4096;
+
+    struct Sample {
+        std::atomic<uint64_t> seq;
+        int nframes;
+        void *frames[CB_BACKTRACE_MAX_FRAMES];
+    };
+
+    struct Ring {
+        Ring() : head(0), tail(0), dropped(0) {
+            for (size_t ii = 0; ii < RING_SIZE; ++ii) {
+                samples[ii].seq.store(0);
+            }
+        }
+
+        /* Called from the signal handler: no locks or allocation */
+        void push(void *const *frames, int nframes) {
+            uint64_t pos = head.load(std::memory_order_relaxed);
+            do {
+                if (pos - tail.load(std::memory_order_acquire) >= RING_SIZE) {
+                    dropped.fetch_add(1, std::memory_order_relaxed);
+                    return;
+                }
+            } while (!head.compare_exchange_weak(pos, pos + 1,
+                                                 std::memory_order_relaxed));
+
+            Sample &sample = samples[pos % RING_SIZE];
+            if (nframes > CB_BACKTRACE_MAX_FRAMES) {
+                nframes = CB_BACKTRACE_MAX_FRAMES;
+            }
+            sample.nframes = nframes;
+            for (int ii = 0; ii < nframes; ++ii) {
+                sample.frames[ii] = frames[ii];
+            }
+            sample.seq.store(pos + 1, std::memory_order_release);
+        }
+
+        std::atomic<uint64_t> head;
+        std::atomic<uint64_t> tail;
+        std::atomic<uint64_t> dropped;
+        Sample samples[RING_SIZE];
+    };
+
+    typedef std::vector<void *> Stack;
+
+    struct Profiler {
+        Profiler() : running(false), samples(0) {
+            cb_mutex_initialize(&mutex);
+            cb_cond_initialize(&cond);
+        }
+
+        /* Move the published samples to the map (with mutex held) */
+        void drain(void) {
+            uint64_t pos = ring.tail.load(std::memory_order_relaxed);
+            for (;;) {
+                Sample &sample = ring.samples[pos % RING_SIZE];
+                if (sample.seq.load(std::memory_order_acquire) != pos + 1) {
+                    break;
+                }
+                Stack stack(sample.frames, sample.frames + sample.nframes);
+                ++pos;
+                ring.tail.store(pos, std::memory_order_release);
+                ++stacks[stack];
+                ++samples;
+            }
+        }
+
+        cb_mutex_t mutex;
+        cb_cond_t cond;
+        cb_thread_t collector;
+        /* Protected by mutex */
+        bool running;
+        std::map<Stack, uint64_t> stacks;
+        uint64_t samples;
+        unsigned int frequency;
+
+        Ring ring;
+    };
+
+    /* Allocated on first use and never freed (the signal handler may
+     * still be running when the profiler is stopped) */
+    Profiler &profiler(void) {
+        static Profiler *instance = new Profiler();
+        return *instance;
+    }
+
+    std::atomic<Ring *> active_ring(nullptr);
+
+    /* The name of the function in a frame, or its address */
+    std::string frame_name(void *addr) {
+        char buffer[200];
+        cb_backtrace_describe(addr, buffer, sizeof(buffer));
+        /* The description looks like "module(symbol+0x12) [0x1234]" */
+        const char *open = strchr(buffer, '(');
+        if (open != NULL) {
+            size_t length = strcspn(open + 1, "+-)");
+            if (length > 0) {
+                return std::string(open + 1, length);
+            }
+        }
+        char address[32];
+        snprintf(address, sizeof(address), "%p", addr);
+        return address;
+    }
+}
+
+#ifdef WIN32
+/* Capture the stack of a suspended thread */
+static int walk_stack(CONTEXT &ctx, void **frames, int max_frames) {
+    int nframes = 0;
+#if defined(_M_X64)
+    while (nframes < max_frames && ctx.Rip != 0) {
+        frames[nframes++] = reinterpret_cast<void *>(ctx.Rip);
+        DWORD64 image_base;
+        PRUNTIME_FUNCTION function = RtlLookupFunctionEntry(ctx.Rip,
+                                                            &image_base,
+                                                            NULL);
+        if (function == NULL) {
+            /* A leaf function: the return address is on the top of
+             * the stack */
+            ctx.Rip = *reinterpret_cast<DWORD64 *>(ctx.Rsp);
+            ctx.Rsp += 8;
+        } else {
+            PVOID handler_data;
+            DWORD64 establisher_frame;
+            RtlVirtualUnwind(UNW_FLAG_NHANDLER, image_base, ctx.Rip,
+                             function, &ctx, &handler_data,
+                             &establisher_frame, NULL);
+        }
+    }
+#elif defined(_M_IX86)
+    frames[nframes++] = reinterpret_cast<void *>(ctx.Eip);
+#else
+    frames[nframes++] = reinterpret_cast<void *>(ctx.Pc);
+#endif
+    return nframes;
+}
+
+static void sample_threads(std::map<DWORD, uint64_t> &cputime) {
+    HANDLE snapshot = CreateToolhelp32Snapshot(TH32CS_SNAPTHREAD, 0);
+    if (snapshot == INVALID_HANDLE_VALUE) {
+        return;
+    }
+    const DWORD pid = GetCurrentProcessId();
+    const DWORD self = GetCurrentThreadId();
+    THREADENTRY32 entry;
+    entry.dwSize = sizeof(entry);
+
+    for (BOOL ok = Thread32First(snapshot, &entry); ok;
+         ok = Thread32Next(snapshot, &entry)) {
+        if (entry.th32OwnerProcessID != pid || entry.th32ThreadID == self) {
+            continue;
+        }
+        HANDLE thread = OpenThread(THREAD_SUSPEND_RESUME |
+                                   THREAD_GET_CONTEXT |
+                                   THREAD_QUERY_INFORMATION,
+                                   FALSE, entry.th32ThreadID);
+        if (thread == NULL) {
+            continue;
+        }
+
+        /* Only sample the threads which used CPU since the last time */
+        FILETIME creation, exit, kernel, user;
+        if (GetThreadTimes(thread, &creation, &exit, &kernel, &user)) {
+            uint64_t used = (uint64_t(kernel.dwHighDateTime) << 32) +
+                            kernel.dwLowDateTime +
+                            (uint64_t(user.dwHighDateTime) << 32) +
+                            user.dwLowDateTime;
+            uint64_t &previous = cputime[entry.th32ThreadID];
+            bool idle = used == previous;
+            previous = used;
+            if (idle) {
+                CloseHandle(thread);
+                continue;
+            }
+        }
+
+        if (SuspendThread(thread) != DWORD(-1)) {
+            CONTEXT ctx;
+            memset(&ctx, 0, sizeof(ctx));
+            ctx.ContextFlags = CONTEXT_FULL;
+            if (GetThreadContext(thread, &ctx)) {
+                void *frames[CB_BACKTRACE_MAX_FRAMES];
+                int nframes = walk_stack(ctx, frames,
+                                         CB_BACKTRACE_MAX_FRAMES);
+                profiler().ring.push(frames, nframes);
+            }
+            ResumeThread(thread);
+        }
+        CloseHandle(thread);
+    }
+    CloseHandle(snapshot);
+}
+#else
+static struct sigaction previous_action;
+
+static void sigprof_handler(int) {
+    int saved_errno = errno;
+    Ring *ring = active_ring.load(std::memory_order_acquire);
+    if (ring != nullptr) {
+        /* Skip the handler and the signal trampoline */
+        const int skip = 2;
+        void *frames[CB_BACKTRACE_MAX_FRAMES + skip];
+        /* May take the loader lock on older glibc, see
+           cb_backtrace_capture */
+        int nframes = cb_backtrace_capture(frames,
+                                           CB_BACKTRACE_MAX_FRAMES + skip);
+        if (nframes > skip) {
+            ring->push(frames + skip, nframes - skip);
+        }
+    }
+    errno = saved_errno;
+}
+#endif
+
+static void collector_main(void *) {
+    Profiler &prof = profiler();
+#ifdef WIN32
+    std::map<DWORD, uint64_t> cputime;
+    const unsigned int interval = 1000 / prof.frequency > 0 ?
+                                  1000 / prof.frequency : 1;
+#else
+    const unsigned int interval = 10;
+#endif
+
+    cb_mutex_enter(&prof.mutex);
+    while (prof.running) {
+        cb_cond_timedwait(&prof.cond, &prof.mutex, interval);
+#ifdef WIN32
+        cb_mutex_exit(&prof.mutex);
+        sample_threads(cputime);
+        cb_mutex_enter(&prof.mutex);
+#endif
+        prof.drain();
+    }
+    cb_mutex_exit(&prof.mutex);
+}
+
+#ifndef WIN32
+static void stop_sampling(void) {
+    struct itimerval timer;
+    memset(&timer, 0, sizeof(timer));
+    setitimer(ITIMER_PROF, &timer, NULL);
+    /* A signal may still be pending, so keep our handler installed
+     * (with sampling disabled) if nobody else had one */
+    active_ring.store(nullptr, std::memory_order_release);
+    if (previous_action.sa_handler != SIG_DFL) {
+        sigaction(SIGPROF, &previous_action, NULL);
+    }
+}
+#endif
+
+PLATFORM_PUBLIC_API
+int cb_profiler_start(unsigned int frequency) {
+    Profiler &prof = profiler();
+    if (frequency == 0) {
+        frequency = 100;
+    }
+
+    cb_mutex_enter(&prof.mutex);
+    if (prof.running) {
+        cb_mutex_exit(&prof.mutex);
+        return -1;
+    }
+    prof.running = true;
+    prof.frequency = frequency;
+    cb_mutex_exit(&prof.mutex);
+
+#ifndef WIN32
+    active_ring.store(&prof.ring, std::memory_order_release);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = sigprof_handler;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    struct itimerval timer;
+    long interval = frequency > 1000000 ? 1 : 1000000 / frequency;
+    // tv_usec must be less than a second (or setitimer fails for 1 Hz)
+    timer.it_interval.tv_sec = interval / 1000000;
+    timer.it_interval.tv_usec = interval % 1000000;
+    timer.it_value = timer.it_interval;
+
+    if (sigaction(SIGPROF, &action, &previous_action) == -1) {
+        active_ring.store(nullptr);
+        cb_mutex_enter(&prof.mutex);
+        prof.running = false;
+        cb_mutex_exit(&prof.mutex);
+        return -1;
+    }
+    if (setitimer(ITIMER_PROF, &timer, NULL) == -1) {
+        sigaction(SIGPROF, &previous_action, NULL);
+        active_ring.store(nullptr);
+        cb_mutex_enter(&prof.mutex);
+        prof.running = false;
+        cb_mutex_exit(&prof.mutex);
+        return -1;
+    }
+#endif
+
+    if (cb_create_named_thread(&prof.collector, collector_main, NULL, 0,
+                               "cb_profiler") != 0) {
+        // There is no collector to join, so just undo the above
+#ifndef WIN32
+        stop_sampling();
+#endif
+        cb_mutex_enter(&prof.mutex);
+        prof.running = false;
+        prof.drain();
+        cb_mutex_exit(&prof.mutex);
+        return -1;
+    }
+    return 0;
+}
+
+PLATFORM_PUBLIC_API
+void cb_profiler_stop(void) {
+    Profiler &prof = profiler();
+
+    cb_mutex_enter(&prof.mutex);
+    if (!prof.running) {
+        cb_mutex_exit(&prof.mutex);
+        return;
+    }
+    prof.running = false;
+    cb_cond_signal(&prof.cond);
+    cb_mutex_exit(&prof.mutex);
+
+#ifndef WIN32
+    stop_sampling();
+#endif
+
+    cb_join_thread(prof.collector);
+
+    cb_mutex_enter(&prof.mutex);
+    prof.drain();
+    cb_mutex_exit(&prof.mutex);
+}
+
+PLATFORM_PUBLIC_API
+void cb_profiler_reset(void) {
+    Profiler &prof = profiler();
+    cb_mutex_enter(&prof.mutex);
+    prof.drain();
+    prof.stacks.clear();
+    prof.samples = 0;
+    prof.ring.dropped.store(0);
+    cb_mutex_exit(&prof.mutex);
+}
+
+PLATFORM_PUBLIC_API
+uint64_t cb_profiler_get_samples(uint64_t *dropped) {
+    Profiler &prof = profiler();
+    cb_mutex_enter(&prof.mutex);
+    prof.drain();
+    uint64_t ret = prof.samples;
+    cb_mutex_exit(&prof.mutex);
+    if (dropped != NULL) {
+        *dropped = prof.ring.dropped.load();
+    }
+    return ret;
+}
+
+PLATFORM_PUBLIC_API
+void cb_profiler_write_collapsed(write_cb_t write_cb, void *context) {
+    Profiler &prof = profiler();
+    std::map<Stack, uint64_t> stacks;
+    cb_mutex_enter(&prof.mutex);
+    prof.drain();
+    stacks = prof.stacks;
+    cb_mutex_exit(&prof.mutex);
+
+    /* Different addresses in the same functions end up as the same
+     * line, so merge them */
+    std::map<std::string, uint64_t> lines;
+    for (const auto &entry : stacks) {
+        std::string line;
+        for (auto ii = entry.first.rbegin(); ii != entry.first.rend(); ++ii) {
+            if (!line.empty()) {
+                line.push_back(';');
+            }
+            line.append(frame_name(*ii));
+        }
+        lines[line] += entry.second;
+    }
+
+    for (const auto &entry : lines) {
+        std::string line = entry.first + " " + std::to_string(entry.second);
+        write_cb(context, line.c_str());
+    }
+}
@@ -0,0 +1,475 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2016 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config.h"
+
+#include <platform/queue.h>
+
+#include <stdlib.h>
+
+#define CACHELINE 64
+#define WAIT_FOREVER UINT64_MAX
+
+/* The number of failed attempts before going to sleep */
+#define SPIN_COUNT 64
+
+#ifdef _MSC_VER
+/* Volatile accesses have acquire / release semantics on x86 and x64 */
+#define load_relaxed(p) (*(p))
+#define load_acquire(p) (*(p))
+#define store_release(p, v) (*(p) = (v))
+#ifdef _WIN64
+#define cas_size(p, expected, desired)                                 \
+    (InterlockedCompareExchange64((volatile LONG64 *)(p),              \
+                                  (LONG64)(desired),                   \
+                                  (LONG64)(expected)) == (LONG64)(expected))
+#else
+#define cas_size(p, expected, desired)                                 \
+    (InterlockedCompareExchange((volatile LONG *)(p), (LONG)(desired), \
+                                (LONG)(expected)) == (LONG)(expected))
+#endif
+#define atomic_add32(p, v) InterlockedExchangeAdd((volatile LONG *)(p), (LONG)(v))
+#define atomic_load32(p) \
+    ((uint32_t)InterlockedCompareExchange((volatile LONG *)(p), 0, 0))
+#define full_fence() MemoryBarrier()
+#define cpu_relax() YieldProcessor()
+#else
+#define load_relaxed(p) __atomic_load_n(p, __ATOMIC_RELAXED)
+#define load_acquire(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define store_release(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define cas_size(p, expected, desired) \
+    __sync_bool_compare_and_swap(p, expected, desired)
+#define atomic_add32(p, v) __atomic_fetch_add(p, v, __ATOMIC_SEQ_CST)
+#define atomic_load32(p) __atomic_load_n(p, __ATOMIC_SEQ_CST)
+#define full_fence() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define cpu_relax() __asm__ __volatile__("yield")
+#else
+#define cpu_relax()
+#endif
+#endif
+
+/*
+ * The threads waiting on one side of a queue. A thread about to sleep
+ * bumps the count and then tries once more, and the other side posts
+ * the semaphore after every push (or pop) while the count is non-zero.
+ * The fences order the count against the item on both sides, so either
+ * the waiter sees the item or the other side sees the waiter. A post nobody
+ * needed just makes a later wait loop once more.
+ *
+ * This is the semaphore cb_event_t is built on rather than the event
+ * itself: an event stays set until it is reset, and so would wake every
+ * waiter for every item (and the reset would race with the next set),
+ * while each post lets exactly one waiter through.
+ */
+typedef struct {
+    volatile uint32_t waiting;
+    cb_semaphore_t sem;
+} queue_waiters;
+
+static void waiters_initialize(queue_waiters *waiters)
+{
+    waiters->waiting = 0;
+    cb_semaphore_initialize(&waiters->sem, 0);
+}
+
+static void wake_waiter(queue_waiters *waiters)
+{
+    full_fence();
+    if (atomic_load32(&waiters->waiting) != 0) {
+        cb_semaphore_post(&waiters->sem, 1);
+    }
+}
+
+typedef int (*try_fn)(void *queue, void **item);
+
+/* Retry the operation until it succeeds or the time is up */
+static int wait_for(void *queue, try_fn op, void **item,
+                    queue_waiters *waiters, uint64_t ns)
+{
+    hrtime_t deadline = 0;
+    int ii;
+
+    for (ii = 0; ii < SPIN_COUNT; ++ii) {
+        if (op(queue, item) == 0) {
+            return 0;
+        }
+        cpu_relax();
+    }
+
+    if (ns != WAIT_FOREVER) {
+        deadline = gethrtime() + ns;
+        if (deadline < ns) {
+            /* That's a few hundred years from now... */
+            deadline = UINT64_MAX;
+        }
+    }
+    for (;;) {
+        int timedout = 0;
+        atomic_add32(&waiters->waiting, 1);
+        full_fence();
+        if (op(queue, item) == 0) {
+            atomic_add32(&waiters->waiting, -1);
+            return 0;
+        }
+        if (ns == WAIT_FOREVER) {
+            cb_semaphore_wait(&waiters->sem);
+        } else {
+            hrtime_t now = gethrtime();
+            timedout = now >= deadline ||
+                cb_semaphore_timedwait_ns(&waiters->sem, deadline - now) == -1;
+        }
+        atomic_add32(&waiters->waiting, -1);
+        if (timedout) {
+            return op(queue, item);
+        }
+    }
+}
+
+static size_t round_up_capacity(size_t capacity)
+{
+    size_t ret = 2;
+    while (ret < capacity) {
+        ret *= 2;
+    }
+    return ret;
+}
+
+/* MPMC */
+
+typedef struct {
+    volatile size_t sequence;
+    void *data;
+} mpmc_cell;
+
+struct cb_mpmc_queue {
+    char pad0[CACHELINE];
+    mpmc_cell *cells;
+    size_t mask;
+    char pad1[CACHELINE];
+    volatile size_t enqueue_pos;
+    char pad2[CACHELINE - sizeof(size_t)];
+    volatile size_t dequeue_pos;
+    char pad3[CACHELINE - sizeof(size_t)];
+    /* Consumers waiting for an item */
+    queue_waiters not_empty;
+    char pad4[CACHELINE];
+    /* Producers waiting for a free slot */
+    queue_waiters not_full;
+    char pad5[CACHELINE];
+};
+
+cb_mpmc_queue_t *cb_mpmc_queue_create(size_t capacity)
+{
+    cb_mpmc_queue_t *queue = calloc(1, sizeof(*queue));
+    size_t ii;
+    if (queue == NULL) {
+        return NULL;
+    }
+    capacity = round_up_capacity(capacity);
+    queue->cells = malloc(capacity * sizeof(mpmc_cell));
+    if (queue->cells == NULL) {
+        free(queue);
+        return NULL;
+    }
+    for (ii = 0; ii < capacity; ++ii) {
+        queue->cells[ii].sequence = ii;
+    }
+    queue->mask = capacity - 1;
+    waiters_initialize(&queue->not_empty);
+    waiters_initialize(&queue->not_full);
+    return queue;
+}
+
+void cb_mpmc_queue_destroy(cb_mpmc_queue_t *queue)
+{
+    if (queue != NULL) {
+        cb_semaphore_destroy(&queue->not_empty.sem);
+        cb_semaphore_destroy(&queue->not_full.sem);
+        free(queue->cells);
+        free(queue);
+    }
+}
+
+/* A free slot has the sequence number of the position writing it, and
+ * one holding an item the position + 1; the pop moves it on to the
+ * position of the next lap. */
+static int mpmc_try_push(cb_mpmc_queue_t *queue, void *item)
+{
+    size_t pos = load_relaxed(&queue->enqueue_pos);
+    mpmc_cell *cell;
+
+    for (;;) {
+        size_t seq;
+        intptr_t diff;
+        cell = &queue->cells[pos & queue->mask];
+        seq = load_acquire(&cell->sequence);
+        diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0) {
+            if (cas_size(&queue->enqueue_pos, pos, pos + 1)) {
+                break;
+            }
+            pos = load_relaxed(&queue->enqueue_pos);
+        } else if (diff < 0) {
+            /* Still holds the item from the previous lap */
+            return -1;
+        } else {
+            pos = load_relaxed(&queue->enqueue_pos);
+        }
+    }
+
+    cell->data = item;
+    store_release(&cell->sequence, pos + 1);
+    return 0;
+}
+
+static int mpmc_try_pop(cb_mpmc_queue_t *queue, void **item)
+{
+    size_t pos = load_relaxed(&queue->dequeue_pos);
+    mpmc_cell *cell;
+
+    for (;;) {
+        size_t seq;
+        intptr_t diff;
+        cell = &queue->cells[pos & queue->mask];
+        seq = load_acquire(&cell->sequence);
+        diff = (intptr_t)seq - (intptr_t)(pos + 1);
+        if (diff == 0) {
+            if (cas_size(&queue->dequeue_pos, pos, pos + 1)) {
+                break;
+            }
+            pos = load_relaxed(&queue->dequeue_pos);
+        } else if (diff < 0) {
+            return -1;
+        } else {
+            pos = load_relaxed(&queue->dequeue_pos);
+        }
+    }
+
+    *item = cell->data;
+    store_release(&cell->sequence, pos + queue->mask + 1);
+    return 0;
+}
+
+int cb_mpmc_queue_try_push(cb_mpmc_queue_t *queue, void *item)
+{
+    if (mpmc_try_push(queue, item) == -1) {
+        return -1;
+    }
+    wake_waiter(&queue->not_empty);
+    return 0;
+}
+
+int cb_mpmc_queue_try_pop(cb_mpmc_queue_t *queue, void **item)
+{
+    if (mpmc_try_pop(queue, item) == -1) {
+        return -1;
+    }
+    wake_waiter(&queue->not_full);
+    return 0;
+}
+
+static int mpmc_push_op(void *queue, void **item)
+{
+    return mpmc_try_push(queue, *item);
+}
+
+static int mpmc_pop_op(void *queue, void **item)
+{
+    return mpmc_try_pop(queue, item);
+}
+
+int cb_mpmc_queue_timedpush_ns(cb_mpmc_queue_t *queue, void *item,
+                               uint64_t ns)
+{
+    if (wait_for(queue, mpmc_push_op, &item, &queue->not_full, ns) == -1) {
+        return -1;
+    }
+    wake_waiter(&queue->not_empty);
+    return 0;
+}
+
+int cb_mpmc_queue_timedpop_ns(cb_mpmc_queue_t *queue, void **item,
+                              uint64_t ns)
+{
+    if (wait_for(queue, mpmc_pop_op, item, &queue->not_empty, ns) == -1) {
+        return -1;
+    }
+    wake_waiter(&queue->not_full);
+    return 0;
+}
+
+void cb_mpmc_queue_push(cb_mpmc_queue_t *queue, void *item)
+{
+    cb_mpmc_queue_timedpush_ns(queue, item, WAIT_FOREVER);
+}
+
+void cb_mpmc_queue_pop(cb_mpmc_queue_t *queue, void **item)
+{
+    cb_mpmc_queue_timedpop_ns(queue, item, WAIT_FOREVER);
+}
+
+size_t cb_mpmc_queue_size(cb_mpmc_queue_t *queue)
+{
+    size_t head = load_acquire(&queue->dequeue_pos);
+    size_t tail = load_acquire(&queue->enqueue_pos);
+    return tail > head ? tail - head : 0;
+}
+
+/* SPSC */
+
+struct cb_spsc_queue {
+    char pad0[CACHELINE];
+    void **items;
+    size_t mask;
+    char pad1[CACHELINE];
+    /* Written by the consumer */
+    volatile size_t head;
+    /* The consumer's copy of tail, only refreshed when it looks empty */
+    size_t cached_tail;
+    char pad2[CACHELINE - 2 * sizeof(size_t)];
+    /* Written by the producer */
+    volatile size_t tail;
+    size_t cached_head;
+    char pad3[CACHELINE - 2 * sizeof(size_t)];
+    queue_waiters not_empty;
+    char pad4[CACHELINE];
+    queue_waiters not_full;
+    char pad5[CACHELINE];
+};
+
+cb_spsc_queue_t *cb_spsc_queue_create(size_t capacity)
+{
+    cb_spsc_queue_t *queue = calloc(1, sizeof(*queue));
+    if (queue == NULL) {
+        return NULL;
+    }
+    capacity = round_up_capacity(capacity);
+    queue->items = malloc(capacity * sizeof(void *));
+    if (queue->items == NULL) {
+        free(queue);
+        return NULL;
+    }
+    queue->mask = capacity - 1;
+    waiters_initialize(&queue->not_empty);
+    waiters_initialize(&queue->not_full);
+    return queue;
+}
+
+void cb_spsc_queue_destroy(cb_spsc_queue_t *queue)
+{
+    if (queue != NULL) {
+        cb_semaphore_destroy(&queue->not_empty.sem);
+        cb_semaphore_destroy(&queue->not_full.sem);
+        free(queue->items);
+        free(queue);
+    }
+}
+
+static int spsc_try_push(cb_spsc_queue_t *queue, void *item)
+{
+    size_t tail = load_relaxed(&queue->tail);
+    if (tail - queue->cached_head > queue->mask) {
+        queue->cached_head = load_acquire(&queue->head);
+        if (tail - queue->cached_head > queue->mask) {
+            return -1;
+        }
+    }
+    queue->items[tail & queue->mask] = item;
+    store_release(&queue->tail, tail + 1);
+    return 0;
+}
+
+static int spsc_try_pop(cb_spsc_queue_t *queue, void **item)
+{
+    size_t head = load_relaxed(&queue->head);
+    if (head == queue->cached_tail) {
+        queue->cached_tail = load_acquire(&queue->tail);
+        if (head == queue->cached_tail) {
+            return -1;
+        }
+    }
+    *item = queue->items[head & queue->mask];
+    store_release(&queue->head, head + 1);
+    return 0;
+}
+
+int cb_spsc_queue_try_push(cb_spsc_queue_t *queue, void *item)
+{
+    if (spsc_try_push(queue, item) == -1) {
+        return -1;
+    }
+    wake_waiter(&queue->not_empty);
+    return 0;
+}
+
+int cb_spsc_queue_try_pop(cb_spsc_queue_t *queue, void **item)
+{
+    if (spsc_try_pop(queue, item) == -1) {
+        return -1;
+    }
+    wake_waiter(&queue->not_full);
+    return 0;
+}
+
+static int spsc_push_op(void *queue, void **item)
+{
+    return spsc_try_push(queue, *item);
+}
+
+static int spsc_pop_op(void *queue, void **item)
+{
+    return spsc_try_pop(queue, item);
+}
+
+int cb_spsc_queue_timedpush_ns(cb_spsc_queue_t *queue, void *item,
+                               uint64_t ns)
+{
+    if (wait_for(queue, spsc_push_op, &item, &queue->not_full, ns) == -1) {
+        return -1;
+    }
+    wake_waiter(&queue->not_empty);
+    return 0;
+}
+
+int cb_spsc_queue_timedpop_ns(cb_spsc_queue_t *queue, void **item,
+                              uint64_t ns)
+{
+    if (wait_for(queue, spsc_pop_op, item, &queue->not_empty, ns) == -1) {
+        return -1;
+    }
+    wake_waiter(&queue->not_full);
+    return 0;
+}
+
+void cb_spsc_queue_push(cb_spsc_queue_t *queue, void *item)
+{
+    cb_spsc_queue_timedpush_ns(queue, item, WAIT_FOREVER);
+}
+
+void cb_spsc_queue_pop(cb_spsc_queue_t *queue, void **item)
+{
+    cb_spsc_queue_timedpop_ns(queue, item, WAIT_FOREVER);
+}
+
+size_t cb_spsc_queue_size(cb_spsc_queue_t *queue)
+{
+    size_t head = load_acquire(&queue->head);
+    size_t tail = load_acquire(&queue->tail);
+    return tail > head ? tail - head : 0;
+}
@@ -15,15 +15,152 @@
  *   limitations under the License.
  */
 #include "config.h"
+#include "random_os.h"
 
 #include <platform/platform.h>
 #include <platform/strerror.h>
 #include <platform/random.h>
 
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
 #include <sstream>
 #include <stdexcept>
 #include <mutex>
 
+#ifndef WIN32
+#include <pthread.h>
+#endif
+
+/*
+ * Bumped in the child after fork() so that the pools (and the fast
+ * generators) don't hand out the same bytes in the parent and child
+ */
+static std::atomic<unsigned int> fork_generation(0);
+
+#ifndef WIN32
+static void child_after_fork(void) {
+   fork_generation.fetch_add(1, std::memory_order_relaxed);
+}
+#endif
+
+static void register_fork_handler(void) {
+#ifndef WIN32
+   static std::once_flag once;
+   std::call_once(once, []() {
+      pthread_atfork(nullptr, nullptr, child_after_fork);
+   });
+#endif
+}
+
+#define DEFAULT_POOL_SIZE 4096
+
+struct cb_rand_pool {
+   size_t size;
+   /* Bytes before offset have been handed out (and wiped) */
+   size_t offset;
+   unsigned int generation;
+   uint8_t *data;
+};
+
+static void wipe(void *ptr, size_t size) {
+   /* Don't let the compiler drop the memset as a dead store */
+   volatile uint8_t *p = static_cast<volatile uint8_t *>(ptr);
+   while (size-- > 0) {
+      *p++ = 0;
+   }
+}
+
+PLATFORM_PUBLIC_API
+cb_rand_pool_t *cb_rand_pool_create(size_t size) {
+   register_fork_handler();
+   if (size == 0) {
+      size = DEFAULT_POOL_SIZE;
+   }
+   cb_rand_pool_t *pool =
+      static_cast<cb_rand_pool_t *>(malloc(sizeof(*pool) + size));
+   if (pool == nullptr) {
+      return nullptr;
+   }
+   pool->size = size;
+   pool->offset = size;
+   pool->generation = fork_generation.load(std::memory_order_relaxed);
+   pool->data = reinterpret_cast<uint8_t *>(pool + 1);
+   return pool;
+}
+
+PLATFORM_PUBLIC_API
+int cb_rand_pool_get(cb_rand_pool_t *pool, void *dest, size_t nbytes) {
+   unsigned int generation = fork_generation.load(std::memory_order_relaxed);
+   if (pool->generation != generation) {
+      /* We're in the child after a fork */
+      wipe(pool->data, pool->size);
+      pool->offset = pool->size;
+      pool->generation = generation;
+   }
+
+   if (nbytes > pool->size / 2) {
+      return cb_rand_os_get(dest, nbytes);
+   }
+
+   uint8_t *ptr = static_cast<uint8_t *>(dest);
+   while (nbytes > 0) {
+      if (pool->offset == pool->size) {
+         if (cb_rand_os_get(pool->data, pool->size) == -1) {
+            return -1;
+         }
+         pool->offset = 0;
+      }
+      size_t chunk = pool->size - pool->offset;
+      if (chunk > nbytes) {
+         chunk = nbytes;
+      }
+      memcpy(ptr, pool->data + pool->offset, chunk);
+      wipe(pool->data + pool->offset, chunk);
+      pool->offset += chunk;
+      ptr += chunk;
+      nbytes -= chunk;
+   }
+   return 0;
+}
+
+PLATFORM_PUBLIC_API
+void cb_rand_pool_destroy(cb_rand_pool_t *pool) {
+   if (pool != nullptr) {
+      wipe(pool->data, pool->size);
+      free(pool);
+   }
+}
+
+namespace {
+   class ThreadEntropyPool {
+   public:
+      ~ThreadEntropyPool() {
+         cb_rand_pool_destroy(pool);
+      }
+
+      cb_rand_pool_t *get() {
+         if (pool == nullptr) {
+            pool = cb_rand_pool_create(0);
+         }
+         return pool;
+      }
+
+   private:
+      cb_rand_pool_t *pool = nullptr;
+   };
+}
+
+PLATFORM_PUBLIC_API
+int cb_rand_bytes(void *dest, size_t nbytes) {
+   static thread_local ThreadEntropyPool thread_pool;
+   cb_rand_pool_t *pool = thread_pool.get();
+   if (pool == nullptr) {
+      return cb_rand_os_get(dest, nbytes);
+   }
+   return cb_rand_pool_get(pool, dest, nbytes);
+}
+
 namespace Couchbase {
    class RandomGeneratorProvider {
 
@@ -49,37 +186,112 @@ namespace Couchbase {
       cb_rand_t provider;
    };
 
+   /* Serve the shared generators from the per thread pools, so they
+    * don't need a lock and rarely need a system call */
    class SharedRandomGeneratorProvider : public RandomGeneratorProvider {
    public:
       virtual bool getBytes(void *dest, size_t size) {
-         std::lock_guard<std::mutex> lock(mutex);
-         return RandomGeneratorProvider::getBytes(dest, size);
+         return cb_rand_bytes(dest, size) == 0;
+      }
+   };
+}
+
+static Couchbase::RandomGeneratorProvider *shared_provider(void) {
+   static Couchbase::SharedRandomGeneratorProvider singleton_provider;
+   return &singleton_provider;
+}
+
+/*
+ * xoshiro256** by David Blackman and Sebastiano Vigna (public domain).
+ * The state of each thread is seeded from the shared provider the
+ * first time the thread uses it.
+ */
+namespace {
+   class FastRandom {
+   public:
+      FastRandom() {
+         register_fork_handler();
+         if (!shared_provider()->getBytes(state, sizeof(state))) {
+            uint64_t seed = gethrtime() ^ uint64_t(uintptr_t(this));
+            for (auto &s : state) {
+               s = splitmix(seed);
+            }
+         }
+         if ((state[0] | state[1] | state[2] | state[3]) == 0) {
+            state[0] = 1;
+         }
+      }
+
+      uint64_t next() {
+         unsigned int current = fork_generation.load(std::memory_order_relaxed);
+         if (current != generation) {
+            /* Don't repeat the parent's sequence after fork() */
+            generation = current;
+            *this = FastRandom();
+         }
+
+         const uint64_t result = rotl(state[1] * 5, 7) * 9;
+         const uint64_t t = state[1] << 17;
+         state[2] ^= state[0];
+         state[3] ^= state[1];
+         state[1] ^= state[2];
+         state[0] ^= state[3];
+         state[2] ^= t;
+         state[3] = rotl(state[3], 45);
+         return result;
       }
 
    private:
-      std::mutex mutex;
+      static uint64_t rotl(uint64_t x, int k) {
+         return (x << k) | (x >> (64 - k));
+      }
+
+      static uint64_t splitmix(uint64_t &seed) {
+         uint64_t z = (seed += 0x9e3779b97f4a7c15ULL);
+         z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+         z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+         return z ^ (z >> 31);
+      }
+
+      uint64_t state[4];
+      unsigned int generation =
+         fork_generation.load(std::memory_order_relaxed);
    };
 }
 
 PLATFORM_PUBLIC_API
-Couchbase::RandomGenerator::RandomGenerator(bool s) : shared(s) {
-   if (shared) {
-      static SharedRandomGeneratorProvider singleton_provider;
-      provider = &singleton_provider;
-   } else {
+Couchbase::RandomGenerator::RandomGenerator(bool s)
+   : RandomGenerator(s ? Mode::Shared : Mode::Private) {
+}
+
+PLATFORM_PUBLIC_API
+Couchbase::RandomGenerator::RandomGenerator(Mode m) : mode(m) {
+   if (mode == Mode::Private) {
       provider = new RandomGeneratorProvider();
+   } else {
+      provider = shared_provider();
    }
 }
 
 PLATFORM_PUBLIC_API
 Couchbase::RandomGenerator::~RandomGenerator() {
-   if (!shared) {
+   if (mode == Mode::Private) {
       delete provider;
    }
 }
 
+PLATFORM_PUBLIC_API
+uint64_t Couchbase::RandomGenerator::fastNext(void) {
+   static thread_local FastRandom generator;
+   return generator.next();
+}
+
 PLATFORM_PUBLIC_API
 uint64_t Couchbase::RandomGenerator::next(void) {
+   if (mode == Mode::Fast) {
+      return fastNext();
+   }
+
    uint64_t ret;
    if (provider->getBytes(&ret, sizeof(ret))) {
       return ret;
@@ -90,6 +302,17 @@ uint64_t Couchbase::RandomGenerator::next(void) {
 
 PLATFORM_PUBLIC_API
 bool Couchbase::RandomGenerator::getBytes(void *dest, size_t size) {
+   if (mode == Mode::Fast) {
+      uint8_t *ptr = static_cast<uint8_t *>(dest);
+      while (size > 0) {
+         uint64_t value = fastNext();
+         size_t chunk = size < sizeof(value) ? size : sizeof(value);
+         memcpy(ptr, &value, chunk);
+         ptr += chunk;
+         size -= chunk;
+      }
+      return true;
+   }
    return provider->getBytes(dest, size);
 }
 
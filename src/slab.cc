@@ -0,0 +1,448 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2016 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config.h"
+
+#include <platform/slab.h>
+#include <cJSON.h>
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <new>
+
+/*
+ * The magazine layer of Bonwick's slab allocator. A thread has a
+ * "loaded" and a "previous" magazine for every slab, and only goes to
+ * the depot when both are empty (allocating) or full (freeing), at
+ * which point it trades one for a full (or empty) magazine. A thread
+ * which keeps allocating and freeing around a magazine boundary
+ * bounces between its two magazines instead of the depot.
+ *
+ * The caches live in an array indexed by the id of the slab, which is
+ * allocated (on the heap, as it is too big for the static TLS block)
+ * the first time a thread uses a slab. An entry is only valid for the
+ * generation of the slab it was filled for: when a slab is destroyed
+ * and its id reused, the stale magazines are simply dropped (their
+ * memory went with the old slab). The threads give their magazines
+ * back to the depots when they exit.
+ */
+
+#define MAX_SLABS 256
+#define MAGAZINE_SIZE 32
+#define CHUNK_SIZE (64 * 1024)
+#define ALIGNMENT 16
+
+namespace {
+
+struct Magazine {
+    size_t count;
+    Magazine *next;
+    /* All of the slab's magazines, so they can be released */
+    Magazine *all_next;
+    void *objects[MAGAZINE_SIZE];
+};
+
+struct ThreadCache {
+    uint64_t generation;
+    Magazine *loaded;
+    Magazine *previous;
+};
+
+}
+
+struct cb_slab {
+    size_t size;
+    unsigned int id;
+    uint64_t generation;
+
+    /* The depot, and the memory the objects are carved from */
+    std::mutex mutex;
+    Magazine *full;
+    Magazine *empty;
+    Magazine *magazines;
+    /* Objects freed when no magazine was available */
+    void *loose;
+    /* The chunks are linked through their first word */
+    void *chunks;
+    char *cursor;
+    char *end;
+};
+
+static std::mutex registry_mutex;
+static cb_slab_t *slabs[MAX_SLABS];
+static uint64_t next_generation = 1;
+
+static thread_local ThreadCache *caches = nullptr;
+static thread_local bool thread_exiting = false;
+
+static void put_magazine(cb_slab_t *slab, Magazine *magazine) {
+    if (magazine->count == 0) {
+        magazine->next = slab->empty;
+        slab->empty = magazine;
+    } else {
+        magazine->next = slab->full;
+        slab->full = magazine;
+    }
+}
+
+static void flush_thread_caches(void) {
+    if (caches == nullptr) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> guard(registry_mutex);
+        for (unsigned int ii = 0; ii < MAX_SLABS; ++ii) {
+            cb_slab_t *slab = slabs[ii];
+            ThreadCache &cache = caches[ii];
+            if (slab == nullptr || slab->generation != cache.generation) {
+                continue;
+            }
+            std::lock_guard<std::mutex> depot(slab->mutex);
+            if (cache.loaded != nullptr) {
+                put_magazine(slab, cache.loaded);
+            }
+            if (cache.previous != nullptr) {
+                put_magazine(slab, cache.previous);
+            }
+        }
+    }
+    free(caches);
+    caches = nullptr;
+}
+
+namespace {
+
+struct CacheFlusher {
+    /* Makes sure the destructor runs when the thread exits */
+    void touch() {
+    }
+
+    ~CacheFlusher() {
+        flush_thread_caches();
+        /* Other exit handlers may still free objects */
+        thread_exiting = true;
+    }
+};
+
+}
+
+static ThreadCache *get_cache(const cb_slab_t *slab) {
+    if (caches == nullptr) {
+        if (thread_exiting) {
+            return nullptr;
+        }
+        caches = static_cast<ThreadCache *>(calloc(MAX_SLABS,
+                                                   sizeof(ThreadCache)));
+        if (caches == nullptr) {
+            return nullptr;
+        }
+        static thread_local CacheFlusher flusher;
+        flusher.touch();
+    }
+    ThreadCache *cache = &caches[slab->id];
+    if (cache->generation != slab->generation) {
+        cache->generation = slab->generation;
+        cache->loaded = nullptr;
+        cache->previous = nullptr;
+    }
+    return cache;
+}
+
+/* Called with the depot locked */
+static void *carve(cb_slab_t *slab) {
+    if (slab->loose != nullptr) {
+        void *ret = slab->loose;
+        slab->loose = *static_cast<void **>(ret);
+        return ret;
+    }
+    if (slab->cursor + slab->size > slab->end) {
+        size_t size = CHUNK_SIZE;
+        if (size < slab->size * 8 + ALIGNMENT) {
+            size = slab->size * 8 + ALIGNMENT;
+        }
+        char *chunk = static_cast<char *>(malloc(size));
+        if (chunk == nullptr) {
+            return nullptr;
+        }
+        *reinterpret_cast<void **>(chunk) = slab->chunks;
+        slab->chunks = chunk;
+        /* The link is in the first ALIGNMENT bytes */
+        slab->cursor = chunk + ALIGNMENT;
+        slab->end = chunk + size;
+    }
+    void *ret = slab->cursor;
+    slab->cursor += slab->size;
+    return ret;
+}
+
+/* Called with the depot locked */
+static Magazine *take_empty(cb_slab_t *slab) {
+    Magazine *magazine = slab->empty;
+    if (magazine != nullptr) {
+        slab->empty = magazine->next;
+        return magazine;
+    }
+    magazine = static_cast<Magazine *>(malloc(sizeof(Magazine)));
+    if (magazine != nullptr) {
+        magazine->count = 0;
+        magazine->all_next = slab->magazines;
+        slab->magazines = magazine;
+    }
+    return magazine;
+}
+
+PLATFORM_PUBLIC_API
+cb_slab_t *cb_slab_create(size_t size) {
+    cb_slab_t *slab = new (std::nothrow) cb_slab_t;
+    if (slab == nullptr) {
+        return nullptr;
+    }
+    if (size == 0) {
+        size = 1;
+    }
+    slab->size = (size + ALIGNMENT - 1) & ~size_t(ALIGNMENT - 1);
+    slab->full = nullptr;
+    slab->empty = nullptr;
+    slab->magazines = nullptr;
+    slab->loose = nullptr;
+    slab->chunks = nullptr;
+    slab->cursor = nullptr;
+    slab->end = nullptr;
+
+    std::lock_guard<std::mutex> guard(registry_mutex);
+    for (unsigned int ii = 0; ii < MAX_SLABS; ++ii) {
+        if (slabs[ii] == nullptr) {
+            slab->id = ii;
+            slab->generation = next_generation++;
+            slabs[ii] = slab;
+            return slab;
+        }
+    }
+    delete slab;
+    return nullptr;
+}
+
+PLATFORM_PUBLIC_API
+void cb_slab_destroy(cb_slab_t *slab) {
+    if (slab == nullptr) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> guard(registry_mutex);
+        slabs[slab->id] = nullptr;
+    }
+    while (slab->magazines != nullptr) {
+        Magazine *next = slab->magazines->all_next;
+        free(slab->magazines);
+        slab->magazines = next;
+    }
+    while (slab->chunks != nullptr) {
+        void *next = *static_cast<void **>(slab->chunks);
+        free(slab->chunks);
+        slab->chunks = next;
+    }
+    delete slab;
+}
+
+PLATFORM_PUBLIC_API
+void *cb_slab_alloc(cb_slab_t *slab) {
+    ThreadCache *cache = get_cache(slab);
+    if (cache != nullptr) {
+        Magazine *loaded = cache->loaded;
+        if (loaded != nullptr && loaded->count > 0) {
+            return loaded->objects[--loaded->count];
+        }
+        Magazine *previous = cache->previous;
+        if (previous != nullptr && previous->count > 0) {
+            cache->previous = loaded;
+            cache->loaded = previous;
+            return previous->objects[--previous->count];
+        }
+    }
+
+    std::lock_guard<std::mutex> guard(slab->mutex);
+    if (cache == nullptr) {
+        return carve(slab);
+    }
+
+    /* Both are empty: trade one for a full magazine, or fill one */
+    Magazine *magazine = slab->full;
+    if (magazine != nullptr) {
+        slab->full = magazine->next;
+    } else {
+        magazine = take_empty(slab);
+        if (magazine == nullptr) {
+            return carve(slab);
+        }
+        while (magazine->count < MAGAZINE_SIZE) {
+            void *object = carve(slab);
+            if (object == nullptr) {
+                break;
+            }
+            magazine->objects[magazine->count++] = object;
+        }
+        if (magazine->count == 0) {
+            put_magazine(slab, magazine);
+            return nullptr;
+        }
+    }
+    if (cache->previous != nullptr) {
+        put_magazine(slab, cache->previous);
+    }
+    cache->previous = cache->loaded;
+    cache->loaded = magazine;
+    return magazine->objects[--magazine->count];
+}
+
+PLATFORM_PUBLIC_API
+void cb_slab_free(cb_slab_t *slab, void *ptr) {
+    if (ptr == nullptr) {
+        return;
+    }
+    ThreadCache *cache = get_cache(slab);
+    if (cache != nullptr) {
+        Magazine *loaded = cache->loaded;
+        if (loaded != nullptr && loaded->count < MAGAZINE_SIZE) {
+            loaded->objects[loaded->count++] = ptr;
+            return;
+        }
+        Magazine *previous = cache->previous;
+        if (previous != nullptr && previous->count < MAGAZINE_SIZE) {
+            cache->previous = loaded;
+            cache->loaded = previous;
+            previous->objects[previous->count++] = ptr;
+            return;
+        }
+    }
+
+    std::lock_guard<std::mutex> guard(slab->mutex);
+    Magazine *magazine = (cache != nullptr) ? take_empty(slab) : nullptr;
+    if (magazine == nullptr) {
+        *static_cast<void **>(ptr) = slab->loose;
+        slab->loose = ptr;
+        return;
+    }
+    /* Both are full: trade one for the empty magazine */
+    if (cache->previous != nullptr) {
+        put_magazine(slab, cache->previous);
+    }
+    cache->previous = cache->loaded;
+    cache->loaded = magazine;
+    magazine->objects[magazine->count++] = ptr;
+}
+
+PLATFORM_PUBLIC_API
+size_t cb_slab_object_size(const cb_slab_t *slab) {
+    return slab->size;
+}
+
+/*
+ * The malloc replacements put a header with the slab in front of each
+ * block (NULL for the ones from malloc), as free doesn't get the size.
+ */
+
+#define HEADER_SIZE ALIGNMENT
+#define MAX_CLASS_SIZE 512
+
+static const size_t class_sizes[] = {
+    16, 32, 48, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384, 448, 512
+};
+#define NCLASSES (sizeof(class_sizes) / sizeof(class_sizes[0]))
+
+static cb_slab_t *class_slabs[NCLASSES];
+/* The slab for each multiple of ALIGNMENT up to MAX_CLASS_SIZE */
+static cb_slab_t *slab_for_size[MAX_CLASS_SIZE / ALIGNMENT + 1];
+static std::once_flag classes_created;
+
+static void create_classes(void) {
+    for (size_t ii = 0; ii < NCLASSES; ++ii) {
+        class_slabs[ii] = cb_slab_create(class_sizes[ii]);
+    }
+    size_t cls = 0;
+    for (size_t ii = 0; ii <= MAX_CLASS_SIZE / ALIGNMENT; ++ii) {
+        while (class_sizes[cls] < ii * ALIGNMENT) {
+            ++cls;
+        }
+        /* NULL if the slab couldn't be created: use malloc */
+        slab_for_size[ii] = class_slabs[cls];
+    }
+}
+
+PLATFORM_PUBLIC_API
+void *cb_slab_malloc(size_t size) {
+    if (size > SIZE_MAX - HEADER_SIZE - ALIGNMENT) {
+        return nullptr;
+    }
+    size_t total = size + HEADER_SIZE;
+    cb_slab_t *slab = nullptr;
+    if (total <= MAX_CLASS_SIZE) {
+        std::call_once(classes_created, create_classes);
+        slab = slab_for_size[(total + ALIGNMENT - 1) / ALIGNMENT];
+    }
+    char *block = static_cast<char *>(slab != nullptr ? cb_slab_alloc(slab)
+                                                      : malloc(total));
+    if (block == nullptr) {
+        return nullptr;
+    }
+    *reinterpret_cast<cb_slab_t **>(block) = slab;
+    return block + HEADER_SIZE;
+}
+
+PLATFORM_PUBLIC_API
+void *cb_slab_calloc(size_t nmemb, size_t size) {
+    if (size != 0 && nmemb > SIZE_MAX / size) {
+        return nullptr;
+    }
+    void *ret = cb_slab_malloc(nmemb * size);
+    if (ret != nullptr) {
+        memset(ret, 0, nmemb * size);
+    }
+    return ret;
+}
+
+PLATFORM_PUBLIC_API
+char *cb_slab_strdup(const char *str) {
+    size_t len = strlen(str) + 1;
+    char *ret = static_cast<char *>(cb_slab_malloc(len));
+    if (ret != nullptr) {
+        memcpy(ret, str, len);
+    }
+    return ret;
+}
+
+PLATFORM_PUBLIC_API
+void cb_slab_release(void *ptr) {
+    if (ptr == nullptr) {
+        return;
+    }
+    char *block = static_cast<char *>(ptr) - HEADER_SIZE;
+    cb_slab_t *slab = *reinterpret_cast<cb_slab_t **>(block);
+    if (slab != nullptr) {
+        cb_slab_free(slab, block);
+    } else {
+        free(block);
+    }
+}
+
+PLATFORM_PUBLIC_API
+void cb_slab_cjson_hooks(struct cJSON_Hooks *hooks) {
+    hooks->malloc_fn = cb_slab_malloc;
+    hooks->free_fn = cb_slab_release;
+    hooks->calloc_fn = cb_slab_calloc;
+    hooks->strdup_fn = cb_slab_strdup;
+}
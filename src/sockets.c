@@ -15,7 +15,11 @@
  *   limitations under the License.
  */
 #include "config.h"
+#include <platform/socket.h>
+#include <io.h>
+#include <mswsock.h>
 #include <stdio.h>
+#include <string.h>
 
 __declspec(dllexport)
 void cb_initialize_sockets(void)
@@ -27,29 +31,186 @@ void cb_initialize_sockets(void)
     }
 }
 
-__declspec(dllexport)
-int sendmsg(SOCKET sock, const struct msghdr *msg, int flags)
+/* WSASend / WSARecv take an array of WSABUF, which isn't laid out like
+ * an iovec on 64 bit, so the buffers are converted in chunks */
+#define MAX_WSABUF 64
+
+static int fill_wsabuf(WSABUF *bufs, const struct iovec *iov, int iovcnt,
+                       DWORD *total)
 {
-    /* @todo make this more optimal! */
     int ii;
+    *total = 0;
+    for (ii = 0; ii < iovcnt && ii < MAX_WSABUF; ++ii) {
+        bufs[ii].buf = (CHAR *)iov[ii].iov_base;
+        bufs[ii].len = (ULONG)iov[ii].iov_len;
+        *total += bufs[ii].len;
+    }
+    return ii;
+}
+
+/* Send the message with as few calls as possible, returns the number of
+ * bytes sent or -1 if nothing could be sent */
+static int send_message(SOCKET sock, const struct msghdr *msg, int flags)
+{
+    int done = 0;
     int ret = 0;
 
-    for (ii = 0; ii < msg->msg_iovlen; ++ii) {
-        if (msg->msg_iov[ii].iov_len > 0) {
-            int nw = send(sock, msg->msg_iov[ii].iov_base, (int)msg->msg_iov[ii].iov_len, flags);
-            if (nw > 0) {
-                ret += nw;
-                if (nw != msg->msg_iov[ii].iov_len) {
-                    return ret;
-                }
-            } else {
-                if (ret > 0) {
-                    return ret;
-                }
-                return nw;
-            }
+    while (done < msg->msg_iovlen) {
+        WSABUF bufs[MAX_WSABUF];
+        DWORD total;
+        DWORD nw = 0;
+        int nbufs = fill_wsabuf(bufs, msg->msg_iov + done,
+                                msg->msg_iovlen - done, &total);
+        int rc;
+        if (msg->msg_name != NULL) {
+            rc = WSASendTo(sock, bufs, nbufs, &nw, flags,
+                           (const struct sockaddr *)msg->msg_name,
+                           msg->msg_namelen, NULL, NULL);
+        } else {
+            rc = WSASend(sock, bufs, nbufs, &nw, flags, NULL, NULL);
+        }
+        if (rc == SOCKET_ERROR) {
+            return ret > 0 ? ret : -1;
         }
+        ret += (int)nw;
+        if (nw != total) {
+            break;
+        }
+        done += nbufs;
     }
 
     return ret;
 }
+
+__declspec(dllexport)
+int sendmsg(SOCKET sock, const struct msghdr *msg, int flags)
+{
+    return send_message(sock, msg, flags);
+}
+
+__declspec(dllexport)
+int cb_sendmmsg(cb_socket_t sock, cb_mmsghdr_t *msgvec, unsigned int vlen,
+                int flags)
+{
+    unsigned int ii;
+    for (ii = 0; ii < vlen; ++ii) {
+        const struct msghdr *msg = &msgvec[ii].msg_hdr;
+        size_t size = 0;
+        int jj;
+        int nw = send_message(sock, msg, flags);
+        if (nw < 0) {
+            return ii > 0 ? (int)ii : -1;
+        }
+        msgvec[ii].msg_len = (unsigned int)nw;
+        for (jj = 0; jj < msg->msg_iovlen; ++jj) {
+            size += msg->msg_iov[jj].iov_len;
+        }
+        if ((size_t)nw < size) {
+            /* Don't send the next one after a partial write */
+            return (int)ii + 1;
+        }
+    }
+    return (int)vlen;
+}
+
+__declspec(dllexport)
+int cb_recvmmsg(cb_socket_t sock, cb_mmsghdr_t *msgvec, unsigned int vlen,
+                int flags)
+{
+    unsigned int ii;
+    for (ii = 0; ii < vlen; ++ii) {
+        struct msghdr *msg = &msgvec[ii].msg_hdr;
+        WSABUF bufs[MAX_WSABUF];
+        DWORD total;
+        DWORD nr = 0;
+        DWORD msgflags = (DWORD)flags;
+        /* A message is received with one call, so it can't use more
+         * than MAX_WSABUF buffers */
+        int nbufs = fill_wsabuf(bufs, msg->msg_iov, msg->msg_iovlen, &total);
+        int rc;
+
+        if (ii > 0) {
+            /* Only collect the rest if they're already here */
+            u_long avail = 0;
+            if (ioctlsocket(sock, FIONREAD, &avail) != 0 || avail == 0) {
+                break;
+            }
+        }
+
+        if (msg->msg_name != NULL) {
+            rc = WSARecvFrom(sock, bufs, nbufs, &nr, &msgflags,
+                             (struct sockaddr *)msg->msg_name,
+                             &msg->msg_namelen, NULL, NULL);
+        } else {
+            rc = WSARecv(sock, bufs, nbufs, &nr, &msgflags, NULL, NULL);
+        }
+        if (rc == SOCKET_ERROR) {
+            return ii > 0 ? (int)ii : -1;
+        }
+        msgvec[ii].msg_len = (unsigned int)nr;
+        if (nr == 0) {
+            /* The peer closed the connection */
+            return (int)ii + 1;
+        }
+    }
+    return (int)ii;
+}
+
+/*
+ * TransmitFile has no non-blocking mode, so we send a chunk at the time
+ * and cancel the transfer if it doesn't complete straight away. The
+ * bytes which made it out by then are reported by the cancelled request.
+ */
+#define MAX_TRANSMIT (64 * 1024)
+
+__declspec(dllexport)
+ssize_t cb_sendfile(cb_socket_t sock, int fd, uint64_t *offset, size_t len)
+{
+    HANDLE file = (HANDLE)_get_osfhandle(fd);
+    HANDLE event;
+    OVERLAPPED overlapped;
+    DWORD nw = 0;
+    DWORD flags = 0;
+    BOOL ok;
+
+    if (file == INVALID_HANDLE_VALUE) {
+        WSASetLastError(WSAEBADF);
+        return -1;
+    }
+    if (len == 0) {
+        /* TransmitFile would send the whole file */
+        return 0;
+    }
+    if (len > MAX_TRANSMIT) {
+        len = MAX_TRANSMIT;
+    }
+
+    event = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (event == NULL) {
+        return -1;
+    }
+    memset(&overlapped, 0, sizeof(overlapped));
+    overlapped.Offset = (DWORD)*offset;
+    overlapped.OffsetHigh = (DWORD)(*offset >> 32);
+    /* The low bit keeps the completion off a port the socket is bound to */
+    overlapped.hEvent = (HANDLE)((ULONG_PTR)event | 1);
+
+    ok = TransmitFile(sock, file, (DWORD)len, 0, &overlapped, NULL, 0);
+    if (ok || WSAGetLastError() == WSA_IO_PENDING) {
+        if (WaitForSingleObject(event, 0) != WAIT_OBJECT_0) {
+            CancelIoEx((HANDLE)sock, &overlapped);
+            WaitForSingleObject(event, INFINITE);
+        }
+        ok = WSAGetOverlappedResult(sock, &overlapped, &nw, FALSE, &flags);
+        if (!ok && nw == 0 && WSAGetLastError() == WSA_OPERATION_ABORTED) {
+            WSASetLastError(WSAEWOULDBLOCK);
+        }
+    }
+    CloseHandle(event);
+
+    if (!ok && nw == 0) {
+        return -1;
+    }
+    *offset += nw;
+    return (ssize_t)nw;
+}
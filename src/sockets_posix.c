@@ -0,0 +1,171 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2016 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config.h"
+
+#include <platform/socket.h>
+
+#include <errno.h>
+#include <stddef.h>
+#include <unistd.h>
+
+#if defined(HAVE_LINUX_SENDFILE)
+#include <sys/sendfile.h>
+#elif defined(HAVE_BSD_SENDFILE)
+#include <sys/types.h>
+#include <sys/uio.h>
+#endif
+
+#if defined(HAVE_SENDMMSG) || defined(HAVE_RECVMMSG)
+/* We pass our array straight to the kernel */
+typedef char mmsghdr_size_check[sizeof(cb_mmsghdr_t) ==
+                                sizeof(struct mmsghdr) ? 1 : -1];
+typedef char mmsghdr_len_check[offsetof(cb_mmsghdr_t, msg_len) ==
+                               offsetof(struct mmsghdr, msg_len) ? 1 : -1];
+#endif
+
+#ifndef HAVE_SENDMMSG
+static size_t message_size(const struct msghdr *msg)
+{
+    size_t ret = 0;
+    size_t ii;
+    for (ii = 0; ii < (size_t)msg->msg_iovlen; ++ii) {
+        ret += msg->msg_iov[ii].iov_len;
+    }
+    return ret;
+}
+#endif
+
+int cb_sendmmsg(cb_socket_t sock, cb_mmsghdr_t *msgvec, unsigned int vlen,
+                int flags)
+{
+#ifdef HAVE_SENDMMSG
+    return sendmmsg(sock, (struct mmsghdr *)msgvec, vlen, flags);
+#else
+    unsigned int ii;
+    for (ii = 0; ii < vlen; ++ii) {
+        ssize_t nw = sendmsg(sock, &msgvec[ii].msg_hdr, flags);
+        if (nw < 0) {
+            return ii > 0 ? (int)ii : -1;
+        }
+        msgvec[ii].msg_len = (unsigned int)nw;
+        if ((size_t)nw < message_size(&msgvec[ii].msg_hdr)) {
+            /* Don't send the next one after a partial write */
+            return (int)ii + 1;
+        }
+    }
+    return (int)vlen;
+#endif
+}
+
+int cb_recvmmsg(cb_socket_t sock, cb_mmsghdr_t *msgvec, unsigned int vlen,
+                int flags)
+{
+#ifdef HAVE_RECVMMSG
+    return recvmmsg(sock, (struct mmsghdr *)msgvec, vlen,
+                    flags | MSG_WAITFORONE, NULL);
+#else
+    unsigned int ii;
+    for (ii = 0; ii < vlen; ++ii) {
+        ssize_t nr = recvmsg(sock, &msgvec[ii].msg_hdr, flags);
+        if (nr < 0) {
+            return ii > 0 ? (int)ii : -1;
+        }
+        msgvec[ii].msg_len = (unsigned int)nr;
+        if (nr == 0) {
+            /* The peer closed the connection */
+            return (int)ii + 1;
+        }
+#ifdef MSG_DONTWAIT
+        /* Only collect the rest if they're already here */
+        flags |= MSG_DONTWAIT;
+#else
+        return 1;
+#endif
+    }
+    return (int)vlen;
+#endif
+}
+
+/* Bounce the data through a buffer for files sendfile doesn't handle */
+static ssize_t copy_chunk(cb_socket_t sock, int fd, uint64_t offset,
+                          size_t len)
+{
+    char buffer[65536];
+    ssize_t nr = pread(fd, buffer, len < sizeof(buffer) ? len : sizeof(buffer),
+                       (off_t)offset);
+    if (nr <= 0) {
+        return nr;
+    }
+    /* If it is only sent partially, the rest is read again next time */
+    return send(sock, buffer, (size_t)nr, 0);
+}
+
+/* Send up to len bytes with a single call */
+static ssize_t send_chunk(cb_socket_t sock, int fd, uint64_t offset,
+                          size_t len)
+{
+#if defined(HAVE_LINUX_SENDFILE)
+    off_t off = (off_t)offset;
+    ssize_t nw = sendfile(sock, fd, &off, len);
+    if (nw == -1 && (errno == EINVAL || errno == ENOSYS)) {
+        return copy_chunk(sock, fd, offset, len);
+    }
+    return nw;
+#elif defined(HAVE_BSD_SENDFILE)
+    int rc;
+#ifdef __APPLE__
+    off_t nw = (off_t)len;
+    rc = sendfile(fd, sock, (off_t)offset, &nw, NULL, 0);
+#else
+    off_t nw = 0;
+    rc = sendfile(fd, sock, (off_t)offset, len, NULL, &nw, 0);
+#endif
+    if (rc == -1) {
+        if (errno == ENOTSOCK || errno == EOPNOTSUPP || errno == EINVAL) {
+            return copy_chunk(sock, fd, offset, len);
+        }
+        /* EAGAIN and EINTR may still have sent some of it */
+        return nw > 0 ? (ssize_t)nw : -1;
+    }
+    return (ssize_t)nw;
+#else
+    return copy_chunk(sock, fd, offset, len);
+#endif
+}
+
+ssize_t cb_sendfile(cb_socket_t sock, int fd, uint64_t *offset, size_t len)
+{
+    size_t total = 0;
+
+    while (total < len) {
+        ssize_t nw = send_chunk(sock, fd, *offset, len - total);
+        if (nw < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return total > 0 ? (ssize_t)total : -1;
+        }
+        if (nw == 0) {
+            /* The end of the file */
+            break;
+        }
+        *offset += (uint64_t)nw;
+        total += (size_t)nw;
+    }
+
+    return (ssize_t)total;
+}
@@ -0,0 +1,332 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2016 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config.h"
+
+#include <platform/platform.h>
+#include <platform/threadpool.h>
+
+#include <atomic>
+#include <cstdio>
+#include <new>
+#include <stdexcept>
+#include <thread>
+
+/*
+ * Each worker owns a deque of tasks protected by its own mutex. The
+ * owner pushes and pops at the head (so the task it just queued is
+ * still warm in its cache), while thieves take from the tail. Idle
+ * workers block on a single condition variable, but producers only
+ * touch that lock when somebody is actually sleeping.
+ */
+
+struct cb_threadpool_worker {
+    cb_mutex_t mutex;
+    cb_threadpool_task *head;
+    cb_threadpool_task *tail;
+    cb_thread_t tid;
+    cb_threadpool_t *pool;
+    size_t index;
+    /* Keep the queues of neighbouring workers on separate cache lines */
+    char pad[64];
+};
+
+struct cb_threadpool {
+    cb_threadpool_worker *workers;
+    size_t nworkers;
+
+    /* Tasks sitting in a queue (not yet picked up by a worker) */
+    std::atomic<size_t> queued;
+    /* Tasks submitted but not yet completed */
+    std::atomic<size_t> outstanding;
+    /* Workers blocked (or about to block) on idle_cond */
+    std::atomic<size_t> sleepers;
+    std::atomic<size_t> next_victim;
+    std::atomic<bool> shutdown;
+
+    cb_mutex_t idle_mutex;
+    cb_cond_t idle_cond;
+
+    cb_mutex_t done_mutex;
+    cb_cond_t done_cond;
+};
+
+static thread_local cb_threadpool_worker *current_worker = nullptr;
+
+static void push_head(cb_threadpool_worker *w, cb_threadpool_task *task) {
+    task->prev = nullptr;
+    cb_mutex_enter(&w->mutex);
+    task->next = w->head;
+    if (w->head == nullptr) {
+        w->tail = task;
+    } else {
+        w->head->prev = task;
+    }
+    w->head = task;
+    cb_mutex_exit(&w->mutex);
+}
+
+static cb_threadpool_task *pop_head(cb_threadpool_worker *w) {
+    cb_mutex_enter(&w->mutex);
+    cb_threadpool_task *task = w->head;
+    if (task != nullptr) {
+        w->head = task->next;
+        if (w->head == nullptr) {
+            w->tail = nullptr;
+        } else {
+            w->head->prev = nullptr;
+        }
+    }
+    cb_mutex_exit(&w->mutex);
+    return task;
+}
+
+static cb_threadpool_task *pop_tail(cb_threadpool_worker *w) {
+    if (cb_mutex_try_enter(&w->mutex) != 0) {
+        // Somebody else is using the queue; try another victim rather
+        // than queueing up behind them
+        return nullptr;
+    }
+    cb_threadpool_task *task = w->tail;
+    if (task != nullptr) {
+        w->tail = task->prev;
+        if (w->tail == nullptr) {
+            w->head = nullptr;
+        } else {
+            w->tail->next = nullptr;
+        }
+    }
+    cb_mutex_exit(&w->mutex);
+    return task;
+}
+
+static cb_threadpool_task *find_task(cb_threadpool_worker *self) {
+    cb_threadpool_t *pool = self->pool;
+    cb_threadpool_task *task = pop_head(self);
+    if (task == nullptr) {
+        for (size_t ii = 1; ii < pool->nworkers && task == nullptr; ++ii) {
+            task = pop_tail(&pool->workers[(self->index + ii) %
+                                           pool->nworkers]);
+        }
+    }
+    if (task != nullptr) {
+        pool->queued.fetch_sub(1);
+    }
+    return task;
+}
+
+static void task_done(cb_threadpool_t *pool) {
+    if (pool->outstanding.fetch_sub(1) == 1) {
+        cb_mutex_enter(&pool->done_mutex);
+        cb_cond_broadcast(&pool->done_cond);
+        cb_mutex_exit(&pool->done_mutex);
+    }
+}
+
+static void worker_main(void *arg) {
+    cb_threadpool_worker *self = reinterpret_cast<cb_threadpool_worker *>(arg);
+    cb_threadpool_t *pool = self->pool;
+    current_worker = self;
+
+    for (;;) {
+        cb_threadpool_task *task = find_task(self);
+        if (task != nullptr) {
+            task->func(task);
+            task_done(pool);
+            continue;
+        }
+
+        cb_mutex_enter(&pool->idle_mutex);
+        pool->sleepers.fetch_add(1);
+        // Re-check after announcing ourself as a sleeper: a producer
+        // either sees the sleeper count (and signals us once we wait,
+        // as it needs idle_mutex to do so) or we see its task here.
+        if (pool->queued.load() == 0) {
+            if (pool->shutdown.load()) {
+                pool->sleepers.fetch_sub(1);
+                cb_mutex_exit(&pool->idle_mutex);
+                break;
+            }
+            cb_cond_wait(&pool->idle_cond, &pool->idle_mutex);
+        }
+        pool->sleepers.fetch_sub(1);
+        cb_mutex_exit(&pool->idle_mutex);
+    }
+
+    current_worker = nullptr;
+}
+
+static void wakeup_sleeper(cb_threadpool_t *pool) {
+    if (pool->sleepers.load() != 0) {
+        cb_mutex_enter(&pool->idle_mutex);
+        cb_cond_signal(&pool->idle_cond);
+        cb_mutex_exit(&pool->idle_mutex);
+    }
+}
+
+static void release(cb_threadpool_t *pool, size_t nworkers) {
+    for (size_t ii = 0; ii < nworkers; ++ii) {
+        cb_mutex_destroy(&pool->workers[ii].mutex);
+    }
+    cb_mutex_destroy(&pool->idle_mutex);
+    cb_cond_destroy(&pool->idle_cond);
+    cb_mutex_destroy(&pool->done_mutex);
+    cb_cond_destroy(&pool->done_cond);
+    delete []pool->workers;
+    delete pool;
+}
+
+static void stop_workers(cb_threadpool_t *pool, size_t nstarted) {
+    cb_mutex_enter(&pool->idle_mutex);
+    pool->shutdown.store(true);
+    cb_cond_broadcast(&pool->idle_cond);
+    cb_mutex_exit(&pool->idle_mutex);
+
+    for (size_t ii = 0; ii < nstarted; ++ii) {
+        cb_join_thread(pool->workers[ii].tid);
+    }
+}
+
+PLATFORM_PUBLIC_API
+cb_threadpool_t *cb_threadpool_create(size_t nthreads, const char *name) {
+    if (nthreads == 0) {
+        nthreads = std::thread::hardware_concurrency();
+        if (nthreads == 0) {
+            nthreads = 4;
+        }
+    }
+
+    cb_threadpool_t *pool = new (std::nothrow) cb_threadpool;
+    if (pool == nullptr) {
+        return nullptr;
+    }
+    pool->workers = new (std::nothrow) cb_threadpool_worker[nthreads];
+    if (pool->workers == nullptr) {
+        delete pool;
+        return nullptr;
+    }
+    pool->nworkers = nthreads;
+    pool->queued.store(0);
+    pool->outstanding.store(0);
+    pool->sleepers.store(0);
+    pool->next_victim.store(0);
+    pool->shutdown.store(false);
+    cb_mutex_initialize(&pool->idle_mutex);
+    cb_cond_initialize(&pool->idle_cond);
+    cb_mutex_initialize(&pool->done_mutex);
+    cb_cond_initialize(&pool->done_cond);
+
+    for (size_t ii = 0; ii < nthreads; ++ii) {
+        cb_threadpool_worker *w = &pool->workers[ii];
+        cb_mutex_initialize(&w->mutex);
+        w->head = w->tail = nullptr;
+        w->pool = pool;
+        w->index = ii;
+    }
+
+    for (size_t ii = 0; ii < nthreads; ++ii) {
+        // cb_create_named_thread refuses names longer than 15 characters
+        char tname[16];
+        snprintf(tname, sizeof(tname), "%s:%u",
+                 name ? name : "pool", (unsigned int)ii);
+        if (cb_create_named_thread(&pool->workers[ii].tid, worker_main,
+                                   &pool->workers[ii], 0, tname) != 0) {
+            stop_workers(pool, ii);
+            release(pool, nthreads);
+            return nullptr;
+        }
+    }
+
+    return pool;
+}
+
+PLATFORM_PUBLIC_API
+int cb_threadpool_submit(cb_threadpool_t *pool, cb_threadpool_task *task) {
+    if (pool->shutdown.load()) {
+        return -1;
+    }
+
+    cb_threadpool_worker *w = current_worker;
+    if (w == nullptr || w->pool != pool) {
+        w = &pool->workers[pool->next_victim.fetch_add(1) % pool->nworkers];
+    }
+
+    pool->outstanding.fetch_add(1);
+    pool->queued.fetch_add(1);
+    push_head(w, task);
+    wakeup_sleeper(pool);
+    return 0;
+}
+
+PLATFORM_PUBLIC_API
+void cb_threadpool_wait(cb_threadpool_t *pool) {
+    cb_mutex_enter(&pool->done_mutex);
+    while (pool->outstanding.load() != 0) {
+        cb_cond_wait(&pool->done_cond, &pool->done_mutex);
+    }
+    cb_mutex_exit(&pool->done_mutex);
+}
+
+PLATFORM_PUBLIC_API
+size_t cb_threadpool_size(const cb_threadpool_t *pool) {
+    return pool->nworkers;
+}
+
+PLATFORM_PUBLIC_API
+void cb_threadpool_destroy(cb_threadpool_t *pool) {
+    if (pool == nullptr) {
+        return;
+    }
+    cb_threadpool_wait(pool);
+    stop_workers(pool, pool->nworkers);
+    release(pool, pool->nworkers);
+}
+
+namespace Couchbase {
+    ThreadPool::Task::Task() {
+        func = execute;
+        next = prev = nullptr;
+    }
+
+    void ThreadPool::Task::execute(cb_threadpool_task *task) {
+        static_cast<Task *>(task)->run();
+    }
+
+    ThreadPool::ThreadPool(size_t nthreads, const std::string &name)
+        : pool(cb_threadpool_create(nthreads, name.c_str())) {
+        if (pool == nullptr) {
+            throw std::runtime_error("Failed to create thread pool");
+        }
+    }
+
+    ThreadPool::~ThreadPool() {
+        cb_threadpool_destroy(pool);
+    }
+
+    void ThreadPool::submit(Task &task) {
+        if (cb_threadpool_submit(pool, &task) != 0) {
+            throw std::logic_error("Thread pool is shutting down");
+        }
+    }
+
+    void ThreadPool::wait(void) {
+        cb_threadpool_wait(pool);
+    }
+
+    size_t ThreadPool::size(void) const {
+        return cb_threadpool_size(pool);
+    }
+}
@@ -0,0 +1,409 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2016 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config.h"
+
+#include <platform/timerwheel.h>
+
+#include <cstdio>
+#include <new>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+/*
+ * The slots are doubly linked lists of timers, and every timer knows
+ * which list head it hangs off (its bucket) so it can be unlinked in
+ * constant time. A bitmap of the non-empty slots lets us jump straight
+ * to the next tick with anything to do, however far away it is.
+ *
+ * A timer expiring in tick E is kept in the first level when it is
+ * less than 256 ticks away, in slot E & 255. Otherwise it goes to the
+ * level L whose span covers the distance, in slot (E >> 8L) & 255. The
+ * slot is cascaded (its timers re-inserted) when the tick reaches the
+ * start of the 256^L block holding E, at which point they are less
+ * than 256^L ticks away and land in a lower level. The timers further
+ * away than the wheel covers are parked in the last level, and simply
+ * re-parked when they come around.
+ *
+ * Everything is protected by a single mutex. The timers which expired
+ * are moved to a separate list, and their functions are called one at
+ * the time without the mutex held, so they may still be cancelled
+ * until they are fired.
+ */
+
+#define LEVELS 4
+#define SLOT_BITS 8
+#define SLOTS (1 << SLOT_BITS)
+#define SLOT_MASK (SLOTS - 1)
+
+/* The furthest ahead (in ticks) a timer is put in the wheel */
+#define MAX_DELTA ((uint64_t(1) << (LEVELS * SLOT_BITS)) - 1)
+
+/* Nobody is waiting for a wakeup */
+#define NO_WAKEUP 0
+
+struct cb_timerwheel {
+    cb_timer *slots[LEVELS * SLOTS];
+    uint64_t bitmap[LEVELS * SLOTS / 64];
+    /* Timers which have expired but not yet been fired */
+    cb_timer *expired;
+
+    hrtime_t start;
+    hrtime_t tick;
+    /* The next tick to process */
+    uint64_t current;
+    /* Scheduled timers (including the expired ones) */
+    size_t pending;
+
+    cb_mutex_t mutex;
+    cb_cond_t cond;
+    cb_thread_t tid;
+    bool running;
+    bool shutdown;
+    /* The tick the thread sleeps until (UINT64_MAX if it has no timers) */
+    uint64_t wakeup;
+};
+
+static int lsb64(uint64_t value) {
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward64(&index, value);
+    return (int)index;
+#else
+    return __builtin_ctzll(value);
+#endif
+}
+
+static void list_link(cb_timer **bucket, cb_timer *timer) {
+    timer->bucket = bucket;
+    timer->prev = nullptr;
+    timer->next = *bucket;
+    if (timer->next != nullptr) {
+        timer->next->prev = timer;
+    }
+    *bucket = timer;
+}
+
+static void list_unlink(cb_timerwheel_t *wheel, cb_timer *timer) {
+    cb_timer **bucket = timer->bucket;
+    if (timer->prev == nullptr) {
+        *bucket = timer->next;
+    } else {
+        timer->prev->next = timer->next;
+    }
+    if (timer->next != nullptr) {
+        timer->next->prev = timer->prev;
+    }
+    timer->bucket = nullptr;
+
+    if (*bucket == nullptr && bucket != &wheel->expired) {
+        size_t idx = bucket - wheel->slots;
+        wheel->bitmap[idx / 64] &= ~(uint64_t(1) << (idx % 64));
+    }
+}
+
+static void insert(cb_timerwheel_t *wheel, cb_timer *timer) {
+    uint64_t expires = timer->tick;
+    if (expires < wheel->current) {
+        expires = wheel->current;
+    }
+    uint64_t delta = expires - wheel->current;
+    if (delta > MAX_DELTA) {
+        delta = MAX_DELTA;
+        expires = wheel->current + MAX_DELTA;
+    }
+
+    int level = 0;
+    while (delta >= (uint64_t(1) << ((level + 1) * SLOT_BITS))) {
+        ++level;
+    }
+    size_t idx = level * SLOTS +
+        size_t((expires >> (level * SLOT_BITS)) & SLOT_MASK);
+    list_link(&wheel->slots[idx], timer);
+    wheel->bitmap[idx / 64] |= uint64_t(1) << (idx % 64);
+}
+
+/* Move all of the timers in a slot to the given list */
+static void drain(cb_timerwheel_t *wheel, size_t idx, cb_timer **dest) {
+    cb_timer *timer;
+    while ((timer = wheel->slots[idx]) != nullptr) {
+        list_unlink(wheel, timer);
+        if (dest == nullptr) {
+            insert(wheel, timer);
+        } else {
+            list_link(dest, timer);
+        }
+    }
+}
+
+/*
+ * The distance from a slot in a level to the next non-empty one (which
+ * may be the slot itself), wrapping around at the end of the level.
+ * Returns SLOTS if the level is empty.
+ */
+static size_t slot_distance(const cb_timerwheel_t *wheel, int level,
+                            size_t from) {
+    const uint64_t *bitmap = wheel->bitmap + level * (SLOTS / 64);
+    for (size_t ii = 0; ii <= SLOTS / 64; ++ii) {
+        size_t word = (from / 64 + ii) % (SLOTS / 64);
+        uint64_t bits = bitmap[word];
+        if (ii == 0) {
+            bits &= ~uint64_t(0) << (from % 64);
+        } else if (ii == SLOTS / 64) {
+            bits &= ~(~uint64_t(0) << (from % 64));
+        }
+        if (bits != 0) {
+            return (word * 64 + lsb64(bits) - from) & SLOT_MASK;
+        }
+    }
+    return SLOTS;
+}
+
+/*
+ * The first tick at or after t which has anything to do: a non-empty
+ * slot in the first level to expire, or a non-empty slot in one of the
+ * others to cascade. The ticks in between can be skipped altogether.
+ * Returns UINT64_MAX if the wheel is empty.
+ */
+static uint64_t next_event(const cb_timerwheel_t *wheel, uint64_t t) {
+    uint64_t next = UINT64_MAX;
+    for (int level = 0; level < LEVELS; ++level) {
+        int shift = level * SLOT_BITS;
+        // The first tick at or after t where this level is visited, and
+        // the slot it visits then
+        uint64_t block = (t + (uint64_t(1) << shift) - 1) >> shift;
+        size_t distance = slot_distance(wheel, level,
+                                        size_t(block & SLOT_MASK));
+        if (distance != SLOTS) {
+            uint64_t when = (block + distance) << shift;
+            if (when < next) {
+                next = when;
+            }
+        }
+    }
+    return next;
+}
+
+/* Move the timers due up to (and including) the target tick to expired */
+static void collect(cb_timerwheel_t *wheel, uint64_t target) {
+    while (wheel->current <= target) {
+        uint64_t t = next_event(wheel, wheel->current);
+        if (t > target) {
+            wheel->current = target + 1;
+            break;
+        }
+
+        // The timers cascaded below are inserted relative to t
+        wheel->current = t;
+        size_t index = size_t(t & SLOT_MASK);
+        if (index == 0) {
+            for (int level = 1; level < LEVELS; ++level) {
+                size_t slot = size_t((t >> (level * SLOT_BITS)) & SLOT_MASK);
+                drain(wheel, level * SLOTS + slot, nullptr);
+                if (slot != 0) {
+                    break;
+                }
+            }
+        }
+        drain(wheel, index, &wheel->expired);
+        wheel->current = t + 1;
+    }
+}
+
+/* Call the functions of the expired timers. Called (and returns) locked */
+static size_t fire(cb_timerwheel_t *wheel) {
+    size_t fired = 0;
+    cb_timer *timer;
+    while ((timer = wheel->expired) != nullptr) {
+        list_unlink(wheel, timer);
+        --wheel->pending;
+        cb_mutex_exit(&wheel->mutex);
+        timer->func(timer);
+        ++fired;
+        cb_mutex_enter(&wheel->mutex);
+    }
+    return fired;
+}
+
+static uint64_t to_tick(const cb_timerwheel_t *wheel, hrtime_t time,
+                        bool round_up) {
+    if (time <= wheel->start) {
+        return 0;
+    }
+    hrtime_t elapsed = time - wheel->start;
+    uint64_t tick = elapsed / wheel->tick;
+    if (round_up && elapsed % wheel->tick != 0) {
+        ++tick;
+    }
+    return tick;
+}
+
+static void thread_main(void *arg) {
+    cb_timerwheel_t *wheel = reinterpret_cast<cb_timerwheel_t *>(arg);
+    cb_mutex_enter(&wheel->mutex);
+    while (!wheel->shutdown) {
+        collect(wheel, to_tick(wheel, gethrtime(), false));
+        fire(wheel);
+        if (wheel->shutdown) {
+            break;
+        }
+
+        uint64_t next = next_event(wheel, wheel->current);
+        // The mutex is held from here until we wait, so a timer
+        // scheduled earlier than this will see it and signal us
+        wheel->wakeup = next;
+        if (next == UINT64_MAX) {
+            cb_cond_wait(&wheel->cond, &wheel->mutex);
+        } else {
+            hrtime_t deadline = wheel->start + next * wheel->tick;
+            hrtime_t now = gethrtime();
+            if (deadline > now) {
+                cb_cond_timedwait_ns(&wheel->cond, &wheel->mutex,
+                                     deadline - now);
+            }
+        }
+        wheel->wakeup = NO_WAKEUP;
+    }
+    cb_mutex_exit(&wheel->mutex);
+}
+
+PLATFORM_PUBLIC_API
+void cb_timer_init(cb_timer *timer, void (*func)(cb_timer *timer)) {
+    timer->func = func;
+    timer->next = timer->prev = nullptr;
+    timer->bucket = nullptr;
+    timer->tick = 0;
+}
+
+PLATFORM_PUBLIC_API
+cb_timerwheel_t *cb_timerwheel_create(hrtime_t tick, hrtime_t now) {
+    if (tick == 0) {
+        return nullptr;
+    }
+    cb_timerwheel_t *wheel = new (std::nothrow) cb_timerwheel;
+    if (wheel == nullptr) {
+        return nullptr;
+    }
+    for (size_t ii = 0; ii < LEVELS * SLOTS; ++ii) {
+        wheel->slots[ii] = nullptr;
+    }
+    for (size_t ii = 0; ii < LEVELS * SLOTS / 64; ++ii) {
+        wheel->bitmap[ii] = 0;
+    }
+    wheel->expired = nullptr;
+    wheel->start = now;
+    wheel->tick = tick;
+    wheel->current = 0;
+    wheel->pending = 0;
+    cb_mutex_initialize(&wheel->mutex);
+    cb_cond_initialize(&wheel->cond);
+    wheel->running = false;
+    wheel->shutdown = false;
+    wheel->wakeup = NO_WAKEUP;
+    return wheel;
+}
+
+PLATFORM_PUBLIC_API
+int cb_timerwheel_start(cb_timerwheel_t *wheel, const char *name) {
+    if (wheel->running) {
+        return -1;
+    }
+    // cb_create_named_thread refuses names longer than 15 characters
+    char tname[16];
+    snprintf(tname, sizeof(tname), "%s", name ? name : "timerwheel");
+    if (cb_create_named_thread(&wheel->tid, thread_main, wheel, 0,
+                               tname) != 0) {
+        return -1;
+    }
+    wheel->running = true;
+    return 0;
+}
+
+PLATFORM_PUBLIC_API
+void cb_timerwheel_schedule(cb_timerwheel_t *wheel, cb_timer *timer,
+                            hrtime_t expiry) {
+    cb_mutex_enter(&wheel->mutex);
+    if (timer->bucket != nullptr) {
+        list_unlink(wheel, timer);
+    } else {
+        ++wheel->pending;
+    }
+    timer->tick = to_tick(wheel, expiry, true);
+    insert(wheel, timer);
+    if (wheel->wakeup != NO_WAKEUP && timer->tick < wheel->wakeup) {
+        cb_cond_signal(&wheel->cond);
+    }
+    cb_mutex_exit(&wheel->mutex);
+}
+
+PLATFORM_PUBLIC_API
+int cb_timerwheel_cancel(cb_timerwheel_t *wheel, cb_timer *timer) {
+    int ret = -1;
+    cb_mutex_enter(&wheel->mutex);
+    if (timer->bucket != nullptr) {
+        list_unlink(wheel, timer);
+        --wheel->pending;
+        ret = 0;
+    }
+    cb_mutex_exit(&wheel->mutex);
+    return ret;
+}
+
+PLATFORM_PUBLIC_API
+size_t cb_timerwheel_advance(cb_timerwheel_t *wheel, hrtime_t now) {
+    cb_mutex_enter(&wheel->mutex);
+    if (now >= wheel->start) {
+        collect(wheel, to_tick(wheel, now, false));
+    }
+    size_t fired = fire(wheel);
+    cb_mutex_exit(&wheel->mutex);
+    return fired;
+}
+
+PLATFORM_PUBLIC_API
+hrtime_t cb_timerwheel_next_expiry(cb_timerwheel_t *wheel) {
+    cb_mutex_enter(&wheel->mutex);
+    uint64_t next = next_event(wheel, wheel->current);
+    cb_mutex_exit(&wheel->mutex);
+    if (next == UINT64_MAX) {
+        return UINT64_MAX;
+    }
+    return wheel->start + next * wheel->tick;
+}
+
+PLATFORM_PUBLIC_API
+size_t cb_timerwheel_pending(cb_timerwheel_t *wheel) {
+    cb_mutex_enter(&wheel->mutex);
+    size_t pending = wheel->pending;
+    cb_mutex_exit(&wheel->mutex);
+    return pending;
+}
+
+PLATFORM_PUBLIC_API
+void cb_timerwheel_destroy(cb_timerwheel_t *wheel) {
+    if (wheel->running) {
+        cb_mutex_enter(&wheel->mutex);
+        wheel->shutdown = true;
+        cb_cond_signal(&wheel->cond);
+        cb_mutex_exit(&wheel->mutex);
+        cb_join_thread(wheel->tid);
+    }
+    cb_mutex_destroy(&wheel->mutex);
+    cb_cond_destroy(&wheel->cond);
+    delete wheel;
+}
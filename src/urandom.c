@@ -15,23 +15,128 @@
  *   limitations under the License.
  */
 #include "config.h"
+#include "random_os.h"
 
 #include <platform/random.h>
+#include <errno.h>
 #include <fcntl.h>
 
+#if defined(HAVE_GETRANDOM)
+#include <sys/random.h>
+#endif
+
+#ifndef O_CLOEXEC
+#define O_CLOEXEC 0
+#endif
+
+/*
+ * When the system has a call to get entropy the handle isn't needed,
+ * so cb_rand_open doesn't consume a file descriptor and the handle is
+ * set to NO_FD.
+ */
+#define NO_FD -1
+
+static int read_fully(int fd, void *dest, size_t nbytes) {
+    char *ptr = dest;
+    while (nbytes > 0) {
+        ssize_t nr = read(fd, ptr, nbytes);
+        if (nr == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        } else if (nr == 0) {
+            errno = EIO;
+            return -1;
+        }
+        ptr += nr;
+        nbytes -= (size_t)nr;
+    }
+    return 0;
+}
+
+#if defined(HAVE_GETRANDOM)
+/* Returns 1 if we got the bytes, 0 if getrandom isn't supported by the
+ * kernel and -1 upon errors */
+static int try_getrandom(void *dest, size_t nbytes) {
+    char *ptr = dest;
+    while (nbytes > 0) {
+        ssize_t nr = getrandom(ptr, nbytes, 0);
+        if (nr == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == ENOSYS ? 0 : -1;
+        }
+        ptr += nr;
+        nbytes -= (size_t)nr;
+    }
+    return 1;
+}
+#endif
+
+static int os_call_available(void) {
+#if defined(HAVE_GETRANDOM)
+    char dummy;
+    return getrandom(&dummy, 0, GRND_NONBLOCK) != -1 || errno != ENOSYS;
+#elif defined(HAVE_ARC4RANDOM_BUF)
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+int cb_rand_os_get(void *dest, size_t nbytes) {
+    static int urandom = NO_FD;
+#if defined(HAVE_GETRANDOM)
+    int ret = try_getrandom(dest, nbytes);
+    if (ret != 0) {
+        return ret == 1 ? 0 : -1;
+    }
+#elif defined(HAVE_ARC4RANDOM_BUF)
+    arc4random_buf(dest, nbytes);
+    return 0;
+#endif
+
+    /* The descriptor is kept open for the lifetime of the process */
+    if (__atomic_load_n(&urandom, __ATOMIC_ACQUIRE) == NO_FD) {
+        int fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+        int expected = NO_FD;
+        if (fd == -1) {
+            return -1;
+        }
+        if (!__atomic_compare_exchange_n(&urandom, &expected, fd, 0,
+                                         __ATOMIC_ACQ_REL,
+                                         __ATOMIC_ACQUIRE)) {
+            close(fd);
+        }
+    }
+    return read_fully(__atomic_load_n(&urandom, __ATOMIC_ACQUIRE), dest,
+                      nbytes);
+}
 
 PLATFORM_PUBLIC_API
 int cb_rand_open(cb_rand_t *handle) {
-    *handle = open("/dev/urandom", O_RDONLY);
+    if (os_call_available()) {
+        *handle = NO_FD;
+        return 0;
+    }
+    *handle = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
     return (*handle == -1) ? -1 : 0;
 }
 
 PLATFORM_PUBLIC_API
 int cb_rand_get(cb_rand_t handle, void *dest, size_t nbytes) {
-    return (read(handle, dest, nbytes) == nbytes) ? 0 : -1;
+    if (handle == NO_FD) {
+        return cb_rand_os_get(dest, nbytes);
+    }
+    return read_fully(handle, dest, nbytes);
 }
 
 PLATFORM_PUBLIC_API
 int cb_rand_close(cb_rand_t handle) {
+    if (handle == NO_FD) {
+        return 0;
+    }
     return close(handle) == -1 ? -1 : 0;
 }
@@ -15,8 +15,25 @@
  *   limitations under the License.
  */
 #include "config.h"
+#include "random_os.h"
 
 #include <platform/random.h>
+#include <bcrypt.h>
+#include <limits.h>
+
+int cb_rand_os_get(void *dest, size_t nbytes) {
+    PUCHAR ptr = dest;
+    while (nbytes > 0) {
+        ULONG chunk = nbytes > ULONG_MAX ? ULONG_MAX : (ULONG)nbytes;
+        if (!BCRYPT_SUCCESS(BCryptGenRandom(NULL, ptr, chunk,
+                                            BCRYPT_USE_SYSTEM_PREFERRED_RNG))) {
+            return -1;
+        }
+        ptr += chunk;
+        nbytes -= chunk;
+    }
+    return 0;
+}
 
 PLATFORM_PUBLIC_API
 int cb_rand_open(cb_rand_t *handle) {
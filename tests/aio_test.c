@@ -0,0 +1,204 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef WIN32
+#include <unistd.h>
+#endif
+
+#include <platform/aio.h>
+#include <platform/cbassert.h>
+
+#define BLOCK 4096
+#define NBLOCKS 64
+#define DEPTH 16
+
+static char filename[64];
+
+static cb_aio_file_t open_file(void) {
+#ifdef WIN32
+    HANDLE file = CreateFileA(filename, GENERIC_READ | GENERIC_WRITE, 0,
+                              NULL, CREATE_ALWAYS, FILE_FLAG_OVERLAPPED,
+                              NULL);
+    cb_assert(file != INVALID_HANDLE_VALUE);
+    return file;
+#else
+    int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    cb_assert(fd != -1);
+    return fd;
+#endif
+}
+
+static void close_file(cb_aio_file_t file) {
+#ifdef WIN32
+    CloseHandle(file);
+#else
+    close(file);
+#endif
+}
+
+static void fill_block(char *block, int id) {
+    int ii;
+    for (ii = 0; ii < BLOCK; ++ii) {
+        block[ii] = (char)(id * 7 + ii);
+    }
+}
+
+/* Submit everything, reaping whatever is needed to make room */
+static void run_all(cb_aio_t *aio, cb_aio_request_t *requests, int nrequests,
+                    cb_aio_event_t *events) {
+    int submitted = 0;
+    int completed = 0;
+    while (completed < nrequests) {
+        int ret;
+        if (submitted < nrequests) {
+            ret = cb_aio_submit(aio, requests + submitted,
+                                (unsigned int)(nrequests - submitted));
+            if (ret == -1) {
+                cb_assert(errno == EAGAIN ||
+                          cb_aio_inflight(aio) == DEPTH);
+            } else {
+                submitted += ret;
+            }
+        }
+        ret = cb_aio_complete(aio, events + completed, 1,
+                              (unsigned int)(nrequests - completed));
+        cb_assert(ret >= 1);
+        completed += ret;
+    }
+    cb_assert(cb_aio_inflight(aio) == 0);
+}
+
+static void test_engine(int flags) {
+    static char blocks[NBLOCKS][BLOCK];
+    static char readback[NBLOCKS][BLOCK];
+    cb_aio_request_t requests[NBLOCKS];
+    cb_aio_event_t events[NBLOCKS];
+    int seen[NBLOCKS];
+    cb_aio_buffer_t buffer;
+    cb_aio_file_t file;
+    cb_aio_t *aio;
+    int ii;
+
+    aio = cb_aio_create(DEPTH, flags);
+    cb_assert(aio != NULL);
+    fprintf(stderr, "Testing the %s engine\n", cb_aio_engine(aio));
+    if (flags & CB_AIO_THREADPOOL) {
+        cb_assert(strcmp(cb_aio_engine(aio), "threadpool") == 0);
+    }
+    file = open_file();
+
+    /* Write the blocks in reverse, one request each */
+    memset(requests, 0, sizeof(requests));
+    for (ii = 0; ii < NBLOCKS; ++ii) {
+        int id = NBLOCKS - 1 - ii;
+        fill_block(blocks[id], id);
+        requests[ii].opcode = CB_AIO_WRITE;
+        requests[ii].file = file;
+        requests[ii].buffer = blocks[id];
+        requests[ii].length = BLOCK;
+        requests[ii].offset = (uint64_t)id * BLOCK;
+        requests[ii].user_data = &requests[ii];
+    }
+    run_all(aio, requests, NBLOCKS, events);
+    memset(seen, 0, sizeof(seen));
+    for (ii = 0; ii < NBLOCKS; ++ii) {
+        cb_aio_request_t *request = events[ii].user_data;
+        cb_assert(events[ii].result == BLOCK && events[ii].error == 0);
+        seen[request - requests]++;
+    }
+    for (ii = 0; ii < NBLOCKS; ++ii) {
+        cb_assert(seen[ii] == 1);
+    }
+
+    requests[0].opcode = CB_AIO_FDATASYNC;
+    requests[0].user_data = NULL;
+    requests[1].opcode = CB_AIO_FSYNC;
+    requests[1].user_data = NULL;
+    run_all(aio, requests, 2, events);
+    cb_assert(events[0].result == 0 && events[1].result == 0);
+
+    /* Read them back through the registered file and buffer */
+    cb_assert(cb_aio_register_files(aio, &file, 1) == 0);
+    buffer.base = readback;
+    buffer.length = sizeof(readback);
+    cb_assert(cb_aio_register_buffers(aio, &buffer, 1) == 0);
+    memset(readback, 0, sizeof(readback));
+    memset(requests, 0, sizeof(requests));
+    for (ii = 0; ii < NBLOCKS; ++ii) {
+        requests[ii].opcode = CB_AIO_READ;
+        requests[ii].flags = CB_AIO_FIXED_FILE | CB_AIO_FIXED_BUFFER;
+        requests[ii].buffer = readback[ii];
+        requests[ii].length = BLOCK;
+        requests[ii].offset = (uint64_t)ii * BLOCK;
+    }
+    run_all(aio, requests, NBLOCKS, events);
+    for (ii = 0; ii < NBLOCKS; ++ii) {
+        cb_assert(events[ii].result == BLOCK);
+    }
+    cb_assert(memcmp(blocks, readback, sizeof(blocks)) == 0);
+
+    /* Reading at the end of the file reads nothing, and a short read is
+     * returned as such */
+    requests[0].offset = NBLOCKS * BLOCK;
+    requests[1].offset = NBLOCKS * BLOCK - 100;
+    run_all(aio, requests, 2, events);
+    for (ii = 0; ii < 2; ++ii) {
+        cb_assert(events[ii].error == 0);
+        cb_assert(events[ii].result == 0 || events[ii].result == 100);
+    }
+    cb_assert(events[0].result + events[1].result == 100);
+
+    /* Bad requests */
+    requests[0].file_index = 1;
+    cb_assert(cb_aio_submit(aio, requests, 1) == -1);
+    requests[0].file_index = 0;
+    requests[0].buffer = readback[NBLOCKS - 1] + 1;
+    cb_assert(cb_aio_submit(aio, requests, 1) == -1);
+    requests[0].buffer = readback[0];
+    requests[0].opcode = 42;
+    cb_assert(cb_aio_submit(aio, requests, 1) == -1);
+    cb_assert(cb_aio_inflight(aio) == 0);
+    cb_assert(cb_aio_complete(aio, events, 1, 1) == -1);
+    cb_assert(cb_aio_complete(aio, events, 0, 1) == 0);
+
+#ifndef WIN32
+    /* Failures are reported in the event */
+    memset(requests, 0, sizeof(requests));
+    requests[0].opcode = CB_AIO_READ;
+    requests[0].file = -1;
+    requests[0].buffer = readback[0];
+    requests[0].length = BLOCK;
+    run_all(aio, requests, 1, events);
+    cb_assert(events[0].result == -1 && events[0].error == EBADF);
+#endif
+
+    /* Destroying it waits for the requests in flight */
+    cb_assert(cb_aio_register_files(aio, NULL, 0) == 0);
+    cb_assert(cb_aio_register_buffers(aio, NULL, 0) == 0);
+    memset(requests, 0, sizeof(requests));
+    for (ii = 0; ii < DEPTH; ++ii) {
+        requests[ii].opcode = CB_AIO_READ;
+        requests[ii].file = file;
+        requests[ii].buffer = readback[ii];
+        requests[ii].length = BLOCK;
+    }
+    cb_assert(cb_aio_submit(aio, requests, DEPTH) == DEPTH);
+    cb_assert(cb_aio_submit(aio, requests, 1) == -1);
+    cb_aio_destroy(aio);
+
+    close_file(file);
+    remove(filename);
+}
+
+int main(void) {
+    strcpy(filename, "platform-aio-test.XXXXXX");
+    cb_assert(cb_mktemp(filename) != NULL);
+    remove(filename);
+
+    test_engine(0);
+    test_engine(CB_AIO_THREADPOOL);
+    return EXIT_SUCCESS;
+}
@@ -52,8 +52,58 @@ static void write_callback(void* ctx, const char* frame) {
     frames++;
 }
 
+// Frames captured by cb_backtrace_capture, and the output of
+// print_backtrace_to_fd.
+static void* captured[20];
+static int ncaptured;
+static char output[65536];
+
+static void test_backtrace_to_fd(void) {
+    FILE* fp = tmpfile();
+    size_t nr;
+    cb_assert(fp != NULL);
+    print_backtrace_to_fd(fileno(fp));
+    rewind(fp);
+    nr = fread(output, 1, sizeof(output) - 1, fp);
+    output[nr] = '\0';
+    fclose(fp);
+}
+
+// Captured for symbolizing later
+static cb_backtrace_t deferred;
+
+static int symbolized;
+static void symbolize_callback(void* ctx, const char* frame) {
+    cb_assert(ctx == expected_ctx);
+    cb_assert(strlen(frame) > 0);
+    symbolized++;
+}
+
+static void test_deferred(void) {
+    char first[200];
+    char second[200];
+
+    cb_assert(deferred.nframes >= 3);
+    cb_assert(deferred.nframes <= CB_BACKTRACE_MAX_FRAMES);
+    cb_backtrace_symbolize(&deferred, symbolize_callback, expected_ctx);
+    cb_assert(symbolized == deferred.nframes);
+
+    // The second time round the description comes out of the cache
+    cb_backtrace_describe(deferred.frames[0], first, sizeof(first));
+    cb_backtrace_describe(deferred.frames[0], second, sizeof(second));
+    cb_assert(strcmp(first, second) == 0);
+    printf("deferred: %s\n", first);
+
+    // and it is truncated to fit the buffer
+    cb_backtrace_describe(deferred.frames[0], second, 4);
+    cb_assert(strlen(second) == 3);
+}
+
 static int leaf() {
+    cb_backtrace_get(&deferred);
     print_backtrace(write_callback, expected_ctx);
+    ncaptured = cb_backtrace_capture(captured, 20);
+    test_backtrace_to_fd();
     return dummy++;
 }
 
@@ -70,4 +120,21 @@ static int outer() {
 int main(void) {
     outer();
     cb_assert(frames >= 3);
+
+    test_deferred();
+
+    // The frames of leaf, middle and outer (but not our own)
+    cb_assert(ncaptured >= 3);
+    cb_assert(ncaptured <= 20);
+
+    printf("%s", output);
+    cb_assert(strncmp(output, "backtrace: ", 11) == 0);
+    cb_assert(strstr(output, " #0 0x") != NULL);
+    cb_assert(strstr(output, " #3 0x") != NULL);
+#if defined(__linux__)
+    // At least the executable code of the test program is mapped
+    cb_assert(strstr(output, "mappings:\n") != NULL);
+    cb_assert(strstr(output, "r-xp") != NULL);
+#endif
+    return 0;
 }
@@ -0,0 +1,76 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <platform/cbassert.h>
+#include <platform/platform.h>
+
+static void test_scalar(void) {
+    const uint8_t bytes[8] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+    uint64_t value;
+
+    cb_assert(cb_bswap16(0x0102) == 0x0201);
+    cb_assert(cb_bswap32(0x01020304) == 0x04030201);
+    cb_assert(cb_bswap64(0x0102030405060708ULL) == 0x0807060504030201ULL);
+
+    /* Network order is big endian whatever the host is */
+    memcpy(&value, bytes, sizeof(value));
+    cb_assert(cb_ntohll(value) == 0x0102030405060708ULL);
+    cb_assert(cb_htonll(cb_ntohll(value)) == value);
+#ifndef CB_DONT_NEED_BYTEORDER
+    cb_assert(ntohll(value) == 0x0102030405060708ULL);
+    cb_assert(htonll(0x0102030405060708ULL) == value);
+    /* Parenthesized names must work as well */
+    cb_assert((ntohll)(value) == 0x0102030405060708ULL);
+    cb_assert((htonll)(0x0102030405060708ULL) == value);
+#endif
+}
+
+#define MAXBYTES 1024
+
+/* Check every length (so the vector loops and the tail both get used)
+ * from every alignment, out of place and in place */
+static void test_array(size_t width,
+                       void (*array)(void *, const void *, size_t)) {
+    uint8_t src[MAXBYTES + 8];
+    uint8_t dst[MAXBYTES + 8];
+    uint8_t expected[MAXBYTES + 8];
+    size_t offset, n, ii, jj;
+
+    for (ii = 0; ii < sizeof(src); ++ii) {
+        src[ii] = (uint8_t)(ii * 7 + 1);
+    }
+
+    for (offset = 0; offset < 8; ++offset) {
+        for (n = 0; n <= (MAXBYTES / width); ++n) {
+            const uint8_t *in = src + offset;
+            for (ii = 0; ii < n; ++ii) {
+                for (jj = 0; jj < width; ++jj) {
+                    expected[ii * width + jj] =
+                        in[ii * width + width - 1 - jj];
+                }
+            }
+
+            memset(dst, 0xaa, sizeof(dst));
+            array(dst + offset, in, n);
+            cb_assert(memcmp(dst + offset, expected, n * width) == 0);
+            /* Nothing written past the end */
+            for (ii = offset + n * width; ii < sizeof(dst); ++ii) {
+                cb_assert(dst[ii] == 0xaa);
+            }
+
+            memcpy(dst + offset, in, n * width);
+            array(dst + offset, dst + offset, n);
+            cb_assert(memcmp(dst + offset, expected, n * width) == 0);
+        }
+    }
+}
+
+int main(void) {
+    test_scalar();
+    test_array(2, cb_bswap16_array);
+    test_array(4, cb_bswap32_array);
+    test_array(8, cb_bswap64_array);
+    return 0;
+}
@@ -5,6 +5,7 @@
 #include <assert.h>
 #include <sys/stat.h>
 #include <string.h>
+#include <platform/histogram.h>
 #include <platform/platform.h>
 #include <cJSON.h>
 #include <stdio.h>
@@ -25,7 +26,7 @@ static int spool(FILE *fp, char *dest, size_t size)
     return 0;
 }
 
-static void *load_file(const char *file)
+static void *load_file(const char *file, size_t *size)
 {
     FILE *fp;
     struct stat st;
@@ -61,10 +62,40 @@ static void *load_file(const char *file)
 
     fclose(fp);
     data[st.st_size] = 0;
+    *size = st.st_size;
     return data;
 }
 
-static void report(hrtime_t time) {
+static int count_value(void *ctx, const cJSON *value) {
+   (void)value;
+   ++*(int *)ctx;
+   return 0;
+}
+
+/* Stream the document through the SAX parser in chunks of chunk bytes */
+static int stream(const char *data, size_t size, size_t chunk) {
+   cJSON_SaxCallbacks callbacks;
+   cJSON_Sax *sax;
+   size_t offset;
+   int values = 0;
+   int ret = 0;
+
+   memset(&callbacks, 0, sizeof(callbacks));
+   callbacks.value = count_value;
+   sax = cJSON_CreateSax(&callbacks, &values);
+   assert(sax != NULL);
+   for (offset = 0; offset < size && ret == 0; offset += chunk) {
+      ret = cJSON_SaxFeed(sax, data + offset,
+                          (size - offset < chunk) ? size - offset : chunk);
+   }
+   if (ret == 0) {
+      ret = cJSON_SaxFinish(sax);
+   }
+   cJSON_DeleteSax(sax);
+   return (ret == 0) ? values : -1;
+}
+
+static void report(const char *what, hrtime_t time) {
    const char * const extensions[] = { " ns", " usec", " ms", " s", NULL };
    int id = 0;
 
@@ -77,40 +108,100 @@ static void report(hrtime_t time) {
    }
 
    assert(extensions[id] != NULL);
-   fprintf(stderr, "Parsing took an average of %"PRIu64"%s\n",
-           (uint64_t)time, extensions[id]);
+   fprintf(stderr, "%s%"PRIu64"%s\n", what, (uint64_t)time, extensions[id]);
 }
 
 int main(int argc, char **argv) {
     char *data = NULL;
+    size_t size;
     const char *fname = "testdata.json";
     int num = 1;
+    int use_arena = 0;
+    int in_situ = 0;
+    int tape = 0;
+    int with_length = 0;
+    size_t chunk = 0;
+    char *scratch = NULL;
+    cJSON_Arena *arena = NULL;
     int cmd;
     int ii;
     hrtime_t start;
+    hrtime_t begin;
     hrtime_t delta;
+    cb_histogram_t histogram;
 
-    while ((cmd = getopt(argc, argv, "f:n:")) != -1) {
+    while ((cmd = getopt(argc, argv, "f:n:asltx:")) != -1) {
         switch (cmd) {
         case 'f' : fname = optarg; break;
         case 'n' : num = atoi(optarg); break;
+        case 'a' : use_arena = 1; break;
+        case 's' : in_situ = 1; break;
+        case 'l' : with_length = 1; break;
+        case 't' : tape = 1; break;
+        case 'x' : chunk = (size_t)atoi(optarg); break;
         default:
-            fprintf(stderr, "usage: %s [-f fname] [-n num]\n", argv[0]);
+            fprintf(stderr, "usage: %s [-f fname] [-n num] [-a] [-s] [-l] [-t] [-x chunksize]\n", argv[0]);
             exit(EXIT_FAILURE);
         }
     }
 
-    data = load_file(fname);
+    data = load_file(fname, &size);
+    if (use_arena) {
+        arena = cJSON_CreateArena(0);
+        assert(arena != NULL);
+    }
+    if (in_situ) {
+        /* The in-situ parser destroys its input, so each run parses
+         * a fresh copy */
+        scratch = malloc(size);
+        assert(scratch != NULL);
+    }
 
+    cb_histogram_initialize(&histogram);
     start = gethrtime();
     for (ii = 0; ii < num; ++ii) {
-        cJSON *ptr = cJSON_Parse(data);
-        assert(ptr != NULL);
-        cJSON_Delete(ptr);
+        begin = gethrtime();
+        if (chunk) {
+            int values = stream(data, size, chunk);
+            assert(values > 0);
+        } else if (tape) {
+            cJSON_Tape *ptr = cJSON_TapeParse(data, size);
+            assert(ptr != NULL);
+            cJSON_DeleteTape(ptr);
+        } else if (scratch) {
+            cJSON *ptr;
+            memcpy(scratch, data, size);
+            ptr = cJSON_ParseInSitu(scratch, size, arena);
+            assert(ptr != NULL);
+            if (arena) {
+                cJSON_ResetArena(arena);
+            } else {
+                cJSON_Delete(ptr);
+            }
+        } else if (arena) {
+            cJSON *ptr = cJSON_ParseWithArena(data, arena);
+            assert(ptr != NULL);
+            cJSON_ResetArena(arena);
+        } else if (with_length) {
+            cJSON *ptr = cJSON_ParseWithLength(data, size);
+            assert(ptr != NULL);
+            cJSON_Delete(ptr);
+        } else {
+            cJSON *ptr = cJSON_Parse(data);
+            assert(ptr != NULL);
+            cJSON_Delete(ptr);
+        }
+        cb_histogram_record(&histogram, gethrtime() - begin);
     }
     delta = gethrtime() - start;
-
-    report(delta / (hrtime_t)num);
+    cJSON_DeleteArena(arena);
+    free(scratch);
+
+    report("Parsing took an average of ", delta / (hrtime_t)num);
+    report("  p50:   ", cb_histogram_percentile(&histogram, 50.0));
+    report("  p99:   ", cb_histogram_percentile(&histogram, 99.0));
+    report("  p99.9: ", cb_histogram_percentile(&histogram, 99.9));
+    report("  max:   ", cb_histogram_max(&histogram));
 
     exit(EXIT_SUCCESS);
 }
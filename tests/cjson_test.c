@@ -4,7 +4,19 @@
 #include <cJSON.h>
 #include <stdio.h>
 
-int main(void) {
+static int mallocs;
+
+static void *counting_malloc(size_t sz) {
+   ++mallocs;
+   return malloc(sz);
+}
+
+static void *counting_calloc(size_t nmemb, size_t size) {
+   ++mallocs;
+   return calloc(nmemb, size);
+}
+
+static int test_print(void) {
    const char *expected = "{\"foo\":\"bar\"}";
    char *str;
    int retcode = EXIT_SUCCESS;
@@ -22,3 +34,1061 @@ int main(void) {
 
    return retcode;
 }
+
+static int test_arena(void) {
+   const char *doc = "{\"name\":\"arena\",\"values\":[1,2,3],"
+                     "\"nested\":{\"key\":\"a long string which is longer "
+                     "than the slab size used by this test\"}}";
+   cJSON_Hooks hooks = { counting_malloc, NULL, NULL, NULL };
+   cJSON_Arena *arena;
+   cJSON *root;
+   cJSON *item;
+   char *str;
+   int ii;
+   int retcode = EXIT_SUCCESS;
+
+   cJSON_InitHooks(&hooks);
+   arena = cJSON_CreateArena(64);
+   for (ii = 0; ii < 3; ++ii) {
+      mallocs = 0;
+      root = cJSON_ParseWithArena(doc, arena);
+      if (ii > 0 && mallocs != 0) {
+         /* The slabs from the first parse should be reused */
+         fprintf(stderr, "Expected the arena to reuse its slabs, "
+                 "got %d allocations\n", mallocs);
+         retcode = EXIT_FAILURE;
+      }
+      if (root == NULL) {
+         fprintf(stderr, "Failed to parse document into arena\n");
+         retcode = EXIT_FAILURE;
+         break;
+      }
+      item = cJSON_GetObjectItem(root, "name");
+      if (item == NULL || strcmp(item->valuestring, "arena") != 0) {
+         fprintf(stderr, "Incorrect value for \"name\"\n");
+         retcode = EXIT_FAILURE;
+      }
+      item = cJSON_GetObjectItem(root, "values");
+      if (item == NULL || cJSON_GetArraySize(item) != 3 ||
+          cJSON_GetArrayItem(item, 2)->valueint != 3) {
+         fprintf(stderr, "Incorrect value for \"values\"\n");
+         retcode = EXIT_FAILURE;
+      }
+      str = cJSON_PrintUnformatted(root);
+      if (strcmp(str, doc) != 0) {
+         fprintf(stderr, "Expected %s got %s\n", doc, str);
+         retcode = EXIT_FAILURE;
+      }
+      cJSON_Free(str);
+      cJSON_ResetArena(arena);
+   }
+
+   if (cJSON_ParseWithArena("{\"foo\":[1,2,", arena) != NULL) {
+      fprintf(stderr, "Expected parse of bad input to fail\n");
+      retcode = EXIT_FAILURE;
+   }
+
+   cJSON_DeleteArena(arena);
+   cJSON_InitHooks(NULL);
+   return retcode;
+}
+
+static int test_parse_with_length(void) {
+   const char *doc = "{\"key\":[true,false,null,-1.5e3,\"\\u00e6\"]}  ";
+   size_t len = strlen(doc);
+   size_t ii;
+   char *buffer;
+   cJSON *root;
+   int retcode = EXIT_SUCCESS;
+
+   /* Run every prefix of the document from a buffer without a
+    * terminator (so that overreads are caught by the memory checkers) */
+   for (ii = 0; ii <= len; ++ii) {
+      buffer = malloc(ii + 1);
+      memcpy(buffer, doc, ii);
+      root = cJSON_ParseWithLength(buffer, ii);
+      if (ii < strlen("{\"key\":[true,false,null,-1.5e3,\"\\u00e6\"]}")) {
+         if (root != NULL) {
+            fprintf(stderr, "Expected parse of %d bytes to fail\n", (int)ii);
+            retcode = EXIT_FAILURE;
+         }
+      } else if (root == NULL) {
+         fprintf(stderr, "Failed to parse %d bytes\n", (int)ii);
+         retcode = EXIT_FAILURE;
+      } else if (strcmp(cJSON_GetArrayItem(cJSON_GetObjectItem(root, "key"),
+                                           4)->valuestring, "\xc3\xa6") != 0) {
+         fprintf(stderr, "Incorrect unicode escape\n");
+         retcode = EXIT_FAILURE;
+      }
+      cJSON_Delete(root);
+      free(buffer);
+   }
+
+   /* Only the given length should be used */
+   root = cJSON_ParseWithLength("[1,2]3", 5);
+   if (root == NULL || cJSON_GetArraySize(root) != 2) {
+      fprintf(stderr, "Expected to parse the length bounded array\n");
+      retcode = EXIT_FAILURE;
+   }
+   cJSON_Delete(root);
+
+   return retcode;
+}
+
+static int test_parse_in_situ(void) {
+   const char *doc = "{\"key\":\"va\\\"lue\",\"list\":[\"\\u00e6\\n\",\"x\"]}";
+   cJSON_Hooks hooks = { counting_malloc, NULL, counting_calloc, NULL };
+   cJSON_Arena *arena;
+   char *buffer;
+   cJSON *root;
+   cJSON *item;
+   size_t len = strlen(doc);
+   size_t ii;
+   int retcode = EXIT_SUCCESS;
+
+   cJSON_InitHooks(&hooks);
+   buffer = malloc(len);
+   memcpy(buffer, doc, len);
+   mallocs = 0;
+   root = cJSON_ParseInSitu(buffer, len, NULL);
+   if (root == NULL) {
+      fprintf(stderr, "Failed to parse document in situ\n");
+      cJSON_InitHooks(NULL);
+      free(buffer);
+      return EXIT_FAILURE;
+   }
+   /* Only the items should be allocated, not the strings */
+   if (mallocs != 5) {
+      fprintf(stderr, "Expected 5 allocations, got %d\n", mallocs);
+      retcode = EXIT_FAILURE;
+   }
+   item = cJSON_GetObjectItem(root, "key");
+   if (item == NULL || (item->type & 255) != cJSON_String ||
+       strcmp(item->valuestring, "va\"lue") != 0 ||
+       item->valuestring < buffer || item->valuestring >= buffer + len ||
+       item->string < buffer || item->string >= buffer + len) {
+      fprintf(stderr, "Incorrect value for \"key\"\n");
+      retcode = EXIT_FAILURE;
+   }
+   item = cJSON_GetArrayItem(cJSON_GetObjectItem(root, "list"), 0);
+   if (item == NULL || strcmp(item->valuestring, "\xc3\xa6\n") != 0) {
+      fprintf(stderr, "Incorrect unescaped list item\n");
+      retcode = EXIT_FAILURE;
+   }
+   /* Renaming an in-situ member must not try to free its name */
+   item = cJSON_DetachItemFromObject(root, "key");
+   cJSON_AddItemToObject(root, "renamed", item);
+   cJSON_Delete(root);
+   free(buffer);
+   cJSON_InitHooks(NULL);
+
+   /* Failing parses must not free anything in the buffer, and must not
+    * write past it */
+   for (ii = 0; ii < len; ++ii) {
+      buffer = malloc(ii + 1);
+      memcpy(buffer, doc, ii);
+      if (cJSON_ParseInSitu(buffer, ii, NULL) != NULL) {
+         fprintf(stderr, "Expected parse of %d bytes to fail\n", (int)ii);
+         retcode = EXIT_FAILURE;
+      }
+      free(buffer);
+   }
+
+   arena = cJSON_CreateArena(0);
+   buffer = malloc(len);
+   memcpy(buffer, doc, len);
+   root = cJSON_ParseInSitu(buffer, len, arena);
+   item = root ? cJSON_GetObjectItem(root, "key") : NULL;
+   if (item == NULL || item->type != cJSON_String ||
+       strcmp(item->valuestring, "va\"lue") != 0) {
+      fprintf(stderr, "Failed to parse document in situ into arena\n");
+      retcode = EXIT_FAILURE;
+   }
+   cJSON_DeleteArena(arena);
+   free(buffer);
+
+   return retcode;
+}
+
+static int test_index(void) {
+   cJSON *obj = cJSON_CreateObject();
+   cJSON *array = cJSON_CreateArray();
+   cJSON *item;
+   char key[32];
+   char *str;
+   int ii;
+   int retcode = EXIT_SUCCESS;
+
+   for (ii = 0; ii < 100; ++ii) {
+      snprintf(key, sizeof(key), "Key%d", ii);
+      cJSON_AddNumberToObject(obj, key, ii);
+      cJSON_AddItemToArray(array, cJSON_CreateNumber(ii));
+   }
+   /* Duplicates resolve to the first item, as without the index */
+   cJSON_AddNumberToObject(obj, "key7", -1);
+   if (cJSON_EnableIndex(obj) != 0 || cJSON_EnableIndex(array) != 0) {
+      fprintf(stderr, "Failed to enable the index\n");
+      return EXIT_FAILURE;
+   }
+
+   /* Lookups build the index, the appends after that update it */
+   for (ii = 0; ii < 1000; ++ii) {
+      snprintf(key, sizeof(key), "key%d", ii);
+      if (ii >= 100) {
+         cJSON_AddNumberToObject(obj, key, ii);
+         cJSON_AddItemToArray(array, cJSON_CreateNumber(ii));
+      }
+      item = cJSON_GetObjectItem(obj, key);
+      if (item == NULL || item->valueint != ii) {
+         fprintf(stderr, "Incorrect item for %s\n", key);
+         retcode = EXIT_FAILURE;
+      }
+      item = cJSON_GetArrayItem(array, ii);
+      if (item == NULL || item->valueint != ii) {
+         fprintf(stderr, "Incorrect item %d\n", ii);
+         retcode = EXIT_FAILURE;
+      }
+   }
+   if (cJSON_GetArraySize(array) != 1000 || cJSON_GetArrayItem(array, 1000) ||
+       cJSON_GetArraySize(obj) != 1001) {
+      fprintf(stderr, "Incorrect array size\n");
+      retcode = EXIT_FAILURE;
+   }
+   if (cJSON_GetObjectItemCaseSensitive(obj, "key7") == NULL ||
+       cJSON_GetObjectItemCaseSensitive(obj, "key7")->valueint != -1 ||
+       cJSON_GetObjectItemCaseSensitive(obj, "Key7")->valueint != 7 ||
+       cJSON_GetObjectItemCaseSensitive(obj, "KEY7") != NULL ||
+       cJSON_GetObjectItem(obj, "nokey") != NULL) {
+      fprintf(stderr, "Incorrect case sensitive lookup\n");
+      retcode = EXIT_FAILURE;
+   }
+
+   cJSON_ReplaceItemInObject(obj, "key500", cJSON_CreateString("replaced"));
+   cJSON_DeleteItemFromObject(obj, "key7");
+   cJSON_ReplaceItemInArray(array, 3, cJSON_CreateString("replaced"));
+   cJSON_DeleteItemFromArray(array, 0);
+   item = cJSON_GetObjectItem(obj, "KEY500");
+   if (item == NULL || strcmp(item->valuestring, "replaced") != 0 ||
+       cJSON_GetObjectItem(obj, "key7")->valueint != -1 ||
+       cJSON_GetObjectItemCaseSensitive(obj, "Key7") != NULL) {
+      fprintf(stderr, "Index not updated by replace/delete\n");
+      retcode = EXIT_FAILURE;
+   }
+   item = cJSON_GetArrayItem(array, 2);
+   if (item == NULL || strcmp(item->valuestring, "replaced") != 0 ||
+       cJSON_GetArrayItem(array, 0)->valueint != 1 ||
+       cJSON_GetArraySize(array) != 999) {
+      fprintf(stderr, "Array index not updated by replace/delete\n");
+      retcode = EXIT_FAILURE;
+   }
+
+   cJSON_DisableIndex(array);
+   if (cJSON_GetArrayItem(array, 998)->valueint != 999) {
+      fprintf(stderr, "Incorrect item after disabling the index\n");
+      retcode = EXIT_FAILURE;
+   }
+   cJSON_Delete(obj);
+   cJSON_Delete(array);
+
+   /* Detach and replace in an object where every name is unique */
+   obj = cJSON_CreateObject();
+   cJSON_EnableIndex(obj);
+   for (ii = 0; ii < 1000; ++ii) {
+      snprintf(key, sizeof(key), "key%d", ii);
+      cJSON_AddNumberToObject(obj, key, ii);
+   }
+   for (ii = 0; ii < 1000; ii += 2) {
+      snprintf(key, sizeof(key), "KEY%d", ii);
+      item = cJSON_DetachItemFromObject(obj, key);
+      if (item == NULL || item->valueint != ii) {
+         fprintf(stderr, "Incorrect item detached for %s\n", key);
+         retcode = EXIT_FAILURE;
+      }
+      cJSON_Delete(item);
+   }
+   cJSON_ReplaceItemInObject(obj, "KEY1", cJSON_CreateNumber(-1));
+   for (ii = 0; ii < 1000; ++ii) {
+      snprintf(key, sizeof(key), "key%d", ii);
+      item = cJSON_GetObjectItem(obj, key);
+      if (ii % 2 == 0 ? item != NULL :
+          (item == NULL || item->valueint != (ii == 1 ? -1 : ii) ||
+           cJSON_GetArrayItem(obj, ii / 2) != item)) {
+         fprintf(stderr, "Incorrect item for %s after detach\n", key);
+         retcode = EXIT_FAILURE;
+      }
+   }
+   if (cJSON_GetObjectItemCaseSensitive(obj, "KEY1") == NULL ||
+       cJSON_GetObjectItemCaseSensitive(obj, "key1") != NULL ||
+       cJSON_GetArraySize(obj) != 500) {
+      fprintf(stderr, "Incorrect object after detach\n");
+      retcode = EXIT_FAILURE;
+   }
+   cJSON_Delete(obj);
+
+   /* A negative index replaces the first item, with or without the index */
+   for (ii = 0; ii < 2; ++ii) {
+      array = cJSON_Parse("[1,2,3]");
+      if (ii) {
+         cJSON_EnableIndex(array);
+      }
+      cJSON_ReplaceItemInArray(array, -1, cJSON_CreateNumber(4));
+      str = cJSON_PrintUnformatted(array);
+      if (strcmp(str, "[4,2,3]") != 0) {
+         fprintf(stderr, "Expected [4,2,3] got %s\n", str);
+         retcode = EXIT_FAILURE;
+      }
+      cJSON_Free(str);
+      cJSON_Delete(array);
+   }
+
+   /* Out of range on an empty array */
+   array = cJSON_CreateArray();
+   cJSON_EnableIndex(array);
+   if (cJSON_GetArrayItem(array, 0) != NULL ||
+       cJSON_GetArrayItem(array, -1) != NULL ||
+       cJSON_DetachItemFromArray(array, 0) != NULL) {
+      fprintf(stderr, "Expected no items in an empty array\n");
+      retcode = EXIT_FAILURE;
+   }
+   cJSON_Delete(array);
+
+   return retcode;
+}
+
+static int test_print_to_buffer(void) {
+   const char *doc = "{\"a\":[1,2.5,\"x\\ny\"],\"b\":{},\"c\":[{\"d\":null}]}";
+   cJSON_Hooks hooks = { counting_malloc, NULL, counting_calloc, NULL };
+   cJSON *root = cJSON_Parse(doc);
+   char *expected;
+   char buffer[256];
+   size_t len;
+   int fmt;
+   int retcode = EXIT_SUCCESS;
+
+   for (fmt = 0; fmt < 2; ++fmt) {
+      expected = fmt ? cJSON_Print(root) : cJSON_PrintUnformatted(root);
+      len = strlen(expected) + 1;
+      cJSON_InitHooks(&hooks);
+      mallocs = 0;
+      if (cJSON_PrintToBuffer(root, buffer, len, fmt) != 0 ||
+          strcmp(buffer, expected) != 0) {
+         fprintf(stderr, "Expected %s got %s\n", expected, buffer);
+         retcode = EXIT_FAILURE;
+      }
+      if (cJSON_PrintToBuffer(root, buffer, len - 1, fmt) != -1) {
+         fprintf(stderr, "Expected print to a short buffer to fail\n");
+         retcode = EXIT_FAILURE;
+      }
+      if (mallocs != 0) {
+         fprintf(stderr, "Expected no allocations, got %d\n", mallocs);
+         retcode = EXIT_FAILURE;
+      }
+      cJSON_InitHooks(NULL);
+      cJSON_Free(expected);
+   }
+   cJSON_Delete(root);
+
+   return retcode;
+}
+
+static int test_numbers(void) {
+   const char *docs[] = {
+      "[0,-1,2147483648,9223372036854775807,-9223372036854775808]",
+      "[0.1,0.3333333333333333,1.5,-2.5e-7,1e+21,1.7976931348623157e+308]",
+      "[5e-324,2.2250738585072014e-308,123456789012345680,0.000001]",
+      "[-0,9223372036854776000,-1e+30]"
+   };
+   const double doubles[] = { 0.1, 1.0 / 3, 2.5e-7, 1e21, 4.35, 1e300,
+                              5e-324, 9007199254740993.0 };
+   char buffer[64];
+   cJSON *root;
+   cJSON *item;
+   char *str;
+   size_t ii;
+   int retcode = EXIT_SUCCESS;
+
+   /* The shortest form is printed, and integers are kept exact */
+   for (ii = 0; ii < sizeof(docs) / sizeof(docs[0]); ++ii) {
+      root = cJSON_Parse(docs[ii]);
+      str = cJSON_PrintUnformatted(root);
+      if (strcmp(str, docs[ii]) != 0) {
+         fprintf(stderr, "Expected %s got %s\n", docs[ii], str);
+         retcode = EXIT_FAILURE;
+      }
+      cJSON_Free(str);
+      cJSON_Delete(root);
+   }
+
+   root = cJSON_Parse("[9223372036854775807,-9223372036854775808,1.5,3e9]");
+   if (cJSON_GetArrayItem(root, 0)->valueint64 != INT64_MAX ||
+       cJSON_GetArrayItem(root, 1)->valueint64 != INT64_MIN ||
+       cJSON_GetArrayItem(root, 2)->valueint64 != 1 ||
+       cJSON_GetArrayItem(root, 3)->valueint != 2147483647) {
+      fprintf(stderr, "Incorrect integer values\n");
+      retcode = EXIT_FAILURE;
+   }
+   cJSON_Delete(root);
+
+   /* Out of range integers are doubles, not the saturated valueint64 */
+   root = cJSON_Parse("[9223372036854775808,-9223372036854775809,-0]");
+   item = cJSON_GetArrayItem(root, 0);
+   if (item->valuedouble != 9223372036854775808.0 ||
+       item->valueint64 != INT64_MAX ||
+       !(item->type & cJSON_NumberIsSaturated)) {
+      fprintf(stderr, "Incorrect integer above the range\n");
+      retcode = EXIT_FAILURE;
+   }
+   item = cJSON_GetArrayItem(root, 1);
+   if (item->valuedouble != -9223372036854775808.0 ||
+       item->valueint64 != INT64_MIN ||
+       !(item->type & cJSON_NumberIsSaturated)) {
+      fprintf(stderr, "Incorrect integer below the range\n");
+      retcode = EXIT_FAILURE;
+   }
+   str = cJSON_PrintUnformatted(root);
+   if (strcmp(str, "[9223372036854776000,-9223372036854776000,-0]") != 0) {
+      fprintf(stderr, "Incorrect out of range integers %s\n", str);
+      retcode = EXIT_FAILURE;
+   }
+   cJSON_Free(str);
+   cJSON_Delete(root);
+
+   /* The ends of the range are exact as integers */
+   item = cJSON_CreateInt64(INT64_MIN);
+   if (item->type != cJSON_Number ||
+       cJSON_PrintToBuffer(item, buffer, sizeof(buffer), 0) != 0 ||
+       strcmp(buffer, "-9223372036854775808") != 0) {
+      fprintf(stderr, "Incorrect 64 bit integer %s\n", buffer);
+      retcode = EXIT_FAILURE;
+   }
+   cJSON_Delete(item);
+
+   item = cJSON_CreateInt64(INT64_MAX);
+   if (item->type != cJSON_Number ||
+       cJSON_PrintToBuffer(item, buffer, sizeof(buffer), 0) != 0 ||
+       strcmp(buffer, "9223372036854775807") != 0) {
+      fprintf(stderr, "Incorrect 64 bit integer %s\n", buffer);
+      retcode = EXIT_FAILURE;
+   }
+   cJSON_Delete(item);
+
+   item = cJSON_CreateInt64(INT64_MAX - 1);
+   if (cJSON_PrintToBuffer(item, buffer, sizeof(buffer), 0) != 0 ||
+       strcmp(buffer, "9223372036854775806") != 0) {
+      fprintf(stderr, "Incorrect 64 bit integer %s\n", buffer);
+      retcode = EXIT_FAILURE;
+   }
+   cJSON_Delete(item);
+
+   /* Modifying valuedouble by hand prints the new value */
+   item = cJSON_CreateNumber(1);
+   item->valuedouble = 2.75;
+   if (cJSON_PrintToBuffer(item, buffer, sizeof(buffer), 0) != 0 ||
+       strcmp(buffer, "2.75") != 0) {
+      fprintf(stderr, "Expected 2.75 got %s\n", buffer);
+      retcode = EXIT_FAILURE;
+   }
+   cJSON_Delete(item);
+
+   for (ii = 0; ii < sizeof(doubles) / sizeof(doubles[0]); ++ii) {
+      item = cJSON_CreateNumber(doubles[ii]);
+      cJSON_PrintToBuffer(item, buffer, sizeof(buffer), 0);
+      root = cJSON_Parse(buffer);
+      if (root == NULL || root->valuedouble != doubles[ii]) {
+         fprintf(stderr, "%s doesn't read back as %.17g\n", buffer,
+                 doubles[ii]);
+         retcode = EXIT_FAILURE;
+      }
+      cJSON_Delete(root);
+      cJSON_Delete(item);
+   }
+
+   return retcode;
+}
+
+/* Record the events of the streaming parser as text */
+struct sax_log {
+   char text[512];
+   size_t len;
+   int abort_at_key;
+};
+
+static void sax_log_add(struct sax_log *log, const char *str) {
+   size_t len = strlen(str);
+   if (log->len + len < sizeof(log->text)) {
+      memcpy(log->text + log->len, str, len + 1);
+      log->len += len;
+   }
+}
+
+static int sax_start_object(void *ctx) {
+   sax_log_add(ctx, "{");
+   return 0;
+}
+
+static int sax_end_object(void *ctx) {
+   sax_log_add(ctx, "}");
+   return 0;
+}
+
+static int sax_start_array(void *ctx) {
+   sax_log_add(ctx, "[");
+   return 0;
+}
+
+static int sax_end_array(void *ctx) {
+   sax_log_add(ctx, "]");
+   return 0;
+}
+
+static int sax_key(void *ctx, const char *key) {
+   struct sax_log *log = ctx;
+   sax_log_add(log, key);
+   sax_log_add(log, "=");
+   return log->abort_at_key;
+}
+
+static int sax_value(void *ctx, const cJSON *value) {
+   char buffer[64];
+   if (value->type == cJSON_String) {
+      sax_log_add(ctx, "s:");
+      sax_log_add(ctx, value->valuestring);
+   } else {
+      cJSON_PrintToBuffer((cJSON *)value, buffer, sizeof(buffer), 0);
+      sax_log_add(ctx, buffer);
+   }
+   sax_log_add(ctx, ";");
+   return 0;
+}
+
+static int sax_parse(const char *doc, size_t chunk, struct sax_log *log) {
+   cJSON_SaxCallbacks callbacks = { sax_start_object, sax_end_object,
+                                    sax_start_array, sax_end_array,
+                                    sax_key, sax_value };
+   cJSON_Sax *sax = cJSON_CreateSax(&callbacks, log);
+   size_t len = strlen(doc);
+   size_t offset;
+   int ret = 0;
+
+   log->len = 0;
+   log->text[0] = '\0';
+   for (offset = 0; offset < len && ret == 0; offset += chunk) {
+      ret = cJSON_SaxFeed(sax, doc + offset,
+                          (len - offset < chunk) ? len - offset : chunk);
+   }
+   if (ret == 0) {
+      ret = cJSON_SaxFinish(sax);
+   }
+   cJSON_DeleteSax(sax);
+   return ret;
+}
+
+static int test_sax(void) {
+   const char *doc = " {\"name\" : \"sa\\\"x\\u00e6\", \"list\":[1, -2.5e3,"
+                     "true,false,null,[],{}],\"obj\":{\"a\":{\"b\":[\"\"]}} }\n";
+   const char *expected = "{name=s:sa\"x\xc3\xa6;list=[1;-2500;true;false;"
+                          "null;[]{}]obj={a={b=[s:;]}}}";
+   const char *bad[] = { "[1,]", "{\"a\" 1}", "{\"a\":1,}", "[1 2]", "[1}",
+                         "{1:2}", "[tru]", "[nullx]", "[1.2.3]", "[1]]",
+                         "\"abc", "[\"a\nb\"]", "[1", "" };
+   struct sax_log log;
+   size_t chunk;
+   size_t ii;
+   int retcode = EXIT_SUCCESS;
+
+   log.abort_at_key = 0;
+   for (chunk = 1; chunk <= strlen(doc); ++chunk) {
+      if (sax_parse(doc, chunk, &log) != 0 || strcmp(log.text, expected) != 0) {
+         fprintf(stderr, "Chunks of %d: expected %s got %s\n", (int)chunk,
+                 expected, log.text);
+         retcode = EXIT_FAILURE;
+      }
+   }
+
+   /* A top level scalar is terminated by the end of the input */
+   if (sax_parse("1234", 3, &log) != 0 || strcmp(log.text, "1234;") != 0) {
+      fprintf(stderr, "Expected a top level number, got %s\n", log.text);
+      retcode = EXIT_FAILURE;
+   }
+
+   for (ii = 0; ii < sizeof(bad) / sizeof(bad[0]); ++ii) {
+      for (chunk = 1; chunk <= 3; ++chunk) {
+         if (sax_parse(bad[ii], chunk, &log) == 0) {
+            fprintf(stderr, "Expected %s to fail\n", bad[ii]);
+            retcode = EXIT_FAILURE;
+         }
+      }
+   }
+
+   log.abort_at_key = 1;
+   if (sax_parse(doc, 4, &log) == 0 || strcmp(log.text, "{name=") != 0) {
+      fprintf(stderr, "Expected the callback to abort the parse\n");
+      retcode = EXIT_FAILURE;
+   }
+
+   return retcode;
+}
+
+static int test_paths(void) {
+   /* The example document of RFC 6901 */
+   const char *doc = "{\"foo\":[\"bar\",\"baz\"],\"\":0,\"a/b\":1,\"c%d\":2,"
+                     "\"e^f\":3,\"g|h\":4,\"i\\\\j\":5,\"k\\\"l\":6,\" \":7,"
+                     "\"m~n\":8,\"x\":{\"y\":{\"z\":[10,11,{\"w\":12}]}},"
+                     "\"dup\":1,\"dup\":2}";
+   const char *pointers[] = { "/foo/0", "/", "/a~1b", "/c%d", "/e^f", "/g|h",
+                              "/i\\j", "/k\"l", "/ ", "/m~0n", "/x/y/z/2/w",
+                              "/x/y/z/1", "/dup", "/foo/01", "/foo/2",
+                              "/x/nope", "/Foo/0", "" };
+   const int expected[] = { -1, 0, 1, 2, 3, 4, 5, 6, 7, 8, 12, 11, 1,
+                            -2, -2, -2, -2, -3 };
+   const int npaths = sizeof(pointers) / sizeof(pointers[0]);
+   cJSON_Path *paths[sizeof(pointers) / sizeof(pointers[0])];
+   cJSON *results[sizeof(pointers) / sizeof(pointers[0])];
+   cJSON *root = cJSON_Parse(doc);
+   int pass, ii, nfound = 0;
+   int retcode = EXIT_SUCCESS;
+
+   if (root == NULL) {
+      fprintf(stderr, "Failed to parse the path document\n");
+      return EXIT_FAILURE;
+   }
+   for (ii = 0; ii < npaths; ++ii) {
+      paths[ii] = cJSON_CompilePath(pointers[ii]);
+      if (paths[ii] == NULL) {
+         fprintf(stderr, "Failed to compile %s\n", pointers[ii]);
+         return EXIT_FAILURE;
+      }
+      nfound += expected[ii] != -2;
+   }
+
+   /* Without and with the lookup index */
+   for (pass = 0; pass < 2; ++pass) {
+      if (cJSON_GetPaths(root, (const cJSON_Path *const *)paths, npaths,
+                         results) != nfound) {
+         fprintf(stderr, "Incorrect number of paths found\n");
+         retcode = EXIT_FAILURE;
+      }
+      for (ii = 0; ii < npaths; ++ii) {
+         cJSON *item = cJSON_GetPath(root, paths[ii]);
+         int ok;
+         if (expected[ii] == -1) {
+            ok = item && item->type == cJSON_String &&
+                 strcmp(item->valuestring, "bar") == 0;
+         } else if (expected[ii] == -2) {
+            ok = item == NULL;
+         } else if (expected[ii] == -3) {
+            ok = item == root;
+         } else {
+            ok = item && item->valueint == expected[ii];
+         }
+         if (!ok || results[ii] != item) {
+            fprintf(stderr, "Incorrect item for \"%s\"\n", pointers[ii]);
+            retcode = EXIT_FAILURE;
+         }
+      }
+      cJSON_EnableIndex(root);
+      cJSON_EnableIndex(cJSON_GetObjectItem(root, "foo"));
+   }
+
+   if (cJSON_GetPointer(root, "/x/y/z/0")->valueint != 10 ||
+       cJSON_CompilePath("foo") != NULL || cJSON_CompilePath("/a~2") != NULL ||
+       cJSON_CompilePath("/a~") != NULL) {
+      fprintf(stderr, "Incorrect pointer validation\n");
+      retcode = EXIT_FAILURE;
+   }
+
+   for (ii = 0; ii < npaths; ++ii) {
+      cJSON_DeletePath(paths[ii]);
+   }
+   cJSON_Delete(root);
+   return retcode;
+}
+
+static int test_binary(void) {
+   const char *doc = "{\"name\":\"binary\",\"n\":[0,-0,1,-1,2.5,1e300,"
+                     "9007199254740993,-9223372036854775808],"
+                     "\"nested\":{\"name\":\"inner\",\"list\":[true,false,"
+                     "null,{},[]]},\"\":\"empty key\",\"s\":\"a\\\"\\n\"}";
+   cJSON *root = cJSON_Parse(doc);
+   cJSON *decoded;
+   cJSON_BinaryValue value, item, inner;
+   char *text, *retext, *encoded, *copy;
+   const char *name;
+   size_t length, ii;
+   int64_t i64;
+   double d;
+   int retcode = EXIT_SUCCESS;
+
+   if (root == NULL || (encoded = cJSON_EncodeBinary(root, &length)) == NULL) {
+      fprintf(stderr, "Failed to encode the binary document\n");
+      return EXIT_FAILURE;
+   }
+
+   decoded = cJSON_DecodeBinary(encoded, length);
+   text = cJSON_PrintUnformatted(root);
+   retext = decoded ? cJSON_PrintUnformatted(decoded) : NULL;
+   if (retext == NULL || strcmp(text, retext) != 0) {
+      fprintf(stderr, "Binary round trip failed:\n%s\n%s\n", text,
+              retext ? retext : "(null)");
+      retcode = EXIT_FAILURE;
+   }
+   cJSON_Free(text);
+   cJSON_Free(retext);
+   if (decoded) {
+      cJSON *n = cJSON_GetObjectItem(decoded, "n");
+      if (cJSON_GetArrayItem(n, 6)->valueint64 != 9007199254740993LL ||
+          cJSON_GetArrayItem(n, 7)->valueint64 != INT64_MIN ||
+          cJSON_GetArrayItem(n, 4)->valuedouble != 2.5) {
+         fprintf(stderr, "Binary numbers aren't exact\n");
+         retcode = EXIT_FAILURE;
+      }
+      cJSON_Delete(decoded);
+   }
+
+   /* Read fields straight from the buffer */
+   if (cJSON_BinaryOpen(encoded, length, &value) != 0 ||
+       cJSON_BinaryType(&value) != cJSON_Object ||
+       cJSON_BinaryGetSize(&value) != 5 ||
+       cJSON_BinaryGetObjectItem(&value, "nested", &inner) != 0 ||
+       cJSON_BinaryGetObjectItem(&inner, "name", &item) != 0 ||
+       strcmp(cJSON_BinaryGetString(&item), "inner") != 0 ||
+       cJSON_BinaryGetObjectItem(&inner, "list", &item) != 0 ||
+       cJSON_BinaryGetArrayItem(&item, 2, &item) != 0 ||
+       cJSON_BinaryType(&item) != cJSON_NULL ||
+       cJSON_BinaryGetObjectItem(&value, "missing", &item) != -1 ||
+       cJSON_BinaryGetObjectEntry(&value, 3, &name, &item) != 0 ||
+       strcmp(name, "") != 0 ||
+       strcmp(cJSON_BinaryGetString(&item), "empty key") != 0 ||
+       cJSON_BinaryGetObjectItem(&value, "n", &item) != 0 ||
+       cJSON_BinaryGetArrayItem(&item, 6, &item) != 0 ||
+       cJSON_BinaryGetNumber(&item, &i64, &d) != 0 ||
+       i64 != 9007199254740993LL || cJSON_BinaryGetString(&item) != NULL) {
+      fprintf(stderr, "Incorrect lazy binary access\n");
+      retcode = EXIT_FAILURE;
+   }
+
+   /* Truncated or damaged encodings are rejected (or at least don't
+      read outside the buffer) */
+   copy = malloc(length);
+   for (ii = 0; ii < length; ++ii) {
+      memcpy(copy, encoded, ii);
+      decoded = cJSON_DecodeBinary(copy, ii);
+      if (decoded != NULL) {
+         fprintf(stderr, "Decoded a truncated buffer\n");
+         retcode = EXIT_FAILURE;
+         cJSON_Delete(decoded);
+      }
+   }
+   for (ii = 4; ii < length; ++ii) {
+      memcpy(copy, encoded, length);
+      copy[ii] ^= 0x5a;
+      cJSON_Delete(cJSON_DecodeBinary(copy, length));
+   }
+   free(copy);
+
+   cJSON_Free(encoded);
+   cJSON_Delete(root);
+   return retcode;
+}
+
+/* Documents nested deeper than CJSON_NESTING_LIMIT are rejected by the
+   parsers and the binary decoder */
+static int test_nesting(void) {
+   char *doc = malloc(2 * CJSON_NESTING_LIMIT + 3);
+   cJSON *root = cJSON_CreateArray();
+   cJSON *item = root;
+   cJSON *decoded;
+   cJSON_Tape *tape;
+   char *encoded;
+   size_t length;
+   int depth, ii;
+   int retcode = EXIT_SUCCESS;
+
+   for (depth = CJSON_NESTING_LIMIT; depth <= CJSON_NESTING_LIMIT + 1; ++depth) {
+      const int ok = depth <= CJSON_NESTING_LIMIT;
+      for (ii = 0; ii < depth; ++ii) {
+         doc[ii] = '[';
+         doc[2 * depth - 1 - ii] = ']';
+      }
+      doc[2 * depth] = '\0';
+      decoded = cJSON_Parse(doc);
+      tape = cJSON_TapeParse(doc, strlen(doc));
+      if ((decoded != NULL) != ok || (tape != NULL) != ok) {
+         fprintf(stderr, "Incorrect parse of %d nested arrays\n", depth);
+         retcode = EXIT_FAILURE;
+      }
+      cJSON_Delete(decoded);
+      cJSON_DeleteTape(tape);
+   }
+   free(doc);
+
+   for (depth = 1; depth <= CJSON_NESTING_LIMIT + 1; ++depth) {
+      if (depth >= CJSON_NESTING_LIMIT) {
+         encoded = cJSON_EncodeBinary(root, &length);
+         decoded = encoded ? cJSON_DecodeBinary(encoded, length) : NULL;
+         if (encoded == NULL ||
+             (decoded != NULL) != (depth == CJSON_NESTING_LIMIT)) {
+            fprintf(stderr, "Incorrect decode of %d nested arrays\n", depth);
+            retcode = EXIT_FAILURE;
+         }
+         cJSON_Delete(decoded);
+         cJSON_Free(encoded);
+      }
+      cJSON_AddItemToArray(item, cJSON_CreateArray());
+      item = item->child;
+   }
+   cJSON_Delete(root);
+
+   return retcode;
+}
+
+struct tracker {
+   size_t allocated;
+   int blocks;
+   int bad_frees;
+};
+
+/* Keep the size in front of the block to check the one passed to free */
+static void *tracking_malloc(void *ctx, size_t size) {
+   struct tracker *tracker = ctx;
+   size_t *block = malloc(size + 16);
+   if (block == NULL) {
+      return NULL;
+   }
+   *block = size;
+   tracker->allocated += size;
+   tracker->blocks++;
+   return (char *)block + 16;
+}
+
+static void tracking_free(void *ctx, void *ptr, size_t size) {
+   struct tracker *tracker = ctx;
+   size_t *block = (size_t *)((char *)ptr - 16);
+   if (*block != size) {
+      tracker->bad_frees++;
+   }
+   tracker->allocated -= *block;
+   tracker->blocks--;
+   free(block);
+}
+
+static int test_allocator(void) {
+   const char *doc = "{\"name\":\"tracked\",\"escaped\\n\":\"a\\tb\\u00e9\","
+                     "\"nul\":\"x\\u0000y\",\"list\":[1,2.5,true,null,"
+                     "{\"deep\":[\"\\\"quoted\\\"\"]}]}";
+   struct tracker bucket1, bucket2;
+   cJSON_Allocator alloc1, alloc2;
+   cJSON_Hooks hooks;
+   cJSON *root, *item;
+   char *text;
+   size_t size;
+   int retcode = EXIT_SUCCESS;
+
+   memset(&bucket1, 0, sizeof(bucket1));
+   memset(&bucket2, 0, sizeof(bucket2));
+   alloc1.malloc_fn = alloc2.malloc_fn = tracking_malloc;
+   alloc1.free_fn = alloc2.free_fn = tracking_free;
+   alloc1.ctx = &bucket1;
+   alloc2.ctx = &bucket2;
+
+   /* Nothing goes through the hooks */
+   memset(&hooks, 0, sizeof(hooks));
+   hooks.malloc_fn = counting_malloc;
+   hooks.calloc_fn = counting_calloc;
+   cJSON_InitHooks(&hooks);
+   mallocs = 0;
+
+   root = cJSON_ParseWithAllocator(doc, strlen(doc), &alloc1);
+   if (root == NULL || bucket1.blocks == 0) {
+      fprintf(stderr, "Failed to parse with the allocator\n");
+      cJSON_InitHooks(NULL);
+      return EXIT_FAILURE;
+   }
+
+   /* Items from another bucket (and the hooks) can be mixed in */
+   item = cJSON_CreateWithAllocator(cJSON_Object, &alloc2);
+   cJSON_AddItemToObject(item, "s",
+                         cJSON_CreateStringWithAllocator("value", &alloc2));
+   cJSON_AddItemToObject(item, "i",
+                         cJSON_CreateInt64WithAllocator(INT64_MAX, &alloc2));
+   cJSON_AddItemToObject(item, "d",
+                         cJSON_CreateNumberWithAllocator(0.5, &alloc2));
+   cJSON_AddItemToObject(item, "t",
+                         cJSON_CreateWithAllocator(cJSON_True, &alloc2));
+   cJSON_AddItemToObject(root, "other", item);
+   cJSON_ReplaceItemInObject(item, "s",
+                             cJSON_CreateStringWithAllocator("new", &alloc1));
+   cJSON_DeleteItemFromObject(item, "d");
+
+   text = cJSON_PrintWithAllocator(root, 0, &alloc2, &size);
+   if (text == NULL || size < strlen(text) + 1 ||
+       strcmp(text, "{\"name\":\"tracked\",\"escaped\\n\":\"a\\tb\xc3\xa9\","
+              "\"nul\":\"x\",\"list\":[1,2.5,true,null,"
+              "{\"deep\":[\"\\\"quoted\\\"\"]}],\"other\":{\"s\":\"new\","
+              "\"i\":9223372036854775807,\"t\":true}}") != 0) {
+      fprintf(stderr, "Incorrect print with the allocator: %s\n",
+              text ? text : "(null)");
+      retcode = EXIT_FAILURE;
+   }
+   if (text) {
+      tracking_free(&bucket2, text, size);
+   }
+   if (mallocs != 0) {
+      fprintf(stderr, "%d allocations went through the hooks\n", mallocs);
+      retcode = EXIT_FAILURE;
+   }
+   cJSON_InitHooks(NULL);
+
+   cJSON_AddItemToObject(root, "hooks", cJSON_CreateString("hooked"));
+   cJSON_Delete(root);
+   if (bucket1.blocks != 0 || bucket1.allocated != 0 ||
+       bucket2.blocks != 0 || bucket2.allocated != 0 ||
+       bucket1.bad_frees != 0 || bucket2.bad_frees != 0) {
+      fprintf(stderr, "Allocator accounting is off\n");
+      retcode = EXIT_FAILURE;
+   }
+
+   /* A failed parse gives everything back */
+   root = cJSON_ParseWithAllocator(doc, strlen(doc) - 3, &alloc1);
+   if (root != NULL || bucket1.blocks != 0 || bucket1.bad_frees != 0) {
+      fprintf(stderr, "A failed parse leaked\n");
+      retcode = EXIT_FAILURE;
+   }
+   return retcode;
+}
+
+/* The number of nodes item takes on a tape */
+static size_t tape_nodes(cJSON *item) {
+   size_t count = 1;
+   cJSON *child;
+   for (child = item->child; child; child = child->next) {
+      count += tape_nodes(child) + ((item->type & 255) == cJSON_Object);
+   }
+   return count;
+}
+
+/* Compare node of the tape with item */
+static int tape_matches(const cJSON_Tape *tape, int node, cJSON *item) {
+   int type = item->type & 255;
+   int64_t i64;
+   double d;
+   cJSON *child;
+   int tchild;
+
+   if (cJSON_TapeType(tape, node) != type) {
+      return 0;
+   }
+   switch (type) {
+   case cJSON_Number:
+      return cJSON_TapeGetNumber(tape, node, &i64, &d) == 0 &&
+             i64 == item->valueint64 &&
+             memcmp(&d, &item->valuedouble, sizeof(d)) == 0;
+   case cJSON_String:
+      return strcmp(cJSON_TapeGetString(tape, node), item->valuestring) == 0;
+   case cJSON_Array:
+   case cJSON_Object:
+      if (cJSON_TapeGetArraySize(tape, node) != cJSON_GetArraySize(item)) {
+         return 0;
+      }
+      tchild = cJSON_TapeGetChild(tape, node);
+      for (child = item->child; child; child = child->next) {
+         if (tchild == -1 || !tape_matches(tape, tchild, child)) {
+            return 0;
+         }
+         if (type == cJSON_Object &&
+             strcmp(cJSON_TapeGetName(tape, tchild), child->string) != 0) {
+            return 0;
+         }
+         tchild = cJSON_TapeGetNext(tape, node, tchild);
+      }
+      return tchild == -1;
+   }
+   return 1;
+}
+
+static int test_tape(void) {
+   const char *doc = "{\"name\":\"tape\",\"Short\":\"1234567\",\"long\":"
+                     "\"12345678\",\"esc\":\"a\\tb\\u00e9\",\"n\":[0,-0,1,-1,2.5,"
+                     "1e300,9007199254740993,-9223372036854775808],"
+                     "\"nested\":{\"list\":[true,false,null,{},[],[[1]]],"
+                     "\"x\":{\"deep\":\"value\"}},\"\":\"empty key\",\"last\":7}";
+   cJSON *root = cJSON_Parse(doc);
+   cJSON_Tape *parsed = cJSON_TapeParse(doc, strlen(doc));
+   cJSON_Tape *converted = root ? cJSON_TapeFromTree(root) : NULL;
+   const char *invalid[] = { "", "[1,", "{\"a\" 1}", "{\"a\":}", "[1 2]",
+                             "{\"a\":1,}", "nul" };
+   int nested, list, ii;
+   int64_t i64;
+   int retcode = EXIT_SUCCESS;
+
+   if (root == NULL || parsed == NULL || converted == NULL) {
+      fprintf(stderr, "Failed to create the tapes\n");
+      return EXIT_FAILURE;
+   }
+   if (!tape_matches(parsed, 0, root) || !tape_matches(converted, 0, root) ||
+       cJSON_TapeSize(parsed) != cJSON_TapeSize(converted)) {
+      fprintf(stderr, "The tapes don't match the tree\n");
+      retcode = EXIT_FAILURE;
+   }
+
+   /* 16 bytes a node, and only "12345678" and "empty key" outside them
+      (plus a small header) */
+   if (cJSON_TapeSize(parsed) > 64 + tape_nodes(root) * 16 + 9 + 10) {
+      fprintf(stderr, "The tape takes %lu bytes\n",
+              (unsigned long)cJSON_TapeSize(parsed));
+      retcode = EXIT_FAILURE;
+   }
+
+   nested = cJSON_TapeGetObjectItem(parsed, 0, "NESTED");
+   list = cJSON_TapeGetObjectItemCaseSensitive(parsed, nested, "list");
+   if (nested == -1 || list == -1 ||
+       cJSON_TapeGetObjectItemCaseSensitive(parsed, 0, "short") != -1 ||
+       cJSON_TapeGetObjectItem(parsed, 0, "short") == -1 ||
+       cJSON_TapeType(parsed, cJSON_TapeGetArrayItem(parsed, list, 2)) != cJSON_NULL ||
+       cJSON_TapeGetArrayItem(parsed, list, 6) != -1 ||
+       cJSON_TapeGetArraySize(parsed, cJSON_TapeGetArrayItem(parsed, list, 5)) != 1 ||
+       cJSON_TapeGetNumber(parsed, cJSON_TapeGetObjectItem(parsed, 0, "last"),
+                           &i64, NULL) != 0 || i64 != 7 ||
+       strcmp(cJSON_TapeGetString(parsed, cJSON_TapeGetObjectItem(parsed,
+              cJSON_TapeGetObjectItem(parsed, nested, "x"), "deep")), "value") != 0 ||
+       strcmp(cJSON_TapeGetString(parsed, cJSON_TapeGetArrayItem(parsed, 0, 6)),
+              "empty key") != 0 ||
+       cJSON_TapeGetString(parsed, list) != NULL ||
+       cJSON_TapeGetNumber(parsed, list, NULL, NULL) != -1 ||
+       cJSON_TapeGetName(parsed, 0) != NULL ||
+       cJSON_TapeType(parsed, 1) != -1 ||
+       cJSON_TapeType(parsed, 1000) != -1 ||
+       cJSON_TapeGetChild(parsed, cJSON_TapeGetArrayItem(parsed, list, 3)) != -1) {
+      fprintf(stderr, "Incorrect tape lookups\n");
+      retcode = EXIT_FAILURE;
+   }
+
+   for (ii = 0; ii < (int)(sizeof(invalid) / sizeof(invalid[0])); ++ii) {
+      cJSON_Tape *tape = cJSON_TapeParse(invalid[ii], strlen(invalid[ii]));
+      if (tape != NULL) {
+         fprintf(stderr, "Parsed the invalid document %s\n", invalid[ii]);
+         cJSON_DeleteTape(tape);
+         retcode = EXIT_FAILURE;
+      }
+   }
+
+   cJSON_DeleteTape(parsed);
+   cJSON_DeleteTape(converted);
+   cJSON_Delete(root);
+   return retcode;
+}
+
+int main(void) {
+   if (test_print() != EXIT_SUCCESS || test_print_to_buffer() != EXIT_SUCCESS ||
+       test_arena() != EXIT_SUCCESS ||
+       test_parse_with_length() != EXIT_SUCCESS ||
+       test_parse_in_situ() != EXIT_SUCCESS ||
+       test_index() != EXIT_SUCCESS || test_numbers() != EXIT_SUCCESS ||
+       test_sax() != EXIT_SUCCESS || test_paths() != EXIT_SUCCESS ||
+       test_binary() != EXIT_SUCCESS || test_nesting() != EXIT_SUCCESS ||
+       test_allocator() != EXIT_SUCCESS ||
+       test_tape() != EXIT_SUCCESS) {
+      return EXIT_FAILURE;
+   }
+   return EXIT_SUCCESS;
+}
@@ -0,0 +1,124 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2016 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config.h"
+
+#include <platform/cbassert.h>
+#include <platform/counter.h>
+
+#include <cJSON.h>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+static const int nthreads = 8;
+static const int iterations = 100000;
+
+static void test_single_thread(void) {
+    cb_counter_t *counter = cb_counter_create(NULL);
+    cb_assert(counter != NULL);
+    cb_assert(cb_counter_get_name(counter) == NULL);
+    cb_assert(cb_counter_get(counter) == 0);
+    cb_counter_increment(counter);
+    cb_counter_add(counter, 41);
+    cb_assert(cb_counter_get(counter) == 42);
+    cb_counter_add(counter, uint64_t(-2));
+    cb_assert(cb_counter_get(counter) == 40);
+    cb_assert(cb_counter_reset(counter) == 40);
+    cb_assert(cb_counter_get(counter) == 0);
+    cb_counter_destroy(counter);
+}
+
+static void test_threads(void) {
+    cb_counter_t *counter = cb_counter_create(NULL);
+    cb_assert(counter != NULL);
+
+    /* Reset while the others are counting, nothing may get lost */
+    std::atomic<bool> done(false);
+    uint64_t collected = 0;
+    std::thread collector([&counter, &done, &collected]() {
+        while (!done.load()) {
+            collected += cb_counter_reset(counter);
+        }
+    });
+
+    std::vector<std::thread> threads;
+    for (int ii = 0; ii < nthreads; ++ii) {
+        threads.emplace_back([counter]() {
+            for (int jj = 0; jj < iterations; ++jj) {
+                cb_counter_increment(counter);
+            }
+        });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    done.store(true);
+    collector.join();
+
+    collected += cb_counter_get(counter);
+    cb_assert(collected == uint64_t(nthreads) * iterations);
+    cb_counter_destroy(counter);
+}
+
+static void test_registry(void) {
+    cb_counter_t *hits = cb_counter_create("get_hits");
+    cb_counter_t *misses = cb_counter_create("get_misses");
+    cb_assert(hits != NULL && misses != NULL);
+    cb_assert(cb_counter_create("get_hits") == NULL);
+    cb_assert(cb_counter_find("get_hits") == hits);
+    cb_assert(cb_counter_find("nothing") == NULL);
+    cb_assert(strcmp(cb_counter_get_name(misses), "get_misses") == 0);
+
+    cb_counter_add(hits, 1032);
+    cb_counter_add(misses, 7);
+
+    cJSON *json = cb_counter_stats_to_json();
+    char *text = cJSON_PrintUnformatted(json);
+    cb_assert(strcmp(text, "{\"get_hits\":1032,\"get_misses\":7}") == 0);
+    cJSON_Free(text);
+    cJSON_Delete(json);
+
+    /* A counter which wrapped doesn't turn negative */
+    cb_counter_add(misses, uint64_t(0) - 8);
+    json = cb_counter_stats_to_json();
+    cb_assert(cJSON_GetObjectItem(json, "get_misses")->valueint64 == INT64_MAX);
+    cJSON_Delete(json);
+    cb_counter_add(misses, 8);
+
+    cb_counter_destroy(hits);
+    cb_assert(cb_counter_find("get_hits") == NULL);
+    json = cb_counter_stats_to_json();
+    cb_assert(cJSON_GetObjectItem(json, "get_hits") == NULL);
+    cb_assert(cJSON_GetObjectItem(json, "get_misses") != NULL);
+    cJSON_Delete(json);
+
+    /* The name can be used again once it is gone */
+    hits = cb_counter_create("get_hits");
+    cb_assert(hits != NULL);
+    cb_assert(cb_counter_get(hits) == 0);
+    cb_counter_destroy(hits);
+    cb_counter_destroy(misses);
+}
+
+int main(void) {
+    test_single_thread();
+    test_threads();
+    test_registry();
+    return EXIT_SUCCESS;
+}
@@ -1,7 +1,11 @@
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <iostream>
 #include <platform/dirutils.h>
 #include <cstdlib>
 #include <list>
+#include <mutex>
 #include <string>
 #include <cerrno>
 #include <cstring>
@@ -22,6 +26,8 @@ static bool CreateDirectory(const std::string &dir) {
 #define PATH_SEPARATOR "\\"
 
 #else
+#include <unistd.h>
+
 static bool CreateDirectory(const std::string &dir) {
    if (mkdir(dir.c_str(), S_IXUSR | S_IWUSR | S_IRUSR) != 0) {
       return false;
@@ -161,6 +167,53 @@ static void testFindFilesContaining(void) {
    contains("fs" PATH_SEPARATOR "2d", vec);
 }
 
+static void testDirectoryIterator(void) {
+   using namespace CouchbaseDirectoryUtilities;
+
+   FILE *fp = fopen("fs" PATH_SEPARATOR "data", "w");
+   fwrite("0123456789", 1, 10, fp);
+   fclose(fp);
+
+   DirectoryIterator iter;
+   expect(false, iter.next());
+   expect(false, iter.open("/it/would/suck/if/this/exists"));
+   expect(true, iter.open("fs"));
+
+   std::vector<std::string> dirs;
+   int files = 0;
+   while (iter.next()) {
+      std::string name(iter.getName(), iter.getNameLength());
+      if (iter.getType() == DirectoryIterator::Type::Directory) {
+         dirs.push_back("fs" PATH_SEPARATOR + name);
+      } else {
+         expect("data", name);
+         expect(true, iter.getType() == DirectoryIterator::Type::File);
+         uint64_t size = 0;
+         expect(true, iter.getSize(size));
+         expect(true, size == 10);
+         ++files;
+      }
+   }
+   expect(false, iter.next());
+   expect(true, files == 1);
+   expect(vfs.size() - 1, dirs);
+   contains("fs" PATH_SEPARATOR "d1", dirs);
+   contains("fs" PATH_SEPARATOR "2d", dirs);
+
+   // Stop early
+   int count = 0;
+   expect(true, forEachEntry("fs", [&count](const DirectoryIterator &) {
+      return ++count < 3;
+   }));
+   expect(true, count == 3);
+   expect(false, forEachEntry("/it/would/suck/if/this/exists",
+                              [](const DirectoryIterator &) {
+      return true;
+   }));
+
+   remove("fs" PATH_SEPARATOR "data");
+}
+
 static void testRemove(void) {
    fclose(fopen("test-file", "w"));
    if (!CouchbaseDirectoryUtilities::rmrf("test-file")) {
@@ -175,6 +228,78 @@ static void testRemove(void) {
    }
 }
 
+static void createTree(const std::string &root, int depth) {
+   if (!CreateDirectory(root)) {
+      std::cerr << "Fatal: failed to create " << root << std::endl;
+      exit(EXIT_FAILURE);
+   }
+   for (int ii = 0; ii < 20; ++ii) {
+      std::string name = root + PATH_SEPARATOR "file" + std::to_string(ii);
+      fclose(fopen(name.c_str(), "w"));
+   }
+   if (depth > 0) {
+      for (int ii = 0; ii < 4; ++ii) {
+         createTree(root + PATH_SEPARATOR "dir" + std::to_string(ii),
+                    depth - 1);
+      }
+   }
+}
+
+static void testParallelRemove(void) {
+   using namespace CouchbaseDirectoryUtilities;
+
+   // 1 + 4 + 16 + 64 directories with 20 files each
+   createTree("prmrf", 3);
+#ifndef WIN32
+   // Links are removed, not followed
+   createTree("prmrf-target", 0);
+   if (symlink("../prmrf-target", "prmrf/dir0/link") != 0) {
+      std::cerr << "Failed to create symbolic link" << std::endl;
+      exit_value = EXIT_FAILURE;
+   }
+#endif
+
+   std::atomic<int> callbacks(0);
+   std::atomic<bool> result(false);
+   {
+      TreeRemover remover("prmrf", 4);
+      remover.start([&callbacks, &result](bool success) {
+         result = success;
+         ++callbacks;
+      });
+      expect(true, remover.wait());
+      expect(true, remover.isDone());
+      expect(true, remover.getDirectoriesRemoved() == 85);
+      expect(true, remover.getFailures() == 0);
+#ifdef WIN32
+      expect(true, remover.getFilesRemoved() == 85 * 20);
+#else
+      expect(true, remover.getFilesRemoved() == 85 * 20 + 1);
+#endif
+   }
+   expect(true, callbacks.load() == 1);
+   expect(true, result.load());
+   expect(false, exists("prmrf"));
+
+#ifndef WIN32
+   expect(true, isDirectory("prmrf-target"));
+   expect(true, exists("prmrf-target" PATH_SEPARATOR "file0"));
+   expect(true, rmrf("prmrf-target", 2));
+   expect(false, exists("prmrf-target"));
+#endif
+
+   // A single file, and something which doesn't exist
+   fclose(fopen("prmrf-file", "w"));
+   expect(true, rmrf("prmrf-file", 2));
+   expect(false, exists("prmrf-file"));
+   expect(false, rmrf("prmrf-file", 2));
+
+   // Nothing happens until it is started
+   TreeRemover idle("prmrf", 1);
+   expect(false, idle.isDone());
+   expect(false, idle.wait());
+}
+
 static void testIsDirectory(void) {
     using namespace CouchbaseDirectoryUtilities;
 #ifdef WIN32
@@ -209,6 +334,159 @@ static void testMkdirp(void) {
     rmrf("foo");
 }
 
+static std::string readFile(const std::string &name) {
+   std::string content;
+   FILE *fp = fopen(name.c_str(), "rb");
+   if (fp != NULL) {
+      char buffer[8192];
+      size_t nr;
+      while ((nr = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
+         content.append(buffer, nr);
+      }
+      fclose(fp);
+   }
+   return content;
+}
+
+static void testCopyFile(void) {
+   using namespace CouchbaseDirectoryUtilities;
+
+   // Larger than the buffer used by the read/write fallback
+   std::string content;
+   for (int ii = 0; content.size() < 3 * 1024 * 1024; ++ii) {
+      content.append(std::to_string(ii));
+   }
+   FILE *fp = fopen("copy-source", "wb");
+   fwrite(content.data(), 1, content.size(), fp);
+   fclose(fp);
+
+   expect(true, copyFile("copy-source", "copy-destination"));
+   expect(true, readFile("copy-destination") == content);
+
+   // An existing file is replaced (and truncated)
+   content.resize(1000);
+   fp = fopen("copy-source", "wb");
+   fwrite(content.data(), 1, content.size(), fp);
+   fclose(fp);
+   expect(true, copyFile("copy-source", "copy-destination"));
+   expect(true, readFile("copy-destination") == content);
+
+   // Empty files are copied too
+   fclose(fopen("copy-source", "wb"));
+   expect(true, copyFile("copy-source", "copy-destination"));
+   expect(true, exists("copy-destination"));
+   expect(true, readFile("copy-destination").empty());
+
+#ifndef WIN32
+   // Copying a file onto itself must not destroy it
+   fp = fopen("copy-source", "wb");
+   fwrite(content.data(), 1, content.size(), fp);
+   fclose(fp);
+   expect(false, copyFile("copy-source", "copy-source"));
+   expect(true, readFile("copy-source") == content);
+#endif
+
+   expect(false, copyFile("copy-does-not-exist", "copy-destination"));
+   remove("copy-source");
+   remove("copy-destination");
+}
+
+static void testPreallocate(void) {
+   using namespace CouchbaseDirectoryUtilities;
+   struct stat st;
+
+   remove("preallocated");
+   expect(true, preallocate("preallocated", 1024 * 1024));
+   expect(true, stat("preallocated", &st) == 0 && st.st_size == 1024 * 1024);
+   expect(true, readFile("preallocated") == std::string(1024 * 1024, '\0'));
+
+   // It never shrinks, and keeps the content
+   FILE *fp = fopen("preallocated", "r+b");
+   fwrite("hello", 1, 5, fp);
+   fclose(fp);
+   expect(true, preallocate("preallocated", 4096));
+   expect(true, stat("preallocated", &st) == 0 && st.st_size == 1024 * 1024);
+   expect(true, preallocate("preallocated", 2 * 1024 * 1024));
+   expect(true, stat("preallocated", &st) == 0 &&
+                st.st_size == 2 * 1024 * 1024);
+   expect(true, readFile("preallocated").compare(0, 5, "hello") == 0);
+
+   expect(false, preallocate("/it/would/suck/if/this/exists", 4096));
+   remove("preallocated");
+}
+
+typedef CouchbaseDirectoryUtilities::DirectoryWatcher::Event WatchEvent;
+
+static std::mutex watchMutex;
+static std::condition_variable watchCond;
+static std::vector<std::pair<WatchEvent, std::string> > watchEvents;
+
+// Wait for an event of one of the given types for the entry
+static bool waitForEvent(WatchEvent a, WatchEvent b, const std::string &name) {
+   std::unique_lock<std::mutex> lock(watchMutex);
+   auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+   for (;;) {
+      for (auto ii = watchEvents.begin(); ii != watchEvents.end(); ++ii) {
+         if ((ii->first == a || ii->first == b) && ii->second == name) {
+            watchEvents.erase(ii);
+            return true;
+         }
+      }
+      if (watchCond.wait_until(lock, deadline) == std::cv_status::timeout) {
+         std::cerr << "Timed out waiting for an event for " << name
+                   << std::endl;
+         return false;
+      }
+   }
+}
+
+static void testDirectoryWatcher(void) {
+   using namespace CouchbaseDirectoryUtilities;
+
+   DirectoryWatcher missing("/it/would/suck/if/this/exists", "",
+                            [](WatchEvent, const std::string &) {});
+   expect(false, missing.start());
+
+   rmrf("watch");
+   expect(true, mkdirp("watch"));
+   fclose(fopen("watch" PATH_SEPARATOR "log.0", "w"));
+
+   DirectoryWatcher watcher("watch", "log.",
+                            [](WatchEvent event, const std::string &name) {
+      std::lock_guard<std::mutex> guard(watchMutex);
+      watchEvents.push_back(std::make_pair(event, name));
+      watchCond.notify_all();
+   });
+   expect(true, watcher.start());
+   expect(false, watcher.start());
+
+   fclose(fopen("watch" PATH_SEPARATOR "data.1", "w"));
+   fclose(fopen("watch" PATH_SEPARATOR "log.1", "w"));
+   expect(true, waitForEvent(WatchEvent::Created, WatchEvent::Created,
+                             "log.1"));
+
+   expect(true, rename("watch" PATH_SEPARATOR "log.1",
+                       "watch" PATH_SEPARATOR "log.2") == 0);
+   expect(true, waitForEvent(WatchEvent::RenamedTo, WatchEvent::Created,
+                             "log.2"));
+
+   expect(true, remove("watch" PATH_SEPARATOR "log.2") == 0);
+   expect(true, waitForEvent(WatchEvent::Deleted, WatchEvent::Deleted,
+                             "log.2"));
+   watcher.stop();
+
+   // Files which existed already and other prefixes aren't reported
+   std::lock_guard<std::mutex> guard(watchMutex);
+   for (const auto &event : watchEvents) {
+      if (event.second != "log.1") {
+         std::cerr << "Unexpected event for " << event.second << std::endl;
+         exit_value = EXIT_FAILURE;
+      }
+   }
+   watchEvents.clear();
+   rmrf("watch");
+}
+
 int main(int argc, char **argv)
 {
    testDirname();
@@ -240,10 +518,15 @@ int main(int argc, char **argv)
 
    testFindFilesWithPrefix();
    testFindFilesContaining();
+   testDirectoryIterator();
    testRemove();
+   testParallelRemove();
 
    testIsDirectory();
    testMkdirp();
+   testCopyFile();
+   testPreallocate();
+   testDirectoryWatcher();
 
    return exit_value;
 }
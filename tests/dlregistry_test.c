@@ -0,0 +1,137 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <cJSON.h>
+#include <platform/cbassert.h>
+#include <platform/platform.h>
+
+struct cjson_functions {
+    cJSON *(*parse)(const char *value);
+    cJSON *(*get_item)(cJSON *object, const char *string);
+    void (*delete_item)(cJSON *c);
+    void *missing;
+};
+
+static const cb_dlsymbol_t cjson_symbols[] = {
+    { "cJSON_Parse", offsetof(struct cjson_functions, parse), 0 },
+    { "cJSON_GetObjectItem", offsetof(struct cjson_functions, get_item), 0 },
+    { "cJSON_Delete", offsetof(struct cjson_functions, delete_item), 0 },
+    { "cJSON_NoSuchFunction", offsetof(struct cjson_functions, missing), 1 }
+};
+
+/* The same file by another name: dir/./file */
+static char *alias_of(const char *path) {
+    const char *slash = strrchr(path, '/');
+    char *ret = malloc(strlen(path) + 3);
+    cb_assert(ret != NULL);
+    if (slash == NULL) {
+        sprintf(ret, "./%s", path);
+    } else {
+        size_t dir = (size_t)(slash - path);
+        memcpy(ret, path, dir);
+        sprintf(ret + dir, "/.%s", slash);
+    }
+    return ret;
+}
+
+static void test_refcount(const char *path) {
+    char *errmsg = NULL;
+    char *alias = alias_of(path);
+    cb_dlhandle_t first = cb_dlregistry_open(path, &errmsg);
+    cb_dlhandle_t second;
+    cb_dlhandle_t third;
+    cb_assert(first != NULL);
+
+    second = cb_dlregistry_open(path, &errmsg);
+    third = cb_dlregistry_open(alias, &errmsg);
+    cb_assert(second == first);
+    cb_assert(third == first);
+
+    cb_dlregistry_close(first);
+    cb_dlregistry_close(second);
+    /* Still open, and still known to the registry */
+    cb_assert(cb_dlregistry_sym(third, "cJSON_Parse", NULL) != NULL);
+    cb_assert(cb_dlregistry_bind(third, cjson_symbols, 1,
+                                 &(struct cjson_functions){0}, NULL) == 0);
+    cb_dlregistry_close(third);
+    free(alias);
+
+    cb_assert(cb_dlregistry_open("/no/such/library", &errmsg) == NULL);
+    cb_assert(errmsg != NULL);
+    free(errmsg);
+}
+
+static void test_symbols(const char *path) {
+    char *errmsg = NULL;
+    cb_dlhandle_t handle = cb_dlregistry_open(path, &errmsg);
+    void *address;
+    cb_assert(handle != NULL);
+
+    address = cb_dlregistry_sym(handle, "cJSON_Parse", NULL);
+    cb_assert(address != NULL);
+    cb_assert(cb_dlregistry_sym(handle, "cJSON_Parse", NULL) == address);
+
+    /* Failures are cached, but still reported every time */
+    cb_assert(cb_dlregistry_sym(handle, "cJSON_NoSuchFunction",
+                                &errmsg) == NULL);
+    cb_assert(errmsg != NULL);
+    free(errmsg);
+    errmsg = NULL;
+    cb_assert(cb_dlregistry_sym(handle, "cJSON_NoSuchFunction",
+                                &errmsg) == NULL);
+    cb_assert(errmsg != NULL);
+    free(errmsg);
+    errmsg = NULL;
+
+    cb_dlregistry_close(handle);
+}
+
+static void test_bind(const char *path) {
+    struct cjson_functions functions;
+    cb_dlsymbol_t required[2];
+    char *errmsg = NULL;
+    cb_dlhandle_t handle = cb_dlregistry_open(path, &errmsg);
+    cJSON *json;
+    cb_assert(handle != NULL);
+
+    memset(&functions, 0xff, sizeof(functions));
+    cb_assert(cb_dlregistry_bind(handle, cjson_symbols,
+                                 sizeof(cjson_symbols) /
+                                     sizeof(cjson_symbols[0]),
+                                 &functions, &errmsg) == 0);
+    cb_assert(errmsg == NULL);
+    cb_assert(functions.missing == NULL);
+
+    json = functions.parse("{\"answer\":42}");
+    cb_assert(json != NULL);
+    cb_assert(functions.get_item(json, "answer")->valueint == 42);
+    functions.delete_item(json);
+
+    /* A required symbol which is missing fails the bind, but the rest
+     * are still resolved */
+    required[0] = cjson_symbols[3];
+    required[0].optional = 0;
+    required[1] = cjson_symbols[0];
+    functions.parse = NULL;
+    cb_assert(cb_dlregistry_bind(handle, required, 2, &functions,
+                                 &errmsg) == -1);
+    cb_assert(errmsg != NULL);
+    free(errmsg);
+    cb_assert(functions.parse != NULL);
+
+    cb_dlregistry_close(handle);
+}
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s <path to the cJSON library>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    test_refcount(argv[1]);
+    test_symbols(argv[1]);
+    test_bind(argv[1]);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,123 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2016 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config.h"
+
+#include <platform/cbassert.h>
+#include <platform/epoch.h>
+#include <platform/platform.h>
+
+#include <atomic>
+#include <cstdlib>
+#include <vector>
+
+using namespace Couchbase;
+
+static const int nreaders = 4;
+static const int nversions = 2000;
+static const uint64_t alive = 0x600d600d600d600dULL;
+
+struct Config {
+    uint64_t magic;
+    int version;
+};
+
+static std::atomic<Config *> config;
+static std::atomic<int> released;
+static std::atomic<bool> done;
+
+static void release_config(void *ptr) {
+    Config *old = static_cast<Config *>(ptr);
+    /* A reader still using it would notice */
+    old->magic = 0;
+    delete old;
+    ++released;
+}
+
+static void reader(void *) {
+    int last = 0;
+    while (!done.load()) {
+        EpochGuard guard;
+        Config *current = config.load(std::memory_order_acquire);
+        cb_assert(current->magic == alive);
+        /* Versions are only ever published in order */
+        cb_assert(current->version >= last);
+        last = current->version;
+        cb_assert(current->magic == alive);
+    }
+}
+
+static Config *publish(int version) {
+    Config *next = new Config;
+    next->magic = alive;
+    next->version = version;
+    return config.exchange(next, std::memory_order_acq_rel);
+}
+
+static void test_readers_and_writer(void) {
+    released = 0;
+    done = false;
+    publish(0);
+
+    std::vector<cb_thread_t> threads(nreaders);
+    for (auto &tid : threads) {
+        cb_assert(cb_create_thread(&tid, reader, NULL, 0) == 0);
+    }
+
+    for (int ii = 1; ii <= nversions; ++ii) {
+        cb_epoch_retire(publish(ii), release_config);
+        if (ii % 100 == 0) {
+            cb_epoch_synchronize();
+            /* Everything retired before the call is gone */
+            cb_assert(released == ii);
+        }
+    }
+
+    done = true;
+    for (auto &tid : threads) {
+        cb_assert(cb_join_thread(tid) == 0);
+    }
+
+    cb_epoch_retire(config.exchange(nullptr), release_config);
+    /* The readers are unregistered, so this doesn't wait for them */
+    cb_epoch_synchronize();
+    cb_assert(released == nversions + 1);
+}
+
+static void test_nesting(void) {
+    released = 0;
+    cb_epoch_enter();
+    cb_epoch_enter();
+    cb_epoch_exit();
+    Config *old = new Config;
+    old->magic = alive;
+    cb_epoch_retire(old, release_config);
+    cb_epoch_exit();
+
+    cb_epoch_synchronize();
+    cb_assert(released == 1);
+
+    /* Registered again on the next use */
+    cb_epoch_unregister_thread();
+    cb_epoch_unregister_thread();
+    EpochGuard guard;
+}
+
+int main(void) {
+    test_readers_and_writer();
+    test_nesting();
+    return EXIT_SUCCESS;
+}
@@ -1,12 +1,41 @@
 #include <stdio.h>
 #include <stdlib.h>
+#ifndef WIN32
+#include <unistd.h>
+#endif
 
 #include <platform/platform.h>
 
+/* Compare an interval measured with gethrtime with gettimeofday */
+static int check_interval(unsigned int usec)
+{
+    struct timeval tv0, tv1;
+    hrtime_t start, end;
+    uint64_t wall, hr;
+
+    gettimeofday(&tv0, NULL);
+    start = gethrtime();
+    usleep(usec);
+    end = gethrtime();
+    gettimeofday(&tv1, NULL);
+
+    wall = (uint64_t)(tv1.tv_sec - tv0.tv_sec) * 1000000 +
+        tv1.tv_usec - tv0.tv_usec;
+    hr = (end - start) / 1000;
+    if (hr < usec || hr > wall + wall / 10 + 1000) {
+        fprintf(stderr, "gethrtime measured %luus for a %uus sleep "
+                "(gettimeofday measured %luus)\n", (unsigned long)hr,
+                usec, (unsigned long)wall);
+        return -1;
+    }
+    return 0;
+}
+
 int main(int argc, char **argv)
 {
     hrtime_t start = gethrtime();
     hrtime_t end;
+    hrtime_t prev = start;
     int ii = 0;
     int max = 2000000;
 
@@ -17,12 +46,44 @@ int main(int argc, char **argv)
         }
     }
 
+    if (gethrtime_period() == 0) {
+        fprintf(stderr, "gethrtime_period returned 0\n");
+        return 1;
+    }
+
+    /* The first interval spans the calibration of the fast clock */
+    if (check_interval(20000) != 0 || check_interval(50000) != 0) {
+        return 1;
+    }
+
+    start = gethrtime();
+    prev = start;
     for (ii = 0; ii < max; ++ii) {
-        gethrtime();
+        hrtime_t now = gethrtime();
+        if (now < prev) {
+            fprintf(stderr, "gethrtime went backwards: %lu -> %lu\n",
+                    (unsigned long)prev, (unsigned long)now);
+            return 1;
+        }
+        prev = now;
     }
 
     end = gethrtime();
     fprintf(stdout, "Running %u iteratons gave an average of %luns\n",
             max, (unsigned long)((end - start) / max));
+    fprintf(stdout, "gethrtime_period: %luns\n",
+            (unsigned long)gethrtime_period());
+
+    /* Keep reading across the second calibration (about a second after
+     * the start) */
+    while (gethrtime() - start < 1200000000) {
+        hrtime_t now = gethrtime();
+        if (now < prev) {
+            fprintf(stderr, "gethrtime went backwards: %lu -> %lu\n",
+                    (unsigned long)prev, (unsigned long)now);
+            return 1;
+        }
+        prev = now;
+    }
     return 0;
 }
@@ -4,8 +4,66 @@
 #include <time.h>
 #else
 #include <sys/time.h>
+#include <unistd.h>
 #endif
 
+static int test_clock_ticker(void)
+{
+    struct timeval before, cached;
+    uint64_t start_ms, ms;
+
+    if (cb_start_clock_ticker(1) != 0) {
+        std::cerr << "cb_start_clock_ticker failed" << std::endl;
+        return 1;
+    }
+    if (cb_start_clock_ticker(1) != -1) {
+        std::cerr << "cb_start_clock_ticker started a second ticker"
+                  << std::endl;
+        return 1;
+    }
+
+    gettimeofday(&before, NULL);
+    start_ms = cb_get_monotonic_milliseconds();
+    do {
+        usleep(1000);
+        ms = cb_get_monotonic_milliseconds();
+    } while (ms - start_ms < 50 && ms >= start_ms);
+
+    if (ms < start_ms) {
+        std::cerr << "cb_get_monotonic_milliseconds went backwards"
+                  << std::endl;
+        return 1;
+    }
+    if (cb_get_monotonic_seconds() != cb_get_monotonic_milliseconds() / 1000 &&
+        cb_get_monotonic_seconds() + 1 != cb_get_monotonic_milliseconds() / 1000) {
+        std::cerr << "cb_get_monotonic_seconds doesn't match the ms clock"
+                  << std::endl;
+        return 1;
+    }
+
+    cb_get_timeofday(&cached);
+    if (cached.tv_sec < before.tv_sec ||
+        cached.tv_sec > before.tv_sec + 10) {
+        std::cerr << "cb_get_timeofday returned " << cached.tv_sec
+                  << " with the ticker running, expected ~"
+                  << before.tv_sec << std::endl;
+        return 1;
+    }
+
+    cb_set_timeofday_offset(3600);
+    cb_get_timeofday(&cached);
+    cb_set_timeofday_offset(0);
+    if (cached.tv_sec < before.tv_sec + 3600) {
+        std::cerr << "cb_set_timeofday_offset ignored by the ticker"
+                  << std::endl;
+        return 1;
+    }
+
+    cb_stop_clock_ticker();
+    cb_stop_clock_ticker();
+    return 0;
+}
+
 int main(void)
 {
     struct timeval tv;
@@ -30,5 +88,5 @@ int main(void)
             return 1;
         }
 
-   return 0;
+   return test_clock_ticker();
 }
@@ -0,0 +1,158 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <cJSON.h>
+#include <platform/cbassert.h>
+#include <platform/histogram.h>
+#include <platform/platform.h>
+
+/* Within the ~3% resolution of the histogram */
+static int close_to(uint64_t value, uint64_t expected) {
+    uint64_t delta = value > expected ? value - expected : expected - value;
+    return delta <= expected / 32 + 1;
+}
+
+static void test_empty(void) {
+    cb_histogram_t h;
+    cb_histogram_initialize(&h);
+    cb_assert(cb_histogram_count(&h) == 0);
+    cb_assert(cb_histogram_min(&h) == 0);
+    cb_assert(cb_histogram_max(&h) == 0);
+    cb_assert(cb_histogram_mean(&h) == 0);
+    cb_assert(cb_histogram_percentile(&h, 50.0) == 0);
+}
+
+static void test_small_values_are_exact(void) {
+    cb_histogram_t h;
+    uint64_t ii;
+    cb_histogram_initialize(&h);
+    for (ii = 1; ii <= 50; ++ii) {
+        cb_histogram_record(&h, ii);
+    }
+    cb_assert(cb_histogram_count(&h) == 50);
+    cb_assert(cb_histogram_min(&h) == 1);
+    cb_assert(cb_histogram_max(&h) == 50);
+    cb_assert(cb_histogram_percentile(&h, 50.0) == 25);
+    cb_assert(cb_histogram_percentile(&h, 100.0) == 50);
+    cb_assert(cb_histogram_percentile(&h, 0.0) == 1);
+    cb_assert(cb_histogram_mean(&h) == 25.5);
+}
+
+static void test_percentiles(void) {
+    cb_histogram_t h;
+    uint64_t ii;
+    cb_histogram_initialize(&h);
+    /* 1us .. 1ms */
+    for (ii = 1; ii <= 1000; ++ii) {
+        cb_histogram_record(&h, ii * 1000);
+    }
+    cb_assert(close_to(cb_histogram_percentile(&h, 50.0), 500000));
+    cb_assert(close_to(cb_histogram_percentile(&h, 99.0), 990000));
+    cb_assert(close_to(cb_histogram_percentile(&h, 99.9), 999000));
+    cb_assert(cb_histogram_percentile(&h, 100.0) == 1000000);
+
+    /* A long tail */
+    cb_histogram_record_n(&h, 3600ULL * 1000000000ULL, 10);
+    cb_assert(cb_histogram_count(&h) == 1010);
+    cb_assert(close_to(cb_histogram_percentile(&h, 50.0), 505000));
+    cb_assert(cb_histogram_percentile(&h, 99.9) == 3600ULL * 1000000000ULL);
+
+    /* The extreme values have a bucket too */
+    cb_histogram_record(&h, UINT64_MAX);
+    cb_assert(cb_histogram_max(&h) == UINT64_MAX);
+    cb_assert(cb_histogram_percentile(&h, 100.0) == UINT64_MAX);
+}
+
+#define NTHREADS 4
+#define NVALUES 100000
+
+static cb_histogram_t shared;
+static cb_histogram_t local[NTHREADS];
+
+static void recorder(void *arg) {
+    cb_histogram_t *mine = arg;
+    uint64_t ii;
+    for (ii = 0; ii < NVALUES; ++ii) {
+        cb_histogram_record(mine, ii);
+        cb_histogram_record(&shared, ii);
+    }
+}
+
+static void test_threads(void) {
+    cb_thread_t tids[NTHREADS];
+    cb_histogram_t merged;
+    int ii;
+
+    cb_histogram_initialize(&shared);
+    for (ii = 0; ii < NTHREADS; ++ii) {
+        cb_histogram_initialize(&local[ii]);
+        cb_assert(cb_create_thread(&tids[ii], recorder, &local[ii], 0) == 0);
+    }
+    for (ii = 0; ii < NTHREADS; ++ii) {
+        cb_assert(cb_join_thread(tids[ii]) == 0);
+    }
+
+    cb_histogram_initialize(&merged);
+    for (ii = 0; ii < NTHREADS; ++ii) {
+        cb_histogram_merge(&merged, &local[ii]);
+    }
+
+    cb_assert(cb_histogram_count(&shared) == NTHREADS * NVALUES);
+    cb_assert(cb_histogram_count(&merged) == NTHREADS * NVALUES);
+    cb_assert(cb_histogram_min(&merged) == 0);
+    cb_assert(cb_histogram_max(&merged) == NVALUES - 1);
+    cb_assert(cb_histogram_mean(&merged) == cb_histogram_mean(&shared));
+    cb_assert(cb_histogram_percentile(&merged, 99.0) ==
+              cb_histogram_percentile(&shared, 99.0));
+    cb_assert(close_to(cb_histogram_percentile(&merged, 50.0), NVALUES / 2));
+}
+
+static void test_json(void) {
+    cb_histogram_t h;
+    cJSON *json;
+    cJSON *buckets;
+    char *text;
+
+    cb_histogram_initialize(&h);
+    cb_histogram_record_n(&h, 10, 3);
+    cb_histogram_record(&h, 1000);
+
+    json = cb_histogram_to_json(&h);
+    cb_assert(json != NULL);
+    cb_assert(cJSON_GetObjectItem(json, "count")->valueint == 4);
+    cb_assert(cJSON_GetObjectItem(json, "min")->valueint == 10);
+    cb_assert(cJSON_GetObjectItem(json, "max")->valueint == 1000);
+    cb_assert(cJSON_GetObjectItem(json, "p50")->valueint == 10);
+    cb_assert(cJSON_GetObjectItem(json, "p99.9")->valueint == 1000);
+    buckets = cJSON_GetObjectItem(json, "buckets");
+    cb_assert(buckets != NULL && cJSON_GetArraySize(buckets) == 2);
+    cb_assert(cJSON_GetArrayItem(cJSON_GetArrayItem(buckets, 0), 1)->valueint
+              == 3);
+
+    text = cJSON_PrintUnformatted(json);
+    cb_assert(text != NULL);
+    printf("%s\n", text);
+    cJSON_Free(text);
+    cJSON_Delete(json);
+
+    /* The last bucket's upper bound doesn't wrap around to -1 */
+    cb_histogram_record(&h, UINT64_MAX);
+    json = cb_histogram_to_json(&h);
+    cb_assert(cJSON_GetObjectItem(json, "max")->valueint64 == INT64_MAX);
+    buckets = cJSON_GetObjectItem(json, "buckets");
+    cb_assert(cJSON_GetArraySize(buckets) == 3);
+    cb_assert(cJSON_GetArrayItem(cJSON_GetArrayItem(buckets, 2), 0)->valueint64
+              == INT64_MAX);
+    cJSON_Delete(json);
+}
+
+int main(void) {
+    test_empty();
+    test_small_values_are_exact();
+    test_percentiles();
+    test_threads();
+    test_json();
+    return 0;
+}
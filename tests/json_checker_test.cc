@@ -17,12 +17,160 @@
 
 #include "config.h"
 #include <iostream>
+#include <string>
+#include <algorithm>
+#include <random>
 #include "JSON_checker.h"
+#include <platform/threadpool.h>
 
 #define check(expr, msg) {if(!(expr)) \
     { std::cerr << "JSON test failed: " << msg << std::endl; exit(1); }}
 #define CHECK_JSON(X) checkUTF8JSON((const unsigned char *)X, sizeof(X) - 1)
 
+static bool check_string(const std::string &json) {
+    return checkUTF8JSON((const unsigned char *)json.data(), json.size());
+}
+
+/* Put the special bytes at every offset of strings and whitespace runs
+   longer than the blocks the checker skips at a time */
+static void check_block_boundaries(void) {
+    for (size_t len = 0; len < 80; ++len) {
+        for (size_t pos = 0; pos < len; ++pos) {
+            std::string plain(len, 'x');
+            std::string str;
+
+            str = plain;
+            str[pos] = '"';
+            check(!check_string("\"" + str + "\""), "quote inside string is not OK");
+            str = plain;
+            str.replace(pos, 1, "\\n");
+            check(check_string("\"" + str + "\""), "escape inside string is OK");
+            str = plain;
+            str[pos] = '\n';
+            check(!check_string("\"" + str + "\""), "control inside string is not OK");
+            str = plain;
+            str.replace(pos, 1, "\xc3\xa6");
+            check(check_string("\"" + str + "\""), "UTF-8 inside string is OK");
+            str = plain;
+            str[pos] = '\xff';
+            check(!check_string("\"" + str + "\""), "bad UTF-8 inside string is not OK");
+
+            str = std::string(len, ' ');
+            str[pos] = '\t';
+            check(check_string("[" + str + "1" + str + "]"), "whitespace is OK");
+            str[pos] = 'x';
+            check(!check_string("[" + str + "1]"), "junk in whitespace is not OK");
+        }
+        check(check_string("\"" + std::string(len, 'x') + "\""), "plain string is OK");
+        check(!check_string("\"" + std::string(len, 'x')), "unterminated string is not OK");
+    }
+}
+
+static void check_validator(void) {
+    JSON_validator *validator = JSON_validator_create(3);
+    check(validator != NULL, "validator is created");
+    for (int ii = 0; ii < 3; ++ii) {
+        const std::string ok = "{\"a\": [[1, 2], {\"b\": \"c\"}]}";
+        const std::string bad = "{\"a\": [1, 2}";
+        const std::string deep = "[[[[1]]]]";
+        check(JSON_validator_check(validator, (const unsigned char *)ok.data(),
+                                   ok.size()), "validator accepts good json");
+        check(!JSON_validator_check(validator, (const unsigned char *)bad.data(),
+                                    bad.size()), "validator rejects bad json");
+        check(!JSON_validator_check(validator, (const unsigned char *)deep.data(),
+                                    deep.size()), "validator limits the depth");
+    }
+    JSON_validator_destroy(validator);
+
+    /* Without a limit the stack grows past its inline size */
+    validator = JSON_validator_create(0);
+    std::string deep = std::string(1000, '[') + std::string(1000, ']');
+    check(JSON_validator_check(validator, (const unsigned char *)deep.data(),
+                               deep.size()), "validator accepts deep json");
+    check(!JSON_validator_check(validator, (const unsigned char *)deep.data(),
+                                deep.size() - 1), "validator rejects deep bad json");
+    check(JSON_validator_check(validator, (const unsigned char *)"[1]", 3),
+          "validator is reset between documents");
+    JSON_validator_destroy(validator);
+    check(check_string(deep), "deep json is OK");
+}
+
+/* Every split of the document into chunks must give the same answer */
+static void check_chunked(const std::string &json) {
+    bool expected = check_string(json);
+    JSON_validator *validator = JSON_validator_create(0);
+    for (size_t chunk = 1; chunk <= json.size(); ++chunk) {
+        bool ok = true;
+        JSON_validator_begin(validator);
+        for (size_t offset = 0; offset < json.size(); offset += chunk) {
+            size_t len = std::min(chunk, json.size() - offset);
+            ok = JSON_validator_feed(validator,
+                                     (const unsigned char *)json.data() + offset,
+                                     len) && ok;
+        }
+        ok = JSON_validator_finish(validator) && ok;
+        check(ok == expected, "chunked validation of " << json);
+    }
+    JSON_validator_destroy(validator);
+}
+
+/* Every chunk size of the parallel checker must give the same answer */
+static void check_parallel(cb_threadpool_t *pool, const std::string &json) {
+    bool expected = check_string(json);
+    for (size_t chunk = 1; chunk <= json.size() + 1; ++chunk) {
+        bool ok = checkUTF8JSONParallel((const unsigned char *)json.data(),
+                                        json.size(), pool, chunk);
+        check(ok == expected, "parallel validation (" << chunk << ") of " << json);
+    }
+}
+
+static void check_parallel_documents(void) {
+    cb_threadpool_t *pool = cb_threadpool_create(4, "json");
+    check(pool != NULL, "thread pool is created");
+
+    const std::string docs[] = {
+        "{\"a\": [1, {\"b\": \"[{:\\\"}]\"}, [[]], {}], \"c\": {\"d\": null}}",
+        "[\"\\\\\", \"\\\\\\\"]\", {\"\\\\\\\\\": [\"x\\\\\"]}]",
+        "{\"k\xc3\xa6y\": [12, -3.5e2, \"\xe2\x82\xac\xf0\x9f\x98\x80\", true]}",
+        "[\"\\u005b\", \"\\u007B\", {\"x\":\"y\"}, [1e5, 0.25, -0]]",
+        "\"{[:]}\"", "12345", "[[[[[[[[[[]]]]]]]]]]",
+        /* Invalid ones */
+        "{\"a\": [1, 2}", "{\"a\": [1, 2]]", "[1, 2", "{\"a\": nul}",
+        "{\"a\" [1]}", "[1, 2]]]", "{\"a\": \"b\\\"}", "[\"\\q\"]",
+        "{\"a\": [\"\xe2\x82\"]}", "{\"a\": {\"b\": 1}, \"c\": [}", "[]]",
+        "{:1}", "[1 \\ \"]\"]", "{\"a\": 1, \"b\" [2]}", "\"a\" \"b\"",
+    };
+    for (const auto &doc : docs) {
+        check_parallel(pool, doc);
+    }
+
+    /* Damage a document in every way at random */
+    const std::string base = docs[0] + docs[1];
+    std::string doc = "[" + docs[0] + ", " + docs[1] + ", " + docs[2] + "]";
+    std::mt19937 gen(42);
+    const char bytes[] = "{}[]:,\"\\ 1a\xc3";
+    for (int ii = 0; ii < 200; ++ii) {
+        std::string damaged = doc;
+        damaged[gen() % damaged.size()] = bytes[gen() % (sizeof(bytes) - 1)];
+        check_parallel(pool, damaged);
+    }
+
+    /* A big document with the default chunks */
+    std::string big = "[";
+    for (int ii = 0; ii < 100000; ++ii) {
+        big += docs[ii % 4] + ",";
+    }
+    big += "null]";
+    check(checkUTF8JSONParallel((const unsigned char *)big.data(), big.size(),
+                                pool, 0), "big document is OK");
+    big[big.size() / 2 + 1] = ']';
+    check(checkUTF8JSONParallel((const unsigned char *)big.data(), big.size(),
+                                pool, 0) == check_string(big),
+          "damaged big document");
+
+    cb_threadpool_destroy(pool);
+}
+
 int main(void) {
     check(CHECK_JSON("{\"test\": 12}"), "simple json checks as OK");
     check(CHECK_JSON("{\"test\": [[[[[[[[[[[[[[[[[[[[[[12]]]]]]]]]]]]]]]]]]]]]]}"),
@@ -33,4 +181,13 @@ int main(void) {
     check(CHECK_JSON("null"), "bare values are OK");
     check(CHECK_JSON("99"), "bare numbers are OK");
     check(!CHECK_JSON("{\"test\xFF\": 12}"), "bad UTF-8 is not OK");
+    check_block_boundaries();
+    check_validator();
+    check_chunked("{\"k\xc3\xa6y\": [12, -3.5e2, \"\xe2\x82\xac\xf0\x9f\x98\x80\", true]}");
+    check_chunked("12345");
+    check_chunked("\"\xe2\x82\"");
+    check_chunked("\"\xe2\x82\xac\xac\"");
+    check_chunked("[1, 2");
+    check_chunked("{\"a\": nul}");
+    check_parallel_documents();
 }
@@ -29,6 +29,8 @@
 #ifdef WIN32
 #include <process.h>
 #define getpid() _getpid()
+#else
+#include <sys/wait.h>
 #endif
 
 using namespace Couchbase;
@@ -107,6 +109,255 @@ static void testSharedMapping(void) {
     cb_assert(memcmp(before.data(), after.data(), before.size()) != 0);
 }
 
+static void testAdvice(void) {
+    std::vector<uint8_t> before = readFile();
+    MemoryMappedFile mymap(filename.c_str(), false, true);
+    mymap.setPrefault(true);
+    try {
+        mymap.open();
+        mymap.advise(MemoryMappedFile::Advice::Sequential);
+        mymap.advise(MemoryMappedFile::Advice::Random, 100, 5000);
+        mymap.advise(MemoryMappedFile::Advice::WillNeed, 4096, 4096);
+        mymap.advise(MemoryMappedFile::Advice::DontNeed, 8192);
+        mymap.advise(MemoryMappedFile::Advice::Normal);
+    } catch (std::string err) {
+        std::cerr << "ERROR: " << err << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    cb_assert(memcmp(before.data(), mymap.getRoot(), mymap.getSize()) == 0);
+
+    try {
+        mymap.advise(MemoryMappedFile::Advice::WillNeed,
+                     mymap.getSize() + 1);
+        std::cerr << "ERROR: advise accepted an offset outside the mapping"
+                  << std::endl;
+        exit(EXIT_FAILURE);
+    } catch (std::string err) {
+    }
+}
+
+static void testBacking(void) {
+    std::vector<uint8_t> before = readFile();
+    MemoryMappedFile mymap(filename.c_str(), false, true);
+    mymap.setHugePages(MemoryMappedFile::HugePages::Transparent);
+    try {
+        mymap.open();
+    } catch (std::string err) {
+        std::cerr << "ERROR: " << err << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    cb_assert(memcmp(before.data(), mymap.getRoot(), mymap.getSize()) == 0);
+    MemoryMappedFile::Backing backing = mymap.getBacking();
+    cb_assert(backing.pageSize > 0);
+    cb_assert(!backing.locked);
+    mymap.close();
+
+    /* A small file should be lockable within the default rlimit */
+    MemoryMappedFile locked(filename.c_str(), false, true);
+    locked.setLocked(true);
+    try {
+        locked.open();
+        cb_assert(locked.getBacking().locked);
+        cb_assert(memcmp(before.data(), locked.getRoot(),
+                         locked.getSize()) == 0);
+    } catch (std::string err) {
+        std::cerr << "NOTE: " << err << std::endl;
+    }
+
+    /* Regular files aren't on hugetlbfs */
+    MemoryMappedFile huge(filename.c_str(), false, true);
+    huge.setHugePages(MemoryMappedFile::HugePages::Explicit);
+    try {
+        huge.open();
+        std::cerr << "ERROR: expected explicit huge pages to fail"
+                  << std::endl;
+        exit(EXIT_FAILURE);
+    } catch (std::string err) {
+    }
+}
+
+static void testWindowAndGrow(void) {
+    std::vector<uint8_t> before = readFile();
+    /* 64k is a multiple of the page size (and the Windows allocation
+     * granularity), so use a file which is larger than that */
+    const size_t window = 64 * 1024;
+    {
+        MemoryMappedFile mymap(filename.c_str(), true, false);
+        try {
+            mymap.open(0, before.size() + window);
+        } catch (std::string err) {
+            std::cerr << "ERROR: " << err << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        /* The file was extended to cover the mapping */
+        cb_assert(mymap.getSize() == before.size() + window);
+        uint8_t *ptr = static_cast<uint8_t *>(mymap.getRoot());
+        cb_assert(memcmp(before.data(), ptr, before.size()) == 0);
+        memset(ptr + before.size(), 'a', window);
+
+        /* Append another 64k */
+        try {
+            mymap.remap(before.size() + 2 * window);
+        } catch (std::string err) {
+            std::cerr << "ERROR: " << err << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        ptr = static_cast<uint8_t *>(mymap.getRoot());
+        cb_assert(ptr[before.size()] == 'a');
+        memset(ptr + before.size() + window, 'b', window);
+        mymap.sync(before.size(), window, true);
+        mymap.sync();
+    }
+
+    std::vector<uint8_t> after = readFile();
+    cb_assert(after.size() == before.size() + 2 * window);
+    cb_assert(memcmp(before.data(), after.data(), before.size()) == 0);
+    cb_assert(after[before.size()] == 'a');
+    cb_assert(after[before.size() + window - 1] == 'a');
+    cb_assert(after[before.size() + window] == 'b');
+    cb_assert(after.back() == 'b');
+
+    /* Growing a private mapping keeps the changes made to it, without
+     * writing them to the file */
+    {
+        MemoryMappedFile mymap(filename.c_str(), false, false);
+        try {
+            mymap.open(0, window);
+            memset(mymap.getRoot(), 'c', window);
+            mymap.remap(2 * window);
+        } catch (std::string err) {
+            std::cerr << "ERROR: " << err << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        uint8_t *ptr = static_cast<uint8_t *>(mymap.getRoot());
+        cb_assert(ptr[0] == 'c' && ptr[window - 1] == 'c');
+        cb_assert(memcmp(after.data() + window, ptr + window, window) == 0);
+    }
+    cb_assert(readFile() == after);
+
+    /* Map the second 64k window of the file */
+    MemoryMappedFile mymap(filename.c_str(), false, true);
+    try {
+        mymap.open(window, window);
+    } catch (std::string err) {
+        std::cerr << "ERROR: " << err << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    cb_assert(mymap.getOffset() == window);
+    cb_assert(mymap.getSize() == window);
+    cb_assert(memcmp(after.data() + window, mymap.getRoot(), window) == 0);
+
+    /* A read only mapping can't grow the file */
+    try {
+        mymap.remap(after.size());
+        std::cerr << "ERROR: remap grew a readonly mapping" << std::endl;
+        exit(EXIT_FAILURE);
+    } catch (std::string err) {
+    }
+    mymap.close();
+
+    /* The offset must be aligned */
+    try {
+        mymap.open(1, 0);
+        std::cerr << "ERROR: open accepted an unaligned offset" << std::endl;
+        exit(EXIT_FAILURE);
+    } catch (std::string err) {
+    }
+}
+
+/* Both kinds of mappings are used through the same interface */
+static void fill(MemoryMapping &mapping, uint8_t value) {
+    memset(mapping.getRoot(), value, mapping.getSize());
+}
+
+static bool filledWith(const MemoryMapping &mapping, uint8_t value) {
+    const uint8_t *ptr = static_cast<const uint8_t *>(mapping.getRoot());
+    for (size_t ii = 0; ii < mapping.getSize(); ++ii) {
+        if (ptr[ii] != value) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void testAnonymousSegment(void) {
+    SharedMemorySegment segment(NULL, false);
+    try {
+        segment.create(10000);
+    } catch (std::string err) {
+        std::cerr << "ERROR: " << err << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    cb_assert(segment.getSize() == 10000);
+    cb_assert(segment.getBacking().pageSize != 0);
+    cb_assert(filledWith(segment, 0));
+
+#ifndef WIN32
+    /* The segment is shared with a child process */
+    pid_t pid = fork();
+    cb_assert(pid != -1);
+    if (pid == 0) {
+        fill(segment, 'c');
+        _exit(EXIT_SUCCESS);
+    }
+    int status;
+    cb_assert(waitpid(pid, &status, 0) == pid);
+    cb_assert(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS);
+    cb_assert(filledWith(segment, 'c'));
+#endif
+
+    /* Anonymous segments can't be opened */
+    SharedMemorySegment other(NULL, false);
+    try {
+        other.open();
+        std::cerr << "ERROR: opened an anonymous segment" << std::endl;
+        exit(EXIT_FAILURE);
+    } catch (std::string err) {
+    }
+}
+
+static void testNamedSegment(void) {
+    std::stringstream nm;
+    nm << "cb_memorymap_test_" << getpid();
+    const std::string name = nm.str();
+
+    SharedMemorySegment segment(name.c_str(), false);
+    try {
+        segment.create(64 * 1024);
+    } catch (std::string err) {
+        std::cerr << "ERROR: " << err << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    fill(segment, 'd');
+
+    /* The name is taken */
+    SharedMemorySegment duplicate(name.c_str(), false);
+    try {
+        duplicate.create(4096);
+        std::cerr << "ERROR: created the segment twice" << std::endl;
+        exit(EXIT_FAILURE);
+    } catch (std::string err) {
+    }
+
+    SharedMemorySegment reader(name.c_str(), true);
+    try {
+        reader.open();
+    } catch (std::string err) {
+        std::cerr << "ERROR: " << err << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    cb_assert(reader.getSize() == segment.getSize());
+    cb_assert(filledWith(reader, 'd'));
+
+    /* Writes show up in the other mapping */
+    fill(segment, 'e');
+    cb_assert(filledWith(reader, 'e'));
+
+    reader.close();
+    segment.close();
+    SharedMemorySegment::unlink(name.c_str());
+}
+
 static void createFile(void) {
     std::vector<uint8_t> buffer;
     buffer.resize(16 * 1024);
@@ -131,6 +382,11 @@ int main(void) {
     testPrivateMapping();
 #endif
     testSharedMapping();
+    testAdvice();
+    testBacking();
+    testWindowAndGrow();
+    testAnonymousSegment();
+    testNamedSegment();
     remove(filename.c_str());
     exit(EXIT_SUCCESS);
 }
\ No newline at end of file
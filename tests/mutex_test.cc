@@ -0,0 +1,381 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2016 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config.h"
+
+#include <platform/platform.h>
+#include <platform/cbassert.h>
+
+#include <cJSON.h>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+static const int nthreads = 4;
+static const int iterations = 100000;
+
+static cb_adaptive_mutex_t adaptive;
+static uint64_t counter;
+
+static void adaptive_worker(void *) {
+    for (int ii = 0; ii < iterations; ++ii) {
+        cb_adaptive_mutex_enter(&adaptive);
+        ++counter;
+        cb_adaptive_mutex_exit(&adaptive);
+    }
+}
+
+static void test_adaptive_mutex(unsigned int spins) {
+    cb_adaptive_mutex_initialize(&adaptive, spins);
+    counter = 0;
+
+    std::vector<cb_thread_t> threads(nthreads);
+    for (auto &tid : threads) {
+        cb_assert(cb_create_thread(&tid, adaptive_worker, NULL, 0) == 0);
+    }
+    for (auto &tid : threads) {
+        cb_assert(cb_join_thread(tid) == 0);
+    }
+    cb_assert(counter == uint64_t(nthreads) * iterations);
+
+    cb_assert(cb_adaptive_mutex_try_enter(&adaptive) == 0);
+    cb_adaptive_mutex_exit(&adaptive);
+
+    cb_adaptive_mutex_destroy(&adaptive);
+}
+
+static void test_adaptive_mutex_try_enter(void) {
+    cb_adaptive_mutex_initialize(&adaptive, 10);
+    cb_adaptive_mutex_enter(&adaptive);
+
+    // Try from another thread while we hold it
+    cb_thread_t tid;
+    static int result;
+    result = 0;
+    cb_assert(cb_create_thread(&tid, [](void *) {
+                result = cb_adaptive_mutex_try_enter(&adaptive);
+            }, NULL, 0) == 0);
+    cb_assert(cb_join_thread(tid) == 0);
+    cb_assert(result == -1);
+
+    cb_adaptive_mutex_exit(&adaptive);
+    cb_adaptive_mutex_destroy(&adaptive);
+}
+
+static cb_rwlock_t rwlock;
+static uint64_t pair[2];
+
+/* Writers keep both members equal, readers verify that they always are */
+static void rwlock_writer(void *) {
+    for (int ii = 0; ii < iterations / 10; ++ii) {
+        cb_rwlock_writer_enter(&rwlock);
+        ++pair[0];
+        ++pair[1];
+        cb_rwlock_writer_exit(&rwlock);
+    }
+}
+
+static void rwlock_reader(void *) {
+    for (int ii = 0; ii < iterations; ++ii) {
+        cb_rwlock_reader_enter(&rwlock);
+        cb_assert(pair[0] == pair[1]);
+        cb_rwlock_reader_exit(&rwlock);
+    }
+}
+
+static void test_rwlock(int prefer_writer) {
+    cb_rwlock_initialize(&rwlock, prefer_writer);
+    pair[0] = pair[1] = 0;
+
+    std::vector<cb_thread_t> threads(nthreads);
+    for (size_t ii = 0; ii < threads.size(); ++ii) {
+        cb_assert(cb_create_thread(&threads[ii],
+                                   ii == 0 ? rwlock_writer : rwlock_reader,
+                                   NULL, 0) == 0);
+    }
+    for (auto &tid : threads) {
+        cb_assert(cb_join_thread(tid) == 0);
+    }
+    cb_assert(pair[0] == uint64_t(iterations / 10));
+    cb_assert(pair[1] == uint64_t(iterations / 10));
+
+    /* Readers share the lock, writers don't */
+    cb_rwlock_reader_enter(&rwlock);
+    cb_assert(cb_rwlock_writer_try_enter(&rwlock) == -1);
+    cb_thread_t tid;
+    static int result;
+    result = -1;
+    cb_assert(cb_create_thread(&tid, [](void *) {
+                result = cb_rwlock_reader_try_enter(&rwlock);
+                if (result == 0) {
+                    cb_rwlock_reader_exit(&rwlock);
+                }
+            }, NULL, 0) == 0);
+    cb_assert(cb_join_thread(tid) == 0);
+    cb_assert(result == 0);
+    cb_rwlock_reader_exit(&rwlock);
+
+    cb_assert(cb_rwlock_writer_try_enter(&rwlock) == 0);
+    cb_assert(cb_rwlock_reader_try_enter(&rwlock) == -1);
+    cb_rwlock_writer_exit(&rwlock);
+
+    cb_rwlock_destroy(&rwlock);
+}
+
+static cb_mutex_t profiled;
+
+static void find_stats(const cb_mutex_stats_t *stats, void *ctx) {
+    if (strcmp(stats->name, "profiled") == 0) {
+        *reinterpret_cast<cb_mutex_stats_t *>(ctx) = *stats;
+    }
+}
+
+static void test_profiling(void) {
+    cb_mutex_t unnamed;
+    cb_mutex_initialize(&unnamed);
+    cb_mutex_initialize(&profiled);
+    cb_assert(cb_mutex_set_name(&profiled, "profiled") == 0);
+    cb_mutex_profiling_enable(1);
+
+    /* Hold the mutex while another thread blocks on it */
+    cb_mutex_enter(&profiled);
+    cb_thread_t tid;
+    cb_assert(cb_create_thread(&tid, [](void *) {
+                cb_mutex_enter(&profiled);
+                cb_mutex_exit(&profiled);
+            }, NULL, 0) == 0);
+    usleep(20000);
+    cb_mutex_exit(&profiled);
+    cb_assert(cb_join_thread(tid) == 0);
+
+    cb_assert(cb_mutex_try_enter(&profiled) == 0);
+    cb_mutex_exit(&profiled);
+    cb_mutex_enter(&unnamed);
+    cb_mutex_exit(&unnamed);
+
+    cb_mutex_stats_t stats;
+    memset(&stats, 0, sizeof(stats));
+    cb_mutex_stats_iterate(find_stats, &stats);
+    cb_assert(stats.acquisitions == 3);
+    cb_assert(stats.contended == 1);
+    cb_assert(stats.total_wait_ns == stats.max_wait_ns);
+    cb_assert(stats.max_wait_ns > 0);
+    cb_assert(stats.max_hold_ns >= 10000000);
+
+    cJSON *json = cb_mutex_stats_to_json();
+    cb_assert(json != NULL);
+    cb_assert(cJSON_GetArraySize(json) == 1);
+    cJSON *entry = cJSON_GetArrayItem(json, 0);
+    cb_assert(strcmp(cJSON_GetObjectItem(entry, "name")->valuestring,
+                     "profiled") == 0);
+    cb_assert(cJSON_GetObjectItem(entry, "acquisitions")->valueint64 == 3);
+    cb_assert(cJSON_GetObjectItem(entry, "contended")->valueint64 == 1);
+    cJSON_Delete(json);
+
+    /* The mutex isn't held while waiting for a condition variable */
+    cb_cond_t cond;
+    cb_cond_initialize(&cond);
+    cb_mutex_stats_reset();
+    cb_mutex_enter(&profiled);
+    (void)cb_cond_timedwait_ns(&cond, &profiled, 200000000);
+    cb_mutex_exit(&profiled);
+    cb_cond_destroy(&cond);
+    memset(&stats, 0, sizeof(stats));
+    cb_mutex_stats_iterate(find_stats, &stats);
+    cb_assert(stats.acquisitions == 2);
+    cb_assert(stats.max_hold_ns < 100000000);
+
+    /* A mutex released while profiling was off doesn't report a hold
+     * from its old acquisition once profiling is back on */
+    cb_mutex_stats_reset();
+    cb_mutex_enter(&profiled);
+    cb_mutex_profiling_enable(0);
+    cb_mutex_exit(&profiled);
+    usleep(200000);
+    cb_mutex_enter(&profiled);
+    cb_mutex_profiling_enable(1);
+    cb_mutex_exit(&profiled);
+    memset(&stats, 0, sizeof(stats));
+    cb_mutex_stats_iterate(find_stats, &stats);
+    cb_assert(stats.max_hold_ns < 100000000);
+
+    cb_mutex_stats_reset();
+    memset(&stats, 0, sizeof(stats));
+    stats.acquisitions = 42;
+    cb_mutex_stats_iterate(find_stats, &stats);
+    cb_assert(stats.acquisitions == 0);
+
+    cb_mutex_profiling_enable(0);
+    cb_mutex_destroy(&profiled);
+    cb_mutex_destroy(&unnamed);
+
+    json = cb_mutex_stats_to_json();
+    cb_assert(cJSON_GetArraySize(json) == 0);
+    cJSON_Delete(json);
+
+    /* Many more named mutexes than the registry holds come and go, and
+     * there is still room for a full registry afterwards */
+    std::vector<cb_mutex_t> mutexes(1023);
+    for (int round = 0; round < 10; ++round) {
+        for (auto &m : mutexes) {
+            cb_mutex_initialize(&m);
+            cb_assert(cb_mutex_set_name(&m, "churn") == 0);
+        }
+        for (auto &m : mutexes) {
+            cb_mutex_destroy(&m);
+        }
+    }
+    json = cb_mutex_stats_to_json();
+    cb_assert(cJSON_GetArraySize(json) == 0);
+    cJSON_Delete(json);
+}
+
+static cb_mutex_t cond_mutex;
+static cb_cond_t cond;
+static bool signaled;
+
+static void test_cond_timedwait_ns(void) {
+    cb_mutex_initialize(&cond_mutex);
+    cb_cond_initialize(&cond);
+
+    /* Nobody signals us, so we should time out after (at least) 10ms */
+    cb_mutex_enter(&cond_mutex);
+    hrtime_t start = gethrtime();
+    int ret;
+    do {
+        ret = cb_cond_timedwait_ns(&cond, &cond_mutex, 10000000);
+    } while (ret == 0);
+    cb_assert(ret == -1);
+    cb_assert(gethrtime() - start >= 10000000);
+
+    /* A signal before the (long) timeout */
+    signaled = false;
+    cb_thread_t tid;
+    cb_assert(cb_create_thread(&tid, [](void *) {
+                cb_mutex_enter(&cond_mutex);
+                signaled = true;
+                cb_cond_signal(&cond);
+                cb_mutex_exit(&cond_mutex);
+            }, NULL, 0) == 0);
+    while (!signaled) {
+        cb_assert(cb_cond_timedwait_ns(&cond, &cond_mutex,
+                                       60ULL * 1000000000) == 0);
+    }
+    cb_mutex_exit(&cond_mutex);
+    cb_assert(cb_join_thread(tid) == 0);
+
+    cb_cond_destroy(&cond);
+    cb_mutex_destroy(&cond_mutex);
+}
+
+static cb_semaphore_t sem;
+static cb_semaphore_t done;
+
+/* Consume tokens until we get the (zero) stop token */
+static void semaphore_consumer(void *) {
+    for (;;) {
+        cb_semaphore_wait(&sem);
+        if (__atomic_fetch_add(&counter, 1, __ATOMIC_SEQ_CST) >=
+            uint64_t(iterations)) {
+            break;
+        }
+    }
+    cb_semaphore_post(&done, 1);
+}
+
+static void test_semaphore(void) {
+    cb_semaphore_initialize(&sem, 2);
+    cb_assert(cb_semaphore_try_wait(&sem) == 0);
+    cb_assert(cb_semaphore_try_wait(&sem) == 0);
+    cb_assert(cb_semaphore_try_wait(&sem) == -1);
+
+    hrtime_t start = gethrtime();
+    cb_assert(cb_semaphore_timedwait_ns(&sem, 10000000) == -1);
+    cb_assert(gethrtime() - start >= 10000000);
+    cb_semaphore_post(&sem, 1);
+    cb_assert(cb_semaphore_timedwait_ns(&sem, 10000000) == 0);
+
+    /* Producer / consumer: every post is consumed exactly once */
+    counter = 0;
+    cb_semaphore_initialize(&done, 0);
+    std::vector<cb_thread_t> threads(nthreads);
+    for (auto &tid : threads) {
+        cb_assert(cb_create_thread(&tid, semaphore_consumer, NULL, 0) == 0);
+    }
+    for (int ii = 0; ii < iterations; ++ii) {
+        cb_semaphore_post(&sem, 1);
+    }
+    cb_semaphore_post(&sem, nthreads);
+    for (int ii = 0; ii < nthreads; ++ii) {
+        cb_semaphore_wait(&done);
+    }
+    for (auto &tid : threads) {
+        cb_assert(cb_join_thread(tid) == 0);
+    }
+    cb_assert(counter == uint64_t(iterations) + nthreads);
+    cb_assert(cb_semaphore_try_wait(&sem) == -1);
+
+    cb_semaphore_destroy(&done);
+    cb_semaphore_destroy(&sem);
+}
+
+static cb_event_t event;
+
+static void test_event(void) {
+    cb_event_initialize(&event);
+    cb_assert(!cb_event_is_set(&event));
+    cb_assert(cb_event_timedwait_ns(&event, 1000000) == -1);
+
+    counter = 0;
+    std::vector<cb_thread_t> threads(nthreads);
+    for (auto &tid : threads) {
+        cb_assert(cb_create_thread(&tid, [](void *) {
+                    cb_event_wait(&event);
+                    __atomic_fetch_add(&counter, 1, __ATOMIC_SEQ_CST);
+                }, NULL, 0) == 0);
+    }
+    usleep(10000);
+    cb_assert(counter == 0);
+    cb_event_set(&event);
+    for (auto &tid : threads) {
+        cb_assert(cb_join_thread(tid) == 0);
+    }
+    cb_assert(counter == uint64_t(nthreads));
+
+    /* Stays set until it is reset */
+    cb_assert(cb_event_is_set(&event));
+    cb_event_wait(&event);
+    cb_assert(cb_event_timedwait_ns(&event, 0) == 0);
+    cb_event_reset(&event);
+    cb_assert(cb_event_timedwait_ns(&event, 1000000) == -1);
+
+    cb_event_destroy(&event);
+}
+
+int main(void) {
+    test_adaptive_mutex(0);
+    test_adaptive_mutex(1);
+    test_adaptive_mutex(1000);
+    test_adaptive_mutex_try_enter();
+    test_rwlock(0);
+    test_rwlock(1);
+    test_profiling();
+    test_cond_timedwait_ns();
+    test_semaphore();
+    test_event();
+    std::cout << "All tests pass" << std::endl;
+    return 0;
+}
@@ -0,0 +1,543 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2016 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/*
+ * Microbenchmarks for the hot paths of the platform library. The
+ * results are written as JSON (to stdout, or the file given with -o)
+ * so that runs from different builds can be compared by a script:
+ *
+ *   {
+ *     "context": { "date": ..., "cpus": ..., ... },
+ *     "benchmarks": [
+ *       { "name": "cjson_parse/small_object",
+ *         "iterations": 2048, "repetitions": 10,
+ *         "ns_per_op": { "min": ..., "median": ..., "mean": ...,
+ *                        "max": ... },
+ *         "bytes_per_second": ... },
+ *       ...
+ *     ]
+ *   }
+ *
+ * Every benchmark is calibrated to run for about the target time
+ * (-m milliseconds), and then repeated -r times. The median is the
+ * number to compare between runs. All of the input is generated from
+ * a fixed seed, so it is the same for every run.
+ */
+#include "config.h"
+
+#include <platform/cbassert.h>
+#include <platform/memorymap.h>
+#include <platform/platform.h>
+#include <platform/random.h>
+
+#include <JSON_checker.h>
+#include <cJSON.h>
+#include <getopt.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace Couchbase;
+
+struct Options {
+    /* The time to aim for in each repetition */
+    hrtime_t target;
+    int repetitions;
+    int threads;
+    size_t mapsize;
+    /* Only run the benchmarks with this in their name */
+    std::string filter;
+    std::string file;
+};
+
+static Options options;
+
+/*
+ * A benchmark runs its operation the given number of times, and
+ * returns the number of bytes it processed (for the throughput).
+ */
+typedef std::function<uint64_t(uint64_t)> Operation;
+
+/* The deterministic generator for the input (xorshift64*) */
+class Input {
+public:
+    Input() : state(0x9e3779b97f4a7c15ULL) {
+    }
+
+    uint64_t next(void) {
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        return state * 0x2545f4914f6cdd1dULL;
+    }
+
+    std::string word(size_t length) {
+        static const char chars[] = "abcdefghijklmnopqrstuvwxyz"
+            "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+        std::string ret;
+        for (size_t ii = 0; ii < length; ++ii) {
+            ret.push_back(chars[next() % (sizeof(chars) - 1)]);
+        }
+        return ret;
+    }
+
+private:
+    uint64_t state;
+};
+
+/*
+ * The document shapes, which stress different parts of the parser
+ * and printer
+ */
+static std::string small_object(Input &input) {
+    std::string ret = "{\"id\":" + std::to_string(input.next() % 1000000) +
+        ",\"name\":\"" + input.word(12) + "\",\"active\":true," +
+        "\"score\":" + std::to_string(input.next() % 10000) + ".25," +
+        "\"tags\":[\"" + input.word(5) + "\",\"" + input.word(7) + "\"]," +
+        "\"address\":{\"street\":\"" + input.word(20) + "\",\"zip\":\"" +
+        input.word(5) + "\",\"geo\":[59.91,10.75]},\"parent\":null}";
+    return ret;
+}
+
+static std::string number_array(Input &input) {
+    std::string ret = "[";
+    for (int ii = 0; ii < 10000; ++ii) {
+        if (ii > 0) {
+            ret.push_back(',');
+        }
+        uint64_t value = input.next();
+        if (ii % 2) {
+            ret += std::to_string(value % 100000000);
+        } else {
+            ret += std::to_string((double)(value % 1000000) / 1000.0);
+        }
+    }
+    ret.push_back(']');
+    return ret;
+}
+
+static std::string string_array(Input &input) {
+    std::string ret = "[";
+    for (int ii = 0; ii < 1000; ++ii) {
+        if (ii > 0) {
+            ret.push_back(',');
+        }
+        /* Mostly plain text, with some escapes and multibyte UTF-8 */
+        ret += "\"" + input.word(48) + "\\n\\\"" + input.word(8) +
+            "\xc3\xa6\xc3\xb8\xc3\xa5\\u00e9\xe2\x82\xac\"";
+    }
+    ret.push_back(']');
+    return ret;
+}
+
+static std::string wide_object(Input &input) {
+    std::string ret = "{";
+    for (int ii = 0; ii < 5000; ++ii) {
+        if (ii > 0) {
+            ret.push_back(',');
+        }
+        ret += "\"" + input.word(10) + std::to_string(ii) + "\":" +
+            std::to_string(input.next() % 1000);
+    }
+    ret.push_back('}');
+    return ret;
+}
+
+static std::string deep_nesting(Input &input) {
+    std::string ret;
+    const int depth = 500;
+    for (int ii = 0; ii < depth; ++ii) {
+        ret += (ii % 2) ? "[" : "{\"" + input.word(4) + "\":";
+    }
+    ret += "0";
+    for (int ii = depth - 1; ii >= 0; --ii) {
+        ret += (ii % 2) ? "]" : "}";
+    }
+    return ret;
+}
+
+static std::string read_file(const std::string &name) {
+    std::string ret;
+    FILE *fp = fopen(name.c_str(), "rb");
+    if (fp == NULL) {
+        std::cerr << "Failed to open " << name << ": " << strerror(errno)
+                  << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    char buffer[8192];
+    size_t nr;
+    while ((nr = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
+        ret.append(buffer, nr);
+    }
+    fclose(fp);
+    return ret;
+}
+
+static std::vector<std::pair<std::string, std::string> > documents(void) {
+    Input input;
+    std::vector<std::pair<std::string, std::string> > ret;
+    ret.push_back(std::make_pair("small_object", small_object(input)));
+    ret.push_back(std::make_pair("number_array", number_array(input)));
+    ret.push_back(std::make_pair("string_array", string_array(input)));
+    ret.push_back(std::make_pair("wide_object", wide_object(input)));
+    ret.push_back(std::make_pair("deep_nesting", deep_nesting(input)));
+    if (!options.file.empty()) {
+        ret.push_back(std::make_pair("file", read_file(options.file)));
+    }
+    return ret;
+}
+
+/* The results collected so far */
+static cJSON *results;
+
+static double median(std::vector<double> values) {
+    std::sort(values.begin(), values.end());
+    size_t mid = values.size() / 2;
+    if (values.size() % 2) {
+        return values[mid];
+    }
+    return (values[mid - 1] + values[mid]) / 2;
+}
+
+static void run(const std::string &name, const Operation &op) {
+    if (name.find(options.filter) == std::string::npos) {
+        return;
+    }
+
+    /* Warm up, and double the iterations until they take long enough */
+    uint64_t iterations = 1;
+    for (;;) {
+        hrtime_t start = gethrtime();
+        op(iterations);
+        hrtime_t elapsed = gethrtime() - start;
+        if (elapsed >= options.target / 2 || iterations >= (1ULL << 40)) {
+            if (elapsed > 0 && elapsed < options.target) {
+                iterations = iterations * options.target / elapsed;
+            }
+            break;
+        }
+        iterations *= 2;
+    }
+
+    std::vector<double> nsperop;
+    uint64_t bytes = 0;
+    for (int ii = 0; ii < options.repetitions; ++ii) {
+        hrtime_t start = gethrtime();
+        bytes = op(iterations);
+        hrtime_t elapsed = gethrtime() - start;
+        nsperop.push_back((double)elapsed / (double)iterations);
+    }
+
+    double mean = 0;
+    for (auto value : nsperop) {
+        mean += value;
+    }
+    mean /= nsperop.size();
+
+    cJSON *entry = cJSON_CreateObject();
+    cJSON_AddStringToObject(entry, "name", name.c_str());
+    cJSON_AddNumberToObject(entry, "iterations", (double)iterations);
+    cJSON_AddNumberToObject(entry, "repetitions", options.repetitions);
+    cJSON *ns = cJSON_CreateObject();
+    cJSON_AddNumberToObject(ns, "min",
+                            *std::min_element(nsperop.begin(), nsperop.end()));
+    cJSON_AddNumberToObject(ns, "median", median(nsperop));
+    cJSON_AddNumberToObject(ns, "mean", mean);
+    cJSON_AddNumberToObject(ns, "max",
+                            *std::max_element(nsperop.begin(), nsperop.end()));
+    cJSON_AddItemToObject(entry, "ns_per_op", ns);
+    if (bytes > 0) {
+        double bytesperop = (double)bytes / (double)iterations;
+        cJSON_AddNumberToObject(entry, "bytes_per_second",
+                                bytesperop * 1e9 / median(nsperop));
+    }
+    cJSON_AddItemToArray(results, entry);
+
+    std::cerr << name << ": " << median(nsperop) << " ns/op" << std::endl;
+}
+
+/* Keep the compiler from optimizing the operations away */
+static volatile uint64_t sink;
+
+static void bench_cjson(void) {
+    for (const auto &doc : documents()) {
+        const std::string &data = doc.second;
+        run("cjson_parse/" + doc.first, [&data](uint64_t n) {
+            for (uint64_t ii = 0; ii < n; ++ii) {
+                cJSON *json = cJSON_ParseWithLength(data.data(), data.size());
+                cb_assert(json != NULL);
+                cJSON_Delete(json);
+            }
+            return n * data.size();
+        });
+
+        cJSON *json = cJSON_ParseWithLength(data.data(), data.size());
+        cb_assert(json != NULL);
+        run("cjson_print_unformatted/" + doc.first, [json](uint64_t n) {
+            uint64_t bytes = 0;
+            for (uint64_t ii = 0; ii < n; ++ii) {
+                char *text = cJSON_PrintUnformatted(json);
+                cb_assert(text != NULL);
+                bytes += strlen(text);
+                cJSON_Free(text);
+            }
+            return bytes;
+        });
+        cJSON_Delete(json);
+
+        run("check_utf8_json/" + doc.first, [&data](uint64_t n) {
+            for (uint64_t ii = 0; ii < n; ++ii) {
+                cb_assert(checkUTF8JSON((const unsigned char *)data.data(),
+                                        data.size()));
+            }
+            return n * data.size();
+        });
+    }
+}
+
+static void bench_mutex(void) {
+    for (int nthreads = 1; nthreads <= options.threads; nthreads *= 2) {
+        run("cb_mutex_enter/threads:" + std::to_string(nthreads),
+            [nthreads](uint64_t n) {
+            cb_mutex_t mutex;
+            uint64_t counter = 0;
+            cb_mutex_initialize(&mutex);
+            /* n is the total, so the time is per mutex hand over */
+            uint64_t each = (n + nthreads - 1) / nthreads;
+            std::vector<std::thread> threads;
+            for (int ii = 0; ii < nthreads; ++ii) {
+                threads.emplace_back([&mutex, &counter, each]() {
+                    for (uint64_t jj = 0; jj < each; ++jj) {
+                        cb_mutex_enter(&mutex);
+                        ++counter;
+                        cb_mutex_exit(&mutex);
+                    }
+                });
+            }
+            for (auto &thread : threads) {
+                thread.join();
+            }
+            cb_mutex_destroy(&mutex);
+            sink = counter;
+            return uint64_t(0);
+        });
+    }
+}
+
+static void bench_random(void) {
+    const std::pair<const char *, RandomGenerator::Mode> modes[] = {
+        { "shared", RandomGenerator::Mode::Shared },
+        { "private", RandomGenerator::Mode::Private },
+        { "fast", RandomGenerator::Mode::Fast }
+    };
+
+    for (const auto &mode : modes) {
+        RandomGenerator generator(mode.second);
+        run(std::string("random_next/") + mode.first, [&generator](uint64_t n) {
+            uint64_t value = 0;
+            for (uint64_t ii = 0; ii < n; ++ii) {
+                value ^= generator.next();
+            }
+            sink = value;
+            return n * sizeof(uint64_t);
+        });
+    }
+}
+
+static void bench_gethrtime(void) {
+    run("gethrtime", [](uint64_t n) {
+        hrtime_t value = 0;
+        for (uint64_t ii = 0; ii < n; ++ii) {
+            value += gethrtime();
+        }
+        sink = value;
+        return uint64_t(0);
+    });
+}
+
+static void bench_memorymap(void) {
+    if (std::string("memorymap_scan/random").find(options.filter) ==
+            std::string::npos &&
+        std::string("memorymap_scan/sequential").find(options.filter) ==
+            std::string::npos) {
+        return;
+    }
+
+    char pattern[] = "platform-bench-XXXXXX";
+    cb_assert(cb_mktemp(pattern) != NULL);
+    std::string filename(pattern);
+    FILE *fp = fopen(filename.c_str(), "wb");
+    cb_assert(fp != NULL);
+    Input input;
+    std::vector<uint64_t> block(8192);
+    size_t size = 0;
+    while (size < options.mapsize) {
+        for (auto &word : block) {
+            word = input.next();
+        }
+        cb_assert(fwrite(block.data(), sizeof(uint64_t), block.size(), fp) ==
+                  block.size());
+        size += block.size() * sizeof(uint64_t);
+    }
+    cb_assert(fclose(fp) == 0);
+
+    try {
+        MemoryMappedFile map(filename.c_str(), false, true);
+        map.open();
+        const uint64_t *words = static_cast<const uint64_t *>(map.getRoot());
+        const size_t nwords = map.getSize() / sizeof(uint64_t);
+
+        map.advise(MemoryMappedFile::Advice::Sequential);
+        run("memorymap_scan/sequential", [words, nwords](uint64_t n) {
+            uint64_t sum = 0;
+            for (uint64_t ii = 0; ii < n; ++ii) {
+                for (size_t jj = 0; jj < nwords; ++jj) {
+                    sum += words[jj];
+                }
+            }
+            sink = sum;
+            return n * nwords * sizeof(uint64_t);
+        });
+
+        /* One word from a random cache line for each operation */
+        map.advise(MemoryMappedFile::Advice::Random);
+        std::vector<size_t> offsets(1 << 16);
+        for (auto &offset : offsets) {
+            offset = (input.next() % (nwords / 8)) * 8;
+        }
+        run("memorymap_scan/random", [words, &offsets](uint64_t n) {
+            uint64_t sum = 0;
+            const size_t mask = offsets.size() - 1;
+            for (uint64_t ii = 0; ii < n; ++ii) {
+                sum += words[offsets[ii & mask]];
+            }
+            sink = sum;
+            return n * sizeof(uint64_t);
+        });
+        map.close();
+    } catch (std::string &error) {
+        std::cerr << "Failed to map " << filename << ": " << error
+                  << std::endl;
+        remove(filename.c_str());
+        exit(EXIT_FAILURE);
+    }
+    remove(filename.c_str());
+}
+
+static cJSON *context(void) {
+    cJSON *ret = cJSON_CreateObject();
+    char date[64];
+    time_t now = time(NULL);
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+    cJSON_AddStringToObject(ret, "date", date);
+    cJSON_AddNumberToObject(ret, "cpus", std::thread::hardware_concurrency());
+    cJSON_AddNumberToObject(ret, "gethrtime_period_ns",
+                            (double)gethrtime_period());
+    cJSON_AddNumberToObject(ret, "target_ms",
+                            (double)(options.target / 1000000));
+#ifdef NDEBUG
+    cJSON_AddStringToObject(ret, "build", "release");
+#else
+    cJSON_AddStringToObject(ret, "build", "debug");
+#endif
+    return ret;
+}
+
+static void usage(const char *name) {
+    std::cerr << "usage: " << name << " [-m ms] [-r repetitions] "
+              << "[-t threads] [-s mapsize-mb] [-b filter] [-f file] "
+              << "[-o output]" << std::endl
+              << "  -m  the time to run each repetition for (50)" << std::endl
+              << "  -r  the number of repetitions (10)" << std::endl
+              << "  -t  the most threads to contend for a mutex (4)"
+              << std::endl
+              << "  -s  the size of the mapped file in MB (64)" << std::endl
+              << "  -b  only run the benchmarks with this in their name"
+              << std::endl
+              << "  -f  also parse this JSON document" << std::endl
+              << "  -o  write the results here instead of stdout"
+              << std::endl;
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+    const char *output = NULL;
+    int cmd;
+
+    options.target = 50 * 1000000ULL;
+    options.repetitions = 10;
+    options.threads = 4;
+    options.mapsize = 64 * 1024 * 1024;
+
+    while ((cmd = getopt(argc, argv, "m:r:t:s:b:f:o:")) != -1) {
+        switch (cmd) {
+        case 'm': options.target = strtoull(optarg, NULL, 10) * 1000000ULL;
+            break;
+        case 'r': options.repetitions = atoi(optarg); break;
+        case 't': options.threads = atoi(optarg); break;
+        case 's': options.mapsize = strtoull(optarg, NULL, 10) * 1024 * 1024;
+            break;
+        case 'b': options.filter = optarg; break;
+        case 'f': options.file = optarg; break;
+        case 'o': output = optarg; break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (options.target == 0 || options.repetitions < 1 ||
+        options.threads < 1 || options.mapsize == 0) {
+        usage(argv[0]);
+    }
+
+    results = cJSON_CreateArray();
+    bench_cjson();
+    bench_mutex();
+    bench_random();
+    bench_gethrtime();
+    bench_memorymap();
+
+    cJSON *root = cJSON_CreateObject();
+    cJSON_AddItemToObject(root, "context", context());
+    cJSON_AddItemToObject(root, "benchmarks", results);
+    char *text = cJSON_Print(root);
+    cb_assert(text != NULL);
+
+    FILE *fp = stdout;
+    if (output != NULL && (fp = fopen(output, "w")) == NULL) {
+        std::cerr << "Failed to open " << output << ": " << strerror(errno)
+                  << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    fprintf(fp, "%s\n", text);
+    if (fp != stdout) {
+        fclose(fp);
+    }
+    cJSON_Free(text);
+    cJSON_Delete(root);
+
+    return EXIT_SUCCESS;
+}
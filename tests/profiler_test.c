@@ -0,0 +1,126 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2016 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <cJSON.h>
+#include <platform/cbassert.h>
+#include <platform/platform.h>
+#include <platform/profiler.h>
+
+static const char *document =
+    "{\"name\":\"profiler\",\"values\":[1,2,3,4,5,6,7,8,9,10],"
+    "\"nested\":{\"a\":true,\"b\":null,\"c\":\"some text\"}}";
+
+static cb_mutex_t mutex;
+static int stop;
+
+static int stopped(void) {
+    int ret;
+    cb_mutex_enter(&mutex);
+    ret = stop;
+    cb_mutex_exit(&mutex);
+    return ret;
+}
+
+/* Burn CPU in the (exported) cJSON functions, so that the samples can
+ * be symbolized */
+static void burn(void) {
+    cJSON *json = cJSON_Parse(document);
+    char *text;
+    cb_assert(json != NULL);
+    text = cJSON_PrintUnformatted(json);
+    cb_assert(text != NULL);
+    cJSON_Free(text);
+    cJSON_Delete(json);
+}
+
+static void worker(void *arg) {
+    (void)arg;
+    while (!stopped()) {
+        burn();
+    }
+}
+
+static int lines;
+static int cjson_lines;
+
+static void write_line(void *ctx, const char *line) {
+    const char *count = strrchr(line, ' ');
+    cb_assert(ctx == &lines);
+    cb_assert(count != NULL && count[1] >= '1' && count[1] <= '9');
+    if (strstr(line, "cJSON_") != NULL) {
+        ++cjson_lines;
+    }
+    if (lines++ < 5) {
+        printf("%s\n", line);
+    }
+}
+
+int main(void) {
+    cb_thread_t tid;
+    uint64_t dropped;
+    hrtime_t start;
+
+    cb_mutex_initialize(&mutex);
+    if (cb_profiler_start(1000) != 0) {
+        fprintf(stderr, "Profiling isn't supported here, skipping\n");
+        return 0;
+    }
+    /* It is already running */
+    cb_assert(cb_profiler_start(1000) == -1);
+
+    cb_assert(cb_create_thread(&tid, worker, NULL, 0) == 0);
+    start = gethrtime();
+    while (cb_profiler_get_samples(NULL) < 100 &&
+           gethrtime() - start < 10000000000ULL) {
+        burn();
+    }
+    cb_mutex_enter(&mutex);
+    stop = 1;
+    cb_mutex_exit(&mutex);
+    cb_assert(cb_join_thread(tid) == 0);
+    cb_profiler_stop();
+    cb_profiler_stop();
+
+    cb_assert(cb_profiler_get_samples(&dropped) >= 100);
+    printf("%llu samples (%llu dropped)\n",
+           (unsigned long long)cb_profiler_get_samples(NULL),
+           (unsigned long long)dropped);
+
+    cb_profiler_write_collapsed(write_line, &lines);
+    cb_assert(lines > 0);
+    cb_assert(cjson_lines > 0);
+
+    /* Nothing is collected once stopped */
+    cb_profiler_reset();
+    cb_assert(cb_profiler_get_samples(&dropped) == 0);
+    cb_assert(dropped == 0);
+    burn();
+    cb_assert(cb_profiler_get_samples(NULL) == 0);
+
+    /* And it may be started again */
+    cb_assert(cb_profiler_start(0) == 0);
+    cb_profiler_stop();
+
+    /* Down to one sample a second */
+    cb_assert(cb_profiler_start(1) == 0);
+    cb_profiler_stop();
+    return 0;
+}
@@ -0,0 +1,172 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <platform/cbassert.h>
+#include <platform/platform.h>
+#include <platform/queue.h>
+
+#define NPRODUCERS 4
+#define NCONSUMERS 4
+#define NITEMS 100000
+
+static cb_mpmc_queue_t *mpmc;
+static cb_spsc_queue_t *spsc;
+static uint8_t seen[NPRODUCERS * NITEMS];
+
+/* Items are 1 + producer * NITEMS + sequence, 0 tells a consumer to stop */
+static void *item_of(int producer, int ii) {
+    return (void *)(uintptr_t)(1 + producer * NITEMS + ii);
+}
+
+static void producer(void *arg) {
+    int id = (int)(uintptr_t)arg;
+    int ii;
+    for (ii = 0; ii < NITEMS; ++ii) {
+        if (ii % 2) {
+            cb_mpmc_queue_push(mpmc, item_of(id, ii));
+        } else {
+            while (cb_mpmc_queue_try_push(mpmc, item_of(id, ii)) == -1) {
+            }
+        }
+    }
+}
+
+static void consumer(void *arg) {
+    int last[NPRODUCERS];
+    int ii;
+    (void)arg;
+    for (ii = 0; ii < NPRODUCERS; ++ii) {
+        last[ii] = -1;
+    }
+    for (;;) {
+        void *item;
+        uintptr_t value;
+        int from, seq;
+        cb_mpmc_queue_pop(mpmc, &item);
+        value = (uintptr_t)item;
+        if (value == 0) {
+            return;
+        }
+        from = (int)((value - 1) / NITEMS);
+        seq = (int)((value - 1) % NITEMS);
+        /* Each producer's items come out in order */
+        cb_assert(seq > last[from]);
+        last[from] = seq;
+        /* Each slot is only written by the consumer which got it */
+        cb_assert(seen[value - 1] == 0);
+        seen[value - 1] = 1;
+    }
+}
+
+static void test_mpmc(void) {
+    cb_thread_t producers[NPRODUCERS];
+    cb_thread_t consumers[NCONSUMERS];
+    void *item;
+    int ii;
+
+    /* A small queue so that both sides have to wait */
+    mpmc = cb_mpmc_queue_create(60);
+    cb_assert(mpmc != NULL);
+
+    for (ii = 0; ii < NCONSUMERS; ++ii) {
+        cb_assert(cb_create_thread(&consumers[ii], consumer, NULL, 0) == 0);
+    }
+    for (ii = 0; ii < NPRODUCERS; ++ii) {
+        cb_assert(cb_create_thread(&producers[ii], producer,
+                                   (void *)(uintptr_t)ii, 0) == 0);
+    }
+    for (ii = 0; ii < NPRODUCERS; ++ii) {
+        cb_assert(cb_join_thread(producers[ii]) == 0);
+    }
+    for (ii = 0; ii < NCONSUMERS; ++ii) {
+        cb_mpmc_queue_push(mpmc, NULL);
+    }
+    for (ii = 0; ii < NCONSUMERS; ++ii) {
+        cb_assert(cb_join_thread(consumers[ii]) == 0);
+    }
+
+    for (ii = 0; ii < NPRODUCERS * NITEMS; ++ii) {
+        cb_assert(seen[ii] == 1);
+    }
+    cb_assert(cb_mpmc_queue_size(mpmc) == 0);
+    cb_assert(cb_mpmc_queue_try_pop(mpmc, &item) == -1);
+    cb_assert(cb_mpmc_queue_timedpop_ns(mpmc, &item, 1000000) == -1);
+
+    /* The capacity was rounded up to 64 */
+    for (ii = 0; ii < 64; ++ii) {
+        cb_assert(cb_mpmc_queue_try_push(mpmc, item_of(0, ii)) == 0);
+    }
+    cb_assert(cb_mpmc_queue_try_push(mpmc, NULL) == -1);
+    cb_assert(cb_mpmc_queue_timedpush_ns(mpmc, NULL, 1000000) == -1);
+    cb_assert(cb_mpmc_queue_size(mpmc) == 64);
+    cb_assert(cb_mpmc_queue_try_pop(mpmc, &item) == 0);
+    cb_assert(item == item_of(0, 0));
+
+    cb_mpmc_queue_destroy(mpmc);
+}
+
+static void spsc_producer(void *arg) {
+    int ii;
+    (void)arg;
+    for (ii = 1; ii <= NITEMS; ++ii) {
+        cb_spsc_queue_push(spsc, (void *)(uintptr_t)ii);
+    }
+}
+
+static void test_spsc(void) {
+    cb_thread_t tid;
+    void *item;
+    int ii;
+
+    spsc = cb_spsc_queue_create(16);
+    cb_assert(spsc != NULL);
+    cb_assert(cb_create_thread(&tid, spsc_producer, NULL, 0) == 0);
+    for (ii = 1; ii <= NITEMS; ++ii) {
+        if (ii % 2) {
+            cb_spsc_queue_pop(spsc, &item);
+        } else {
+            while (cb_spsc_queue_try_pop(spsc, &item) == -1) {
+            }
+        }
+        cb_assert(item == (void *)(uintptr_t)ii);
+    }
+    cb_assert(cb_join_thread(tid) == 0);
+
+    cb_assert(cb_spsc_queue_timedpop_ns(spsc, &item, 1000000) == -1);
+    for (ii = 0; ii < 16; ++ii) {
+        cb_assert(cb_spsc_queue_try_push(spsc, NULL) == 0);
+    }
+    cb_assert(cb_spsc_queue_timedpush_ns(spsc, NULL, 1000000) == -1);
+    cb_assert(cb_spsc_queue_size(spsc) == 16);
+    cb_spsc_queue_destroy(spsc);
+}
+
+static void delayed_push(void *arg) {
+    (void)arg;
+    usleep(20000);
+    cb_mpmc_queue_push(mpmc, item_of(0, 0));
+}
+
+/* A timeout too long for the deadline to fit waits instead of failing */
+static void test_long_timeout(void) {
+    cb_thread_t tid;
+    void *item;
+
+    mpmc = cb_mpmc_queue_create(1);
+    cb_assert(mpmc != NULL);
+    cb_assert(cb_create_thread(&tid, delayed_push, NULL, 0) == 0);
+    cb_assert(cb_mpmc_queue_timedpop_ns(mpmc, &item, UINT64_MAX - 1) == 0);
+    cb_assert(item == item_of(0, 0));
+    cb_assert(cb_join_thread(tid) == 0);
+    cb_mpmc_queue_destroy(mpmc);
+}
+
+int main(void) {
+    test_mpmc();
+    test_spsc();
+    test_long_timeout();
+    return 0;
+}
@@ -21,6 +21,11 @@
 #include <platform/platform.h>
 #include <platform/random.h>
 
+#ifndef WIN32
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
 using namespace Couchbase;
 using namespace std;
 
@@ -123,13 +128,152 @@ static int test_cc_interface(void) {
    delete r1;
    delete r2;
 
+   r1 = new RandomGenerator(RandomGenerator::Mode::Fast);
+   r2 = new RandomGenerator(RandomGenerator::Mode::Fast);
+
+   if (basic_rand_tests(r1, r2) != 0) {
+       return -1;
+   }
+
+   delete r1;
+   delete r2;
+
    return 0;
 }
 
+static void fast_thread(void *arg) {
+    *static_cast<uint64_t *>(arg) = RandomGenerator::fastNext();
+}
+
+static int test_fast_per_thread(void) {
+    /* Every thread should be seeded differently */
+    uint64_t values[4];
+    cb_thread_t tids[4];
+    for (int ii = 0; ii < 4; ++ii) {
+        if (cb_create_thread(&tids[ii], fast_thread, &values[ii], 0) != 0) {
+            cerr << "Failed to create thread" << endl;
+            return -1;
+        }
+    }
+    for (int ii = 0; ii < 4; ++ii) {
+        cb_join_thread(tids[ii]);
+    }
+    for (int ii = 0; ii < 4; ++ii) {
+        for (int jj = ii + 1; jj < 4; ++jj) {
+            if (values[ii] == values[jj]) {
+                cerr << "Two threads got the same fast random sequence"
+                     << endl;
+                return -1;
+            }
+        }
+    }
+
+    /* Odd sizes are filled completely */
+    RandomGenerator fast(RandomGenerator::Mode::Fast);
+    char buffer[1027];
+    memset(buffer, 0, sizeof(buffer));
+    if (!fast.getBytes(buffer, sizeof(buffer))) {
+        cerr << "getBytes failed in fast mode" << endl;
+        return -1;
+    }
+    if (buffer[1024] == 0 && buffer[1025] == 0 && buffer[1026] == 0) {
+        cerr << "getBytes didn't fill the tail of the buffer" << endl;
+        return -1;
+    }
+    return 0;
+}
+
+static bool all_zero(const char *buffer, size_t size) {
+    for (size_t ii = 0; ii < size; ++ii) {
+        if (buffer[ii] != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static int test_pool(void) {
+    cb_rand_pool_t *pool = cb_rand_pool_create(64);
+    if (pool == NULL) {
+        cerr << "Failed to create pool" << endl;
+        return -1;
+    }
+
+    /* Lots of small reads crossing the refills, and one bypassing it */
+    uint64_t previous = 0;
+    for (int ii = 0; ii < 100; ++ii) {
+        uint64_t value = 0;
+        char small[3] = {0, 0, 0};
+        if (cb_rand_pool_get(pool, &value, sizeof(value)) != 0 ||
+            cb_rand_pool_get(pool, small, sizeof(small)) != 0) {
+            cerr << "cb_rand_pool_get failed" << endl;
+            cb_rand_pool_destroy(pool);
+            return -1;
+        }
+        if (value == previous) {
+            cerr << "cb_rand_pool_get returned the same value twice" << endl;
+            cb_rand_pool_destroy(pool);
+            return -1;
+        }
+        previous = value;
+    }
+
+    char buffer[1024];
+    memset(buffer, 0, sizeof(buffer));
+    if (cb_rand_pool_get(pool, buffer, sizeof(buffer)) != 0 ||
+        all_zero(buffer, sizeof(buffer))) {
+        cerr << "cb_rand_pool_get failed for a large request" << endl;
+        cb_rand_pool_destroy(pool);
+        return -1;
+    }
+    cb_rand_pool_destroy(pool);
+
+    memset(buffer, 0, sizeof(buffer));
+    if (cb_rand_bytes(buffer, 16) != 0 || all_zero(buffer, 16) ||
+        cb_rand_bytes(buffer + 16, sizeof(buffer) - 16) != 0 ||
+        all_zero(buffer + 16, sizeof(buffer) - 16)) {
+        cerr << "cb_rand_bytes failed" << endl;
+        return -1;
+    }
+
+#ifndef WIN32
+    /* The child must not get the bytes buffered by the parent */
+    uint64_t mine = 0;
+    uint64_t theirs = 0;
+    int fds[2];
+    if (pipe(fds) != 0) {
+        cerr << "pipe failed" << endl;
+        return -1;
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        uint64_t value = 0;
+        cb_rand_bytes(&value, sizeof(value));
+        ssize_t nw = write(fds[1], &value, sizeof(value));
+        _exit(nw == sizeof(value) ? 0 : 1);
+    }
+    cb_rand_bytes(&mine, sizeof(mine));
+    ssize_t nr = read(fds[0], &theirs, sizeof(theirs));
+    close(fds[0]);
+    close(fds[1]);
+    int status;
+    waitpid(pid, &status, 0);
+    if (nr != sizeof(theirs) || mine == theirs) {
+        cerr << "The parent and child got the same random bytes" << endl;
+        return -1;
+    }
+#endif
+
+    return 0;
+}
+
 int main(int argc, char **argv)
 {
    int c_error = test_c_interface();
    int cc_error = test_cc_interface();
+   int fast_error = test_fast_per_thread();
+   int pool_error = test_pool();
 
-   return (c_error== 0 && cc_error == 0) ? 0 : -1;
+   return (c_error== 0 && cc_error == 0 && fast_error == 0 &&
+           pool_error == 0) ? 0 : -1;
 }
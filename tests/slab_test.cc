@@ -0,0 +1,224 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2016 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config.h"
+
+#include <platform/cbassert.h>
+#include <platform/slab.h>
+
+#include <cJSON.h>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <set>
+#include <thread>
+#include <vector>
+
+static const int nthreads = 4;
+static const int nobjects = 10000;
+
+static void test_single_thread(void) {
+    cb_slab_t *slab = cb_slab_create(24);
+    cb_assert(slab != NULL);
+    cb_assert(cb_slab_object_size(slab) == 32);
+
+    std::vector<void *> objects;
+    std::set<void *> unique;
+    for (int ii = 0; ii < nobjects; ++ii) {
+        void *object = cb_slab_alloc(slab);
+        cb_assert(object != NULL);
+        cb_assert((uintptr_t(object) & 15) == 0);
+        memset(object, ii & 0xff, 32);
+        objects.push_back(object);
+        unique.insert(object);
+    }
+    cb_assert(unique.size() == size_t(nobjects));
+    for (int ii = 0; ii < nobjects; ++ii) {
+        const unsigned char *object =
+            static_cast<const unsigned char *>(objects[ii]);
+        for (int jj = 0; jj < 32; ++jj) {
+            cb_assert(object[jj] == (ii & 0xff));
+        }
+    }
+    for (void *object : objects) {
+        cb_slab_free(slab, object);
+    }
+
+    /* The freed objects are reused */
+    for (int ii = 0; ii < nobjects; ++ii) {
+        void *object = cb_slab_alloc(slab);
+        cb_assert(unique.count(object) == 1);
+        objects[ii] = object;
+    }
+    for (void *object : objects) {
+        cb_slab_free(slab, object);
+    }
+    cb_slab_free(slab, NULL);
+    cb_slab_destroy(slab);
+
+    /* Big objects */
+    slab = cb_slab_create(100000);
+    cb_assert(slab != NULL);
+    objects.clear();
+    for (int ii = 0; ii < 100; ++ii) {
+        void *object = cb_slab_alloc(slab);
+        cb_assert(object != NULL);
+        memset(object, 0xa5, cb_slab_object_size(slab));
+        objects.push_back(object);
+    }
+    for (void *object : objects) {
+        cb_slab_free(slab, object);
+    }
+    cb_slab_destroy(slab);
+}
+
+/* The objects are allocated by one thread and freed by another */
+static void test_cross_thread(void) {
+    cb_slab_t *slab = cb_slab_create(64);
+    cb_assert(slab != NULL);
+
+    for (int round = 0; round < 10; ++round) {
+        std::vector<std::vector<void *>> objects(nthreads);
+        std::vector<std::thread> threads;
+        for (int ii = 0; ii < nthreads; ++ii) {
+            threads.emplace_back([slab, &objects, ii]() {
+                for (int jj = 0; jj < nobjects; ++jj) {
+                    void *object = cb_slab_alloc(slab);
+                    cb_assert(object != NULL);
+                    memset(object, ii, 64);
+                    objects[ii].push_back(object);
+                }
+            });
+        }
+        for (auto &thread : threads) {
+            thread.join();
+        }
+        threads.clear();
+
+        std::set<void *> unique;
+        for (int ii = 0; ii < nthreads; ++ii) {
+            for (void *object : objects[ii]) {
+                cb_assert(*static_cast<char *>(object) == ii);
+                unique.insert(object);
+            }
+        }
+        cb_assert(unique.size() == size_t(nthreads) * nobjects);
+
+        for (int ii = 0; ii < nthreads; ++ii) {
+            threads.emplace_back([slab, &objects, ii]() {
+                for (void *object : objects[(ii + 1) % nthreads]) {
+                    cb_slab_free(slab, object);
+                }
+            });
+        }
+        for (auto &thread : threads) {
+            thread.join();
+        }
+    }
+
+    /* ... and the main thread reuses what the others gave back */
+    std::vector<void *> objects;
+    for (int ii = 0; ii < nthreads * nobjects; ++ii) {
+        objects.push_back(cb_slab_alloc(slab));
+    }
+    for (void *object : objects) {
+        cb_slab_free(slab, object);
+    }
+    cb_slab_destroy(slab);
+}
+
+/* A thread's cache of a destroyed slab isn't used for its successor */
+static void test_reuse(void) {
+    for (int ii = 0; ii < 10; ++ii) {
+        cb_slab_t *slab = cb_slab_create(16);
+        cb_assert(slab != NULL);
+        void *object = cb_slab_alloc(slab);
+        cb_slab_free(slab, object);
+        cb_slab_destroy(slab);
+    }
+
+    std::vector<cb_slab_t *> slabs;
+    cb_slab_t *slab;
+    while ((slab = cb_slab_create(16)) != NULL) {
+        slabs.push_back(slab);
+    }
+    cb_assert(slabs.size() <= 256);
+    for (cb_slab_t *s : slabs) {
+        cb_slab_destroy(s);
+    }
+}
+
+static void test_malloc(void) {
+    std::vector<char *> blocks;
+    for (size_t size = 0; size < 2000; ++size) {
+        char *block = static_cast<char *>(cb_slab_malloc(size));
+        cb_assert(block != NULL);
+        cb_assert((uintptr_t(block) & 15) == 0);
+        memset(block, int(size & 0xff), size);
+        blocks.push_back(block);
+    }
+    for (size_t size = 0; size < blocks.size(); ++size) {
+        for (size_t ii = 0; ii < size; ++ii) {
+            cb_assert(blocks[size][ii] == char(size & 0xff));
+        }
+        cb_slab_release(blocks[size]);
+    }
+    cb_slab_release(NULL);
+
+    char *block = static_cast<char *>(cb_slab_calloc(10, 30));
+    cb_assert(block != NULL);
+    for (int ii = 0; ii < 300; ++ii) {
+        cb_assert(block[ii] == 0);
+    }
+    cb_slab_release(block);
+    cb_assert(cb_slab_calloc(SIZE_MAX / 2, 4) == NULL);
+
+    block = cb_slab_strdup("Hello, world");
+    cb_assert(strcmp(block, "Hello, world") == 0);
+    cb_slab_release(block);
+}
+
+static void test_cjson_hooks(void) {
+    cJSON_Hooks hooks;
+    cb_slab_cjson_hooks(&hooks);
+    cJSON_InitHooks(&hooks);
+
+    const char *doc = "{\"name\":\"slab\",\"values\":[1,2,3,4.5],"
+        "\"nested\":{\"t\":true,\"f\":false,\"n\":null}}";
+    cJSON *json = cJSON_Parse(doc);
+    cb_assert(json != NULL);
+    cJSON_AddStringToObject(json, "added", "a string which is longer "
+                            "than the smaller size classes");
+    char *text = cJSON_PrintUnformatted(json);
+    cb_assert(text != NULL);
+    cb_assert(strncmp(text, doc, strlen(doc) - 1) == 0);
+    cJSON_Free(text);
+    cJSON_Delete(json);
+
+    cJSON_InitHooks(NULL);
+    json = cJSON_Parse(doc);
+    cb_assert(json != NULL);
+    cJSON_Delete(json);
+}
+
+int main(void) {
+    test_single_thread();
+    test_cross_thread();
+    test_reuse();
+    test_malloc();
+    test_cjson_hooks();
+    return EXIT_SUCCESS;
+}
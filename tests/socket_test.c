@@ -0,0 +1,212 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <platform/cbassert.h>
+#include <platform/socket.h>
+
+static void test_iovec_cursor(void) {
+    char a[] = "hello";
+    char b[] = "";
+    char c[] = "world";
+    struct iovec iov[3];
+    cb_iovec_cursor_t cursor;
+
+    iov[0].iov_base = a;
+    iov[0].iov_len = 5;
+    iov[1].iov_base = b;
+    iov[1].iov_len = 0;
+    iov[2].iov_base = c;
+    iov[2].iov_len = 5;
+    cb_iovec_cursor_init(&cursor, iov, 3);
+    cb_assert(cb_iovec_cursor_remaining(&cursor) == 10);
+
+    cb_iovec_cursor_advance(&cursor, 3);
+    cb_assert(cursor.iovcnt == 3);
+    cb_assert(cursor.iov->iov_base == a + 3 && cursor.iov->iov_len == 2);
+
+    /* Lands on the end of the first buffer, which skips the empty one */
+    cb_iovec_cursor_advance(&cursor, 2);
+    cb_assert(cursor.iovcnt == 1 && cursor.iov == &iov[2]);
+
+    cb_iovec_cursor_advance(&cursor, 5);
+    cb_assert(cursor.iovcnt == 0);
+    cb_assert(cb_iovec_cursor_remaining(&cursor) == 0);
+}
+
+static void test_mmsg(void) {
+    int fds[2];
+    char out[3][16];
+    char in[4][16];
+    struct iovec outv[3], inv[4];
+    cb_mmsghdr_t msgs[4];
+    int ii;
+
+    cb_assert(socketpair(AF_UNIX, SOCK_DGRAM, 0, fds) == 0);
+
+    memset(msgs, 0, sizeof(msgs));
+    for (ii = 0; ii < 3; ++ii) {
+        snprintf(out[ii], sizeof(out[ii]), "message %d", ii);
+        outv[ii].iov_base = out[ii];
+        outv[ii].iov_len = strlen(out[ii]);
+        msgs[ii].msg_hdr.msg_iov = &outv[ii];
+        msgs[ii].msg_hdr.msg_iovlen = 1;
+    }
+    cb_assert(cb_sendmmsg(fds[0], msgs, 3, 0) == 3);
+    for (ii = 0; ii < 3; ++ii) {
+        cb_assert(msgs[ii].msg_len == outv[ii].iov_len);
+    }
+
+    /* There are only 3 waiting, so it returns without blocking for the
+     * fourth */
+    memset(msgs, 0, sizeof(msgs));
+    for (ii = 0; ii < 4; ++ii) {
+        inv[ii].iov_base = in[ii];
+        inv[ii].iov_len = sizeof(in[ii]);
+        msgs[ii].msg_hdr.msg_iov = &inv[ii];
+        msgs[ii].msg_hdr.msg_iovlen = 1;
+    }
+    cb_assert(cb_recvmmsg(fds[1], msgs, 4, 0) == 3);
+    for (ii = 0; ii < 3; ++ii) {
+        cb_assert(msgs[ii].msg_len == outv[ii].iov_len);
+        cb_assert(memcmp(in[ii], out[ii], outv[ii].iov_len) == 0);
+    }
+
+    close(fds[0]);
+    close(fds[1]);
+}
+
+#define NBUFFERS 64
+#define BUFSIZE 65536
+
+/* Fill the socket until it would block, drain it, and go again until
+ * everything made it across in order */
+static void test_writev_cursor(void) {
+    int fds[2];
+    struct iovec iov[NBUFFERS];
+    cb_iovec_cursor_t cursor;
+    char *data = malloc(NBUFFERS * BUFSIZE);
+    char *received = malloc(NBUFFERS * BUFSIZE);
+    size_t total = 0;
+    int blocked = 0;
+    int ii;
+
+    cb_assert(data != NULL && received != NULL);
+    for (ii = 0; ii < NBUFFERS * BUFSIZE; ++ii) {
+        data[ii] = (char)(ii * 31 + ii / 251);
+    }
+    for (ii = 0; ii < NBUFFERS; ++ii) {
+        iov[ii].iov_base = data + ii * BUFSIZE;
+        iov[ii].iov_len = BUFSIZE;
+    }
+    cb_iovec_cursor_init(&cursor, iov, NBUFFERS);
+
+    cb_assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    cb_assert(fcntl(fds[0], F_SETFL, O_NONBLOCK) == 0);
+    cb_assert(fcntl(fds[1], F_SETFL, O_NONBLOCK) == 0);
+
+    while (cursor.iovcnt > 0 || total < NBUFFERS * BUFSIZE) {
+        ssize_t nr;
+        ssize_t nw = cb_writev_cursor(fds[0], &cursor, 0);
+        if (nw == -1) {
+            cb_assert(errno == EWOULDBLOCK || errno == EAGAIN);
+            ++blocked;
+        } else {
+            cb_assert(cursor.iovcnt == 0 || nw > 0);
+        }
+        while ((nr = read(fds[1], received + total,
+                          NBUFFERS * BUFSIZE - total)) > 0) {
+            total += (size_t)nr;
+        }
+    }
+
+    cb_assert(cb_iovec_cursor_remaining(&cursor) == 0);
+    cb_assert(memcmp(data, received, NBUFFERS * BUFSIZE) == 0);
+    printf("socket was full %d times\n", blocked);
+
+    close(fds[0]);
+    close(fds[1]);
+    free(data);
+    free(received);
+}
+
+#define FILESIZE (4 * 1024 * 1024)
+
+/* Send part of a file across in as many calls as it takes */
+static void sendfile_until_done(int fd, uint64_t offset, size_t len,
+                                const char *expected) {
+    int fds[2];
+    char *received = malloc(len);
+    size_t total = 0;
+    size_t sent = 0;
+
+    cb_assert(received != NULL);
+    cb_assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    cb_assert(fcntl(fds[0], F_SETFL, O_NONBLOCK) == 0);
+    cb_assert(fcntl(fds[1], F_SETFL, O_NONBLOCK) == 0);
+
+    while (total < len) {
+        ssize_t nr;
+        if (sent < len) {
+            uint64_t before = offset;
+            ssize_t nw = cb_sendfile(fds[0], fd, &offset, len - sent);
+            if (nw == -1) {
+                cb_assert(errno == EWOULDBLOCK || errno == EAGAIN);
+                cb_assert(offset == before);
+            } else {
+                cb_assert(nw > 0 && offset == before + (uint64_t)nw);
+                sent += (size_t)nw;
+            }
+        }
+        while ((nr = read(fds[1], received + total, len - total)) > 0) {
+            total += (size_t)nr;
+        }
+    }
+    cb_assert(memcmp(received, expected, len) == 0);
+
+    close(fds[0]);
+    close(fds[1]);
+    free(received);
+}
+
+static void test_sendfile(void) {
+    FILE *fp = tmpfile();
+    char *data = malloc(FILESIZE);
+    uint64_t offset;
+    int fds[2];
+    int ii;
+
+    cb_assert(fp != NULL && data != NULL);
+    for (ii = 0; ii < FILESIZE; ++ii) {
+        data[ii] = (char)(ii * 13 + ii / 509);
+    }
+    cb_assert(fwrite(data, 1, FILESIZE, fp) == FILESIZE);
+    cb_assert(fflush(fp) == 0);
+
+    sendfile_until_done(fileno(fp), 0, FILESIZE, data);
+    sendfile_until_done(fileno(fp), 12345, FILESIZE - 23456, data + 12345);
+
+    /* Stops at the end of the file */
+    cb_assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    offset = FILESIZE - 10;
+    cb_assert(cb_sendfile(fds[0], fileno(fp), &offset, 100) == 10);
+    cb_assert(offset == FILESIZE);
+    cb_assert(cb_sendfile(fds[0], fileno(fp), &offset, 100) == 0);
+    close(fds[0]);
+    close(fds[1]);
+
+    fclose(fp);
+    free(data);
+}
+
+int main(void) {
+    test_iovec_cursor();
+    test_mmsg();
+    test_writev_cursor();
+    test_sendfile();
+    return 0;
+}
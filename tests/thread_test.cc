@@ -0,0 +1,108 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2016 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config.h"
+
+#include <platform/platform.h>
+#include <platform/cbassert.h>
+
+#include <iostream>
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+static int observed_cpu;
+static bool ran;
+
+static void record_cpu(void *) {
+#ifdef __linux__
+    observed_cpu = sched_getcpu();
+#else
+    observed_cpu = 0;
+#endif
+    ran = true;
+}
+
+static void test_defaults(void) {
+    cb_thread_t tid;
+    ran = false;
+    cb_assert(cb_create_thread_ex(&tid, record_cpu, NULL, NULL) == 0);
+    cb_assert(cb_join_thread(tid) == 0);
+    cb_assert(ran);
+}
+
+static void test_attributes(void) {
+    cb_thread_attr_t attr;
+    cb_thread_attr_initialize(&attr);
+
+    unsigned int cpu = 0;
+    attr.name = "attr-test";
+    attr.cpus = &cpu;
+    attr.ncpus = 1;
+    attr.stack_size = 1024 * 1024;
+    attr.priority = CB_THREAD_PRIORITY_LOW;
+
+    cb_thread_t tid;
+    ran = false;
+    observed_cpu = -1;
+    cb_assert(cb_create_thread_ex(&tid, record_cpu, NULL, &attr) == 0);
+    cb_assert(cb_join_thread(tid) == 0);
+    cb_assert(ran);
+    cb_assert(observed_cpu == 0);
+}
+
+static void test_numa(void) {
+    int nodes = cb_get_numa_node_count();
+    cb_assert(nodes >= 1);
+
+    cb_thread_attr_t attr;
+    cb_thread_attr_initialize(&attr);
+    attr.name = "numa-test";
+
+#if defined(__linux__) || defined(WIN32)
+    /* A node that doesn't exist */
+    cb_thread_t tid;
+    attr.numa_node = nodes + 100;
+    cb_assert(cb_create_thread_ex(&tid, record_cpu, NULL, &attr) == -1);
+
+    /* A CPU set outside of the available CPUs */
+    unsigned int cpu = 1000;
+    attr.numa_node = -1;
+    attr.cpus = &cpu;
+    attr.ncpus = 1;
+    cb_assert(cb_create_thread_ex(&tid, record_cpu, NULL, &attr) == -1);
+#endif
+}
+
+static void test_name_too_long(void) {
+    cb_thread_attr_t attr;
+    cb_thread_attr_initialize(&attr);
+    attr.name = "this-name-is-too-long";
+    cb_thread_t tid;
+    cb_assert(cb_create_thread_ex(&tid, record_cpu, NULL, &attr) == -1);
+    cb_assert(cb_create_named_thread(&tid, record_cpu, NULL, 0,
+                                     "this-name-is-too-long") == -1);
+}
+
+int main(void) {
+    test_defaults();
+    test_attributes();
+    test_numa();
+    test_name_too_long();
+    std::cout << "All tests pass" << std::endl;
+    return 0;
+}
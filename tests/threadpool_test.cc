@@ -0,0 +1,157 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2016 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config.h"
+
+#include <platform/platform.h>
+#include <platform/threadpool.h>
+#include <platform/cbassert.h>
+
+#include <atomic>
+#include <iostream>
+#include <vector>
+
+using namespace Couchbase;
+
+struct counting_task {
+    cb_threadpool_task task;
+    std::atomic<int> *counter;
+};
+
+static void count_task(cb_threadpool_task *t) {
+    reinterpret_cast<counting_task *>(t)->counter->fetch_add(1);
+}
+
+static void test_c_interface(void) {
+    const int ntasks = 10000;
+    std::atomic<int> counter(0);
+    std::vector<counting_task> tasks(ntasks);
+
+    cb_threadpool_t *pool = cb_threadpool_create(4, "test");
+    cb_assert(pool != NULL);
+    cb_assert(cb_threadpool_size(pool) == 4);
+
+    for (int round = 0; round < 3; ++round) {
+        for (auto &t : tasks) {
+            t.task.func = count_task;
+            t.counter = &counter;
+            cb_assert(cb_threadpool_submit(pool, &t.task) == 0);
+        }
+        cb_threadpool_wait(pool);
+        cb_assert(counter.load() == ntasks * (round + 1));
+    }
+
+    cb_threadpool_destroy(pool);
+}
+
+/*
+ * Each task splits itself in two until it reaches the leaf level, so
+ * all but the first task are submitted from the workers (and end up
+ * being stolen to keep the other workers busy).
+ */
+struct split_task {
+    cb_threadpool_task task;
+    cb_threadpool_t *pool;
+    int depth;
+    std::atomic<int> *leaves;
+};
+
+static void split(cb_threadpool_task *t) {
+    split_task *self = reinterpret_cast<split_task *>(t);
+    if (self->depth == 0) {
+        self->leaves->fetch_add(1);
+    } else {
+        for (int ii = 0; ii < 2; ++ii) {
+            split_task *child = new split_task;
+            child->task.func = split;
+            child->pool = self->pool;
+            child->depth = self->depth - 1;
+            child->leaves = self->leaves;
+            cb_assert(cb_threadpool_submit(self->pool, &child->task) == 0);
+        }
+    }
+    // The pool doesn't touch the task after calling it
+    delete self;
+}
+
+static void test_nested_submit(void) {
+    std::atomic<int> leaves(0);
+    cb_threadpool_t *pool = cb_threadpool_create(0, NULL);
+    cb_assert(pool != NULL);
+    cb_assert(cb_threadpool_size(pool) > 0);
+
+    split_task *root = new split_task;
+    root->task.func = split;
+    root->pool = pool;
+    root->depth = 12;
+    root->leaves = &leaves;
+    cb_assert(cb_threadpool_submit(pool, &root->task) == 0);
+    cb_threadpool_wait(pool);
+    cb_assert(leaves.load() == 1 << 12);
+
+    cb_threadpool_destroy(pool);
+}
+
+/* Destroying the pool runs whatever is still queued */
+static void test_destroy_drains(void) {
+    std::atomic<int> counter(0);
+    std::vector<counting_task> tasks(1000);
+
+    cb_threadpool_t *pool = cb_threadpool_create(2, "a-very-long-pool-name");
+    cb_assert(pool != NULL);
+    for (auto &t : tasks) {
+        t.task.func = count_task;
+        t.counter = &counter;
+        cb_assert(cb_threadpool_submit(pool, &t.task) == 0);
+    }
+    cb_threadpool_destroy(pool);
+    cb_assert(counter.load() == 1000);
+}
+
+class CountTask : public ThreadPool::Task {
+public:
+    CountTask(std::atomic<int> &c) : counter(c) {
+    }
+
+    virtual void run() {
+        counter.fetch_add(1);
+    }
+
+private:
+    std::atomic<int> &counter;
+};
+
+static void test_cxx_interface(void) {
+    std::atomic<int> counter(0);
+    std::vector<CountTask> tasks(100, CountTask(counter));
+
+    ThreadPool pool(3, "cxx");
+    cb_assert(pool.size() == 3);
+    for (auto &t : tasks) {
+        pool.submit(t);
+    }
+    pool.wait();
+    cb_assert(counter.load() == 100);
+}
+
+int main(void) {
+    test_c_interface();
+    test_nested_submit();
+    test_destroy_drains();
+    test_cxx_interface();
+    std::cout << "All tests pass" << std::endl;
+    return 0;
+}
@@ -0,0 +1,358 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2016 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config.h"
+
+#include <platform/cbassert.h>
+#include <platform/timerwheel.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <random>
+#include <thread>
+#include <vector>
+
+struct test_timer {
+    cb_timer timer;
+    hrtime_t expiry;
+    int fired;
+    hrtime_t fired_at;
+};
+
+/* The time the wheel is advanced to by the current advance call */
+static hrtime_t advance_now;
+
+static void record(cb_timer *t) {
+    test_timer *self = reinterpret_cast<test_timer *>(t);
+    self->fired++;
+    self->fired_at = advance_now;
+}
+
+static size_t advance(cb_timerwheel_t *wheel, hrtime_t now) {
+    advance_now = now;
+    return cb_timerwheel_advance(wheel, now);
+}
+
+static void test_basic(void) {
+    cb_timerwheel_t *wheel = cb_timerwheel_create(10, 1000);
+    cb_assert(wheel != NULL);
+    cb_assert(cb_timerwheel_pending(wheel) == 0);
+    cb_assert(cb_timerwheel_next_expiry(wheel) == UINT64_MAX);
+
+    test_timer t;
+    cb_timer_init(&t.timer, record);
+    t.fired = 0;
+    cb_assert(cb_timerwheel_cancel(wheel, &t.timer) == -1);
+
+    /* Rounded up to the next tick */
+    cb_timerwheel_schedule(wheel, &t.timer, 1005);
+    cb_assert(cb_timerwheel_pending(wheel) == 1);
+    cb_assert(cb_timerwheel_next_expiry(wheel) == 1010);
+    cb_assert(advance(wheel, 1009) == 0);
+    cb_assert(advance(wheel, 1010) == 1);
+    cb_assert(t.fired == 1);
+    cb_assert(cb_timerwheel_pending(wheel) == 0);
+    cb_assert(cb_timerwheel_cancel(wheel, &t.timer) == -1);
+
+    /* Cancelled timers don't fire */
+    cb_timerwheel_schedule(wheel, &t.timer, 2000);
+    cb_assert(cb_timerwheel_cancel(wheel, &t.timer) == 0);
+    cb_assert(cb_timerwheel_cancel(wheel, &t.timer) == -1);
+    cb_assert(advance(wheel, 3000) == 0);
+    cb_assert(t.fired == 1);
+
+    /* Rescheduling moves the timer */
+    cb_timerwheel_schedule(wheel, &t.timer, 5000);
+    cb_timerwheel_schedule(wheel, &t.timer, 4000);
+    cb_assert(cb_timerwheel_pending(wheel) == 1);
+    cb_assert(advance(wheel, 3999) == 0);
+    cb_assert(advance(wheel, 4000) == 1);
+    cb_assert(advance(wheel, 6000) == 0);
+    cb_assert(t.fired == 2);
+
+    /* Timers in the past fire in the next tick */
+    cb_timerwheel_schedule(wheel, &t.timer, 0);
+    cb_assert(advance(wheel, 6009) == 0);
+    cb_assert(advance(wheel, 6010) == 1);
+    cb_assert(t.fired == 3);
+
+    /* ... and so do the ones beyond the span of the wheel, eventually */
+    const hrtime_t distant = 1000 + 10 * (uint64_t(1) << 36);
+    cb_timerwheel_schedule(wheel, &t.timer, distant);
+    cb_assert(advance(wheel, distant / 2) == 0);
+    cb_assert(cb_timerwheel_next_expiry(wheel) <= distant);
+    cb_assert(advance(wheel, distant - 1) == 0);
+    cb_assert(advance(wheel, distant) == 1);
+    cb_assert(t.fired == 4);
+
+    /* Pending timers are dropped */
+    cb_timerwheel_schedule(wheel, &t.timer, distant + 100);
+    cb_timerwheel_destroy(wheel);
+    cb_assert(t.fired == 4);
+}
+
+/*
+ * Compare the wheel with the obvious implementation: every timer must
+ * fire exactly once, in the first advance to reach the tick it expires
+ * in. The expiry times are spread over all of the levels, and beyond.
+ */
+static void test_random(hrtime_t tick, hrtime_t start, unsigned int seed) {
+    std::mt19937_64 rng(seed);
+    cb_timerwheel_t *wheel = cb_timerwheel_create(tick, start);
+    cb_assert(wheel != NULL);
+
+    const size_t ntimers = 20000;
+    std::vector<test_timer> timers(ntimers);
+    std::vector<bool> cancelled(ntimers);
+    hrtime_t last = start;
+    for (auto &t : timers) {
+        cb_timer_init(&t.timer, record);
+        t.fired = 0;
+        t.expiry = start + (rng() & ((uint64_t(1) << (rng() % 42)) - 1));
+        if (t.expiry > last) {
+            last = t.expiry;
+        }
+        cb_timerwheel_schedule(wheel, &t.timer, t.expiry);
+    }
+    cb_assert(cb_timerwheel_pending(wheel) == ntimers);
+
+    auto due = [tick, start](hrtime_t expiry, hrtime_t now) {
+        uint64_t expires = (expiry - start + tick - 1) / tick;
+        return now >= start && (now - start) / tick >= expires;
+    };
+
+    hrtime_t now = start;
+    size_t total = 0;
+    size_t ncancelled = 0;
+    while (now < last) {
+        hrtime_t step = rng() & ((uint64_t(1) << (rng() % 36)) - 1);
+        hrtime_t next = now + step;
+
+        /* Move or cancel some of the pending timers on the way */
+        for (int ii = 0; ii < 10; ++ii) {
+            size_t idx = rng() % ntimers;
+            test_timer &t = timers[idx];
+            if (t.fired || cancelled[idx]) {
+                continue;
+            }
+            if (rng() % 4 == 0) {
+                cb_assert(cb_timerwheel_cancel(wheel, &t.timer) == 0);
+                cancelled[idx] = true;
+                ++ncancelled;
+            } else {
+                t.expiry = now + (rng() &
+                                  ((uint64_t(1) << (rng() % 40)) - 1));
+                if (t.expiry > last) {
+                    last = t.expiry;
+                }
+                cb_timerwheel_schedule(wheel, &t.timer, t.expiry);
+            }
+        }
+
+        cb_assert(cb_timerwheel_next_expiry(wheel) >= now ||
+                  cb_timerwheel_pending(wheel) == 0);
+        size_t expected = 0;
+        for (size_t ii = 0; ii < ntimers; ++ii) {
+            if (!timers[ii].fired && !cancelled[ii] &&
+                due(timers[ii].expiry, next)) {
+                ++expected;
+            }
+        }
+        size_t fired = advance(wheel, next);
+        cb_assert(fired == expected);
+        total += fired;
+        now = next;
+    }
+    advance(wheel, now);
+
+    for (size_t ii = 0; ii < ntimers; ++ii) {
+        const test_timer &t = timers[ii];
+        if (cancelled[ii]) {
+            cb_assert(t.fired == 0);
+        } else {
+            cb_assert(t.fired == 1);
+            cb_assert(t.fired_at >= t.expiry);
+        }
+    }
+    cb_assert(total + ncancelled == ntimers);
+    cb_assert(cb_timerwheel_pending(wheel) == 0);
+    cb_timerwheel_destroy(wheel);
+}
+
+struct periodic_timer {
+    cb_timer timer;
+    cb_timerwheel_t *wheel;
+    hrtime_t interval;
+    hrtime_t expiry;
+    int count;
+};
+
+static void periodic(cb_timer *t) {
+    periodic_timer *self = reinterpret_cast<periodic_timer *>(t);
+    if (++self->count < 100) {
+        self->expiry += self->interval;
+        cb_timerwheel_schedule(self->wheel, &self->timer, self->expiry);
+    }
+}
+
+/* The timers may reschedule themselves when they fire */
+static void test_periodic(void) {
+    cb_timerwheel_t *wheel = cb_timerwheel_create(1, 0);
+    cb_assert(wheel != NULL);
+    periodic_timer t;
+    cb_timer_init(&t.timer, periodic);
+    t.wheel = wheel;
+    t.interval = 300;
+    t.expiry = 300;
+    t.count = 0;
+    cb_timerwheel_schedule(wheel, &t.timer, t.expiry);
+
+    for (hrtime_t now = 0; now < 100000; now += 100) {
+        advance(wheel, now);
+        cb_assert(t.count == int(now / 300) || t.count == 100);
+    }
+    cb_assert(t.count == 100);
+    cb_assert(cb_timerwheel_pending(wheel) == 0);
+    cb_timerwheel_destroy(wheel);
+}
+
+/* A million pending timers, to show that it doesn't slow down */
+static void test_many(void) {
+    cb_timerwheel_t *wheel = cb_timerwheel_create(1000, 0);
+    cb_assert(wheel != NULL);
+    const size_t ntimers = 1000000;
+    std::vector<test_timer> timers(ntimers);
+    std::mt19937_64 rng(42);
+    for (auto &t : timers) {
+        cb_timer_init(&t.timer, record);
+        t.fired = 0;
+        t.expiry = rng() % 10000000000ULL;
+        cb_timerwheel_schedule(wheel, &t.timer, t.expiry);
+    }
+    cb_assert(cb_timerwheel_pending(wheel) == ntimers);
+    for (size_t ii = 0; ii < ntimers; ii += 2) {
+        cb_assert(cb_timerwheel_cancel(wheel, &timers[ii].timer) == 0);
+    }
+    cb_assert(cb_timerwheel_pending(wheel) == ntimers / 2);
+
+    size_t total = 0;
+    for (hrtime_t now = 0; now <= 10000000000ULL; now += 100000000) {
+        total += advance(wheel, now);
+    }
+    cb_assert(total == ntimers / 2);
+    for (size_t ii = 0; ii < ntimers; ++ii) {
+        cb_assert(timers[ii].fired == int(ii % 2));
+    }
+    cb_timerwheel_destroy(wheel);
+}
+
+struct thread_timer {
+    cb_timer timer;
+    hrtime_t expiry;
+    std::atomic<hrtime_t> fired_at;
+};
+
+static std::atomic<int> thread_fired;
+
+static void thread_record(cb_timer *t) {
+    thread_timer *self = reinterpret_cast<thread_timer *>(t);
+    self->fired_at.store(gethrtime());
+    thread_fired.fetch_add(1);
+}
+
+static void wait_for(int count) {
+    auto deadline = std::chrono::steady_clock::now() +
+        std::chrono::seconds(30);
+    while (thread_fired.load() < count) {
+        cb_assert(std::chrono::steady_clock::now() < deadline);
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
+/* The wheel driven by its own thread */
+static void test_thread(void) {
+    const hrtime_t ms = 1000000;
+    cb_timerwheel_t *wheel = cb_timerwheel_create(ms, gethrtime());
+    cb_assert(wheel != NULL);
+    cb_assert(cb_timerwheel_start(wheel, "timers") == 0);
+    cb_assert(cb_timerwheel_start(wheel, "timers") == -1);
+
+    const int ntimers = 1000;
+    std::vector<thread_timer> timers(ntimers);
+    std::mt19937 rng(7);
+    hrtime_t now = gethrtime();
+    for (auto &t : timers) {
+        cb_timer_init(&t.timer, thread_record);
+        t.expiry = now + (rng() % 50) * ms;
+        t.fired_at.store(0);
+        cb_timerwheel_schedule(wheel, &t.timer, t.expiry);
+    }
+    wait_for(ntimers);
+    for (auto &t : timers) {
+        cb_assert(t.fired_at.load() >= t.expiry);
+    }
+
+    /* The thread sleeps until the far away timer, and has to be woken
+     * up for the one which is scheduled after it */
+    thread_timer far, near;
+    cb_timer_init(&far.timer, thread_record);
+    cb_timer_init(&near.timer, thread_record);
+    far.fired_at.store(0);
+    near.fired_at.store(0);
+    cb_timerwheel_schedule(wheel, &far.timer, gethrtime() + 3600000 * ms);
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    near.expiry = gethrtime() + 5 * ms;
+    cb_timerwheel_schedule(wheel, &near.timer, near.expiry);
+    wait_for(ntimers + 1);
+    cb_assert(near.fired_at.load() >= near.expiry);
+    cb_assert(far.fired_at.load() == 0);
+
+    /* Schedule and cancel from other threads while the wheel runs */
+    std::vector<std::thread> threads;
+    std::atomic<int> cancelled(0);
+    for (int ii = 0; ii < 4; ++ii) {
+        threads.emplace_back([wheel, &timers, &cancelled, ii, ms]() {
+            for (int jj = ii; jj < ntimers; jj += 4) {
+                cb_timerwheel_schedule(wheel, &timers[jj].timer,
+                                       gethrtime() + (jj % 20) * ms);
+                if (jj % 3 == 0 &&
+                    cb_timerwheel_cancel(wheel, &timers[jj].timer) == 0) {
+                    cancelled.fetch_add(1);
+                }
+            }
+        });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    wait_for(2 * ntimers + 1 - cancelled.load());
+    cb_assert(cb_timerwheel_pending(wheel) == 1);
+
+    cb_timerwheel_destroy(wheel);
+    cb_assert(far.fired_at.load() == 0);
+}
+
+int main(void) {
+    test_basic();
+    test_random(1, 0, 1);
+    test_random(1000, 12345, 2);
+    test_random(7, 3, 3);
+    test_periodic();
+    test_many();
+    test_thread();
+    return EXIT_SUCCESS;
+}